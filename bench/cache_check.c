@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evanix.h"
+#include "jobs.h"
+#include "nix.h"
+#include "store.h"
+#include "util.h"
+
+/* Compares the cache status checks of nix-build --dry-run against the ones
+ * done through libstore. Takes a nix-eval-jobs output file of derivations
+ * that are in the local store, there is no synthetic fallback since both
+ * backends need real ones. */
+
+#define EXIT_SKIP 77
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = true,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.system = NULL,
+	.solver_report = false,
+	.check_cache_status = true,
+	.solver = NULL,
+	.cache_backend = NULL,
+	.break_evanix = false,
+};
+
+static void bench_run(const char *name,
+		      int (*backend)(struct job *, struct cache_memo *,
+				     struct cache_status *),
+		      FILE *stream)
+{
+	struct cache_memo memo;
+	double start, elapsed;
+	struct job *job;
+	int ret;
+
+	size_t jobs = 0, cached = 0;
+	size_t line_size = 0;
+	char *line = NULL;
+
+	evanix_opts.cache_backend = backend;
+	cache_memo_init(&memo);
+	rewind(stream);
+
+	start = monotonic_now();
+	while (job_read(stream, &line, &line_size, &job) == JOB_READ_SUCCESS) {
+		ret = job_cache_check(job, &memo);
+		job_free(job);
+		if (ret < 0)
+			break;
+
+		jobs++;
+		if (ret == JOB_READ_CACHED)
+			cached++;
+	}
+	elapsed = monotonic_now() - start;
+
+	printf("%-10s %8zu jobs %8zu cached %8.3fs %10.1f jobs/s\n", name,
+	       jobs, cached, elapsed, jobs / elapsed);
+
+	free(line);
+	cache_memo_free(&memo);
+}
+
+int main(int argc, char *argv[])
+{
+	nix_c_context *nix_ctx;
+	FILE *stream;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <nix-eval-jobs output>\n", argv[0]);
+		return EXIT_SKIP;
+	}
+
+	stream = fopen(argv[1], "r");
+	if (stream == NULL) {
+		print_err("%s: %s", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	ret = _nix_init(&nix_ctx);
+	if (ret < 0)
+		goto out_close_stream;
+
+	ret = nix_setting_get(nix_ctx, "system", _nix_get_string_strdup,
+			      &evanix_opts.system);
+	if (ret != NIX_OK || evanix_opts.system == NULL) {
+		print_err("%s", "Failed to get system");
+		ret = -EPERM;
+		goto out_free_nix_ctx;
+	}
+
+	ret = store_init(nix_ctx);
+	if (ret < 0)
+		goto out_free_system;
+
+	bench_run("nix-build", job_read_cache, stream);
+	bench_run("libstore", store_closure_read, stream);
+
+	store_free();
+out_free_system:
+	free(evanix_opts.system);
+out_free_nix_ctx:
+	nix_c_context_free(nix_ctx);
+out_close_stream:
+	fclose(stream);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "closure.h"
+#include "dag.h"
+#include "evanix.h"
+#include "jobs.h"
+#include "util.h"
+
+/* Compares marginal closure costs worked out by walking deps against the
+ * bitsets of closure_set, over a synthetic DAG frozen like the solvers do.
+ * Every derivation needs a shared bootstrap chain, like stdenv, plus a
+ * handful of others below it. */
+
+#define SYNTHETIC_BOOTSTRAP 300
+#define SYNTHETIC_JOBS	    100000
+#define SYNTHETIC_REQUESTED 4000
+#define SYNTHETIC_DEPS	    8
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = false,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.max_time = 0,
+	.system = "x86_64-linux",
+	.solver_report = false,
+	.check_cache_status = false,
+	.solver = NULL,
+	.break_evanix = false,
+};
+
+static int synthetic_job_new(struct job **jobs, size_t i)
+{
+	char drv_path[64];
+	int ret;
+
+	snprintf(drv_path, sizeof(drv_path), "/nix/store/%032zu-job%zu.drv",
+		 i, i);
+	ret = job_new(&jobs[i], NULL, drv_path, NULL, NULL);
+	if (ret < 0)
+		return ret;
+
+	/* cached, so job_cost() doesn't need statistics */
+	jobs[i]->cost = 1 + i % 97;
+	return 0;
+}
+
+static int synthetic_dag(struct job **jobs, struct job_clist *q)
+{
+	size_t dep, requested;
+	unsigned seed = 1;
+	int ret;
+
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		ret = synthetic_job_new(jobs, i);
+		if (ret < 0)
+			return ret;
+
+		if (i == 0) {
+			continue;
+		} else if (i < SYNTHETIC_BOOTSTRAP) {
+			ret = job_deps_list_insert(jobs[i], jobs[i - 1]);
+		} else {
+			dep = i / 2 < SYNTHETIC_BOOTSTRAP
+				      ? SYNTHETIC_BOOTSTRAP - 1
+				      : i / 2;
+			ret = job_deps_list_insert(jobs[i], jobs[dep]);
+			if (ret == 0 && i / 3 >= SYNTHETIC_BOOTSTRAP)
+				ret = job_deps_list_insert(jobs[i],
+							   jobs[i / 3]);
+		}
+		if (ret < 0)
+			return ret;
+	}
+
+	/* requested jobs come last, picking deps from all over */
+	requested = SYNTHETIC_JOBS - SYNTHETIC_REQUESTED;
+	for (size_t i = requested; i < SYNTHETIC_JOBS; i++) {
+		for (size_t j = 0; j < SYNTHETIC_DEPS; j++) {
+			seed = seed * 1103515245 + 12345;
+			dep = SYNTHETIC_BOOTSTRAP +
+			      (seed >> 8) % (requested - SYNTHETIC_BOOTSTRAP);
+			ret = job_deps_list_insert(jobs[i], jobs[dep]);
+			if (ret < 0)
+				return ret;
+		}
+
+		jobs[i]->requested = true;
+		CIRCLEQ_INSERT_TAIL(q, jobs[i], clist);
+	}
+
+	return 0;
+}
+
+/* selects every other requested job, and asks what the rest would add */
+static long bench_walk(struct job_clist *q, double *elapsed)
+{
+	struct closure c;
+	struct job *j;
+	double start;
+	size_t i = 0;
+	long sum = 0;
+	int ret;
+
+	start = monotonic_now();
+	closure_init(&c);
+	CIRCLEQ_FOREACH (j, q, clist) {
+		ret = (i++ % 2) ? closure_cost_marginal(&c, j)
+				: closure_select(&c, j);
+		if (ret < 0)
+			break;
+		sum += ret;
+	}
+	closure_free(&c);
+	*elapsed = monotonic_now() - start;
+
+	return sum;
+}
+
+static long bench_set(struct closure_set *cs, struct job_clist *q,
+		      double *elapsed)
+{
+	struct job *j;
+	double start;
+	size_t i = 0;
+	long sum = 0;
+	int ret;
+
+	start = monotonic_now();
+	CIRCLEQ_FOREACH (j, q, clist) {
+		ret = (i++ % 2) ? closure_set_cost_marginal(cs, j)
+				: closure_set_select(cs, j);
+		if (ret < 0)
+			break;
+		sum += ret;
+	}
+	*elapsed = monotonic_now() - start;
+
+	return sum;
+}
+
+int main(void)
+{
+	double elapsed_walk, elapsed_set, elapsed_build, start;
+	struct closure_set *cs = NULL;
+	struct dag *dag = NULL;
+	long sum_walk, sum_set;
+	struct job_clist q;
+	struct job **jobs;
+	int ret;
+
+	jobs = calloc(SYNTHETIC_JOBS, sizeof(*jobs));
+	if (jobs == NULL) {
+		print_err("%s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	CIRCLEQ_INIT(&q);
+
+	ret = synthetic_dag(jobs, &q);
+	if (ret < 0)
+		goto out_free_jobs;
+
+	ret = dag_new(&dag, &q);
+	if (ret < 0)
+		goto out_free_jobs;
+
+	start = monotonic_now();
+	ret = closure_set_new(&cs, dag);
+	if (ret < 0)
+		goto out_free_dag;
+	elapsed_build = monotonic_now() - start;
+
+	sum_walk = bench_walk(&q, &elapsed_walk);
+	sum_set = bench_set(cs, &q, &elapsed_set);
+
+	printf("%u jobs, %d requested, %zu bytes of bitsets\n",
+	       dag->nodes, SYNTHETIC_REQUESTED,
+	       SYNTHETIC_REQUESTED * cs->words * sizeof(*cs->bits));
+	printf("%-8s %10.6fs %12ld cost\n", "walk", elapsed_walk, sum_walk);
+	printf("%-8s %10.6fs %12ld cost, built in %.6fs\n", "bitset",
+	       elapsed_set, sum_set, elapsed_build);
+	if (sum_walk != sum_set) {
+		print_err("%s", "walk and bitset costs differ");
+		ret = -EINVAL;
+	}
+
+	closure_set_free(cs);
+out_free_dag:
+	dag_free(dag);
+out_free_jobs:
+	/* the DAG is freed flat, so shared deps aren't freed twice */
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		if (jobs[i] == NULL)
+			continue;
+		jobs[i]->deps_filled = 0;
+		job_free(jobs[i]);
+	}
+	free(jobs);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "closure.h"
+#include "dag.h"
+#include "evanix.h"
+#include "jobs.h"
+#include "util.h"
+
+/* Compares a solver pass, the closure cost of every requested job like
+ * solver_sjf() works out, over the pointer graph of struct job against the
+ * frozen one of struct dag. Every derivation needs a shared bootstrap chain,
+ * like stdenv, plus a handful of others below it. */
+
+#define SYNTHETIC_BOOTSTRAP 300
+#define SYNTHETIC_JOBS	    100000
+#define SYNTHETIC_REQUESTED 4000
+#define SYNTHETIC_DEPS	    8
+#define PASSES		    5
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = false,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.max_time = 0,
+	.system = "x86_64-linux",
+	.solver_report = false,
+	.check_cache_status = false,
+	.solver = NULL,
+	.break_evanix = false,
+};
+
+static int synthetic_edge(struct job *job, struct job *dep)
+{
+	int ret;
+
+	ret = job_deps_list_insert(job, dep);
+	if (ret < 0)
+		return ret;
+
+	return job_parents_list_insert(dep, job);
+}
+
+static int synthetic_dag(struct job **jobs, struct job_clist *q)
+{
+	char drv_path[64];
+	size_t dep, requested;
+	unsigned seed = 1;
+	int ret;
+
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		snprintf(drv_path, sizeof(drv_path),
+			 "/nix/store/%032zu-job%zu.drv", i, i);
+		ret = job_new(&jobs[i], NULL, drv_path, NULL, NULL);
+		if (ret < 0)
+			return ret;
+		/* cached, so job_cost() doesn't need statistics */
+		jobs[i]->cost = 1 + i % 97;
+
+		if (i == 0) {
+			continue;
+		} else if (i < SYNTHETIC_BOOTSTRAP) {
+			ret = synthetic_edge(jobs[i], jobs[i - 1]);
+		} else {
+			dep = i / 2 < SYNTHETIC_BOOTSTRAP
+				      ? SYNTHETIC_BOOTSTRAP - 1
+				      : i / 2;
+			ret = synthetic_edge(jobs[i], jobs[dep]);
+			if (ret == 0 && i / 3 >= SYNTHETIC_BOOTSTRAP)
+				ret = synthetic_edge(jobs[i], jobs[i / 3]);
+		}
+		if (ret < 0)
+			return ret;
+	}
+
+	/* requested jobs come last, picking deps from all over */
+	requested = SYNTHETIC_JOBS - SYNTHETIC_REQUESTED;
+	for (size_t i = requested; i < SYNTHETIC_JOBS; i++) {
+		for (size_t j = 0; j < SYNTHETIC_DEPS; j++) {
+			seed = seed * 1103515245 + 12345;
+			dep = SYNTHETIC_BOOTSTRAP +
+			      (seed >> 8) % (requested - SYNTHETIC_BOOTSTRAP);
+			ret = synthetic_edge(jobs[i], jobs[dep]);
+			if (ret < 0)
+				return ret;
+		}
+
+		jobs[i]->requested = true;
+		CIRCLEQ_INSERT_TAIL(q, jobs[i], clist);
+	}
+
+	return 0;
+}
+
+/* what the jobs dag was frozen from and their edge lists take, strings and
+ * outputs aside */
+static size_t pointer_size(struct dag *dag)
+{
+	struct job *j;
+	size_t size = 0;
+
+	for (uint32_t n = 0; n < dag->nodes; n++) {
+		j = dag->jobid->jobs[n];
+		size += sizeof(*j);
+		size += j->deps_size * sizeof(*j->deps);
+		size += j->parents_size * sizeof(*j->parents);
+	}
+
+	return size;
+}
+
+static long bench_pointer(struct job_clist *q, double *elapsed)
+{
+	struct closure c;
+	struct job *j;
+	double start;
+	long sum = 0;
+	int ret;
+
+	start = monotonic_now();
+	closure_init(&c);
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		CIRCLEQ_FOREACH (j, q, clist) {
+			ret = closure_cost(&c, j);
+			if (ret < 0)
+				break;
+			sum += ret;
+		}
+	}
+	closure_free(&c);
+	*elapsed = monotonic_now() - start;
+
+	return sum;
+}
+
+static long bench_dag(struct dag *dag, double *elapsed)
+{
+	double start;
+	long sum = 0;
+	int ret;
+
+	start = monotonic_now();
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		for (uint32_t i = 0; i < dag->roots_filled; i++) {
+			ret = dag_closure_cost(dag, dag->roots[i]);
+			if (ret < 0)
+				break;
+			sum += ret;
+		}
+	}
+	*elapsed = monotonic_now() - start;
+
+	return sum;
+}
+
+int main(void)
+{
+	double elapsed_pointer, elapsed_dag, elapsed_build, start;
+	long sum_pointer, sum_dag;
+	struct dag *dag = NULL;
+	struct job_clist q;
+	struct job **jobs;
+	int ret;
+
+	jobs = calloc(SYNTHETIC_JOBS, sizeof(*jobs));
+	if (jobs == NULL) {
+		print_err("%s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	CIRCLEQ_INIT(&q);
+
+	ret = synthetic_dag(jobs, &q);
+	if (ret < 0)
+		goto out_free_jobs;
+
+	start = monotonic_now();
+	ret = dag_new(&dag, &q);
+	if (ret < 0)
+		goto out_free_jobs;
+	elapsed_build = monotonic_now() - start;
+
+	sum_pointer = bench_pointer(&q, &elapsed_pointer);
+	sum_dag = bench_dag(dag, &elapsed_dag);
+
+	printf("%u jobs, %d requested, %d passes\n", dag->nodes,
+	       SYNTHETIC_REQUESTED, PASSES);
+	printf("%-8s %10.6fs %12ld cost %10zu bytes\n", "pointer",
+	       elapsed_pointer, sum_pointer, pointer_size(dag));
+	printf("%-8s %10.6fs %12ld cost %10zu bytes, frozen in %.6fs\n",
+	       "dag", elapsed_dag, sum_dag, dag_size(dag), elapsed_build);
+	if (sum_pointer != sum_dag) {
+		print_err("%s", "pointer and dag costs differ");
+		ret = -EINVAL;
+	}
+
+	dag_free(dag);
+out_free_jobs:
+	/* the DAG is freed flat, so shared deps aren't freed twice */
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		if (jobs[i] == NULL)
+			continue;
+		jobs[i]->deps_filled = 0;
+		jobs[i]->parents_filled = 0;
+		job_free(jobs[i]);
+	}
+	free(jobs);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,289 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "drv.h"
+#include "evanix.h"
+#include "util.h"
+
+/* Compares getting the pname out of a .drv the way evanix used to, getline
+ * and a regex compiled for every drv, against drv_read(). Reads every .drv
+ * under the given directory, /nix/store by default, or a synthetic set when
+ * there are none. */
+
+#define SYNTHETIC_DRVS	     20000
+#define SYNTHETIC_INPUT_DRVS 12
+#define SYNTHETIC_ENV_VARS   40
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = false,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.system = "x86_64-linux",
+	.solver_report = false,
+	.check_cache_status = false,
+	.solver = NULL,
+	.break_evanix = false,
+};
+
+static int paths_insert(char ***paths, size_t *size, size_t *filled,
+			const char *dir, const char *name)
+{
+	size_t newsize;
+	void *ret;
+
+	if (*filled == *size) {
+		newsize = *size == 0 ? 1024 : *size * 2;
+		ret = realloc(*paths, newsize * sizeof(**paths));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		*paths = ret;
+		*size = newsize;
+	}
+
+	if (asprintf(&(*paths)[*filled], "%s/%s", dir, name) < 0) {
+		print_err("%s", "Failed to allocate path");
+		return -ENOMEM;
+	}
+	(*filled)++;
+
+	return 0;
+}
+
+static int paths_read(const char *dir, char ***paths, size_t *filled)
+{
+	size_t len, size = 0;
+	struct dirent *de;
+	DIR *d;
+	int ret = 0;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return 0;
+
+	while ((de = readdir(d)) != NULL) {
+		len = strlen(de->d_name);
+		if (len < 4 || strcmp(de->d_name + len - 4, ".drv"))
+			continue;
+
+		ret = paths_insert(paths, &size, filled, dir, de->d_name);
+		if (ret < 0)
+			break;
+	}
+	closedir(d);
+
+	return ret;
+}
+
+/* drvs the size and shape of what's in nixpkgs, on a single line */
+static int synthetic_paths(char *dir, char ***paths, size_t *filled)
+{
+	size_t size = 0;
+	char name[64];
+	FILE *stream;
+	int ret;
+
+	if (mkdtemp(dir) == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	for (size_t i = 0; i < SYNTHETIC_DRVS; i++) {
+		snprintf(name, sizeof(name), "%032zu-pkg%zu-1.0.drv", i, i);
+		ret = paths_insert(paths, &size, filled, dir, name);
+		if (ret < 0)
+			return ret;
+
+		stream = fopen((*paths)[i], "w");
+		if (stream == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		fprintf(stream,
+			"Derive([(\"out\",\"/nix/store/%032zu-pkg%zu-1.0\","
+			"\"\",\"\")],[",
+			i, i);
+		for (size_t j = 0; j < SYNTHETIC_INPUT_DRVS; j++)
+			fprintf(stream,
+				"%s(\"/nix/store/%032zu-dep%zu.drv\","
+				"[\"out\"])",
+				j ? "," : "", i * SYNTHETIC_INPUT_DRVS + j, j);
+		fprintf(stream,
+			"],[\"/nix/store/%032zu-source\"],\"x86_64-linux\","
+			"\"/nix/store/%032zu-bash/bin/bash\",[\"-e\","
+			"\"/nix/store/%032zu-builder.sh\"],[",
+			i, i, i);
+		for (size_t j = 0; j < SYNTHETIC_ENV_VARS; j++)
+			fprintf(stream,
+				"(\"var%zu\",\"some value with \\\"quotes\\\" "
+				"and a newline\\n in it %032zu\"),",
+				j, j);
+		fprintf(stream,
+			"(\"pname\",\"pkg%zu\"),(\"preferLocalBuild\",\"%s\"),"
+			"(\"requiredSystemFeatures\",\"%s\")])",
+			i, (i % 7) ? "" : "1", (i % 11) ? "" : "big-parallel");
+		if (fclose(stream) != 0) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+/* drv_to_pname() as it was */
+static int regex_pname(char *drv_path, char **pname)
+{
+	regmatch_t pmatch[2];
+	FILE *drv_file;
+	size_t drv_len;
+	regex_t regex;
+	int ret;
+
+	char *drv_string = NULL;
+	char *pattern = "\\(\"pname\",\"([^\"]*)";
+
+	drv_file = fopen(drv_path, "r");
+	if (drv_file == NULL)
+		return -errno;
+
+	ret = getline(&drv_string, &drv_len, drv_file);
+	if (ret < 0) {
+		ret = -EINVAL;
+		goto out_close_drv_file;
+	}
+
+	ret = regcomp(&regex, pattern, REG_EXTENDED);
+	if (ret != 0) {
+		ret = -EPERM;
+		goto out_close_drv_file;
+	}
+
+	ret = regexec(&regex, drv_string, 2, pmatch, 0);
+	if (ret != 0 || pmatch[1].rm_so == -1) {
+		ret = -ENOENT;
+		goto out_free_regex;
+	}
+
+	*pname = strndup(drv_string + pmatch[1].rm_so,
+			 pmatch[1].rm_eo - pmatch[1].rm_so);
+	ret = *pname == NULL ? -ENOMEM : 0;
+
+out_free_regex:
+	regfree(&regex);
+out_close_drv_file:
+	fclose(drv_file);
+	free(drv_string);
+
+	return ret;
+}
+
+static size_t bench_regex(char **paths, size_t n, double *elapsed)
+{
+	size_t found = 0;
+	double start;
+	char *pname;
+
+	start = monotonic_now();
+	for (size_t i = 0; i < n; i++) {
+		if (regex_pname(paths[i], &pname) < 0)
+			continue;
+		found++;
+		free(pname);
+	}
+	*elapsed = monotonic_now() - start;
+
+	return found;
+}
+
+static size_t bench_drv(char **paths, size_t n, double *elapsed,
+			size_t *features, size_t *local)
+{
+	size_t found = 0;
+	struct drv drv;
+	double start;
+
+	*features = 0;
+	*local = 0;
+
+	start = monotonic_now();
+	for (size_t i = 0; i < n; i++) {
+		if (drv_read(paths[i], &drv) < 0)
+			continue;
+
+		if (drv.pname.s != NULL)
+			found++;
+		if (drv.required_system_features.len > 0)
+			(*features)++;
+		if (drv.prefer_local_build.len > 0)
+			(*local)++;
+		drv_free(&drv);
+	}
+	*elapsed = monotonic_now() - start;
+
+	return found;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t filled = 0, found_regex, found_drv, features, local;
+	char synthetic_dir[] = "/tmp/evanix-drv-XXXXXX";
+	double elapsed_regex, elapsed_drv;
+	const char *dir = "/nix/store";
+	bool issynthetic = false;
+	char **paths = NULL;
+	int ret;
+
+	if (argc > 1)
+		dir = argv[1];
+
+	ret = paths_read(dir, &paths, &filled);
+	if (ret == 0 && filled == 0) {
+		issynthetic = true;
+		ret = synthetic_paths(synthetic_dir, &paths, &filled);
+	}
+	if (ret < 0)
+		goto out_free_paths;
+
+	/* in the page cache for both */
+	bench_drv(paths, filled, &elapsed_drv, &features, &local);
+
+	found_regex = bench_regex(paths, filled, &elapsed_regex);
+	found_drv = bench_drv(paths, filled, &elapsed_drv, &features, &local);
+
+	printf("%zu drvs from %s, %zu requiring system features, %zu "
+	       "preferring local builds\n",
+	       filled, issynthetic ? synthetic_dir : dir, features, local);
+	printf("%-8s %10.6fs %8zu pnames\n", "regex", elapsed_regex,
+	       found_regex);
+	printf("%-8s %10.6fs %8zu pnames\n", "drv_read", elapsed_drv,
+	       found_drv);
+	/* the regex stops at the first line, and misses escaped quotes */
+	if (found_drv < found_regex) {
+		print_err("%s", "drv_read found fewer pnames than the regex");
+		ret = -EINVAL;
+	}
+
+out_free_paths:
+	for (size_t i = 0; i < filled; i++) {
+		if (issynthetic)
+			unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	if (issynthetic)
+		rmdir(synthetic_dir);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
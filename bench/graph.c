@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "evanix.h"
+#include "jobs.h"
+#include "queue.h"
+#include "util.h"
+
+/* Builds the job graph of a nix-eval-jobs output the way the queue thread
+ * does, then tears it down, and reports what it took in time and memory.
+ * Reads the given nix-eval-jobs output file, or generates a synthetic one
+ * where the jobs share most of their inputDrvs, like nixpkgs does. */
+
+#define SYNTHETIC_LINES	     50000
+#define SYNTHETIC_INPUT_DRVS 12
+/* the inputDrvs are drawn from this many drvs */
+#define SYNTHETIC_SHARED_DRVS 20000
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = false,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.system = "x86_64-linux",
+	.solver_report = false,
+	.check_cache_status = false,
+	.solver = NULL,
+	.break_evanix = false,
+};
+
+static void store_hash(char *buf, unsigned seed)
+{
+	const char *alphabet = "0123456789abcdfghijklmnpqrsvwxyz";
+
+	for (size_t i = 0; i < 32; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = alphabet[(seed >> 16) % 32];
+	}
+	buf[32] = '\0';
+}
+
+static FILE *synthetic_stream(size_t lines)
+{
+	char hash[33];
+	unsigned dep;
+	FILE *stream;
+
+	stream = tmpfile();
+	if (stream == NULL) {
+		print_err("%s", strerror(errno));
+		return NULL;
+	}
+
+	for (size_t i = 0; i < lines; i++) {
+		store_hash(hash, i);
+		fprintf(stream,
+			"{\"attr\":\"pkg%zu\",\"attrPath\":[\"pkg%zu\"],"
+			"\"drvPath\":\"/nix/store/%s-pkg%zu-1.0.drv\","
+			"\"inputDrvs\":{",
+			i, i, hash, i);
+		for (size_t j = 0; j < SYNTHETIC_INPUT_DRVS; j++) {
+			/* the first few are shared by about everything, like
+			 * stdenv is */
+			dep = j < 4 ? j
+				    : 4 + (i * 7919 + j * 104729) %
+						  (SYNTHETIC_SHARED_DRVS - 4);
+			store_hash(hash, ~dep);
+			fprintf(stream,
+				"%s\"/nix/store/%s-dep%u.drv\":[\"out\"%s]",
+				j ? "," : "", hash, dep,
+				(dep % 3) ? "" : ",\"dev\"");
+		}
+		store_hash(hash, i + lines);
+		fprintf(stream,
+			"},\"name\":\"pkg%zu-1.0\",\"outputs\":{"
+			"\"out\":\"/nix/store/%s-pkg%zu-1.0\"},"
+			"\"system\":\"x86_64-linux\"}\n",
+			i, hash, i);
+	}
+
+	rewind(stream);
+	return stream;
+}
+
+static size_t heap_in_use(void)
+{
+	struct mallinfo2 mi;
+
+	mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+static long peak_rss(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return -1;
+	return usage.ru_maxrss;
+}
+
+int main(int argc, char *argv[])
+{
+	double start, elapsed_build, elapsed_free, elapsed_release;
+	size_t heap_before, heap_graph, jobs;
+	struct queue_thread *qt = NULL;
+	struct jobs_memory m;
+	struct job *job;
+	FILE *stream;
+	int ret;
+
+	size_t line_size = 0;
+	char *line = NULL;
+
+	if (argc > 1)
+		stream = fopen(argv[1], "r");
+	else
+		stream = synthetic_stream(SYNTHETIC_LINES);
+	if (stream == NULL) {
+		print_err("%s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	ret = queue_thread_new(&qt, NULL);
+	if (ret < 0)
+		goto out_fclose;
+
+	heap_before = heap_in_use();
+	start = monotonic_now();
+	while ((ret = job_read(stream, &line, &line_size, &job)) !=
+	       JOB_READ_EOF) {
+		if (ret < 0)
+			goto out_free_qt;
+		else if (ret != JOB_READ_SUCCESS)
+			continue;
+
+		ret = queue_push_batch(qt->queue, &job, 1);
+		if (ret < 0)
+			goto out_free_qt;
+	}
+	elapsed_build = monotonic_now() - start;
+	heap_graph = heap_in_use() - heap_before;
+	jobs = qt->queue->htab.slots_filled;
+	jobs_memory(&m);
+
+	start = monotonic_now();
+	queue_thread_free(qt);
+	qt = NULL;
+	elapsed_free = monotonic_now() - start;
+
+	start = monotonic_now();
+	jobs_release();
+	elapsed_release = monotonic_now() - start;
+
+	printf("%zu jobs in the graph, built in %.3fs, peak RSS %.1f MiB, "
+	       "%.1f MiB of heap\n",
+	       jobs, elapsed_build, peak_rss() / 1024.0,
+	       heap_graph / (1024.0 * 1024.0));
+	printf("jobs:    %8zu allocated %8zu reused\n", m.jobs.allocs,
+	       m.jobs.reuses);
+	printf("outputs: %8zu allocated %8zu reused\n", m.outputs.allocs,
+	       m.outputs.reuses);
+	printf("edges:   %8zu allocated %8zu reused\n", m.edges.allocs,
+	       m.edges.reuses);
+	printf("paths:   %8zu interned  %8zu lookups\n", m.paths.strings,
+	       m.paths.lookups);
+	printf("teardown %.3fs, arena release %.3fs\n", elapsed_free,
+	       elapsed_release);
+	ret = 0;
+
+out_free_qt:
+	queue_thread_free(qt);
+out_fclose:
+	free(line);
+	fclose(stream);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
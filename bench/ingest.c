@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cjson/cJSON.h>
+
+#include "eval_json.h"
+#include "evanix.h"
+#include "jobs.h"
+#include "util.h"
+
+/* Compares nix-eval-jobs ingestion throughput of the cJSON path evanix used
+ * to take against eval_json. Reads the given nix-eval-jobs output file, or
+ * generates a synthetic one when none is given. */
+
+#define SYNTHETIC_LINES	     100000
+#define SYNTHETIC_INPUT_DRVS 12
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = false,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.system = "x86_64-linux",
+	.solver_report = false,
+	.check_cache_status = false,
+	.solver = NULL,
+	.break_evanix = false,
+};
+
+static void store_hash(char *buf, unsigned seed)
+{
+	const char *alphabet = "0123456789abcdfghijklmnpqrsvwxyz";
+
+	for (size_t i = 0; i < 32; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = alphabet[(seed >> 16) % 32];
+	}
+	buf[32] = '\0';
+}
+
+static FILE *synthetic_stream(size_t lines)
+{
+	char hash[33];
+	FILE *stream;
+
+	stream = tmpfile();
+	if (stream == NULL) {
+		print_err("%s", strerror(errno));
+		return NULL;
+	}
+
+	for (size_t i = 0; i < lines; i++) {
+		store_hash(hash, i);
+		fprintf(stream,
+			"{\"attr\":\"pkg%zu\",\"attrPath\":[\"pkg%zu\"],"
+			"\"drvPath\":\"/nix/store/%s-pkg%zu-1.0.drv\","
+			"\"inputDrvs\":{",
+			i, i, hash, i);
+		for (size_t j = 0; j < SYNTHETIC_INPUT_DRVS; j++) {
+			store_hash(hash, i * SYNTHETIC_INPUT_DRVS + j + 1);
+			fprintf(stream,
+				"%s\"/nix/store/%s-dep%zu.drv\":[\"out\"%s]",
+				j ? "," : "", hash, j,
+				(j % 3) ? "" : ",\"dev\"");
+		}
+		store_hash(hash, ~i);
+		fprintf(stream,
+			"},\"name\":\"pkg%zu-1.0\",\"outputs\":{"
+			"\"out\":\"/nix/store/%s-pkg%zu-1.0\"},"
+			"\"system\":\"x86_64-linux\"}\n",
+			i, hash, i);
+	}
+
+	rewind(stream);
+	return stream;
+}
+
+static void strdup_free(const char *s)
+{
+	free(strdup(s));
+}
+
+/* what job_read() used to do, sans the struct job allocations */
+static size_t bench_cjson(FILE *stream)
+{
+	cJSON *root, *temp, *input_drv, *output;
+	size_t lines = 0;
+
+	while (json_streaming_read(stream, &root) >= 0) {
+		lines++;
+
+		temp = cJSON_GetObjectItemCaseSensitive(root, "system");
+		temp = cJSON_GetObjectItemCaseSensitive(root, "name");
+		strdup_free(temp->valuestring);
+		temp = cJSON_GetObjectItemCaseSensitive(root, "attr");
+		strdup_free(temp->valuestring);
+		temp = cJSON_GetObjectItemCaseSensitive(root, "drvPath");
+		strdup_free(temp->valuestring);
+
+		temp = cJSON_GetObjectItemCaseSensitive(root, "inputDrvs");
+		for (input_drv = temp->child; input_drv != NULL;
+		     input_drv = input_drv->next) {
+			strdup_free(input_drv->string);
+			cJSON_ArrayForEach (output, input_drv)
+				strdup_free(output->valuestring);
+		}
+
+		temp = cJSON_GetObjectItemCaseSensitive(root, "outputs");
+		for (output = temp->child; output != NULL;
+		     output = output->next) {
+			strdup_free(output->string);
+			strdup_free(output->valuestring);
+		}
+
+		cJSON_Delete(root);
+	}
+
+	return lines;
+}
+
+static size_t bench_eval_json(FILE *stream)
+{
+	char *cursor, *outputs, *key, *value;
+	struct eval_json ej;
+
+	size_t line_size = 0;
+	char *line = NULL;
+	size_t lines = 0;
+
+	while (getline(&line, &line_size, stream) >= 0) {
+		if (eval_json_parse(line, &ej) < 0)
+			break;
+		lines++;
+
+		cursor = ej.input_drvs;
+		while (eval_json_input_drv_next(&cursor, &key, &outputs) > 0) {
+			while (eval_json_string_next(&outputs, &value) > 0)
+				;
+		}
+
+		cursor = ej.outputs;
+		while (eval_json_output_next(&cursor, &key, &value) > 0)
+			;
+	}
+
+	free(line);
+	return lines;
+}
+
+static size_t bench_job_read(FILE *stream)
+{
+	struct job *job;
+
+	size_t line_size = 0;
+	char *line = NULL;
+	size_t lines = 0;
+
+	while (job_read(stream, &line, &line_size, &job) == JOB_READ_SUCCESS) {
+		lines++;
+		job_free(job);
+	}
+
+	free(line);
+	return lines;
+}
+
+static void bench_run(const char *name, size_t (*func)(FILE *), FILE *stream)
+{
+	double start, elapsed;
+	size_t lines;
+
+	rewind(stream);
+	start = monotonic_now();
+	lines = func(stream);
+	elapsed = monotonic_now() - start;
+
+	printf("%-10s %8zu lines %8.3fs %12.0f lines/s\n", name, lines,
+	       elapsed, lines / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *stream;
+
+	if (argc > 1)
+		stream = fopen(argv[1], "r");
+	else
+		stream = synthetic_stream(SYNTHETIC_LINES);
+	if (stream == NULL) {
+		print_err("%s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	bench_run("cjson", bench_cjson, stream);
+	bench_run("eval_json", bench_eval_json, stream);
+	bench_run("job_read", bench_job_read, stream);
+
+	fclose(stream);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uthash.h>
+
+#include "evanix.h"
+#include "jobs.h"
+#include "jobtab.h"
+#include "util.h"
+
+/* Compares looking jobs up by drv path in a uthash keyed on the whole
+ * string, like the queue's htab used to, against a jobtab keyed on the
+ * store path hash, at nixpkgs scale. Merging a job looks up its deps by
+ * their own drv_path and drv_hash, what nix-build --dry-run lists is looked
+ * up by a path that was read off its output. */
+
+/* MAX_NIX_PKG_COUNT of src/queue.c */
+#define SYNTHETIC_JOBS 200000
+#define PASSES	       5
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = false,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.max_time = 0,
+	.system = "x86_64-linux",
+	.solver_report = false,
+	.check_cache_status = false,
+	.solver = NULL,
+	.break_evanix = false,
+};
+
+struct strjob {
+	struct job *job;
+	UT_hash_handle hh;
+};
+
+struct timing {
+	double insert, merge, listed, miss;
+};
+
+static void store_path(char *buf, size_t size, size_t i)
+{
+	const char *alphabet = "0123456789abcdfghijklmnpqrsvwxyz";
+	unsigned seed = i;
+	char hash[33];
+
+	for (size_t k = 0; k < 32; k++) {
+		seed = seed * 1103515245 + 12345;
+		hash[k] = alphabet[(seed >> 16) % 32];
+	}
+	hash[32] = '\0';
+
+	snprintf(buf, size, "/nix/store/%s-pkg%zu-1.0.drv", hash, i);
+}
+
+static long bench_uthash(struct job **jobs, char **listed, char **missing,
+			 struct timing *t)
+{
+	struct strjob *htab = NULL, *sj, *tmp, *sjs;
+	double start;
+	long found = 0;
+
+	sjs = malloc(SYNTHETIC_JOBS * sizeof(*sjs));
+	if (sjs == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	start = monotonic_now();
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		sjs[i].job = jobs[i];
+		HASH_ADD_KEYPTR(hh, htab, jobs[i]->drv_path,
+				strlen(jobs[i]->drv_path), &sjs[i]);
+	}
+	t->insert = monotonic_now() - start;
+
+	start = monotonic_now();
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+			HASH_FIND_STR(htab, jobs[i]->drv_path, sj);
+			found += sj != NULL;
+		}
+	}
+	t->merge = monotonic_now() - start;
+
+	start = monotonic_now();
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+			HASH_FIND_STR(htab, listed[i], sj);
+			found += sj != NULL;
+		}
+	}
+	t->listed = monotonic_now() - start;
+
+	start = monotonic_now();
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+			HASH_FIND_STR(htab, missing[i], sj);
+			found += sj != NULL;
+		}
+	}
+	t->miss = monotonic_now() - start;
+
+	HASH_ITER (hh, htab, sj, tmp)
+		HASH_DEL(htab, sj);
+	free(sjs);
+
+	return found;
+}
+
+static long bench_jobtab(struct job **jobs, char **listed, char **missing,
+			 struct timing *t)
+{
+	struct jobtab tab;
+	double start;
+	long found = 0;
+	int ret;
+
+	jobtab_init(&tab);
+	start = monotonic_now();
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		ret = jobtab_insert(&tab, jobs[i]);
+		if (ret < 0) {
+			jobtab_free(&tab);
+			return ret;
+		}
+	}
+	t->insert = monotonic_now() - start;
+
+	start = monotonic_now();
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		for (size_t i = 0; i < SYNTHETIC_JOBS; i++)
+			found += jobtab_find(&tab, jobs[i]->drv_path,
+					     jobs[i]->drv_hash) != NULL;
+	}
+	t->merge = monotonic_now() - start;
+
+	start = monotonic_now();
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		for (size_t i = 0; i < SYNTHETIC_JOBS; i++)
+			found += jobtab_find(&tab, listed[i],
+					     jobtab_hash(listed[i])) != NULL;
+	}
+	t->listed = monotonic_now() - start;
+
+	start = monotonic_now();
+	for (size_t pass = 0; pass < PASSES; pass++) {
+		for (size_t i = 0; i < SYNTHETIC_JOBS; i++)
+			found += jobtab_find(&tab, missing[i],
+					     jobtab_hash(missing[i])) != NULL;
+	}
+	t->miss = monotonic_now() - start;
+
+	jobtab_free(&tab);
+
+	return found;
+}
+
+static void timing_print(const char *name, struct timing *t)
+{
+	const double lookups = 1e-9 * PASSES * SYNTHETIC_JOBS;
+
+	printf("%-7s insert %6.1fns merge %6.1fns listed %6.1fns "
+	       "miss %6.1fns\n",
+	       name, t->insert / (1e-9 * SYNTHETIC_JOBS), t->merge / lookups,
+	       t->listed / lookups, t->miss / lookups);
+}
+
+int main(void)
+{
+	struct timing t_uthash, t_jobtab;
+	long found_uthash, found_jobtab;
+	char **listed, **missing;
+	char drv_path[128];
+	struct job **jobs;
+	int ret = 0;
+
+	jobs = calloc(SYNTHETIC_JOBS, sizeof(*jobs));
+	listed = calloc(SYNTHETIC_JOBS, sizeof(*listed));
+	missing = calloc(SYNTHETIC_JOBS, sizeof(*missing));
+	if (jobs == NULL || listed == NULL || missing == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free;
+	}
+
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		store_path(drv_path, sizeof(drv_path), i);
+		ret = job_new(&jobs[i], NULL, drv_path, NULL, NULL);
+		if (ret < 0)
+			goto out_free;
+
+		/* copies, not the interned path */
+		listed[i] = strdup(drv_path);
+		store_path(drv_path, sizeof(drv_path), ~i);
+		missing[i] = strdup(drv_path);
+		if (listed[i] == NULL || missing[i] == NULL) {
+			print_err("%s", strerror(errno));
+			ret = -errno;
+			goto out_free;
+		}
+	}
+
+	found_uthash = bench_uthash(jobs, listed, missing, &t_uthash);
+	found_jobtab = bench_jobtab(jobs, listed, missing, &t_jobtab);
+	if (found_uthash < 0 || found_jobtab < 0) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	printf("%d jobs, %d passes\n", SYNTHETIC_JOBS, PASSES);
+	timing_print("uthash", &t_uthash);
+	timing_print("jobtab", &t_jobtab);
+	if (found_uthash != found_jobtab ||
+	    found_jobtab != 2L * PASSES * SYNTHETIC_JOBS) {
+		print_err("%s", "uthash and jobtab found different jobs");
+		ret = -EINVAL;
+	}
+
+out_free:
+	for (size_t i = 0; i < SYNTHETIC_JOBS; i++) {
+		if (listed != NULL)
+			free(listed[i]);
+		if (missing != NULL)
+			free(missing[i]);
+		if (jobs != NULL && jobs[i] != NULL)
+			job_free(jobs[i]);
+	}
+	free(jobs);
+	free(listed);
+	free(missing);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 
-from typing import List, Tuple
+from typing import Dict, List, Tuple
 from sklearn import linear_model
 import tqdm
 import scipy
@@ -11,6 +11,7 @@ import numpy as np
 class matrix_builds_inputpnames:
     independent_variables: scipy.sparse.coo_array
     dependent_variable: np.ndarray
+    pnames: Dict[int, str]
 
     def __init__(self, db: str) -> None:
         row: List[int] = []
@@ -23,7 +24,7 @@ class matrix_builds_inputpnames:
         builds = self.table_fetch(cur, '''
             SELECT ROWID, drv_id, duration FROM builds_cleaned
         ''')
-        self.dependent_variable = np.array([ [ row[1] ] for row in tqdm.tqdm(builds) ])
+        self.dependent_variable = np.array([ [ row[2] ] for row in tqdm.tqdm(builds) ])
 
         for build in tqdm.tqdm(builds):
             inputpnames = self.table_fetch(cur, '''
@@ -41,6 +42,10 @@ class matrix_builds_inputpnames:
         np_data = np.array(data)
         self.independent_variables = scipy.sparse.coo_array((np_data, (np_row, np_col)))
 
+        self.pnames = dict(self.table_fetch(cur, '''
+            SELECT ROWID, pname FROM pnames
+        '''))
+
         con.commit()
         con.close()
 
@@ -49,10 +54,21 @@ class matrix_builds_inputpnames:
         query_exec = cur.execute(query, args)
         return query_exec.fetchall()
 
+# in the format src/model.c reads, columns are pnames ROWIDs
+def model_write(path: str, regr: linear_model.LinearRegression,
+                pnames: Dict[int, str]) -> None:
+    with open(path, 'w') as f:
+        f.write('evanix-model 1\n')
+        f.write(f'intercept\t{float(regr.intercept_[0])!r}\n')
+        for col, coef in enumerate(regr.coef_[0]):
+            if coef != 0 and col in pnames:
+                f.write(f'{pnames[col]}\t{float(coef)!r}\n')
+
 def args_get():
     parser = argparse.ArgumentParser()
     parser.add_argument('-d', '--db', required=True, help="path to sqlite database containing input_pnames and builds")
-    parser.add_argument('-t', '--test', type=int, required=True, help="row to test against")
+    parser.add_argument('-t', '--test', type=int, help="row to test against")
+    parser.add_argument('-o', '--output', help="path to write the model for evanix --model to")
     return parser.parse_args()
 
 if __name__ == '__main__':
@@ -61,8 +77,12 @@ if __name__ == '__main__':
 
     regr = linear_model.LinearRegression()
     regr.fit(matrix.independent_variables, matrix.dependent_variable)
-    pred = regr.predict([matrix.independent_variables.toarray()[args.test]])
 
-    print(f'prediction  : {pred[0][0]}')
-    print(f'og duration : {matrix.dependent_variable[args.test][0]}')
+    if args.test is not None:
+        pred = regr.predict(matrix.independent_variables.tocsr()[[args.test]])
+        print(f'prediction  : {pred[0][0]}')
+        print(f'og duration : {matrix.dependent_variable[args.test][0]}')
+
+    if args.output is not None:
+        model_write(args.output, regr, matrix.pnames)
 
@@ -0,0 +1,51 @@
+#include <pthread.h>
+#include <stddef.h>
+
+#ifndef ARENA_H
+
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+/* threads are spread over this many locks, each with its own chunk */
+#define ARENA_STRIPES 8
+
+struct arena_stripe {
+	pthread_mutex_t mutex;
+	/* the chunk being carved up, chunks are linked through their first
+	 * bytes */
+	char *chunk;
+	size_t chunk_used, chunk_size;
+	/* objects given back with arena_free() */
+	void *free_list;
+	/* carved out of a chunk, taken off free_list, chunks allocated */
+	size_t allocs, reuses, chunks, bytes;
+};
+
+/* Allocates out of chunks that are only ever let go of all at once, by
+ * arena_release(). An arena of fixed size objects, object_size not 0, also
+ * takes back single objects with arena_free() for the next arena_alloc().
+ * Any other arena is for strings, what it hands out is not aligned. */
+struct arena {
+	size_t object_size;
+	struct arena_stripe stripes[ARENA_STRIPES];
+};
+
+#define ARENA_INIT(size)                                                       \
+	{                                                                      \
+		.object_size = (size),                                         \
+		.stripes = {[0 ... ARENA_STRIPES - 1] =                        \
+				    {.mutex = PTHREAD_MUTEX_INITIALIZER}},     \
+	}
+
+struct arena_stats {
+	size_t allocs, reuses, chunks, bytes;
+};
+
+/* size is ignored unless the arena is not of fixed size objects, returns
+ * NULL and sets errno on failure */
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena, void *p);
+/* every object allocated out of arena is gone after this */
+void arena_release(struct arena *arena);
+void arena_stats(struct arena *arena, struct arena_stats *stats);
+
+#define ARENA_H
+#endif
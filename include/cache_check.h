@@ -0,0 +1,49 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jobs.h"
+#include "queue.h"
+
+#ifndef CACHE_CHECK_H
+
+/* classified jobs pushed to the queue under one lock */
+#define CACHE_CHECK_BATCH 64
+
+/* Pipeline stage between parsing and the queue, parsed jobs get their cache
+ * status checked on nthreads threads and are queued in batches as they are
+ * classified, in whatever order that happens */
+struct cache_check {
+	struct queue *queue;
+	pthread_mutex_t mutex;
+	/* signaled when a job is submitted, and when a slot frees up */
+	pthread_cond_t cond_job, cond_slot;
+
+	/* ring of submitted jobs no thread picked up yet */
+	struct job **pending;
+	size_t pending_head, pending_filled;
+	/* submitted and not classified yet, never more than window */
+	size_t inflight, window;
+	/* classified on the submitting thread, with nthreads 0 */
+	struct job *batch[CACHE_CHECK_BATCH];
+	size_t batch_filled;
+	bool done;
+	int ret;
+
+	uint32_t nthreads;
+	pthread_t *threads;
+	/* time submitters spent blocked on a full window */
+	double wait_time;
+};
+
+/* with nthreads 0, or the cache status check disabled, jobs are classified
+ * on the submitting thread */
+int cache_check_new(struct cache_check **cc, struct queue *queue,
+		    uint32_t nthreads);
+/* blocks while the window is full, job is owned by the stage after this */
+int cache_check_submit(struct cache_check *cc, struct job *job);
+/* waits for the jobs in flight, then frees cc */
+int cache_check_finish(struct cache_check *cc);
+
+#define CACHE_CHECK_H
+#endif
@@ -0,0 +1,70 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "dag.h"
+#include "jobs.h"
+
+#ifndef CLOSURE_H
+
+/* Walks the transitive deps of jobs, every derivation left to build is
+ * counted once however many paths lead to it. Substituted jobs cost nothing
+ * and neither do their deps, which don't have to be built for them. */
+struct closure {
+	/* stamped on the jobs the current walk has visited */
+	uint32_t epoch;
+	/* stamped on the jobs selected since closure_init() */
+	uint32_t generation;
+	size_t stack_size, stack_filled;
+	struct job **stack;
+	/* cost of everything selected so far */
+	int selected_cost;
+};
+
+void closure_init(struct closure *c);
+void closure_free(struct closure *c);
+/* cost of building job and whatever it needs that isn't built yet */
+int closure_cost(struct closure *c, struct job *job);
+/* like closure_cost(), minus what is already selected */
+int closure_cost_marginal(struct closure *c, struct job *job);
+/* selects job along with its closure, returns the marginal cost */
+int closure_select(struct closure *c, struct job *job);
+/* sums of the mean build times and variances over the closure cost, the
+ * builds taken as independent */
+int closure_moments(struct closure *c, struct job *job, double *mean,
+		    double *variance);
+
+/* bitsets larger than this in total aren't built, see closure_set_new() */
+#define CLOSURE_SET_MAX_BYTES (256 << 20)
+
+/* The closures of dag_closure_cost(), as one bitset over the nodes of a
+ * frozen DAG per root, so they can be compared a word at a time. Like the
+ * DAG, it isn't kept up to date other than through closure_set_exclude(). */
+struct closure_set {
+	struct dag *dag;
+	/* uint64_t words per bitset */
+	size_t words;
+	/* row of each node, -1 for those that aren't roots */
+	ssize_t *rows;
+	uint64_t *bits;
+	/* union of the selected closures, and of what was excluded */
+	uint64_t *selected;
+	int selected_cost;
+};
+
+/* -E2BIG if the bitsets would take over CLOSURE_SET_MAX_BYTES */
+int closure_set_new(struct closure_set **cs, struct dag *dag);
+void closure_set_free(struct closure_set *cs);
+/* leaves job out of the marginal costs from now on, without selecting it,
+ * see dag_building_set() */
+void closure_set_exclude(struct closure_set *cs, struct job *job);
+/* these take the jobs of roots only */
+int closure_set_cost(struct closure_set *cs, struct job *job);
+int closure_set_cost_marginal(struct closure_set *cs, struct job *job);
+int closure_set_select(struct closure_set *cs, struct job *job);
+/* derivations both would build */
+size_t closure_set_overlap(struct closure_set *cs, struct job *a,
+			   struct job *b);
+
+#define CLOSURE_H
+#endif
@@ -0,0 +1,56 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jobid.h"
+#include "jobs.h"
+
+#ifndef DAG_H
+
+#define DAG_REQUESTED	    (1 << 0)
+#define DAG_STALE	    (1 << 1)
+#define DAG_INSUBSTITUTERS (1 << 2)
+#define DAG_BUILDING	    (1 << 3)
+
+/* The DAG under the queue, frozen for the solvers. Nodes are the job ids
+ * jobid_init() hands out, deps before what needs them, and the edges of
+ * node i are deps[deps_index[i]] up to deps[deps_index[i + 1]], parents
+ * alike. It isn't kept up to date with the jobs, other than the stale and
+ * building flags, see dag_stale_set() and dag_building_set(). */
+struct dag {
+	struct jobid *jobid;
+	uint32_t nodes;
+	/* node ids of the queue, in queue order */
+	uint32_t roots_filled;
+	uint32_t *roots;
+	uint32_t *deps_index, *deps;
+	uint32_t *parents_index, *parents;
+	/* job_cost() of each node, JOB_COST_UNSET until dag_cost() */
+	int32_t *costs;
+	uint8_t *flags;
+
+	/* walks, a node is visited when its stamp is the epoch */
+	uint32_t epoch;
+	uint32_t *stamps;
+	uint32_t *stack;
+};
+
+/* numbers the jobs under q afresh, and freezes them */
+int dag_new(struct dag **dag, struct job_clist *q);
+void dag_free(struct dag *dag);
+/* job_cost() of node */
+int dag_cost(struct dag *dag, uint32_t node);
+/* closure_cost() over the frozen DAG */
+int dag_closure_cost(struct dag *dag, uint32_t node);
+/* same as dag_closure_cost(), and sets the bit of every node counted in bits */
+int dag_closure_bits(struct dag *dag, uint32_t node, uint64_t *bits);
+/* job_stale_set() for node, on the jobs as well as dag, returns how many
+ * requested nodes it made stale */
+size_t dag_stale_set(struct dag *dag, uint32_t node);
+/* job was taken out of the queue to be built, walks leave it out from now
+ * on like the jobs do, does nothing if job has no node */
+void dag_building_set(struct dag *dag, struct job *job);
+/* bytes taken by dag, the jobs it was frozen from aside */
+size_t dag_size(struct dag *dag);
+
+#define DAG_H
+#endif
@@ -0,0 +1,38 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef DRV_H
+
+/* a run of buf, still ATerm escaped, s is NULL if there's none */
+struct drv_span {
+	const char *s;
+	size_t len;
+};
+
+/* a parsed .drv file, the pointers point into buf which is modified in
+ * place, the lists are unparsed, walk them with drv_*_next() */
+struct drv {
+	/* a private mapping of the file if it's large, unless its size is a
+	 * multiple of the page size, there's no NUL after it to map then */
+	char *buf;
+	size_t size;
+	bool ismapped;
+	char *outputs, *input_drvs, *input_srcs;
+	char *platform;
+	/* of env */
+	struct drv_span pname, required_system_features, prefer_local_build;
+};
+
+int drv_read(const char *drv_path, struct drv *drv);
+void drv_free(struct drv *drv);
+/* unescapes span into a string of its own */
+int drv_span_dup(const struct drv_span *span, char **s);
+/* -ENOENT if the env of the drv at drv_path has no pname, -errno without a
+ * word if drv_path can't be opened */
+int drv_pname(const char *drv_path, char **pname);
+int drv_output_next(char **cursor, char **name, char **store_path);
+int drv_input_drv_next(char **cursor, char **drv_path, char **outputs);
+int drv_string_next(char **cursor, char **s);
+
+#define DRV_H
+#endif
@@ -0,0 +1,20 @@
+#include <stdbool.h>
+
+#include "jobs.h"
+
+#ifndef EVAL_CACHE_H
+
+/* Fingerprints expr along with the options and local sources it depends on,
+ * *ishit is set if a complete evaluation is stored under that fingerprint,
+ * otherwise the jobs written from here on get recorded under it */
+int eval_cache_open(char *expr, bool invalidate, bool *ishit);
+/* path of the cache entry, NULL if eval_cache_open() wasn't called */
+const char *eval_cache_path(void);
+/* both are thread safe and do nothing when nothing is being recorded */
+void eval_cache_job_write(struct job *job);
+void eval_cache_error_write(const char *error);
+/* the recording only replaces the cache entry if commit is set */
+int eval_cache_close(bool commit);
+
+#define EVAL_CACHE_H
+#endif
@@ -0,0 +1,18 @@
+#ifndef EVAL_JSON_H
+
+/* fields of a single nix-eval-jobs output line, all pointers point into the
+ * line buffer handed to eval_json_parse(), which is modified in place */
+struct eval_json {
+	char *error, *system, *name, *attr, *drv_path;
+
+	/* unparsed objects, walk them with eval_json_*_next() */
+	char *input_drvs, *outputs;
+};
+
+int eval_json_parse(char *line, struct eval_json *ej);
+int eval_json_input_drv_next(char **cursor, char **drv_path, char **outputs);
+int eval_json_output_next(char **cursor, char **name, char **store_path);
+int eval_json_string_next(char **cursor, char **s);
+
+#define EVAL_JSON_H
+#endif
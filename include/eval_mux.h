@@ -0,0 +1,48 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifndef EVAL_MUX_H
+
+struct eval_mux_src {
+	FILE *stream;
+	int fd;
+	/* nix-eval-jobs, or -1 */
+	pid_t pid;
+	bool eof;
+	/* prepended to the attr of every job read from this source */
+	char *attr_prefix;
+
+	/* bytes read but not handed out yet live in buf[start, filled) */
+	char *buf;
+	size_t start, filled, size;
+};
+
+/* merges the line oriented output of several nix-eval-jobs processes into a
+ * single stream of whole lines */
+struct eval_mux {
+	int epfd;
+	size_t srcs_filled, srcs_open;
+	struct eval_mux_src *srcs;
+	/* round robin between sources that have whole lines buffered */
+	size_t next;
+};
+
+/* Spawns one nix-eval-jobs per shard, each evaluating expr.shard, or a single
+ * one evaluating expr when there are no shards */
+int eval_mux_init(struct eval_mux **mux, char *expr, char **shards,
+		  size_t shards_filled);
+/* A single source reading the nix-eval-jobs lines stored in path */
+int eval_mux_file_init(struct eval_mux **mux, const char *path);
+/* Same as getline(3) but across all sources, *attr_prefix is set to the
+ * shard the line came from, or NULL */
+ssize_t eval_mux_getline(struct eval_mux *mux, char **line, size_t *line_size,
+			 const char **attr_prefix);
+/* Reaps the nix-eval-jobs processes, returns 0 if all of them succeeded.
+ * Those whose output wasn't read to the end are stopped first, and make it
+ * return -ECANCELED. */
+int eval_mux_wait(struct eval_mux *mux);
+void eval_mux_free(struct eval_mux *mux);
+
+#define EVAL_MUX_H
+#endif
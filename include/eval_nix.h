@@ -0,0 +1,11 @@
+#include "cache_check.h"
+
+#ifndef EVAL_NIX_H
+
+/* Evaluates expr in process through the nix expr C API and submits every
+ * derivation found to cc as it goes, this must run on the main thread since
+ * it's the only one the nix garbage collector knows about */
+int eval_nix_run(struct cache_check *cc, char *expr);
+
+#define EVAL_NIX_H
+#endif
@@ -1,15 +1,17 @@
-#include <sqlite3.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 #include "jobs.h"
+#include "model.h"
+#include "queue.h"
+#include "statistics.h"
 
 #ifndef EVANIX_H
 
-struct statistics {
-	struct sqlite3 *db;
-	sqlite3_stmt *statement;
-};
+typedef enum {
+	EVALUATOR_NIX_EVAL_JOBS = 0,
+	EVALUATOR_LIBEXPR = 1,
+} evaluator_t;
 
 struct evanix_opts_t {
 	bool isflake;
@@ -19,11 +21,29 @@ struct evanix_opts_t {
 	bool close_unused_fd;
 	bool check_cache_status;
 	bool break_evanix;
+	bool eval_cache;
+	bool eval_cache_invalidate;
+	/* feed the build times back into the statistics database */
+	bool record_statistics;
+	/* the DAG is all of the closure, not a job and its inputDrvs */
+	bool full_closure;
 	char *system;
 	struct statistics statistics;
+	/* what of the build time solvers plan against */
+	statistics_quantile_t cost_quantile;
+	/* predicts the costs the statistics don't have, may be NULL */
+	struct model *model;
 	uint32_t max_builds;
 	uint32_t max_time;
-	int (*solver)(struct job **, struct job_clist *, int32_t);
+	uint32_t ingest_threads;
+	uint32_t cache_check_jobs;
+	/* attr paths under expr evaluated by their own nix-eval-jobs */
+	size_t eval_shards_size, eval_shards_filled;
+	char **eval_shards;
+	evaluator_t evaluator;
+	int (*solver)(struct job **, struct queue *, int32_t);
+	int (*cache_backend)(struct job *, struct cache_memo *,
+			     struct cache_status *);
 };
 
 extern struct evanix_opts_t evanix_opts;
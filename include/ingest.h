@@ -0,0 +1,16 @@
+#include <stdint.h>
+
+#include "cache_check.h"
+#include "eval_mux.h"
+
+#ifndef INGEST_H
+
+/* Splits the output of mux into line batches, parses them on nthreads worker
+ * threads and submits the parsed jobs to cc one batch at a time, in the same
+ * order they were read. Returns once mux hits EOF and every batch is
+ * submitted. */
+int ingest_run(struct cache_check *cc, struct eval_mux *mux,
+	       uint32_t nthreads);
+
+#define INGEST_H
+#endif
@@ -0,0 +1,51 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#ifndef INTERN_H
+
+/* strings hash to one of these, each with its own lock and table */
+#define INTERN_STRIPES 16
+
+struct intern_slot {
+	uint64_t hash;
+	const char *s;
+};
+
+struct intern_stripe {
+	pthread_mutex_t mutex;
+	/* open addressing, linear probing, a power of 2 in size */
+	size_t slots_size, slots_filled;
+	struct intern_slot *slots;
+	/* intern() calls, and those that found the string already there */
+	size_t lookups, hits;
+};
+
+/* Keeps a single copy of every string it is given, so equal strings share
+ * the same pointer. The copies live in strings until intern_release(). */
+struct intern {
+	struct intern_stripe stripes[INTERN_STRIPES];
+	struct arena strings;
+};
+
+#define INTERN_INIT                                                            \
+	{                                                                      \
+		.stripes = {[0 ... INTERN_STRIPES - 1] =                       \
+				    {.mutex = PTHREAD_MUTEX_INITIALIZER}},     \
+		.strings = ARENA_INIT(0),                                      \
+	}
+
+struct intern_stats {
+	size_t strings, bytes, lookups, hits;
+};
+
+/* the copy of s, returns NULL and sets errno on failure */
+const char *intern(struct intern *in, const char *s);
+/* every string intern() returned is gone after this */
+void intern_release(struct intern *in);
+void intern_stats(struct intern *in, struct intern_stats *stats);
+
+#define INTERN_H
+#endif
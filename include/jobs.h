@@ -1,17 +1,34 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/queue.h>
 #include <uthash.h>
 
+#include "arena.h"
+#include "intern.h"
+
 #ifndef JOBS_H
 
+/* cost of a job not looked up yet */
+#define JOB_COST_UNSET -1
+
+/* jobtab.h includes this one */
+struct jobtab;
+
+/* name and store_path are interned, see jobs_release() */
 struct output {
-	char *name, *store_path;
+	const char *name, *store_path;
 };
 
 struct job {
-	char *name, *drv_path, *nix_attr_name;
+	char *name, *nix_attr_name;
+	/* interned, a drv path is only ever stored once */
+	const char *drv_path;
+	/* jobtab_hash() of drv_path */
+	uint64_t drv_hash;
+	/* interned, NULL until the .drv is read for it, see job_cost() */
+	const char *pname;
 	bool requested;
 	bool insubstituters;
 	size_t outputs_size, outputs_filled;
@@ -22,7 +39,6 @@ struct job {
 	struct job **deps;
 	size_t parents_size, parents_filled;
 	struct job **parents;
-	UT_hash_handle hh;
 
 	/* queue */
 	CIRCLEQ_ENTRY(job) clist;
@@ -30,9 +46,53 @@ struct job {
 	/* solver */
 	ssize_t id;
 	bool stale;
+	/* job_cost() ignoring insubstituters, and job_cost_recursive(), kept
+	 * up to date as deps come and go or get substituted */
+	int cost, cost_recursive;
+	/* cost came from evanix_opts.model, not the statistics */
+	bool cost_estimated;
+	/* the mean and variance of the build time, cost is the
+	 * --cost-quantile of it, JOB_COST_UNSET if only cost is known */
+	int cost_mean;
+	float cost_variance;
+	/* stamps of struct closure */
+	uint32_t closure_epoch, closure_generation;
+	/* stamp of job_free() and job_closure_unlink(), see job_mark_next(),
+	 * and how many of its parents job_free() got to */
+	uint32_t mark;
+	size_t mark_parents;
+	/* the next job of a walk that is stamped, or stale, lists what it
+	 * still has to go through without allocating */
+	struct job *mark_next;
 };
 CIRCLEQ_HEAD(job_clist, job);
 
+typedef enum {
+	CACHE_STATUS_LOCAL = 0,
+	CACHE_STATUS_SUBSTITUTABLE = 1,
+	CACHE_STATUS_BUILD = 2,
+} cache_status_t;
+
+/* what nix-build --dry-run had to say about a drv path, or about an output
+ * path in case of substitutes */
+struct cache_status {
+	char *path;
+	cache_status_t status;
+	/* path was checked itself, closure is everything it listed */
+	bool iscomplete;
+	size_t closure_size, closure_filled;
+	struct cache_status **closure;
+	UT_hash_handle hh;
+};
+
+/* so a dependency shared by many jobs is only checked once per run */
+struct cache_memo {
+	pthread_mutex_t mutex;
+	struct cache_status *htab;
+	/* nix-build --dry-run runs, and checks answered from htab instead */
+	size_t checks, saved;
+};
+
 typedef enum {
 	JOB_READ_SUCCESS = 0,
 	JOB_READ_EOF = 1,
@@ -41,16 +101,75 @@ typedef enum {
 	JOB_READ_CACHED = 4,
 	JOB_READ_SYS_MISMATCH = 5,
 } job_read_state_t;
-int job_read(FILE *stream, struct job **jobs);
+/* parses a single nix-eval-jobs output line, line is modified in place,
+ * attr_prefix is prepended to the attr name if not NULL, the cache status
+ * is not checked, returns a job_read_state_t or -errno */
+int job_parse(char *line, const char *attr_prefix, struct job **job);
+/* line and line_size are reused across calls, just like getline(3) */
+int job_read(FILE *stream, char **line, size_t *line_size, struct job **job);
 
 /* Spawns nix-eval-jobs and connects its stdout to stream */
 int jobs_init(FILE **stream, char *expr);
+int job_new(struct job **j, char *name, const char *drv_path, char *attr,
+	    struct job *parent);
+/* gives j back to the arena it came from, its interned strings stay */
 void job_free(struct job *j);
+int job_output_insert(struct job *j, const char *name,
+		      const char *store_path);
+int job_deps_list_insert(struct job *job, struct job *dep);
+/* reads the inputDrvs of job from its .drv file into job->deps */
+int job_read_drv(struct job *job);
+/* Reads the inputDrvs of every drv in the closure of job from its .drv file,
+ * so deps of deps hang off what needs them instead of job. With islisted,
+ * job->deps is what job_cache_check() kept and the closure is taken to be
+ * no more than that. A drv already in known, looked up with mutex held, is
+ * not read, its closure is in known too. known may be NULL. */
+int job_read_closure(struct job *job, bool islisted, struct jobtab *known,
+		     pthread_mutex_t *mutex);
+/* returns JOB_READ_SUCCESS or JOB_READ_CACHED, or -errno */
+int job_cache_check(struct job *job, struct cache_memo *memo);
+/* cache status backend, root->closure gets what nix-build --dry-run lists
+ * for job */
+int job_read_cache(struct job *job, struct cache_memo *memo,
+		   struct cache_status *root);
+void cache_memo_init(struct cache_memo *memo);
+/* looks up or adds path, memo->mutex must be held */
+int cache_memo_get(struct cache_memo *memo, const char *path,
+		   cache_status_t status, struct cache_status **cs);
+int cache_status_closure_insert(struct cache_status *cs,
+				struct cache_status *dep);
+void cache_memo_free(struct cache_memo *memo);
 int job_cost_recursive(struct job *job);
 int job_parents_list_insert(struct job *job, struct job *parent);
 void job_deps_list_rm(struct job *job, struct job *dep);
-void job_stale_set(struct job *job);
+void job_parents_list_rm(struct job *job, struct job *parent);
+/* a stamp no job has, the 3 after it are taken as well */
+uint32_t job_mark_next(void);
+/* Drops every edge between the n jobs of closure, all stamped with mark,
+ * and the jobs outside of it, in time linear in the edges of both. */
+void job_closure_unlink(struct job **closure, size_t n, uint32_t mark);
+/* returns how many requested jobs it made stale */
+size_t job_stale_set(struct job *job);
+/* sets insubstituters, fixing up the cost_recursive that depends on it */
+void job_insubstituters_set(struct job *job, bool insubstituters);
 int job_cost(struct job *job);
+/* feeds how long the drv at drv_path took to build back into the
+ * statistics, whichever job of the closure nix-build built it for, see
+ * statistics_record() for isalone */
+int job_cost_record(const char *drv_path, double duration, bool isalone);
+
+/* what the jobs, their outputs and the strings they share take up */
+struct jobs_memory {
+	/* edges is the deps, parents and outputs arrays, names what jobs are
+	 * called */
+	struct arena_stats jobs, outputs, edges, names;
+	struct intern_stats paths;
+};
+void jobs_memory(struct jobs_memory *m);
+/* Lets go of every job and output at once, along with their edges and
+ * names and the strings interned for them. Nothing job_new() returned may
+ * be used after, not even with job_free(). */
+void jobs_release(void);
 
 #define JOBS_H
 #endif
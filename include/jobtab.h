@@ -0,0 +1,41 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jobs.h"
+
+#ifndef JOBTAB_H
+
+/* bytes of the sha256 a store path hash is truncated to, 32 base32 digits */
+#define STORE_HASH_SIZE 20
+
+struct jobtab_slot {
+	/* job->drv_hash, so probing doesn't have to look at the job */
+	uint64_t hash;
+	struct job *job;
+};
+
+/* Jobs by drv path, open addressing with linear probing, a power of 2 in
+ * size. Jobs are not owned by it. The key is 8 of the 20 bytes of the store
+ * path hash, a match is confirmed on the path, see jobtab_hash(). */
+struct jobtab {
+	size_t slots_size, slots_filled;
+	struct jobtab_slot *slots;
+};
+
+/* the hash part of a store path, decoded, returns -EINVAL if path is not
+ * one */
+int store_hash_decode(const char *path, uint8_t hash[STORE_HASH_SIZE]);
+/* the key of path in a jobtab, what job_new() puts in job->drv_hash */
+uint64_t jobtab_hash(const char *path);
+void jobtab_init(struct jobtab *tab);
+/* hash is jobtab_hash() of drv_path */
+struct job *jobtab_find(struct jobtab *tab, const char *drv_path,
+			uint64_t hash);
+/* returns -EEXIST if a job of the same drv path is in tab already */
+int jobtab_insert(struct jobtab *tab, struct job *job);
+/* does nothing if job is not in tab */
+void jobtab_del(struct jobtab *tab, struct job *job);
+void jobtab_free(struct jobtab *tab);
+
+#define JOBTAB_H
+#endif
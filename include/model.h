@@ -0,0 +1,38 @@
+#include <stddef.h>
+#include <uthash.h>
+
+#ifndef MODEL_H
+
+#define MODEL_MAGIC "evanix-model 1"
+
+struct model_coef {
+	char *pname;
+	double coef;
+	UT_hash_handle hh;
+};
+
+/* Linear model of build time over the pnames of the input derivations,
+ * written by evanix train or bin/model.py. The file is MODEL_MAGIC, then an
+ * "intercept" line, then a "pname<TAB>coefficient" line per input pname, for
+ * example
+ *
+ *   evanix-model 1
+ *   intercept	31.5
+ *   gcc	120.25
+ */
+struct model {
+	double intercept;
+	struct model_coef *htab;
+};
+
+int model_new(struct model **model);
+int model_read(struct model **model, const char *path);
+int model_write(struct model *model, const char *path);
+void model_free(struct model *model);
+/* replaces the coefficient of pname if it has one */
+int model_coef_insert(struct model *model, const char *pname, double coef);
+/* input pnames that show up more than once count once */
+double model_predict(struct model *model, char **pnames, size_t n);
+
+#define MODEL_H
+#endif
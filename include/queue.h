@@ -4,7 +4,11 @@
 #include <stdint.h>
 #include <sys/queue.h>
 
+#include "closure.h"
+#include "dag.h"
+#include "eval_mux.h"
 #include "jobs.h"
+#include "jobtab.h"
 
 #ifndef QUEUE_H
 
@@ -18,25 +22,62 @@ struct queue {
 	sem_t sem;
 	queue_state_t state;
 	pthread_mutex_t mutex;
-	struct job *htab;
+	struct jobtab htab;
+	struct cache_memo memo;
+	/* requested is what is in jobs, stale what of it won't be built and
+	 * building what queue_pop() handed out that isn't built yet */
+	size_t requested, stale, building;
 
 	/* solver */
 	struct jobid *jobid;
+	/* jobs frozen for the solvers, NULL until queue_dag() */
+	struct dag *dag;
+	/* over dag, NULL until queue_closure_set() */
+	struct closure_set *closure_set;
 	int32_t resources;
+	/* of the build time of what was popped, under --max-time */
+	double planned_mean, planned_variance;
 };
 
 struct queue_thread {
 	pthread_t tid;
 	struct queue *queue;
-	FILE *stream;
+	struct eval_mux *mux;
 };
 
-int queue_thread_new(struct queue_thread **queue_thread, FILE *stream);
+/* the counters of struct queue, ready is what of jobs is left to build */
+struct queue_counts {
+	size_t requested, stale, ready, building;
+};
+
+int queue_thread_new(struct queue_thread **queue_thread,
+		     struct eval_mux *mux);
+/* the jobs still in the queue are not walked, jobs_release() takes them */
 void queue_thread_free(struct queue_thread *queue_thread);
 void *queue_thread_entry(void *queue_thread);
+/* tells the build thread nothing more is going to be pushed */
+void queue_done(struct queue *queue);
 int queue_pop(struct queue *queue, struct job **job);
-int queue_isempty(struct job_clist *jobs);
-int queue_htab_job_merge(struct job **job, struct job **htab);
+/* Freezes jobs into queue->dag for the solvers, or hands out the one frozen
+ * already. What queue_pop() takes out is flagged in it, it's built again
+ * only after a push. Takes the queue locked. */
+int queue_dag(struct queue *queue, struct dag **dag);
+/* The closures of queue_dag() as bitsets, *cs is NULL if they would take
+ * too much memory, dag_closure_cost() is left then. What queue_pop() takes
+ * out is excluded from them. Takes the queue locked. */
+int queue_closure_set(struct queue *queue, struct closure_set **cs);
+/* dag_stale_set() of node in queue_dag(), counting what it made stale in
+ * queue->stale. Takes the queue locked. */
+void queue_dag_stale_set(struct queue *queue, uint32_t node);
+/* job queue_pop() handed out is built, or given up on */
+void queue_build_done(struct queue *queue);
+/* Merges jobs into the htab and queues them, under a single lock. On
+ * failure, the jobs that could not be queued are freed. */
+int queue_push_batch(struct queue *queue, struct job **jobs, size_t n);
+/* nothing in jobs is left to build, stale jobs aside */
+int queue_isempty(struct queue *queue);
+void queue_counts(struct queue *queue, struct queue_counts *counts);
+int queue_htab_job_merge(struct job **job, struct jobtab *htab);
 
 #define QUEUE_H
 #endif
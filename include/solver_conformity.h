@@ -1,3 +1,5 @@
 #include "jobs.h"
+#include "queue.h"
 
-int solver_conformity(struct job **job, struct job_clist *q, int32_t resources);
+int solver_conformity(struct job **job, struct queue *queue,
+		      int32_t resources);
@@ -1,4 +1,5 @@
 #include <jobs.h>
+#include <queue.h>
 #include <stdint.h>
 
-int solver_highs(struct job **job, struct job_clist *q, int32_t resources);
+int solver_highs(struct job **job, struct queue *queue, int32_t resources);
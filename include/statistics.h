@@ -0,0 +1,114 @@
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef STATISTICS_H
+
+struct statistics_index;
+
+/* tables with more rows than this are queried through statement instead */
+#define STATISTICS_LOAD_MAX (1 << 20)
+#define STATISTICS_SLOT_EMPTY UINT32_MAX
+/* weight of a new sample in the local mean, once there are enough */
+#define STATISTICS_EWMA_ALPHA 0.2
+/* builds with statistics it takes before the calibration is applied */
+#define STATISTICS_CALIBRATION_MIN 3
+/* PRAGMA user_version of the local tables, 1 added variance_duration to
+ * local_statistics and 2 dropped its mean_cpu */
+#define STATISTICS_LOCAL_VERSION 2
+
+typedef enum {
+	STATISTICS_MEAN = 0,
+	STATISTICS_P50 = 1,
+	STATISTICS_P90 = 2,
+	STATISTICS_P99 = 3,
+} statistics_quantile_t;
+#define STATISTICS_QUANTILES 4
+
+/* build time of a pname in seconds, costs is indexed by quantile */
+struct statistics_entry {
+	int32_t costs[STATISTICS_QUANTILES];
+	float variance;
+	/* from local_statistics, so already in the seconds of this host */
+	bool islocal;
+};
+
+/* least squares fit through the origin of the durations of our builds over
+ * the means statistics had for them, duration = factor * mean */
+struct statistics_calibration {
+	double factor;
+	/* standard error of factor, 0 with fewer than two samples */
+	double error;
+	uint64_t samples;
+};
+
+struct statistics_slot {
+	uint64_t hash;
+	/* offset of the pname in names, STATISTICS_SLOT_EMPTY if the slot is
+	 * empty */
+	uint32_t pname;
+	struct statistics_entry entry;
+};
+
+struct statistics {
+	/* NULL if index is mapped in its place */
+	struct sqlite3 *db;
+	sqlite3_stmt *statement;
+	/* NULL unless opened writable */
+	sqlite3_stmt *record;
+	sqlite3_stmt *remote;
+	sqlite3_stmt *calibrate;
+	/* the local_statistics table of our own builds exists, its means
+	 * are preferred over those of statistics */
+	bool islocal;
+	/* PRAGMA user_version, older ones are migrated when opened writable */
+	int local_version;
+	/* bit per statistics_quantile_t the statistics can answer */
+	uint32_t quantiles;
+	/* of this host, as it was when opened */
+	struct statistics_calibration calibration;
+
+	/* pname to mean duration, open addressing with linear probing, NULL
+	 * unless statistics_load() succeeded */
+	struct statistics_slot *slots;
+	size_t slots_mask, slots_filled;
+	char *names;
+	size_t names_size, names_filled;
+
+	/* a compiled index, see evanix stats compile, NULL if db is a
+	 * database */
+	struct statistics_index *index;
+};
+
+/* path is a database or a compiled index, writable creates
+ * local_statistics for statistics_record() and needs a database */
+int statistics_open(struct statistics *stats, const char *path,
+		    bool writable);
+/* copies the statistics table into slots, leaves it to statement if the
+ * table is larger than max */
+int statistics_load(struct statistics *stats, size_t max);
+/* -ENOENT if pname has no statistics */
+int statistics_lookup(struct statistics *stats, const char *pname,
+		      struct statistics_entry *entry);
+/* the --cost-quantile duration of pname, -ENOENT if there is none */
+int statistics_cost(struct statistics *stats, const char *pname);
+/* mean, p50, p90 or p99 to its statistics_quantile_t, -EINVAL otherwise */
+int statistics_quantile_parse(const char *name);
+const char *statistics_quantile_name(statistics_quantile_t quantile);
+/* Folds a build of pname that took duration seconds into its
+ * local_statistics mean. If it was the only derivation being built all
+ * along, isalone, and statistics has a mean for pname, it is folded into
+ * the calibration of this host too. */
+int statistics_record(struct statistics *stats, const char *pname,
+		      double duration, bool isalone);
+/* 1 until there are STATISTICS_CALIBRATION_MIN samples */
+double statistics_calibration_factor(const struct statistics *stats);
+/* scales an entry that isn't local by statistics_calibration_factor() */
+void statistics_calibrate(const struct statistics *stats,
+			  struct statistics_entry *entry);
+bool statistics_isopen(struct statistics *stats);
+int statistics_close(struct statistics *stats);
+
+#define STATISTICS_H
+#endif
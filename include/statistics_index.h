@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "statistics.h"
+
+#ifndef STATISTICS_INDEX_H
+
+#define STATISTICS_INDEX_MAGIC	    "EVXSIDX3"
+#define STATISTICS_INDEX_BYTE_ORDER 0x01020304
+
+/* The file is the header, a displacement per bucket, a record per pname and
+ * the pnames themselves, NUL terminated. A pname hashes to a bucket, the
+ * bucket's displacement then picks its record out of a minimal perfect hash
+ * over all the pnames. Integers are in the byte order of the machine that
+ * compiled it. */
+struct statistics_index_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t nrecords;
+	uint32_t nbuckets;
+	/* the quantiles of statistics, see struct statistics */
+	uint32_t quantiles;
+	uint64_t seed;
+	uint64_t names_size;
+	/* of the host that compiled it */
+	double calibration_factor;
+	double calibration_error;
+	uint64_t calibration_samples;
+};
+
+struct statistics_index_record {
+	/* fnv1a_64() of the pname, to turn away pnames that aren't there */
+	uint64_t hash;
+	/* offset of the pname in names */
+	uint32_t pname;
+	uint32_t pname_len;
+	struct statistics_entry entry;
+	uint32_t reserved;
+};
+
+/* a read only mapping, shared through the page cache */
+struct statistics_index {
+	void *base;
+	size_t size;
+	const struct statistics_index_header *header;
+	const uint32_t *displacements;
+	const struct statistics_index_record *records;
+	const char *names;
+};
+
+/* writes the statistics of a loaded stats to path */
+int statistics_index_compile(struct statistics *stats, const char *path);
+/* -EINVAL if path isn't a statistics index */
+int statistics_index_open(struct statistics_index **idx, const char *path);
+/* -ENOENT if pname has no statistics */
+int statistics_index_lookup(const struct statistics_index *idx,
+			    const char *pname, struct statistics_entry *entry);
+void statistics_index_close(struct statistics_index *idx);
+/* true if the file at path starts with STATISTICS_INDEX_MAGIC */
+int statistics_index_detect(const char *path, bool *isindex);
+/* evanix stats, argv[0] is "stats" */
+int statistics_index_main(int argc, char *argv[]);
+
+#define STATISTICS_INDEX_H
+#endif
@@ -0,0 +1,19 @@
+#include <nix/nix_api_util.h>
+
+#include "jobs.h"
+
+#ifndef STORE_H
+
+/* Opens the local store and every configured substituter, needed before
+ * store_closure_read() */
+int store_init(nix_c_context *nix_ctx);
+void store_free(void);
+/* Same as what nix-build --dry-run would list for job, worked out by asking
+ * the stores directly: every drv in the closure of job that has to be built
+ * and the outputs that can be substituted instead go into root->closure.
+ * Inputs of substituted paths are not followed. */
+int store_closure_read(struct job *job, struct cache_memo *memo,
+		       struct cache_status *root);
+
+#define STORE_H
+#endif
@@ -0,0 +1,7 @@
+#ifndef TRAIN_H
+
+/* evanix train, argv[0] is "train" */
+int train_main(int argc, char *argv[]);
+
+#define TRAIN_H
+#endif
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include <cjson/cJSON.h>
@@ -13,6 +14,8 @@
 		(cur) = (next);                                                \
 	}
 
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+
 typedef enum { VPOPEN_STDERR, VPOPEN_STDOUT } vpopen_t;
 
 int vpopen(FILE **stream, const char *file, char *const argv[], vpopen_t type);
@@ -21,3 +24,7 @@ int json_streaming_read(FILE *stream, cJSON **json);
 int atob(const char *s);
 int run(const char *file, char *argv[]);
 char *trim(char *s);
+/* seconds on CLOCK_MONOTONIC, for timing */
+double monotonic_now(void);
+/* start with hash = FNV1A_64_INIT, feed the result back in to hash more */
+uint64_t fnv1a_64(uint64_t hash, const void *buf, size_t len);
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "util.h"
+
+/* as aligned as malloc(3) would have it on glibc */
+#define ARENA_ALIGNMENT (2 * sizeof(void *))
+#define ARENA_ALIGN(n)	(((n) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+#define ARENA_CHUNK_HEADER ARENA_ALIGN(sizeof(void *))
+
+static struct arena_stripe *arena_stripe(struct arena *arena);
+static void *arena_chunk_alloc(struct arena_stripe *stripe, size_t size);
+
+static struct arena_stripe *arena_stripe(struct arena *arena)
+{
+	static unsigned stripe_next = 0;
+	static __thread unsigned stripe = UINT_MAX;
+
+	if (stripe == UINT_MAX)
+		stripe = __atomic_fetch_add(&stripe_next, 1, __ATOMIC_RELAXED) %
+			 ARENA_STRIPES;
+
+	return &arena->stripes[stripe];
+}
+
+/* stripe->mutex must be held */
+static void *arena_chunk_alloc(struct arena_stripe *stripe, size_t size)
+{
+	size_t chunk_size;
+	char *chunk;
+
+	if (stripe->chunk != NULL &&
+	    stripe->chunk_size - stripe->chunk_used >= size) {
+		chunk = stripe->chunk + stripe->chunk_used;
+		stripe->chunk_used += size;
+		return chunk;
+	}
+
+	chunk_size = ARENA_CHUNK_HEADER + size;
+	if (chunk_size < ARENA_CHUNK_SIZE)
+		chunk_size = ARENA_CHUNK_SIZE;
+
+	chunk = malloc(chunk_size);
+	if (chunk == NULL)
+		return NULL;
+	stripe->chunks++;
+	stripe->bytes += chunk_size;
+
+	/* what is left of the current chunk is wasted, unless this one would
+	 * leave even less */
+	if (stripe->chunk != NULL &&
+	    chunk_size - ARENA_CHUNK_HEADER - size <
+		    stripe->chunk_size - stripe->chunk_used) {
+		*(void **)chunk = *(void **)stripe->chunk;
+		*(void **)stripe->chunk = chunk;
+		return chunk + ARENA_CHUNK_HEADER;
+	}
+
+	*(void **)chunk = stripe->chunk;
+	stripe->chunk = chunk;
+	stripe->chunk_size = chunk_size;
+	stripe->chunk_used = ARENA_CHUNK_HEADER + size;
+
+	return chunk + ARENA_CHUNK_HEADER;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_stripe *stripe;
+	void *p;
+
+	stripe = arena_stripe(arena);
+	if (arena->object_size != 0)
+		size = ARENA_ALIGN(arena->object_size);
+
+	pthread_mutex_lock(&stripe->mutex);
+	if (arena->object_size != 0 && stripe->free_list != NULL) {
+		p = stripe->free_list;
+		stripe->free_list = *(void **)p;
+		stripe->reuses++;
+	} else {
+		p = arena_chunk_alloc(stripe, size);
+		if (p != NULL)
+			stripe->allocs++;
+		else
+			print_err("%s", strerror(errno));
+	}
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return p;
+}
+
+void arena_free(struct arena *arena, void *p)
+{
+	struct arena_stripe *stripe;
+
+	if (p == NULL || arena->object_size == 0)
+		return;
+
+	/* every stripe is good for an object of this size, whichever it came
+	 * from */
+	stripe = arena_stripe(arena);
+	pthread_mutex_lock(&stripe->mutex);
+	*(void **)p = stripe->free_list;
+	stripe->free_list = p;
+	pthread_mutex_unlock(&stripe->mutex);
+}
+
+void arena_release(struct arena *arena)
+{
+	struct arena_stripe *stripe;
+	void *next;
+
+	for (size_t i = 0; i < ARENA_STRIPES; i++) {
+		stripe = &arena->stripes[i];
+
+		pthread_mutex_lock(&stripe->mutex);
+		while (stripe->chunk != NULL) {
+			next = *(void **)stripe->chunk;
+			free(stripe->chunk);
+			stripe->chunk = next;
+		}
+		stripe->chunk_used = 0;
+		stripe->chunk_size = 0;
+		stripe->free_list = NULL;
+		pthread_mutex_unlock(&stripe->mutex);
+	}
+}
+
+void arena_stats(struct arena *arena, struct arena_stats *stats)
+{
+	struct arena_stripe *stripe;
+
+	memset(stats, 0, sizeof(*stats));
+	for (size_t i = 0; i < ARENA_STRIPES; i++) {
+		stripe = &arena->stripes[i];
+
+		pthread_mutex_lock(&stripe->mutex);
+		stats->allocs += stripe->allocs;
+		stats->reuses += stripe->reuses;
+		stats->chunks += stripe->chunks;
+		stats->bytes += stripe->bytes;
+		pthread_mutex_unlock(&stripe->mutex);
+	}
+}
@@ -2,8 +2,12 @@
 #include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+
+#include <cjson/cJSON.h>
 
 #include "build.h"
 #include "evanix.h"
@@ -11,7 +15,37 @@
 #include "queue.h"
 #include "util.h"
 
+/* ActivityType of nix's logging.hh for a derivation being built */
+#define NIX_ACTIVITY_BUILD 105
+#define NIX_LOG_PREFIX	   "@nix "
+
+/* a derivation nix-build built, as its internal-json log tells it */
+struct build_activity {
+	uint64_t id;
+	char *drv_path;
+	/* duration is -1 until the activity stops */
+	double start, duration;
+	/* no other derivation was being built all the while */
+	bool isalone;
+};
+
+struct build_log {
+	size_t activities_size, activities_filled;
+	struct build_activity *activities;
+	/* activities started and not stopped yet */
+	size_t running;
+};
+
 static int build(struct queue *queue);
+static int build_log_id(const char *line, uint64_t *id);
+static int build_log_start(struct build_log *log, uint64_t id,
+			   const char *drv_path);
+static void build_log_stop(struct build_log *log, uint64_t id);
+static int build_log_line(struct build_log *log, char *line);
+static void build_log_free(struct build_log *log);
+static void build_record(const char *drv_path, double duration,
+			 bool isalone);
+static int build_timed(char *args[]);
 
 void *build_thread_entry(void *build_thread)
 {
@@ -25,7 +59,7 @@ void *build_thread_entry(void *build_thread)
 			goto out;
 		}
 
-		if (queue_isempty(&bt->queue->jobs)) {
+		if (queue_isempty(bt->queue)) {
 			if (bt->queue->state == Q_ITS_OVER)
 				goto out;
 			else if (bt->queue->state == Q_SEM_WAIT)
@@ -41,10 +75,192 @@ out:
 	pthread_exit(NULL);
 }
 
+/* cJSON keeps numbers as doubles, and the ids nix hands out, its pid
+ * shifted up by 32 bits, run past what they hold exactly. Keys are never
+ * found in a string of the line, the quotes in those are escaped. */
+static int build_log_id(const char *line, uint64_t *id)
+{
+	const char *p;
+
+	p = strstr(line, "\"id\":");
+	if (p == NULL)
+		return -EINVAL;
+
+	*id = strtoull(p + sizeof("\"id\":") - 1, NULL, 10);
+	return 0;
+}
+
+static int build_log_start(struct build_log *log, uint64_t id,
+			   const char *drv_path)
+{
+	struct build_activity *activity;
+	size_t newsize;
+	void *ret;
+
+	if (log->activities_filled == log->activities_size) {
+		newsize = log->activities_size == 0 ? 8
+						    : log->activities_size * 2;
+		ret = realloc(log->activities,
+			      newsize * sizeof(*log->activities));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+		log->activities = ret;
+		log->activities_size = newsize;
+	}
+
+	activity = &log->activities[log->activities_filled];
+	activity->drv_path = strdup(drv_path);
+	if (activity->drv_path == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	activity->id = id;
+	activity->start = monotonic_now();
+	activity->duration = -1;
+	activity->isalone = log->running == 0;
+	log->activities_filled++;
+
+	/* what is running contends with this one, and the other way around */
+	for (size_t i = 0; i < log->activities_filled; i++) {
+		if (log->activities[i].duration < 0 && log->running > 0)
+			log->activities[i].isalone = false;
+	}
+	log->running++;
+
+	return 0;
+}
+
+static void build_log_stop(struct build_log *log, uint64_t id)
+{
+	struct build_activity *activity;
+
+	for (size_t i = 0; i < log->activities_filled; i++) {
+		activity = &log->activities[i];
+		if (activity->id != id || activity->duration >= 0)
+			continue;
+
+		activity->duration = monotonic_now() - activity->start;
+		log->running--;
+		return;
+	}
+}
+
+/* Picks the builds out of a line of nix-build --log-format internal-json,
+ * the messages it would have printed go to stderr as they would have. */
+static int build_log_line(struct build_log *log, char *line)
+{
+	cJSON *json, *action, *field;
+	uint64_t id;
+	int ret = 0;
+
+	if (strncmp(line, NIX_LOG_PREFIX, sizeof(NIX_LOG_PREFIX) - 1)) {
+		fputs(line, stderr);
+		return 0;
+	}
+
+	json = cJSON_Parse(line + sizeof(NIX_LOG_PREFIX) - 1);
+	if (json == NULL)
+		return 0;
+
+	action = cJSON_GetObjectItemCaseSensitive(json, "action");
+	if (!cJSON_IsString(action)) {
+		goto out_delete_json;
+	} else if (!strcmp(action->valuestring, "msg")) {
+		field = cJSON_GetObjectItemCaseSensitive(json, "msg");
+		if (cJSON_IsString(field))
+			fprintf(stderr, "%s\n", field->valuestring);
+	} else if (!strcmp(action->valuestring, "start")) {
+		field = cJSON_GetObjectItemCaseSensitive(json, "type");
+		if (!cJSON_IsNumber(field) ||
+		    field->valueint != NIX_ACTIVITY_BUILD)
+			goto out_delete_json;
+
+		field = cJSON_GetObjectItemCaseSensitive(json, "fields");
+		field = cJSON_GetArrayItem(field, 0);
+		if (!cJSON_IsString(field) || build_log_id(line, &id) < 0)
+			goto out_delete_json;
+		ret = build_log_start(log, id, field->valuestring);
+	} else if (!strcmp(action->valuestring, "stop")) {
+		if (build_log_id(line, &id) == 0)
+			build_log_stop(log, id);
+	}
+
+out_delete_json:
+	cJSON_Delete(json);
+	return ret;
+}
+
+static void build_log_free(struct build_log *log)
+{
+	for (size_t i = 0; i < log->activities_filled; i++)
+		free(log->activities[i].drv_path);
+	free(log->activities);
+}
+
+/* a failure to record leaves the statistics as they were, the build still
+ * went through. Only the wall clock time is kept, the CPU time nix-build
+ * could be asked for is that of the client, the builders of a multi-user
+ * install are children of nix-daemon. */
+static void build_record(const char *drv_path, double duration,
+			 bool isalone)
+{
+	if (job_cost_record(drv_path, duration, isalone) < 0)
+		return;
+
+	if (evanix_opts.solver_report)
+		printf("⏱️ %s built in %.3fs\n", drv_path, duration);
+}
+
+/* Runs nix-build with args, which ask for --log-format internal-json, and
+ * records how long each derivation it built took on its own. Timing
+ * nix-build as a whole would put the time of every dep it had to build
+ * under the pname of the one it was asked for. */
+static int build_timed(char *args[])
+{
+	struct build_log log = {0};
+	int pid, wstatus, ret = 0;
+	FILE *stream;
+
+	size_t line_size = 0;
+	char *line = NULL;
+
+	pid = vpopen(&stream, "nix-build", args, VPOPEN_STDERR);
+	if (pid < 0)
+		return pid;
+
+	while (getline(&line, &line_size, stream) >= 0) {
+		ret = build_log_line(&log, line);
+		if (ret < 0)
+			break;
+	}
+	fclose(stream);
+	free(line);
+
+	/* failed builds say nothing about how long a build takes */
+	if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) ||
+	    WEXITSTATUS(wstatus) != 0 || ret < 0)
+		goto out_free_log;
+
+	for (size_t i = 0; i < log.activities_filled; i++) {
+		if (log.activities[i].duration >= 0)
+			build_record(log.activities[i].drv_path,
+				     log.activities[i].duration,
+				     log.activities[i].isalone);
+	}
+
+out_free_log:
+	build_log_free(&log);
+
+	return ret;
+}
+
 static int build(struct queue *queue)
 {
+	struct queue_counts counts;
 	struct job *job;
-	char *args[5];
+	char *args[7];
 	size_t argindex;
 	int ret;
 
@@ -56,6 +272,12 @@ static int build(struct queue *queue)
 	if (ret < 0)
 		return ret;
 
+	if (evanix_opts.solver_report) {
+		queue_counts(queue, &counts);
+		printf("📋 queue: %zu ready, %zu refused, %zu building\n",
+		       counts.ready, counts.stale, counts.building);
+	}
+
 	if (job->nix_attr_name) {
 		ret = snprintf(out_link, sizeof(out_link), "result-%s",
 			       job->nix_attr_name);
@@ -70,7 +292,11 @@ static int build(struct queue *queue)
 	args[argindex++] = "nix-build";
 	args[argindex++] = "--out-link";
 	args[argindex++] = out_link;
-	args[argindex++] = job->drv_path;
+	if (evanix_opts.record_statistics && !evanix_opts.isdryrun) {
+		args[argindex++] = "--log-format";
+		args[argindex++] = "internal-json";
+	}
+	args[argindex++] = (char *)job->drv_path;
 	args[argindex++] = NULL;
 
 	if (evanix_opts.isdryrun) {
@@ -79,12 +305,15 @@ static int build(struct queue *queue)
 		for (size_t i = 0; i < argindex - 1; i++)
 			printf("%s%c", args[i],
 			       (i + 2 == argindex) ? '\n' : ' ');
-	} else {
+	} else if (!evanix_opts.record_statistics) {
 		run("nix-build", args);
+	} else {
+		build_timed(args);
 	}
 
 out_free_job:
 	job_free(job);
+	queue_build_done(queue);
 
 	return ret;
 }
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache_check.h"
+#include "evanix.h"
+#include "jobs.h"
+#include "queue.h"
+#include "util.h"
+
+/* submitted jobs allowed per thread, one being checked and one waiting */
+#define CACHE_CHECK_WINDOW_PER_THREAD 2
+
+static int cache_check_flush(struct cache_check *cc, struct job **batch,
+			     size_t *batch_filled, bool force);
+static int cache_check_job(struct cache_check *cc, struct job *job,
+			   struct job **batch, size_t *batch_filled);
+static void *cache_check_thread_entry(void *cache_check);
+static void cache_check_free(struct cache_check *cc);
+
+/* Pushes batch to the queue once it's full, or before that if the build
+ * thread popped everything pushed so far, it's not kept waiting on a batch
+ * that's still filling up */
+static int cache_check_flush(struct cache_check *cc, struct job **batch,
+			     size_t *batch_filled, bool force)
+{
+	int sem_value, ret;
+
+	if (*batch_filled == 0)
+		return 0;
+	if (!force && *batch_filled < CACHE_CHECK_BATCH &&
+	    sem_getvalue(&cc->queue->sem, &sem_value) == 0 && sem_value > 0)
+		return 0;
+
+	ret = queue_push_batch(cc->queue, batch, *batch_filled);
+	*batch_filled = 0;
+
+	return ret;
+}
+
+/* adds job to batch, or frees it if there's nothing to build */
+static int cache_check_job(struct cache_check *cc, struct job *job,
+			   struct job **batch, size_t *batch_filled)
+{
+	int ret;
+
+	ret = job_cache_check(job, &cc->queue->memo);
+	if (ret == JOB_READ_SUCCESS && evanix_opts.full_closure)
+		ret = job_read_closure(job, evanix_opts.check_cache_status,
+				       &cc->queue->htab, &cc->queue->mutex);
+	if (ret == JOB_READ_SUCCESS) {
+		batch[(*batch_filled)++] = job;
+		return cache_check_flush(cc, batch, batch_filled, false);
+	}
+
+	job_free(job);
+	return ret < 0 ? ret : 0;
+}
+
+static void *cache_check_thread_entry(void *cache_check)
+{
+	struct cache_check *cc = cache_check;
+	struct job *batch[CACHE_CHECK_BATCH];
+	size_t batch_filled = 0;
+	struct job *job = NULL;
+	bool isjob;
+	int ret;
+
+	while (true) {
+		pthread_mutex_lock(&cc->mutex);
+		while (cc->pending_filled == 0 && !cc->done &&
+		       batch_filled == 0)
+			pthread_cond_wait(&cc->cond_job, &cc->mutex);
+
+		isjob = cc->pending_filled > 0;
+		if (isjob) {
+			job = cc->pending[cc->pending_head];
+			cc->pending_head = (cc->pending_head + 1) % cc->window;
+			cc->pending_filled--;
+		} else if (batch_filled == 0) {
+			pthread_mutex_unlock(&cc->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&cc->mutex);
+
+		/* with nothing left to check, the batch is pushed as it is */
+		if (isjob)
+			ret = cache_check_job(cc, job, batch, &batch_filled);
+		else
+			ret = cache_check_flush(cc, batch, &batch_filled, true);
+
+		pthread_mutex_lock(&cc->mutex);
+		if (ret < 0 && cc->ret == 0)
+			cc->ret = ret;
+		if (isjob) {
+			cc->inflight--;
+			pthread_cond_signal(&cc->cond_slot);
+		}
+		pthread_mutex_unlock(&cc->mutex);
+	}
+
+	return NULL;
+}
+
+int cache_check_submit(struct cache_check *cc, struct job *job)
+{
+	double start;
+	int ret;
+
+	if (cc->nthreads == 0)
+		return cache_check_job(cc, job, cc->batch, &cc->batch_filled);
+
+	pthread_mutex_lock(&cc->mutex);
+	if (cc->inflight == cc->window) {
+		start = monotonic_now();
+		while (cc->inflight == cc->window)
+			pthread_cond_wait(&cc->cond_slot, &cc->mutex);
+		cc->wait_time += monotonic_now() - start;
+	}
+
+	ret = cc->ret;
+	if (ret < 0) {
+		pthread_mutex_unlock(&cc->mutex);
+		job_free(job);
+		return ret;
+	}
+
+	cc->pending[(cc->pending_head + cc->pending_filled) % cc->window] =
+		job;
+	cc->pending_filled++;
+	cc->inflight++;
+	pthread_cond_signal(&cc->cond_job);
+	pthread_mutex_unlock(&cc->mutex);
+
+	return 0;
+}
+
+static void cache_check_free(struct cache_check *cc)
+{
+	pthread_mutex_destroy(&cc->mutex);
+	pthread_cond_destroy(&cc->cond_job);
+	pthread_cond_destroy(&cc->cond_slot);
+	free(cc->threads);
+	free(cc->pending);
+	free(cc);
+}
+
+int cache_check_finish(struct cache_check *cc)
+{
+	int ret;
+
+	pthread_mutex_lock(&cc->mutex);
+	cc->done = true;
+	pthread_cond_broadcast(&cc->cond_job);
+	pthread_mutex_unlock(&cc->mutex);
+
+	for (uint32_t i = 0; i < cc->nthreads; i++)
+		pthread_join(cc->threads[i], NULL);
+
+	ret = cache_check_flush(cc, cc->batch, &cc->batch_filled, true);
+	if (ret < 0 && cc->ret == 0)
+		cc->ret = ret;
+
+	if (cc->nthreads > 0 && evanix_opts.solver_report) {
+		printf("⏳ cache status check threads: %u, submitters waited "
+		       "%.3fs for a free slot\n",
+		       cc->nthreads, cc->wait_time);
+	}
+
+	ret = cc->ret;
+	cache_check_free(cc);
+
+	return ret;
+}
+
+int cache_check_new(struct cache_check **cache_check, struct queue *queue,
+		    uint32_t nthreads)
+{
+	struct cache_check *cc;
+	int ret = 0;
+
+	cc = malloc(sizeof(*cc));
+	if (cc == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	/* reading the closure is worth the threads as well */
+	if (!evanix_opts.check_cache_status && !evanix_opts.full_closure)
+		nthreads = 0;
+
+	cc->queue = queue;
+	cc->pending_head = 0;
+	cc->pending_filled = 0;
+	cc->inflight = 0;
+	cc->batch_filled = 0;
+	cc->window = (size_t)nthreads * CACHE_CHECK_WINDOW_PER_THREAD;
+	cc->done = false;
+	cc->ret = 0;
+	cc->nthreads = 0;
+	cc->threads = NULL;
+	cc->pending = NULL;
+	cc->wait_time = 0;
+	pthread_mutex_init(&cc->mutex, NULL);
+	pthread_cond_init(&cc->cond_job, NULL);
+	pthread_cond_init(&cc->cond_slot, NULL);
+
+	if (nthreads == 0)
+		goto out_free_cc;
+
+	cc->pending = malloc(cc->window * sizeof(*cc->pending));
+	if (cc->pending == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free_cc;
+	}
+
+	cc->threads = malloc(nthreads * sizeof(*cc->threads));
+	if (cc->threads == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free_cc;
+	}
+
+	for (; cc->nthreads < nthreads; cc->nthreads++) {
+		ret = pthread_create(&cc->threads[cc->nthreads], NULL,
+				     cache_check_thread_entry, cc);
+		if (ret != 0) {
+			print_err("%s", strerror(ret));
+			ret = -ret;
+			goto out_free_cc;
+		}
+
+		pthread_setname_np(cc->threads[cc->nthreads], "evanix_check");
+	}
+
+out_free_cc:
+	if (ret < 0 && cc->nthreads > 0) {
+		cache_check_finish(cc);
+	} else if (ret < 0) {
+		cache_check_free(cc);
+	} else {
+		*cache_check = cc;
+	}
+
+	return ret;
+}
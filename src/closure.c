@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "closure.h"
+#include "jobs.h"
+#include "util.h"
+
+/* last stamps handed out, jobs start out with 0 which is never handed out */
+static uint32_t closure_epoch_last = 0;
+static uint32_t closure_generation_last = 0;
+
+static uint32_t closure_stamp_next(uint32_t *last);
+static int closure_stack_push(struct closure *c, struct job *job);
+static bool closure_isflat(struct job *job);
+static int closure_walk(struct closure *c, struct job *job, bool marginal,
+			bool select, double *moments);
+static bool closure_set_isnode(struct closure_set *cs, struct job *job);
+static uint64_t *closure_set_row(struct closure_set *cs, struct job *job);
+static int closure_set_sum(struct closure_set *cs, const uint64_t *row,
+			   const uint64_t *mask);
+
+static uint32_t closure_stamp_next(uint32_t *last)
+{
+	(*last)++;
+	if (*last == 0)
+		(*last)++;
+
+	return *last;
+}
+
+static int closure_stack_push(struct closure *c, struct job *job)
+{
+	size_t newsize;
+	void *ret;
+
+	if (c->stack_filled == c->stack_size) {
+		newsize = c->stack_size == 0 ? 64 : c->stack_size * 2;
+		ret = realloc(c->stack, newsize * sizeof(*c->stack));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		c->stack = ret;
+		c->stack_size = newsize;
+	}
+
+	job->closure_epoch = c->epoch;
+	c->stack[c->stack_filled++] = job;
+	return 0;
+}
+
+/* true when job_cost_recursive() already is the closure cost, that is what
+ * nix-build --dry-run hands out, everything job needs as its direct deps */
+static bool closure_isflat(struct job *job)
+{
+	if (job->insubstituters)
+		return false;
+
+	for (size_t i = 0; i < job->deps_filled; i++) {
+		if (job->deps[i]->deps_filled > 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* moments, if not NULL, gets the sum of the mean build times of every job
+ * counted and that of the variances */
+static int closure_walk(struct closure *c, struct job *job, bool marginal,
+			bool select, double *moments)
+{
+	struct job *j;
+	int ret, cost = 0;
+
+	c->epoch = closure_stamp_next(&closure_epoch_last);
+	c->stack_filled = 0;
+	ret = closure_stack_push(c, job);
+	if (ret < 0)
+		return ret;
+
+	while (c->stack_filled > 0) {
+		j = c->stack[--c->stack_filled];
+		if (j->insubstituters)
+			continue;
+		/* its closure was selected along with it */
+		if (marginal && j->closure_generation == c->generation)
+			continue;
+
+		ret = job_cost(j);
+		if (ret < 0)
+			return ret;
+		cost += ret;
+
+		if (select)
+			j->closure_generation = c->generation;
+		if (moments != NULL) {
+			moments[0] += j->cost_mean == JOB_COST_UNSET
+					      ? ret
+					      : j->cost_mean;
+			moments[1] += j->cost_variance;
+		}
+
+		for (size_t i = 0; i < j->deps_filled; i++) {
+			if (j->deps[i]->closure_epoch == c->epoch)
+				continue;
+
+			ret = closure_stack_push(c, j->deps[i]);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return cost;
+}
+
+void closure_init(struct closure *c)
+{
+	c->epoch = 0;
+	c->generation = closure_stamp_next(&closure_generation_last);
+	c->stack_size = 0;
+	c->stack_filled = 0;
+	c->stack = NULL;
+	c->selected_cost = 0;
+}
+
+void closure_free(struct closure *c)
+{
+	free(c->stack);
+	c->stack = NULL;
+	c->stack_size = 0;
+	c->stack_filled = 0;
+}
+
+int closure_cost(struct closure *c, struct job *job)
+{
+	if (closure_isflat(job))
+		return job_cost_recursive(job);
+
+	return closure_walk(c, job, false, false, NULL);
+}
+
+int closure_cost_marginal(struct closure *c, struct job *job)
+{
+	if (c->selected_cost == 0 && closure_isflat(job))
+		return job_cost_recursive(job);
+
+	return closure_walk(c, job, true, false, NULL);
+}
+
+int closure_select(struct closure *c, struct job *job)
+{
+	int ret;
+
+	ret = closure_walk(c, job, true, true, NULL);
+	if (ret < 0)
+		return ret;
+
+	c->selected_cost += ret;
+	return ret;
+}
+
+int closure_moments(struct closure *c, struct job *job, double *mean,
+		    double *variance)
+{
+	double moments[2] = {0, 0};
+	int ret;
+
+	ret = closure_walk(c, job, false, false, moments);
+	if (ret < 0)
+		return ret;
+
+	*mean = moments[0];
+	*variance = moments[1];
+	return 0;
+}
+
+static bool closure_set_isnode(struct closure_set *cs, struct job *job)
+{
+	return job->id >= 0 && (size_t)job->id < cs->dag->nodes &&
+	       cs->dag->jobid->jobs[job->id] == job;
+}
+
+static uint64_t *closure_set_row(struct closure_set *cs, struct job *job)
+{
+	if (!closure_set_isnode(cs, job) || cs->rows[job->id] < 0)
+		return NULL;
+
+	return cs->bits + cs->rows[job->id] * cs->words;
+}
+
+/* adds up the costs of the bits set in row and not in mask, those were
+ * looked up by the walk that set them */
+static int closure_set_sum(struct closure_set *cs, const uint64_t *row,
+			   const uint64_t *mask)
+{
+	uint64_t word;
+	int cost = 0;
+
+	for (size_t i = 0; i < cs->words; i++) {
+		word = mask == NULL ? row[i] : row[i] & ~mask[i];
+		while (word != 0) {
+			cost += cs->dag->costs[i * 64 + __builtin_ctzll(word)];
+			word &= word - 1;
+		}
+	}
+
+	return cost;
+}
+
+int closure_set_new(struct closure_set **closure_set, struct dag *dag)
+{
+	struct closure_set *cs;
+	int ret = 0;
+
+	cs = malloc(sizeof(*cs));
+	if (cs == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	cs->dag = dag;
+	cs->words = (dag->nodes + 63) / 64;
+	cs->rows = NULL;
+	cs->bits = NULL;
+	cs->selected = NULL;
+	cs->selected_cost = 0;
+
+	if (cs->words > 0 && dag->roots_filled > CLOSURE_SET_MAX_BYTES /
+							 cs->words /
+							 sizeof(*cs->bits)) {
+		ret = -E2BIG;
+		goto out_free_cs;
+	}
+
+	cs->rows = malloc(dag->nodes * sizeof(*cs->rows));
+	cs->bits = calloc(dag->roots_filled * cs->words, sizeof(*cs->bits));
+	cs->selected = calloc(cs->words, sizeof(*cs->selected));
+	if ((dag->nodes > 0 && cs->rows == NULL) ||
+	    (dag->roots_filled * cs->words > 0 && cs->bits == NULL) ||
+	    (cs->words > 0 && cs->selected == NULL)) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free_cs;
+	}
+
+	for (uint32_t n = 0; n < dag->nodes; n++)
+		cs->rows[n] = -1;
+	for (uint32_t i = 0; i < dag->roots_filled; i++) {
+		cs->rows[dag->roots[i]] = i;
+		ret = dag_closure_bits(dag, dag->roots[i],
+				       cs->bits + i * cs->words);
+		if (ret < 0)
+			break;
+	}
+
+out_free_cs:
+	if (ret < 0)
+		closure_set_free(cs);
+	else
+		*closure_set = cs;
+
+	return ret < 0 ? ret : 0;
+}
+
+void closure_set_free(struct closure_set *cs)
+{
+	if (cs == NULL)
+		return;
+
+	free(cs->rows);
+	free(cs->bits);
+	free(cs->selected);
+	free(cs);
+}
+
+void closure_set_exclude(struct closure_set *cs, struct job *job)
+{
+	if (closure_set_isnode(cs, job))
+		cs->selected[job->id / 64] |= UINT64_C(1) << (job->id % 64);
+}
+
+int closure_set_cost(struct closure_set *cs, struct job *job)
+{
+	uint64_t *row;
+
+	row = closure_set_row(cs, job);
+	if (row == NULL)
+		return -EINVAL;
+
+	return closure_set_sum(cs, row, NULL);
+}
+
+int closure_set_cost_marginal(struct closure_set *cs, struct job *job)
+{
+	uint64_t *row;
+
+	row = closure_set_row(cs, job);
+	if (row == NULL)
+		return -EINVAL;
+
+	return closure_set_sum(cs, row, cs->selected);
+}
+
+int closure_set_select(struct closure_set *cs, struct job *job)
+{
+	uint64_t *row;
+	int cost;
+
+	row = closure_set_row(cs, job);
+	if (row == NULL)
+		return -EINVAL;
+
+	cost = closure_set_sum(cs, row, cs->selected);
+	for (size_t i = 0; i < cs->words; i++)
+		cs->selected[i] |= row[i];
+	cs->selected_cost += cost;
+
+	return cost;
+}
+
+size_t closure_set_overlap(struct closure_set *cs, struct job *a,
+			   struct job *b)
+{
+	uint64_t *row_a, *row_b;
+	size_t overlap = 0;
+
+	row_a = closure_set_row(cs, a);
+	row_b = closure_set_row(cs, b);
+	if (row_a == NULL || row_b == NULL)
+		return 0;
+
+	for (size_t i = 0; i < cs->words; i++)
+		overlap += __builtin_popcountll(row_a[i] & row_b[i]);
+
+	return overlap;
+}
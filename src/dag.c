@@ -0,0 +1,321 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dag.h"
+#include "jobid.h"
+#include "jobs.h"
+#include "util.h"
+
+static int dag_stack_push(struct job ***stack, size_t *size, size_t *filled,
+			  struct job *job);
+static int dag_id_reset(struct job_clist *q);
+static bool dag_node_isvalid(struct dag *dag, struct job *job);
+static int dag_edges(struct dag *dag);
+static int dag_closure_walk(struct dag *dag, uint32_t node, uint64_t *bits);
+
+static int dag_stack_push(struct job ***stack, size_t *size, size_t *filled,
+			  struct job *job)
+{
+	size_t newsize;
+	void *ret;
+
+	if (*filled == *size) {
+		newsize = *size == 0 ? 64 : *size * 2;
+		ret = realloc(*stack, newsize * sizeof(**stack));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		*stack = ret;
+		*size = newsize;
+	}
+
+	(*stack)[(*filled)++] = job;
+	return 0;
+}
+
+/* forgets the ids of a previous jobid_init(), which only numbers jobs that
+ * have none */
+static int dag_id_reset(struct job_clist *q)
+{
+	struct job *j, *root, **stack = NULL;
+	size_t stack_size = 0, stack_filled = 0;
+	int ret = 0;
+
+	CIRCLEQ_FOREACH (root, q, clist) {
+		if (root->id < 0)
+			continue;
+
+		root->id = -1;
+		ret = dag_stack_push(&stack, &stack_size, &stack_filled, root);
+		while (ret >= 0 && stack_filled > 0) {
+			j = stack[--stack_filled];
+			for (size_t i = 0; i < j->deps_filled; i++) {
+				if (j->deps[i]->id < 0)
+					continue;
+
+				j->deps[i]->id = -1;
+				ret = dag_stack_push(&stack, &stack_size,
+						     &stack_filled, j->deps[i]);
+				if (ret < 0)
+					break;
+			}
+		}
+		if (ret < 0)
+			break;
+	}
+	free(stack);
+
+	return ret;
+}
+
+static bool dag_node_isvalid(struct dag *dag, struct job *job)
+{
+	return job->id >= 0 && (size_t)job->id < dag->nodes &&
+	       dag->jobid->jobs[job->id] == job;
+}
+
+/* a parent that is not under the queue has no node, and no edge */
+static int dag_edges(struct dag *dag)
+{
+	size_t deps = 0, parents = 0;
+	struct job *j;
+
+	for (uint32_t n = 0; n < dag->nodes; n++) {
+		j = dag->jobid->jobs[n];
+		deps += j->deps_filled;
+		for (size_t i = 0; i < j->parents_filled; i++)
+			parents += dag_node_isvalid(dag, j->parents[i]);
+	}
+	if (deps > UINT32_MAX || parents > UINT32_MAX)
+		return -E2BIG;
+
+	dag->deps = malloc(deps * sizeof(*dag->deps));
+	dag->parents = malloc(parents * sizeof(*dag->parents));
+	if ((deps > 0 && dag->deps == NULL) ||
+	    (parents > 0 && dag->parents == NULL)) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	deps = 0;
+	parents = 0;
+	for (uint32_t n = 0; n < dag->nodes; n++) {
+		j = dag->jobid->jobs[n];
+
+		dag->deps_index[n] = deps;
+		for (size_t i = 0; i < j->deps_filled; i++)
+			dag->deps[deps++] = j->deps[i]->id;
+
+		dag->parents_index[n] = parents;
+		for (size_t i = 0; i < j->parents_filled; i++) {
+			if (dag_node_isvalid(dag, j->parents[i]))
+				dag->parents[parents++] = j->parents[i]->id;
+		}
+	}
+	dag->deps_index[dag->nodes] = deps;
+	dag->parents_index[dag->nodes] = parents;
+
+	return 0;
+}
+
+int dag_new(struct dag **dag, struct job_clist *q)
+{
+	struct dag *d;
+	struct job *j;
+	size_t roots = 0;
+	int ret;
+
+	CIRCLEQ_FOREACH (j, q, clist)
+		roots++;
+
+	ret = dag_id_reset(q);
+	if (ret < 0)
+		return ret;
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	ret = jobid_init(q, &d->jobid);
+	if (ret < 0)
+		goto out_free_d;
+	if (d->jobid->filled > UINT32_MAX - 1) {
+		ret = -E2BIG;
+		goto out_free_d;
+	}
+	d->nodes = d->jobid->filled;
+
+	d->roots = malloc(roots * sizeof(*d->roots));
+	d->deps_index = malloc((d->nodes + 1) * sizeof(*d->deps_index));
+	d->parents_index = malloc((d->nodes + 1) * sizeof(*d->parents_index));
+	d->costs = malloc(d->nodes * sizeof(*d->costs));
+	d->flags = malloc(d->nodes * sizeof(*d->flags));
+	d->stamps = calloc(d->nodes, sizeof(*d->stamps));
+	d->stack = malloc(d->nodes * sizeof(*d->stack));
+	if ((roots > 0 && d->roots == NULL) || d->deps_index == NULL ||
+	    d->parents_index == NULL ||
+	    (d->nodes > 0 && (d->costs == NULL || d->flags == NULL ||
+			      d->stamps == NULL || d->stack == NULL))) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free_d;
+	}
+
+	CIRCLEQ_FOREACH (j, q, clist)
+		d->roots[d->roots_filled++] = j->id;
+
+	for (uint32_t n = 0; n < d->nodes; n++) {
+		j = d->jobid->jobs[n];
+
+		/* looked up as walks get to it, like closure_walk() does */
+		d->costs[n] = JOB_COST_UNSET;
+		d->flags[n] = 0;
+		if (j->requested)
+			d->flags[n] |= DAG_REQUESTED;
+		if (j->stale)
+			d->flags[n] |= DAG_STALE;
+		if (j->insubstituters)
+			d->flags[n] |= DAG_INSUBSTITUTERS;
+	}
+
+	ret = dag_edges(d);
+
+out_free_d:
+	if (ret < 0)
+		dag_free(d);
+	else
+		*dag = d;
+
+	return ret < 0 ? ret : 0;
+}
+
+void dag_free(struct dag *dag)
+{
+	if (dag == NULL)
+		return;
+
+	jobid_free(dag->jobid);
+	free(dag->roots);
+	free(dag->deps_index);
+	free(dag->deps);
+	free(dag->parents_index);
+	free(dag->parents);
+	free(dag->costs);
+	free(dag->flags);
+	free(dag->stamps);
+	free(dag->stack);
+	free(dag);
+}
+
+int dag_cost(struct dag *dag, uint32_t node)
+{
+	int ret;
+
+	if (dag->costs[node] != JOB_COST_UNSET)
+		return dag->costs[node];
+
+	ret = job_cost(dag->jobid->jobs[node]);
+	if (ret >= 0)
+		dag->costs[node] = ret;
+
+	return ret;
+}
+
+/* bits, if not NULL, gets the bit of every node counted set */
+static int dag_closure_walk(struct dag *dag, uint32_t node, uint64_t *bits)
+{
+	uint32_t n, filled = 0;
+	int ret, cost = 0;
+
+	dag->epoch++;
+	if (dag->epoch == 0) {
+		memset(dag->stamps, 0, dag->nodes * sizeof(*dag->stamps));
+		dag->epoch++;
+	}
+
+	dag->stamps[node] = dag->epoch;
+	dag->stack[filled++] = node;
+	while (filled > 0) {
+		n = dag->stack[--filled];
+		if (dag->flags[n] & (DAG_INSUBSTITUTERS | DAG_BUILDING))
+			continue;
+
+		ret = dag_cost(dag, n);
+		if (ret < 0)
+			return ret;
+		cost += ret;
+		if (bits != NULL)
+			bits[n / 64] |= UINT64_C(1) << (n % 64);
+
+		for (uint32_t i = dag->deps_index[n];
+		     i < dag->deps_index[n + 1]; i++) {
+			if (dag->stamps[dag->deps[i]] == dag->epoch)
+				continue;
+
+			dag->stamps[dag->deps[i]] = dag->epoch;
+			dag->stack[filled++] = dag->deps[i];
+		}
+	}
+
+	return cost;
+}
+
+int dag_closure_cost(struct dag *dag, uint32_t node)
+{
+	return dag_closure_walk(dag, node, NULL);
+}
+
+int dag_closure_bits(struct dag *dag, uint32_t node, uint64_t *bits)
+{
+	return dag_closure_walk(dag, node, bits);
+}
+
+size_t dag_stale_set(struct dag *dag, uint32_t node)
+{
+	uint32_t n, filled = 0;
+	size_t requested = 0;
+
+	if (dag->flags[node] & DAG_STALE)
+		return 0;
+
+	dag->flags[node] |= DAG_STALE;
+	dag->stack[filled++] = node;
+	while (filled > 0) {
+		n = dag->stack[--filled];
+		dag->jobid->jobs[n]->stale = true;
+		if (dag->flags[n] & DAG_REQUESTED)
+			requested++;
+
+		for (uint32_t i = dag->parents_index[n];
+		     i < dag->parents_index[n + 1]; i++) {
+			if (dag->flags[dag->parents[i]] & DAG_STALE)
+				continue;
+
+			dag->flags[dag->parents[i]] |= DAG_STALE;
+			dag->stack[filled++] = dag->parents[i];
+		}
+	}
+
+	return requested;
+}
+
+void dag_building_set(struct dag *dag, struct job *job)
+{
+	if (dag_node_isvalid(dag, job))
+		dag->flags[job->id] |= DAG_BUILDING;
+}
+
+size_t dag_size(struct dag *dag)
+{
+	return sizeof(*dag) + dag->roots_filled * sizeof(*dag->roots) +
+	       2 * (dag->nodes + 1) * sizeof(*dag->deps_index) +
+	       dag->deps_index[dag->nodes] * sizeof(*dag->deps) +
+	       dag->parents_index[dag->nodes] * sizeof(*dag->parents) +
+	       dag->nodes * (sizeof(*dag->costs) + sizeof(*dag->flags) +
+			     sizeof(*dag->stamps) + sizeof(*dag->stack));
+}
@@ -0,0 +1,509 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "drv.h"
+#include "util.h"
+
+/* Reads the ATerm encoded .drv files, that is
+ * Derive([outputs],[inputDrvs],[inputSrcs],"platform","builder",[args],[env])
+ * in a single pass over the file, mapped if it's large. Nothing is copied
+ * out, the lists are left for drv_*_next() and the env values evanix cares
+ * about are spans of buf. */
+
+#define DRV_PREFIX "Derive("
+/* smaller drvs, most of them, are read quicker than they're mapped */
+#define DRV_MAP_MIN (256 * 1024)
+
+static int aterm_string_read(char **cursor, char **s);
+static int aterm_span_read(char **cursor, struct drv_span *span);
+static bool drv_span_eq(const struct drv_span *span, const char *s);
+static int drv_map(int fd, size_t size, struct drv *drv);
+static int drv_env_read(char **cursor, struct drv *drv);
+static int drv_fd_read(int fd, const char *drv_path, struct drv *drv);
+static int aterm_skip(char **cursor);
+static int aterm_expect(char **cursor, char c);
+static int aterm_list_next(char **cursor);
+
+static int aterm_string_read(char **cursor, char **s)
+{
+	char *r, *w;
+
+	r = *cursor;
+	if (*r != '"')
+		return -EINVAL;
+	*s = w = ++r;
+
+	while (*r != '"') {
+		if (*r == '\0') {
+			return -EINVAL;
+		} else if (*r != '\\') {
+			*w++ = *r++;
+			continue;
+		}
+
+		r++;
+		switch (*r) {
+		case '\0':
+			return -EINVAL;
+		case 'n':
+			*w++ = '\n';
+			break;
+		case 'r':
+			*w++ = '\r';
+			break;
+		case 't':
+			*w++ = '\t';
+			break;
+		default:
+			*w++ = *r;
+			break;
+		}
+		r++;
+	}
+
+	*w = '\0';
+	*cursor = r + 1;
+	return 0;
+}
+
+/* like aterm_string_read(), without unescaping, so buf is left as it is */
+static int aterm_span_read(char **cursor, struct drv_span *span)
+{
+	char *c;
+
+	c = *cursor;
+	if (*c != '"')
+		return -EINVAL;
+
+	for (c++; *c != '"'; c++) {
+		if (*c == '\0')
+			return -EINVAL;
+		else if (*c == '\\' && *++c == '\0')
+			return -EINVAL;
+	}
+
+	span->s = *cursor + 1;
+	span->len = c - span->s;
+	*cursor = c + 1;
+	return 0;
+}
+
+static bool drv_span_eq(const struct drv_span *span, const char *s)
+{
+	return strlen(s) == span->len && !memcmp(span->s, s, span->len);
+}
+
+/* skips a string, a list or a tuple */
+static int aterm_skip(char **cursor)
+{
+	size_t depth = 0;
+	char *c;
+
+	c = *cursor;
+	if (*c != '"' && *c != '[' && *c != '(')
+		return -EINVAL;
+
+	do {
+		switch (*c) {
+		case '\0':
+			return -EINVAL;
+		case '"':
+			for (c++; *c != '"'; c++) {
+				if (*c == '\0')
+					return -EINVAL;
+				else if (*c == '\\' && *++c == '\0')
+					return -EINVAL;
+			}
+			c++;
+			break;
+		case '[':
+		case '(':
+			depth++;
+			c++;
+			break;
+		case ']':
+		case ')':
+			if (depth == 0)
+				return -EINVAL;
+			depth--;
+			c++;
+			break;
+		default:
+			c++;
+			break;
+		}
+	} while (depth > 0);
+
+	*cursor = c;
+	return 0;
+}
+
+static int aterm_expect(char **cursor, char c)
+{
+	if (**cursor != c)
+		return -EINVAL;
+
+	(*cursor)++;
+	return 0;
+}
+
+/* returns 1 with *cursor on the next element, 0 once the list is exhausted,
+ * *cursor must either be on the opening bracket or right after the previous
+ * element */
+static int aterm_list_next(char **cursor)
+{
+	bool first;
+	char *c;
+
+	c = *cursor;
+	if (*c == ']')
+		return 0;
+	else if (*c != '[' && *c != ',')
+		return -EINVAL;
+
+	first = *c == '[';
+	c++;
+	if (*c == ']') {
+		if (!first)
+			return -EINVAL;
+
+		*cursor = c;
+		return 0;
+	}
+
+	*cursor = c;
+	return 1;
+}
+
+static int drv_map(int fd, size_t size, struct drv *drv)
+{
+	long page_size;
+	ssize_t ret;
+	void *buf;
+
+	drv->size = size;
+
+	/* the rest of the last page reads as zeroes, terminating buf */
+	page_size = sysconf(_SC_PAGESIZE);
+	if (size >= DRV_MAP_MIN && page_size > 0 && size % page_size != 0) {
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+			   0);
+		if (buf == MAP_FAILED) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		drv->buf = buf;
+		drv->ismapped = true;
+		return 0;
+	}
+
+	drv->buf = malloc(size + 1);
+	if (drv->buf == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	drv->ismapped = false;
+
+	for (size_t n = 0; n < size;) {
+		ret = read(fd, drv->buf + n, size - n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			print_err("%s",
+				  ret < 0 ? strerror(errno) : "Short read");
+			free(drv->buf);
+			drv->buf = NULL;
+			return ret < 0 ? -errno : -EIO;
+		}
+		n += ret;
+	}
+	drv->buf[size] = '\0';
+
+	return 0;
+}
+
+/* [("name","value"), ...], picking out the values of interest */
+static int drv_env_read(char **cursor, struct drv *drv)
+{
+	struct drv_span key, value;
+	int ret;
+
+	while ((ret = aterm_list_next(cursor)) > 0) {
+		ret = aterm_expect(cursor, '(');
+		if (ret < 0)
+			return ret;
+		ret = aterm_span_read(cursor, &key);
+		if (ret < 0)
+			return ret;
+		ret = aterm_expect(cursor, ',');
+		if (ret < 0)
+			return ret;
+		ret = aterm_span_read(cursor, &value);
+		if (ret < 0)
+			return ret;
+		ret = aterm_expect(cursor, ')');
+		if (ret < 0)
+			return ret;
+
+		if (drv_span_eq(&key, "pname"))
+			drv->pname = value;
+		else if (drv_span_eq(&key, "requiredSystemFeatures"))
+			drv->required_system_features = value;
+		else if (drv_span_eq(&key, "preferLocalBuild"))
+			drv->prefer_local_build = value;
+	}
+
+	return ret;
+}
+
+/* fd is the caller's to close */
+static int drv_fd_read(int fd, const char *drv_path, struct drv *drv)
+{
+	struct stat st;
+	char *c;
+	int ret = 0;
+
+	drv->buf = NULL;
+	drv->pname = (struct drv_span){NULL, 0};
+	drv->required_system_features = (struct drv_span){NULL, 0};
+	drv->prefer_local_build = (struct drv_span){NULL, 0};
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free;
+	} else if (st.st_size == 0) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	ret = drv_map(fd, st.st_size, drv);
+	if (ret < 0)
+		goto out_free;
+
+	c = drv->buf;
+	if (strncmp(c, DRV_PREFIX, sizeof(DRV_PREFIX) - 1)) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+	c += sizeof(DRV_PREFIX) - 1;
+
+	drv->outputs = c;
+	ret = aterm_skip(&c);
+	if (ret < 0 || (ret = aterm_expect(&c, ',')) < 0)
+		goto out_free;
+
+	drv->input_drvs = c;
+	ret = aterm_skip(&c);
+	if (ret < 0 || (ret = aterm_expect(&c, ',')) < 0)
+		goto out_free;
+
+	drv->input_srcs = c;
+	ret = aterm_skip(&c);
+	if (ret < 0 || (ret = aterm_expect(&c, ',')) < 0)
+		goto out_free;
+
+	ret = aterm_string_read(&c, &drv->platform);
+	if (ret < 0 || (ret = aterm_expect(&c, ',')) < 0)
+		goto out_free;
+
+	/* builder and args */
+	ret = aterm_skip(&c);
+	if (ret < 0 || (ret = aterm_expect(&c, ',')) < 0)
+		goto out_free;
+	ret = aterm_skip(&c);
+	if (ret < 0 || (ret = aterm_expect(&c, ',')) < 0)
+		goto out_free;
+
+	ret = drv_env_read(&c, drv);
+	if (ret < 0 || (ret = aterm_expect(&c, ']')) < 0)
+		goto out_free;
+	ret = aterm_expect(&c, ')');
+
+out_free:
+	if (ret < 0) {
+		if (ret == -EINVAL)
+			print_err("%s: %s", drv_path, "Invalid derivation");
+		drv_free(drv);
+	}
+
+	return ret;
+}
+
+int drv_read(const char *drv_path, struct drv *drv)
+{
+	int fd, ret;
+
+	fd = open(drv_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		print_err("%s: %s", drv_path, strerror(errno));
+		return -errno;
+	}
+
+	ret = drv_fd_read(fd, drv_path, drv);
+	close(fd);
+
+	return ret;
+}
+
+void drv_free(struct drv *drv)
+{
+	if (drv->buf != NULL && drv->ismapped)
+		munmap(drv->buf, drv->size);
+	else
+		free(drv->buf);
+	drv->buf = NULL;
+}
+
+int drv_span_dup(const struct drv_span *span, char **s)
+{
+	char *w;
+
+	w = *s = malloc(span->len + 1);
+	if (w == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	for (size_t i = 0; i < span->len; i++) {
+		if (span->s[i] != '\\' || i + 1 == span->len) {
+			*w++ = span->s[i];
+			continue;
+		}
+
+		switch (span->s[++i]) {
+		case 'n':
+			*w++ = '\n';
+			break;
+		case 'r':
+			*w++ = '\r';
+			break;
+		case 't':
+			*w++ = '\t';
+			break;
+		default:
+			*w++ = span->s[i];
+			break;
+		}
+	}
+	*w = '\0';
+
+	return 0;
+}
+
+int drv_pname(const char *drv_path, char **pname)
+{
+	struct drv drv;
+	int fd, ret;
+
+	/* quietly, there's a pname to make up from drv_path still */
+	fd = open(drv_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	ret = drv_fd_read(fd, drv_path, &drv);
+	close(fd);
+	if (ret < 0)
+		return ret;
+
+	if (drv.pname.s == NULL)
+		ret = -ENOENT;
+	else
+		ret = drv_span_dup(&drv.pname, pname);
+	drv_free(&drv);
+
+	return ret;
+}
+
+/* ("name","store_path","hash_algo","hash") */
+int drv_output_next(char **cursor, char **name, char **store_path)
+{
+	int ret;
+
+	ret = aterm_list_next(cursor);
+	if (ret <= 0)
+		return ret;
+
+	ret = aterm_expect(cursor, '(');
+	if (ret < 0)
+		return ret;
+	ret = aterm_string_read(cursor, name);
+	if (ret < 0)
+		return ret;
+	ret = aterm_expect(cursor, ',');
+	if (ret < 0)
+		return ret;
+	ret = aterm_string_read(cursor, store_path);
+	if (ret < 0)
+		return ret;
+
+	while (**cursor == ',') {
+		(*cursor)++;
+		ret = aterm_skip(cursor);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = aterm_expect(cursor, ')');
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
+
+/* ("drv_path",["output", ...]) */
+int drv_input_drv_next(char **cursor, char **drv_path, char **outputs)
+{
+	int ret;
+
+	ret = aterm_list_next(cursor);
+	if (ret <= 0)
+		return ret;
+
+	ret = aterm_expect(cursor, '(');
+	if (ret < 0)
+		return ret;
+	ret = aterm_string_read(cursor, drv_path);
+	if (ret < 0)
+		return ret;
+	ret = aterm_expect(cursor, ',');
+	if (ret < 0)
+		return ret;
+
+	if (**cursor != '[')
+		return -EINVAL;
+	*outputs = *cursor;
+	ret = aterm_skip(cursor);
+	if (ret < 0)
+		return ret;
+
+	ret = aterm_expect(cursor, ')');
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
+
+int drv_string_next(char **cursor, char **s)
+{
+	int ret;
+
+	ret = aterm_list_next(cursor);
+	if (ret <= 0)
+		return ret;
+
+	ret = aterm_string_read(cursor, s);
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
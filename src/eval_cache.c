@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eval_cache.h"
+#include "evanix.h"
+#include "jobs.h"
+#include "util.h"
+
+/* bump whenever the way jobs are written or fingerprinted changes */
+#define EVAL_CACHE_VERSION "evanix-eval-cache-2"
+
+static struct {
+	pthread_mutex_t mutex;
+	char *path, *tmp_path;
+	/* NULL unless recording */
+	FILE *stream;
+} eval_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.path = NULL,
+	.tmp_path = NULL,
+	.stream = NULL,
+};
+
+static int eval_cache_dir(char **dir);
+static int mkdir_exist_ok(const char *path);
+static int file_hash(uint64_t *hash, const char *path);
+static int dir_file_hash(uint64_t *hash, const char *dir, const char *name,
+			 bool isrequired);
+static int eval_cache_key(char *expr, uint64_t *key);
+static void json_string_write(FILE *stream, const char *s);
+
+static int mkdir_exist_ok(const char *path)
+{
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		print_err("%s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* $XDG_CACHE_HOME/evanix, or ~/.cache/evanix */
+static int eval_cache_dir(char **dir)
+{
+	char *cache_home = NULL;
+	const char *env;
+	int ret;
+
+	env = getenv("XDG_CACHE_HOME");
+	if (env != NULL && env[0] == '/') {
+		cache_home = strdup(env);
+		if (cache_home == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+	} else {
+		env = getenv("HOME");
+		if (env == NULL) {
+			print_err("%s",
+				  "Neither XDG_CACHE_HOME nor HOME is set");
+			return -EINVAL;
+		}
+
+		ret = asprintf(&cache_home, "%s/.cache", env);
+		if (ret < 0) {
+			print_err("%s", "Failed to allocate cache dir");
+			return -ENOMEM;
+		}
+	}
+
+	ret = mkdir_exist_ok(cache_home);
+	if (ret < 0)
+		goto out_free_cache_home;
+
+	ret = asprintf(dir, "%s/evanix", cache_home);
+	if (ret < 0) {
+		print_err("%s", "Failed to allocate cache dir");
+		ret = -ENOMEM;
+		goto out_free_cache_home;
+	}
+
+	ret = mkdir_exist_ok(*dir);
+	if (ret < 0) {
+		free(*dir);
+		*dir = NULL;
+	}
+
+out_free_cache_home:
+	free(cache_home);
+
+	return ret;
+}
+
+static int file_hash(uint64_t *hash, const char *path)
+{
+	char buf[64 * 1024];
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		print_err("%s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			print_err("%s: %s", path, strerror(errno));
+			close(fd);
+			return -errno;
+		}
+
+		*hash = fnv1a_64(*hash, buf, n);
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* hashes the file name under dir, a missing one counts as empty unless
+ * it's required */
+static int dir_file_hash(uint64_t *hash, const char *dir, const char *name,
+			 bool isrequired)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (ret < 0 || (size_t)ret >= sizeof(path)) {
+		print_err("%s/%s: %s", dir, name, strerror(ENAMETOOLONG));
+		return -ENAMETOOLONG;
+	}
+
+	*hash = fnv1a_64(*hash, name, strlen(name) + 1);
+	if (!isrequired && access(path, F_OK) < 0 && errno == ENOENT)
+		return 0;
+
+	return file_hash(hash, path);
+}
+
+/* What an evaluation reads besides its entry point isn't known, so only that
+ * is hashed: flake.nix and flake.lock of a local flake, the file of any other
+ * expr, and the environment nix looks things up in. Imports from elsewhere
+ * are left to --eval-cache-invalidate. */
+static int eval_cache_key(char *expr, uint64_t *key)
+{
+	const char *envs[] = {"NIX_PATH", "NIX_CONFIG"};
+	const char *version = EVAL_CACHE_VERSION;
+	char path[PATH_MAX];
+	char *ref, *fragment;
+	const char *env;
+	struct stat st;
+	uint64_t hash;
+	int ret = 0;
+
+	hash = fnv1a_64(FNV1A_64_INIT, version, strlen(version) + 1);
+	hash = fnv1a_64(hash, expr, strlen(expr) + 1);
+	hash = fnv1a_64(hash, evanix_opts.system,
+			strlen(evanix_opts.system) + 1);
+	hash = fnv1a_64(hash, &evanix_opts.isflake,
+			sizeof(evanix_opts.isflake));
+	for (size_t i = 0; i < evanix_opts.eval_shards_filled; i++) {
+		hash = fnv1a_64(hash, evanix_opts.eval_shards[i],
+				strlen(evanix_opts.eval_shards[i]) + 1);
+	}
+	for (size_t i = 0; i < sizeof(envs) / sizeof(*envs); i++) {
+		env = getenv(envs[i]);
+		if (env == NULL)
+			env = "";
+		hash = fnv1a_64(hash, env, strlen(env) + 1);
+	}
+
+	ref = strdup(expr);
+	if (ref == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	if (evanix_opts.isflake) {
+		fragment = strchr(ref, '#');
+		if (fragment != NULL)
+			*fragment = '\0';
+		fragment = strchr(ref, '?');
+		if (fragment != NULL)
+			*fragment = '\0';
+
+		/* remote refs only have the ref itself to go on */
+		if (!strncmp(ref, "path:", sizeof("path:") - 1))
+			memmove(ref, ref + sizeof("path:") - 1,
+				strlen(ref + sizeof("path:") - 1) + 1);
+		else if (ref[0] != '.' && ref[0] != '/')
+			goto out_free_ref;
+	}
+
+	if (realpath(ref, path) == NULL) {
+		print_err("%s: %s", ref, strerror(errno));
+		ret = -errno;
+		goto out_free_ref;
+	}
+	if (stat(path, &st) < 0) {
+		print_err("%s: %s", path, strerror(errno));
+		ret = -errno;
+		goto out_free_ref;
+	}
+
+	if (evanix_opts.isflake) {
+		ret = dir_file_hash(&hash, path, "flake.nix", true);
+		if (ret >= 0)
+			ret = dir_file_hash(&hash, path, "flake.lock", false);
+	} else if (S_ISDIR(st.st_mode)) {
+		ret = dir_file_hash(&hash, path, "default.nix", true);
+	} else {
+		ret = file_hash(&hash, path);
+	}
+
+out_free_ref:
+	free(ref);
+	if (ret >= 0)
+		*key = hash;
+
+	return ret < 0 ? ret : 0;
+}
+
+static void json_string_write(FILE *stream, const char *s)
+{
+	fputc('"', stream);
+	for (; *s; s++) {
+		switch (*s) {
+		case '"':
+			fputs("\\\"", stream);
+			break;
+		case '\\':
+			fputs("\\\\", stream);
+			break;
+		case '\n':
+			fputs("\\n", stream);
+			break;
+		case '\t':
+			fputs("\\t", stream);
+			break;
+		default:
+			if ((unsigned char)*s < 0x20)
+				fprintf(stream, "\\u%04x", *s);
+			else
+				fputc(*s, stream);
+			break;
+		}
+	}
+	fputc('"', stream);
+}
+
+int eval_cache_open(char *expr, bool invalidate, bool *ishit)
+{
+	char *dir = NULL;
+	uint64_t key;
+	int fd, ret;
+
+	ret = eval_cache_key(expr, &key);
+	if (ret < 0)
+		return ret;
+
+	ret = eval_cache_dir(&dir);
+	if (ret < 0)
+		return ret;
+
+	ret = asprintf(&eval_cache.path, "%s/%016" PRIx64 ".jsonl", dir, key);
+	if (ret < 0) {
+		print_err("%s", "Failed to allocate cache path");
+		eval_cache.path = NULL;
+		ret = -ENOMEM;
+		goto out_free_dir;
+	}
+
+	if (!invalidate && access(eval_cache.path, R_OK) == 0) {
+		*ishit = true;
+		ret = 0;
+		goto out_free_dir;
+	}
+	*ishit = false;
+
+	ret = asprintf(&eval_cache.tmp_path, "%s.XXXXXX", eval_cache.path);
+	if (ret < 0) {
+		print_err("%s", "Failed to allocate cache path");
+		eval_cache.tmp_path = NULL;
+		ret = -ENOMEM;
+		goto out_free_dir;
+	}
+
+	fd = mkstemp(eval_cache.tmp_path);
+	if (fd < 0) {
+		print_err("%s: %s", eval_cache.tmp_path, strerror(errno));
+		ret = -errno;
+		goto out_free_dir;
+	}
+
+	eval_cache.stream = fdopen(fd, "w");
+	if (eval_cache.stream == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		close(fd);
+		unlink(eval_cache.tmp_path);
+		goto out_free_dir;
+	}
+	ret = 0;
+
+out_free_dir:
+	free(dir);
+	if (ret < 0) {
+		free(eval_cache.path);
+		eval_cache.path = NULL;
+		free(eval_cache.tmp_path);
+		eval_cache.tmp_path = NULL;
+	}
+
+	return ret;
+}
+
+const char *eval_cache_path(void)
+{
+	return eval_cache.path;
+}
+
+/* in the nix-eval-jobs format, so a hit is replayed through job_parse() */
+void eval_cache_job_write(struct job *job)
+{
+	FILE *s = eval_cache.stream;
+	struct job *dep;
+
+	if (s == NULL)
+		return;
+
+	pthread_mutex_lock(&eval_cache.mutex);
+
+	fputs("{\"attr\":", s);
+	json_string_write(s, job->nix_attr_name ? job->nix_attr_name : "");
+	fputs(",\"name\":", s);
+	json_string_write(s, job->name);
+	fputs(",\"system\":", s);
+	json_string_write(s, evanix_opts.system);
+	fputs(",\"drvPath\":", s);
+	json_string_write(s, job->drv_path);
+
+	fputs(",\"outputs\":{", s);
+	for (size_t i = 0; i < job->outputs_filled; i++) {
+		if (i > 0)
+			fputc(',', s);
+		json_string_write(s, job->outputs[i]->name);
+		fputc(':', s);
+		if (job->outputs[i]->store_path)
+			json_string_write(s, job->outputs[i]->store_path);
+		else
+			fputs("null", s);
+	}
+
+	fputs("},\"inputDrvs\":{", s);
+	for (size_t i = 0; i < job->deps_filled; i++) {
+		dep = job->deps[i];
+		if (i > 0)
+			fputc(',', s);
+		json_string_write(s, dep->drv_path);
+		fputs(":[", s);
+		for (size_t j = 0; j < dep->outputs_filled; j++) {
+			if (j > 0)
+				fputc(',', s);
+			json_string_write(s, dep->outputs[j]->name);
+		}
+		fputc(']', s);
+	}
+	fputs("}}\n", s);
+
+	pthread_mutex_unlock(&eval_cache.mutex);
+}
+
+void eval_cache_error_write(const char *error)
+{
+	if (eval_cache.stream == NULL)
+		return;
+
+	pthread_mutex_lock(&eval_cache.mutex);
+	fputs("{\"error\":", eval_cache.stream);
+	json_string_write(eval_cache.stream, error);
+	fputs("}\n", eval_cache.stream);
+	pthread_mutex_unlock(&eval_cache.mutex);
+}
+
+int eval_cache_close(bool commit)
+{
+	int ret = 0;
+
+	if (eval_cache.stream != NULL) {
+		if (ferror(eval_cache.stream) || fflush(eval_cache.stream) ||
+		    fsync(fileno(eval_cache.stream)) < 0) {
+			print_err("%s: %s", eval_cache.tmp_path,
+				  strerror(errno));
+			commit = false;
+			ret = -EIO;
+		}
+		fclose(eval_cache.stream);
+		eval_cache.stream = NULL;
+
+		if (commit &&
+		    rename(eval_cache.tmp_path, eval_cache.path) < 0) {
+			print_err("%s: %s", eval_cache.path, strerror(errno));
+			ret = -errno;
+			commit = false;
+		}
+		if (!commit)
+			unlink(eval_cache.tmp_path);
+	}
+
+	free(eval_cache.path);
+	eval_cache.path = NULL;
+	free(eval_cache.tmp_path);
+	eval_cache.tmp_path = NULL;
+
+	return ret;
+}
@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "eval_json.h"
+
+/* A single pass, in place parser for the subset of JSON emitted by
+ * nix-eval-jobs. Strings are unescaped and NUL terminated inside the line
+ * buffer itself, nothing is allocated. Values evanix doesn't care about are
+ * skipped without being validated beyond bracket and quote balancing. */
+
+static char *json_ws_skip(char *p);
+static int json_hex4_read(const char *p, unsigned *cp);
+static char *json_utf8_write(char *w, unsigned cp);
+static int json_string_read(char **cursor, char **s);
+static int json_value_skip(char **cursor);
+static int json_container_next(char **cursor, char open, char close);
+static int json_member_next(char **cursor, char **key);
+static int json_field_string(char **cursor, char **field);
+static int json_field_object(char **cursor, char **field);
+
+static char *json_ws_skip(char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+
+	return p;
+}
+
+static int json_hex4_read(const char *p, unsigned *cp)
+{
+	unsigned v = 0;
+
+	for (size_t i = 0; i < 4; i++) {
+		v <<= 4;
+		if (p[i] >= '0' && p[i] <= '9')
+			v |= p[i] - '0';
+		else if (p[i] >= 'a' && p[i] <= 'f')
+			v |= p[i] - 'a' + 10;
+		else if (p[i] >= 'A' && p[i] <= 'F')
+			v |= p[i] - 'A' + 10;
+		else
+			return -EINVAL;
+	}
+
+	*cp = v;
+	return 0;
+}
+
+static char *json_utf8_write(char *w, unsigned cp)
+{
+	if (cp < 0x80) {
+		*w++ = cp;
+	} else if (cp < 0x800) {
+		*w++ = 0xc0 | (cp >> 6);
+		*w++ = 0x80 | (cp & 0x3f);
+	} else if (cp < 0x10000) {
+		*w++ = 0xe0 | (cp >> 12);
+		*w++ = 0x80 | ((cp >> 6) & 0x3f);
+		*w++ = 0x80 | (cp & 0x3f);
+	} else {
+		*w++ = 0xf0 | (cp >> 18);
+		*w++ = 0x80 | ((cp >> 12) & 0x3f);
+		*w++ = 0x80 | ((cp >> 6) & 0x3f);
+		*w++ = 0x80 | (cp & 0x3f);
+	}
+
+	return w;
+}
+
+/* an escape sequence is never shorter than what it decodes to, so the
+ * decoded string always fits where the encoded one was */
+static int json_string_read(char **cursor, char **s)
+{
+	unsigned cp, lo;
+	char *r, *w;
+
+	r = *cursor;
+	if (*r != '"')
+		return -EINVAL;
+	*s = w = ++r;
+
+	while (*r != '"') {
+		if (*r == '\0') {
+			return -EINVAL;
+		} else if (*r != '\\') {
+			*w++ = *r++;
+			continue;
+		}
+
+		r++;
+		switch (*r++) {
+		case '"':
+			*w++ = '"';
+			break;
+		case '\\':
+			*w++ = '\\';
+			break;
+		case '/':
+			*w++ = '/';
+			break;
+		case 'b':
+			*w++ = '\b';
+			break;
+		case 'f':
+			*w++ = '\f';
+			break;
+		case 'n':
+			*w++ = '\n';
+			break;
+		case 'r':
+			*w++ = '\r';
+			break;
+		case 't':
+			*w++ = '\t';
+			break;
+		case 'u':
+			if (json_hex4_read(r, &cp) < 0 || cp == 0)
+				return -EINVAL;
+			r += 4;
+
+			if (cp >= 0xdc00 && cp <= 0xdfff) {
+				return -EINVAL;
+			} else if (cp >= 0xd800 && cp <= 0xdbff) {
+				if (r[0] != '\\' || r[1] != 'u' ||
+				    json_hex4_read(r + 2, &lo) < 0 ||
+				    lo < 0xdc00 || lo > 0xdfff)
+					return -EINVAL;
+				r += 6;
+				cp = 0x10000 + ((cp - 0xd800) << 10) +
+				     (lo - 0xdc00);
+			}
+
+			w = json_utf8_write(w, cp);
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	*w = '\0';
+	*cursor = r + 1;
+	return 0;
+}
+
+static int json_value_skip(char **cursor)
+{
+	size_t depth, n;
+	char *c;
+
+	c = *cursor;
+	if (*c != '{' && *c != '[' && *c != '"') {
+		/* number, true, false or null */
+		n = strcspn(c, ",}] \t\r\n");
+		if (n == 0)
+			return -EINVAL;
+
+		*cursor = c + n;
+		return 0;
+	}
+
+	depth = 0;
+	do {
+		switch (*c) {
+		case '\0':
+			return -EINVAL;
+		case '"':
+			for (c++; *c != '"'; c++) {
+				if (*c == '\0')
+					return -EINVAL;
+				else if (*c == '\\' && *++c == '\0')
+					return -EINVAL;
+			}
+			c++;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			c++;
+			break;
+		case '}':
+		case ']':
+			if (depth == 0)
+				return -EINVAL;
+			depth--;
+			c++;
+			break;
+		default:
+			c++;
+			break;
+		}
+	} while (depth > 0);
+
+	*cursor = c;
+	return 0;
+}
+
+/* returns 1 with *cursor on the next element, 0 once the container is
+ * exhausted, *cursor must either be on the opening bracket or right after
+ * the previous element */
+static int json_container_next(char **cursor, char open, char close)
+{
+	bool first;
+	char *c;
+
+	c = json_ws_skip(*cursor);
+	if (*c == close) {
+		*cursor = c;
+		return 0;
+	} else if (*c != open && *c != ',') {
+		return -EINVAL;
+	}
+
+	first = *c == open;
+	c = json_ws_skip(c + 1);
+	if (*c == close) {
+		if (!first)
+			return -EINVAL;
+
+		*cursor = c;
+		return 0;
+	}
+
+	*cursor = c;
+	return 1;
+}
+
+static int json_member_next(char **cursor, char **key)
+{
+	char *c;
+	int ret;
+
+	ret = json_container_next(cursor, '{', '}');
+	if (ret <= 0)
+		return ret;
+
+	ret = json_string_read(cursor, key);
+	if (ret < 0)
+		return ret;
+
+	c = json_ws_skip(*cursor);
+	if (*c != ':')
+		return -EINVAL;
+
+	*cursor = json_ws_skip(c + 1);
+	return 1;
+}
+
+static int json_field_string(char **cursor, char **field)
+{
+	if (**cursor == '"')
+		return json_string_read(cursor, field);
+
+	*field = NULL;
+	return json_value_skip(cursor);
+}
+
+static int json_field_object(char **cursor, char **field)
+{
+	*field = (**cursor == '{') ? *cursor : NULL;
+
+	return json_value_skip(cursor);
+}
+
+int eval_json_parse(char *line, struct eval_json *ej)
+{
+	char *cursor, *key;
+	int ret;
+
+	ej->error = NULL;
+	ej->system = NULL;
+	ej->name = NULL;
+	ej->attr = NULL;
+	ej->drv_path = NULL;
+	ej->input_drvs = NULL;
+	ej->outputs = NULL;
+
+	cursor = json_ws_skip(line);
+	if (*cursor != '{')
+		return -EINVAL;
+
+	while ((ret = json_member_next(&cursor, &key)) > 0) {
+		if (!strcmp(key, "drvPath"))
+			ret = json_field_string(&cursor, &ej->drv_path);
+		else if (!strcmp(key, "attr"))
+			ret = json_field_string(&cursor, &ej->attr);
+		else if (!strcmp(key, "name"))
+			ret = json_field_string(&cursor, &ej->name);
+		else if (!strcmp(key, "system"))
+			ret = json_field_string(&cursor, &ej->system);
+		else if (!strcmp(key, "error"))
+			ret = json_field_string(&cursor, &ej->error);
+		else if (!strcmp(key, "inputDrvs"))
+			ret = json_field_object(&cursor, &ej->input_drvs);
+		else if (!strcmp(key, "outputs"))
+			ret = json_field_object(&cursor, &ej->outputs);
+		else
+			ret = json_value_skip(&cursor);
+
+		if (ret < 0)
+			return ret;
+	}
+	if (ret < 0)
+		return ret;
+
+	/* cursor is on the closing brace */
+	if (*json_ws_skip(cursor + 1) != '\0')
+		return -EINVAL;
+
+	return 0;
+}
+
+int eval_json_input_drv_next(char **cursor, char **drv_path, char **outputs)
+{
+	int ret;
+
+	ret = json_member_next(cursor, drv_path);
+	if (ret <= 0)
+		return ret;
+
+	if (**cursor != '[')
+		return -EINVAL;
+	*outputs = *cursor;
+
+	ret = json_value_skip(cursor);
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
+
+int eval_json_output_next(char **cursor, char **name, char **store_path)
+{
+	int ret;
+
+	ret = json_member_next(cursor, name);
+	if (ret <= 0)
+		return ret;
+
+	ret = json_field_string(cursor, store_path);
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
+
+int eval_json_string_next(char **cursor, char **s)
+{
+	int ret;
+
+	ret = json_container_next(cursor, '[', ']');
+	if (ret <= 0)
+		return ret;
+
+	ret = json_string_read(cursor, s);
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
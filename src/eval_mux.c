@@ -0,0 +1,385 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "eval_mux.h"
+#include "jobs.h"
+#include "util.h"
+
+#define EVAL_MUX_READ_SIZE (64 * 1024)
+#define EVAL_MUX_EVENTS	   16
+
+static void eval_mux_src_reset(struct eval_mux_src *src);
+static int eval_mux_src_init(struct eval_mux_src *src, char *expr,
+			     char *shard);
+static int eval_mux_new(struct eval_mux **mux, size_t nsrcs);
+static void eval_mux_src_free(struct eval_mux_src *src);
+static int eval_mux_src_read(struct eval_mux *mux, struct eval_mux_src *src);
+static size_t eval_mux_src_line_len(struct eval_mux_src *src);
+static ssize_t eval_mux_src_line_take(struct eval_mux_src *src, size_t len,
+				      char **line, size_t *line_size);
+
+static void eval_mux_src_reset(struct eval_mux_src *src)
+{
+	src->stream = NULL;
+	src->fd = -1;
+	src->pid = -1;
+	src->eof = false;
+	src->attr_prefix = NULL;
+	src->buf = NULL;
+	src->start = 0;
+	src->filled = 0;
+	src->size = 0;
+}
+
+static int eval_mux_src_init(struct eval_mux_src *src, char *expr, char *shard)
+{
+	char *shard_expr = NULL;
+	int ret;
+
+	eval_mux_src_reset(src);
+	if (shard != NULL) {
+		/* expr.shard, or expr#shard if expr has no attr path yet */
+		ret = asprintf(&shard_expr, "%s%c%s", expr,
+			       strchr(expr, '#') ? '.' : '#', shard);
+		if (ret < 0) {
+			print_err("%s", "Failed to allocate shard expr");
+			return -ENOMEM;
+		}
+
+		src->attr_prefix = strdup(shard);
+		if (src->attr_prefix == NULL) {
+			print_err("%s", strerror(errno));
+			ret = -errno;
+			goto out_free_shard_expr;
+		}
+	}
+
+	ret = jobs_init(&src->stream, shard_expr ? shard_expr : expr);
+	if (ret < 0)
+		goto out_free_shard_expr;
+	src->pid = ret;
+	src->fd = fileno(src->stream);
+
+out_free_shard_expr:
+	free(shard_expr);
+	if (ret < 0) {
+		free(src->attr_prefix);
+		src->attr_prefix = NULL;
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
+static void eval_mux_src_free(struct eval_mux_src *src)
+{
+	if (src->stream != NULL)
+		fclose(src->stream);
+	free(src->attr_prefix);
+	free(src->buf);
+}
+
+static int eval_mux_src_read(struct eval_mux *mux, struct eval_mux_src *src)
+{
+	size_t newsize;
+	ssize_t n;
+	void *ret;
+
+	if (src->start > 0) {
+		memmove(src->buf, src->buf + src->start,
+			src->filled - src->start);
+		src->filled -= src->start;
+		src->start = 0;
+	}
+
+	if (src->size - src->filled < EVAL_MUX_READ_SIZE) {
+		newsize = src->size == 0 ? EVAL_MUX_READ_SIZE * 2
+					 : src->size * 2;
+		ret = realloc(src->buf, newsize);
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		src->buf = ret;
+		src->size = newsize;
+	}
+
+	n = read(src->fd, src->buf + src->filled, src->size - src->filled);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+
+		print_err("%s", strerror(errno));
+		return -errno;
+	} else if (n == 0) {
+		src->eof = true;
+		mux->srcs_open--;
+		if (mux->epfd >= 0)
+			epoll_ctl(mux->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+
+		return 0;
+	}
+
+	src->filled += n;
+	return 0;
+}
+
+/* length of the first whole line buffered in src including its newline, 0
+ * if there is none yet */
+static size_t eval_mux_src_line_len(struct eval_mux_src *src)
+{
+	char *nl;
+
+	if (src->start == src->filled)
+		return 0;
+
+	nl = memchr(src->buf + src->start, '\n', src->filled - src->start);
+	if (nl != NULL)
+		return nl - (src->buf + src->start) + 1;
+
+	/* the last line might be missing its newline */
+	if (src->eof)
+		return src->filled - src->start;
+
+	return 0;
+}
+
+static ssize_t eval_mux_src_line_take(struct eval_mux_src *src, size_t len,
+				      char **line, size_t *line_size)
+{
+	void *ret;
+
+	if (*line == NULL || *line_size < len + 1) {
+		ret = realloc(*line, len + 1);
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -1;
+		}
+
+		*line = ret;
+		*line_size = len + 1;
+	}
+
+	memcpy(*line, src->buf + src->start, len);
+	(*line)[len] = '\0';
+	src->start += len;
+
+	return len;
+}
+
+ssize_t eval_mux_getline(struct eval_mux *mux, char **line, size_t *line_size,
+			 const char **attr_prefix)
+{
+	struct epoll_event events[EVAL_MUX_EVENTS];
+	struct eval_mux_src *src;
+	size_t len;
+	int n;
+
+	while (true) {
+		for (size_t i = 0; i < mux->srcs_filled; i++) {
+			src = &mux->srcs[(mux->next + i) % mux->srcs_filled];
+			len = eval_mux_src_line_len(src);
+			if (len == 0)
+				continue;
+
+			mux->next = (mux->next + i + 1) % mux->srcs_filled;
+			*attr_prefix = src->attr_prefix;
+			return eval_mux_src_line_take(src, len, line,
+						      line_size);
+		}
+
+		if (mux->srcs_open == 0)
+			return -1;
+
+		/* a single source, nothing to multiplex */
+		if (mux->epfd < 0) {
+			if (eval_mux_src_read(mux, &mux->srcs[0]) < 0)
+				return -1;
+			continue;
+		}
+
+		n = epoll_wait(mux->epfd, events, EVAL_MUX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			print_err("%s", strerror(errno));
+			return -1;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (eval_mux_src_read(mux, events[i].data.ptr) < 0)
+				return -1;
+		}
+	}
+}
+
+int eval_mux_wait(struct eval_mux *mux)
+{
+	struct eval_mux_src *src;
+	int wstatus;
+	int ret = 0;
+
+	for (size_t i = 0; i < mux->srcs_filled; i++) {
+		src = &mux->srcs[i];
+		if (src->pid < 0)
+			continue;
+
+		/* The reader gave up before the end, and nix-eval-jobs may be
+		 * stuck writing to a full pipe. Closing it fails the writes of
+		 * its workers, and SIGTERM takes care of the rest. */
+		if (!src->eof) {
+			fclose(src->stream);
+			src->stream = NULL;
+			src->fd = -1;
+			src->eof = true;
+			mux->srcs_open--;
+			kill(src->pid, SIGTERM);
+			ret = -ECANCELED;
+		}
+
+		while (waitpid(src->pid, &wstatus, 0) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+		src->pid = -1;
+
+		if (ret == 0 &&
+		    (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0))
+			ret = -EPERM;
+	}
+
+	return ret;
+}
+
+void eval_mux_free(struct eval_mux *mux)
+{
+	if (mux == NULL)
+		return;
+
+	for (size_t i = 0; i < mux->srcs_filled; i++)
+		eval_mux_src_free(&mux->srcs[i]);
+	free(mux->srcs);
+
+	if (mux->epfd >= 0)
+		close(mux->epfd);
+	free(mux);
+}
+
+static int eval_mux_new(struct eval_mux **mux, size_t nsrcs)
+{
+	struct eval_mux *m;
+	int ret = 0;
+
+	m = malloc(sizeof(*m));
+	if (m == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	m->epfd = -1;
+	m->srcs_filled = 0;
+	m->srcs_open = 0;
+	m->next = 0;
+
+	m->srcs = malloc(nsrcs * sizeof(*m->srcs));
+	if (m->srcs == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free_mux;
+	}
+
+	if (nsrcs > 1) {
+		m->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (m->epfd < 0) {
+			print_err("%s", strerror(errno));
+			ret = -errno;
+			goto out_free_mux;
+		}
+	}
+
+out_free_mux:
+	if (ret < 0)
+		eval_mux_free(m);
+	else
+		*mux = m;
+
+	return ret;
+}
+
+int eval_mux_init(struct eval_mux **mux, char *expr, char **shards,
+		  size_t shards_filled)
+{
+	struct epoll_event event;
+	struct eval_mux *m;
+	size_t nsrcs;
+	int ret = 0;
+
+	nsrcs = shards_filled ? shards_filled : 1;
+
+	ret = eval_mux_new(&m, nsrcs);
+	if (ret < 0)
+		return ret;
+
+	for (size_t i = 0; i < nsrcs; i++) {
+		ret = eval_mux_src_init(&m->srcs[i], expr,
+					shards_filled ? shards[i] : NULL);
+		if (ret < 0)
+			goto out_free_mux;
+		m->srcs_filled++;
+		m->srcs_open++;
+
+		if (m->epfd < 0)
+			continue;
+
+		event.events = EPOLLIN;
+		event.data.ptr = &m->srcs[i];
+		ret = epoll_ctl(m->epfd, EPOLL_CTL_ADD, m->srcs[i].fd, &event);
+		if (ret < 0) {
+			print_err("%s", strerror(errno));
+			ret = -errno;
+			goto out_free_mux;
+		}
+	}
+
+out_free_mux:
+	if (ret < 0)
+		eval_mux_free(m);
+	else
+		*mux = m;
+
+	return ret;
+}
+
+int eval_mux_file_init(struct eval_mux **mux, const char *path)
+{
+	struct eval_mux *m;
+	int ret;
+
+	ret = eval_mux_new(&m, 1);
+	if (ret < 0)
+		return ret;
+
+	eval_mux_src_reset(&m->srcs[0]);
+	m->srcs[0].stream = fopen(path, "r");
+	if (m->srcs[0].stream == NULL) {
+		print_err("%s: %s", path, strerror(errno));
+		ret = -errno;
+		eval_mux_free(m);
+		return ret;
+	}
+	m->srcs[0].fd = fileno(m->srcs[0].stream);
+	m->srcs_filled = 1;
+	m->srcs_open = 1;
+
+	*mux = m;
+	return 0;
+}
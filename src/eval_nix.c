@@ -0,0 +1,439 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nix/nix_api_expr.h>
+#include <nix/nix_api_store.h>
+#include <nix/nix_api_util.h>
+#include <nix/nix_api_value.h>
+
+#include "cache_check.h"
+#include "eval_cache.h"
+#include "eval_nix.h"
+#include "evanix.h"
+#include "jobs.h"
+#include "nix.h"
+#include "util.h"
+
+struct eval_nix {
+	nix_c_context *ctx;
+	Store *store;
+	EvalState *state;
+	struct cache_check *cc;
+};
+
+static void eval_nix_err_print(struct eval_nix *en, const char *attr);
+static void nix_string_escape(FILE *stream, const char *s);
+static int eval_nix_expr_build(char *expr, char **nix_expr);
+static char *eval_nix_attr_string(struct eval_nix *en, nix_value *value,
+				  const char *name);
+static int eval_nix_isderivation(struct eval_nix *en, nix_value *value);
+static int eval_nix_outputs_read(struct eval_nix *en, nix_value *value,
+				 struct job *job);
+static int eval_nix_job(struct eval_nix *en, nix_value *value,
+			const char *attr);
+static int eval_nix_walk(struct eval_nix *en, nix_value *value,
+			 const char *attr, bool top);
+
+static void eval_nix_err_print(struct eval_nix *en, const char *attr)
+{
+	const char *msg;
+
+	msg = nix_err_msg(NULL, en->ctx, NULL);
+	if (msg == NULL)
+		msg = "unexpected value";
+	print_err("%s: %s", attr[0] ? attr : "<root>", msg);
+	eval_cache_error_write(msg);
+	nix_clear_err(en->ctx);
+}
+
+static void nix_string_escape(FILE *stream, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\' || (*s == '$' && s[1] == '{'))
+			fputc('\\', stream);
+		fputc(*s, stream);
+	}
+}
+
+/* turns the expr argument into a nix expression evaluating to the attrset
+ * nix-eval-jobs would have walked */
+static int eval_nix_expr_build(char *expr, char **nix_expr)
+{
+	char path[PATH_MAX];
+	char *fragment, *ref;
+	size_t nix_expr_size;
+	FILE *stream;
+	int ret = 0;
+
+	ref = strdup(expr);
+	if (ref == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	stream = open_memstream(nix_expr, &nix_expr_size);
+	if (stream == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free_ref;
+	}
+
+	if (evanix_opts.isflake) {
+		fragment = strchr(ref, '#');
+		if (fragment == NULL) {
+			print_err("%s", "flake ref needs an attr path");
+			ret = -EINVAL;
+			goto out_close_stream;
+		}
+		*fragment++ = '\0';
+
+		fputs("(builtins.getFlake \"", stream);
+		/* getFlake only takes absolute refs */
+		if (ref[0] == '.' || ref[0] == '/') {
+			if (realpath(ref, path) == NULL) {
+				print_err("%s: %s", ref, strerror(errno));
+				ret = -errno;
+				goto out_close_stream;
+			}
+			fputs("path:", stream);
+			nix_string_escape(stream, path);
+		} else {
+			nix_string_escape(stream, ref);
+		}
+		fprintf(stream, "\").%s", fragment);
+	} else {
+		if (realpath(ref, path) == NULL) {
+			print_err("%s: %s", ref, strerror(errno));
+			ret = -errno;
+			goto out_close_stream;
+		}
+
+		fputs("let e = import (/. + \"", stream);
+		nix_string_escape(stream, path);
+		fputs("\"); in if builtins.isFunction e then e { } else e",
+		      stream);
+	}
+
+out_close_stream:
+	if (fclose(stream) != 0 && ret == 0) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+	}
+	if (ret < 0) {
+		free(*nix_expr);
+		*nix_expr = NULL;
+	}
+out_free_ref:
+	free(ref);
+
+	return ret;
+}
+
+static char *eval_nix_attr_string(struct eval_nix *en, nix_value *value,
+				  const char *name)
+{
+	nix_value *attr;
+	char *s = NULL;
+
+	attr = nix_get_attr_byname(en->ctx, value, en->state, name);
+	if (attr == NULL)
+		return NULL;
+
+	if (nix_value_force(en->ctx, en->state, attr) == NIX_OK &&
+	    nix_get_type(en->ctx, attr) == NIX_TYPE_STRING)
+		nix_get_string(en->ctx, attr, _nix_get_string_strdup, &s);
+
+	nix_gc_decref(en->ctx, attr);
+	return s;
+}
+
+static int eval_nix_isderivation(struct eval_nix *en, nix_value *value)
+{
+	char *type;
+	int ret;
+
+	if (!nix_has_attr_byname(en->ctx, value, en->state, "type"))
+		return false;
+
+	type = eval_nix_attr_string(en, value, "type");
+	if (type == NULL)
+		return false;
+
+	ret = !strcmp(type, "derivation");
+	free(type);
+
+	return ret;
+}
+
+static int eval_nix_outputs_read(struct eval_nix *en, nix_value *value,
+				 struct job *job)
+{
+	nix_value *outputs, *output, *output_value;
+	char *name, *store_path;
+	unsigned int n;
+
+	int ret = 0;
+
+	outputs = nix_get_attr_byname(en->ctx, value, en->state, "outputs");
+	if (outputs == NULL)
+		return -EPERM;
+
+	n = nix_get_list_size(en->ctx, outputs);
+	for (unsigned int i = 0; i < n && ret == 0; i++) {
+		name = NULL;
+		store_path = NULL;
+
+		output = nix_get_list_byidx(en->ctx, outputs, en->state, i);
+		if (output == NULL) {
+			ret = -EPERM;
+			break;
+		}
+		if (nix_value_force(en->ctx, en->state, output) == NIX_OK)
+			nix_get_string(en->ctx, output, _nix_get_string_strdup,
+				       &name);
+		nix_gc_decref(en->ctx, output);
+		if (name == NULL) {
+			ret = -EPERM;
+			break;
+		}
+
+		output_value =
+			nix_get_attr_byname(en->ctx, value, en->state, name);
+		if (output_value != NULL) {
+			store_path = eval_nix_attr_string(en, output_value,
+							  "outPath");
+			nix_gc_decref(en->ctx, output_value);
+		}
+
+		if (store_path == NULL)
+			ret = -EPERM;
+		else
+			ret = job_output_insert(job, name, store_path);
+
+		free(name);
+		free(store_path);
+	}
+
+	nix_gc_decref(en->ctx, outputs);
+	return ret;
+}
+
+/* evaluation errors only skip the attr, like nix-eval-jobs would, anything
+ * else is fatal */
+static int eval_nix_job(struct eval_nix *en, nix_value *value,
+			const char *attr)
+{
+	char *system, *name, *drv_path;
+
+	struct job *job = NULL;
+	int ret = 0;
+
+	system = eval_nix_attr_string(en, value, "system");
+	name = eval_nix_attr_string(en, value, "name");
+	drv_path = eval_nix_attr_string(en, value, "drvPath");
+	if (system == NULL || name == NULL || drv_path == NULL) {
+		eval_nix_err_print(en, attr);
+		goto out_free;
+	} else if (strcmp(evanix_opts.system, system)) {
+		goto out_free;
+	}
+
+	ret = job_new(&job, name, drv_path, attr[0] ? (char *)attr : NULL,
+		      NULL);
+	if (ret < 0)
+		goto out_free;
+
+	ret = eval_nix_outputs_read(en, value, job);
+	if (ret == -EPERM) {
+		eval_nix_err_print(en, attr);
+		ret = 0;
+		goto out_free;
+	} else if (ret < 0) {
+		goto out_free;
+	}
+
+	/* a .drv that can't be read is as good as an evaluation error, it
+	 * only costs the attr, like JOB_READ_EVAL_ERR does in queue_read() */
+	ret = job_read_drv(job);
+	if (ret == -ENOMEM) {
+		goto out_free;
+	} else if (ret < 0) {
+		ret = 0;
+		goto out_free;
+	}
+
+	eval_cache_job_write(job);
+	ret = cache_check_submit(en->cc, job);
+	job = NULL;
+
+out_free:
+	job_free(job);
+	free(system);
+	free(name);
+	free(drv_path);
+
+	return ret;
+}
+
+static int eval_nix_walk(struct eval_nix *en, nix_value *value,
+			 const char *attr, bool top)
+{
+	nix_value *child, *recurse;
+	const char *name;
+	char *child_attr;
+	unsigned int n;
+	bool isrecurse;
+	int ret;
+
+	if (nix_value_force(en->ctx, en->state, value) != NIX_OK) {
+		eval_nix_err_print(en, attr);
+		return 0;
+	} else if (nix_get_type(en->ctx, value) != NIX_TYPE_ATTRS) {
+		return 0;
+	}
+
+	if (eval_nix_isderivation(en, value))
+		return eval_nix_job(en, value, attr);
+	nix_clear_err(en->ctx);
+
+	/* same rules as nix-eval-jobs, the top level attrset is always walked,
+	 * the nested ones only if they ask for it */
+	if (!top) {
+		if (!nix_has_attr_byname(en->ctx, value, en->state,
+					 "recurseForDerivations"))
+			return 0;
+
+		recurse = nix_get_attr_byname(en->ctx, value, en->state,
+					      "recurseForDerivations");
+		if (recurse == NULL) {
+			eval_nix_err_print(en, attr);
+			return 0;
+		}
+		isrecurse = nix_get_bool(en->ctx, recurse);
+		nix_gc_decref(en->ctx, recurse);
+		nix_clear_err(en->ctx);
+		if (!isrecurse)
+			return 0;
+	}
+
+	n = nix_get_attrs_size(en->ctx, value);
+	for (unsigned int i = 0; i < n; i++) {
+		child = nix_get_attr_byidx(en->ctx, value, en->state, i, &name);
+		if (child == NULL) {
+			eval_nix_err_print(en, attr);
+			continue;
+		}
+
+		if (attr[0] == '\0')
+			ret = asprintf(&child_attr, "%s", name);
+		else
+			ret = asprintf(&child_attr, "%s.%s", attr, name);
+		if (ret < 0) {
+			print_err("%s", "Failed to allocate attr");
+			nix_gc_decref(en->ctx, child);
+			return -ENOMEM;
+		}
+
+		ret = eval_nix_walk(en, child, child_attr, false);
+		free(child_attr);
+		nix_gc_decref(en->ctx, child);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+int eval_nix_run(struct cache_check *cc, char *expr)
+{
+	char cwd[PATH_MAX];
+	struct eval_nix en;
+
+	nix_value *value = NULL;
+	char *nix_expr = NULL;
+	int ret = 0;
+
+	en.cc = cc;
+	en.store = NULL;
+	en.state = NULL;
+
+	en.ctx = nix_c_context_create();
+	if (en.ctx == NULL) {
+		print_err("%s", "Failed to create nix context");
+		return -EPERM;
+	}
+
+	if (nix_libexpr_init(en.ctx) != NIX_OK) {
+		print_err("%s", nix_err_msg(NULL, en.ctx, NULL));
+		ret = -EPERM;
+		goto out_free;
+	}
+
+	/* getFlake is what nix-eval-jobs does behind --flake, and it has to
+	 * be able to take unlocked refs like path: */
+	if (evanix_opts.isflake &&
+	    (nix_setting_set(en.ctx, "extra-experimental-features",
+			     "flakes") != NIX_OK ||
+	     nix_setting_set(en.ctx, "pure-eval", "false") != NIX_OK)) {
+		print_err("%s", nix_err_msg(NULL, en.ctx, NULL));
+		ret = -EPERM;
+		goto out_free;
+	}
+
+	ret = eval_nix_expr_build(expr, &nix_expr);
+	if (ret < 0)
+		goto out_free;
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free;
+	}
+
+	en.store = nix_store_open(en.ctx, NULL, NULL);
+	if (en.store == NULL) {
+		print_err("%s", nix_err_msg(NULL, en.ctx, NULL));
+		ret = -EPERM;
+		goto out_free;
+	}
+
+	en.state = nix_state_create(en.ctx, NULL, en.store);
+	if (en.state == NULL) {
+		print_err("%s", nix_err_msg(NULL, en.ctx, NULL));
+		ret = -EPERM;
+		goto out_free;
+	}
+
+	value = nix_alloc_value(en.ctx, en.state);
+	if (value == NULL) {
+		print_err("%s", nix_err_msg(NULL, en.ctx, NULL));
+		ret = -EPERM;
+		goto out_free;
+	}
+
+	if (nix_expr_eval_from_string(en.ctx, en.state, nix_expr, cwd,
+				      value) != NIX_OK) {
+		print_err("%s", nix_err_msg(NULL, en.ctx, NULL));
+		ret = -EPERM;
+		goto out_free;
+	}
+
+	ret = eval_nix_walk(&en, value, "", true);
+
+out_free:
+	if (value != NULL)
+		nix_gc_decref(en.ctx, value);
+	if (en.state != NULL)
+		nix_state_free(en.state);
+	if (en.store != NULL)
+		nix_store_free(en.store);
+	free(nix_expr);
+	nix_c_context_free(en.ctx);
+
+	return ret;
+}
@@ -1,20 +1,34 @@
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <nix/nix_api_value.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 
 #include "build.h"
+#include "cache_check.h"
+#include "eval_mux.h"
+#include "eval_nix.h"
+#include "eval_cache.h"
 #include "evanix.h"
+#include "jobs.h"
+#include "model.h"
 #include "nix.h"
 #include "queue.h"
 #include "solver_conformity.h"
 #include "solver_highs.h"
 #include "solver_sjf.h"
+#include "statistics.h"
+#include "statistics_index.h"
+#include "store.h"
+#include "train.h"
 #include "util.h"
 
 static const char usage[] =
 	"Usage: evanix [options] expr\n"
+	"       evanix train [options]\n"
+	"       evanix stats compile [options]\n"
 	"\n"
 	"  -h, --help                         Show help message and quit.\n"
 	"  -f, --flake                        Build a flake.\n"
@@ -29,8 +43,44 @@ static const char usage[] =
 	"  -l, --check_cache-status   <bool>  Perform cache locality check.\n"
 	"  -c, --close-unused-fd      <bool>  Close stderr on exec.\n"
 	"  -e, --statistics           <path>  Path to time statistics "
-	"database.\n"
+	"database,\n"
+	"                                     or an index compiled from "
+	"one.\n"
+	"  -M, --model                <path>  Model to estimate the build "
+	"times\n"
+	"                                     statistics don't have.\n"
+	"  -q, --cost-quantile        <name>  Plan against the mean, p50, "
+	"p90\n"
+	"                                     or p99 build times.\n"
+	"  -R, --record                       Record how long builds take "
+	"in\n"
+	"                                     the statistics database, and\n"
+	"                                     calibrate it to this host.\n"
+	"  -F, --full-closure                 Read the whole build closure "
+	"from\n"
+	"                                     the .drv files, not just the "
+	"inputs.\n"
 	"  -k, --solver sjf|conformity|highs  Solver to use.\n"
+	"  -i, --ingest-threads       <n>     Threads parsing nix-eval-jobs "
+	"output.\n"
+	"  -S, --eval-shard           <attr>  Evaluate attr in its own "
+	"nix-eval-jobs,\n"
+	"                                     may be repeated.\n"
+	"  -E, --evaluator            <name>  nix-eval-jobs or libexpr, "
+	"the\n"
+	"                                     latter evaluates in "
+	"process.\n"
+	"  -B, --cache-backend        <name>  nix-build or libstore, to "
+	"check\n"
+	"                                     the cache status with.\n"
+	"  -j, --cache-check-jobs     <n>     Cache status checks to run "
+	"at once.\n"
+	"  -C, --eval-cache           <bool>  Reuse the last evaluation of "
+	"an\n"
+	"                                     unchanged expr.\n"
+	"  -X, --eval-cache-invalidate        Evaluate again and replace "
+	"the\n"
+	"                                     cached evaluation.\n"
 	"\n";
 
 struct evanix_opts_t evanix_opts = {
@@ -40,22 +90,48 @@ struct evanix_opts_t evanix_opts = {
 	.isdryrun = false,
 	.max_builds = 0,
 	.max_time = 0,
+	.ingest_threads = 1,
+	.cache_check_jobs = 1,
+	.eval_shards_size = 0,
+	.eval_shards_filled = 0,
+	.eval_shards = NULL,
+	.evaluator = EVALUATOR_NIX_EVAL_JOBS,
 	.system = NULL,
 	.solver_report = false,
 	.check_cache_status = true,
 	.solver = solver_highs,
+	.cache_backend = job_read_cache,
 	.break_evanix = false,
+	.eval_cache = false,
+	.eval_cache_invalidate = false,
+	.record_statistics = false,
+	.full_closure = false,
+	.cost_quantile = STATISTICS_MEAN,
 	.statistics.db = NULL,
 	.statistics.statement = NULL,
+	.statistics.record = NULL,
+	.statistics.remote = NULL,
+	.statistics.calibrate = NULL,
+	.statistics.islocal = false,
+	.statistics.local_version = 0,
+	.statistics.slots = NULL,
+	.statistics.names = NULL,
+	.statistics.index = NULL,
+	.model = NULL,
 };
 
 static int evanix_build_thread_create(struct build_thread *build_thread);
 static int evanix(char *expr);
+static void evanix_budget_report(struct queue *queue);
+static void evanix_memory_report(void);
+static int evanix_eval_nix(char *expr, struct queue_thread *queue_thread,
+			   struct build_thread *build_thread);
 static int evanix_free(struct evanix_opts_t *opts);
 static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 		     char *argv[]);
 static int evanix_opts_system_set(struct evanix_opts_t *opts,
 				  nix_c_context *nix_ctx);
+static int opts_eval_shard_insert(struct evanix_opts_t *opts, char *shard);
 
 /* This function returns errno on failure, consistent with the POSIX threads
  * functions, rather than returning -errno. */
@@ -95,12 +171,138 @@ static int evanix_opts_system_set(struct evanix_opts_t *opts,
 	return 0;
 }
 
+static int opts_eval_shard_insert(struct evanix_opts_t *opts, char *shard)
+{
+	size_t newsize;
+	void *ret;
+
+	if (opts->eval_shards_filled < opts->eval_shards_size) {
+		opts->eval_shards[opts->eval_shards_filled++] = shard;
+		return 0;
+	}
+
+	newsize = opts->eval_shards_size == 0 ? 1 : opts->eval_shards_size * 2;
+	ret = realloc(opts->eval_shards, newsize * sizeof(*opts->eval_shards));
+	if (ret == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	opts->eval_shards = ret;
+	opts->eval_shards_size = newsize;
+	opts->eval_shards[opts->eval_shards_filled++] = shard;
+
+	return 0;
+}
+
+/* libexpr evaluates on the main thread in place of the queue thread */
+static int evanix_eval_nix(char *expr, struct queue_thread *queue_thread,
+			   struct build_thread *build_thread)
+{
+	struct cache_check *cc;
+	int ret, eval_ret;
+
+	if (evanix_opts.ispipelined) {
+		ret = evanix_build_thread_create(build_thread);
+		if (ret != 0) {
+			print_err("%s", strerror(ret));
+			return -ret;
+		}
+	}
+
+	eval_ret = cache_check_new(&cc, queue_thread->queue,
+				   evanix_opts.cache_check_jobs);
+	if (eval_ret == 0) {
+		eval_ret = eval_nix_run(cc, expr);
+		ret = cache_check_finish(cc);
+		if (eval_ret == 0)
+			eval_ret = ret;
+	}
+	queue_done(queue_thread->queue);
+
+	if (!evanix_opts.ispipelined && eval_ret == 0) {
+		ret = evanix_build_thread_create(build_thread);
+		if (ret != 0) {
+			print_err("%s", strerror(ret));
+			return -ret;
+		}
+	} else if (!evanix_opts.ispipelined) {
+		return eval_ret;
+	}
+
+	ret = pthread_join(build_thread->tid, NULL);
+	if (ret != 0) {
+		print_err("%s", strerror(ret));
+		return -ret;
+	}
+
+	return eval_ret;
+}
+
+/* the builds taken as independent, their sum is about normal */
+static void evanix_budget_report(struct queue *queue)
+{
+	const struct statistics_calibration *calibration =
+		&evanix_opts.statistics.calibration;
+	double sigma, fit;
+
+	if (!statistics_isopen(&evanix_opts.statistics))
+		calibration = NULL;
+
+	if (calibration && calibration->samples < STATISTICS_CALIBRATION_MIN) {
+		printf("⚖️ calibration: %lu of %d builds recorded, statistics "
+		       "taken as they are\n",
+		       (unsigned long)calibration->samples,
+		       STATISTICS_CALIBRATION_MIN);
+	} else if (calibration) {
+		printf("⚖️ calibration: statistics ×%.3f ± %.3f, fitted over "
+		       "%lu builds on this host\n",
+		       calibration->factor, calibration->error,
+		       (unsigned long)calibration->samples);
+	}
+
+	sigma = sqrt(queue->planned_variance);
+	if (sigma > 0)
+		fit = 0.5 * erfc((queue->planned_mean - evanix_opts.max_time) /
+				 (sigma * sqrt(2)));
+	else
+		fit = queue->planned_mean <= evanix_opts.max_time;
+
+	printf("🎲 planned %.0fs, σ %.0fs, of %us, %.1f%% likely to fit, "
+	       "planned against the %s\n",
+	       queue->planned_mean, sigma, evanix_opts.max_time, fit * 100,
+	       statistics_quantile_name(evanix_opts.cost_quantile));
+}
+
+static void evanix_memory_report(void)
+{
+	struct jobs_memory m;
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0) {
+		print_err("%s", strerror(errno));
+		return;
+	}
+	jobs_memory(&m);
+
+	printf("🧠 peak RSS %.1f MiB, jobs: %zu allocated, %zu reused, "
+	       "outputs: %zu allocated, %zu reused, edges: %zu allocated, %zu "
+	       "reused, paths: %zu interned out of %zu, %.1f MiB in arenas\n",
+	       usage.ru_maxrss / 1024.0, m.jobs.allocs, m.jobs.reuses,
+	       m.outputs.allocs, m.outputs.reuses, m.edges.allocs,
+	       m.edges.reuses, m.paths.strings, m.paths.lookups,
+	       (m.jobs.bytes + m.outputs.bytes + m.edges.bytes +
+		m.names.bytes + m.paths.bytes) /
+		       (1024.0 * 1024.0));
+}
+
 static int evanix(char *expr)
 {
 	nix_c_context *nix_ctx = NULL;
 	struct queue_thread *queue_thread = NULL;
 	struct build_thread *build_thread = NULL;
-	FILE *jobs_stream = NULL; /* nix-eval-jobs stdout */
+	struct eval_mux *eval_mux = NULL; /* nix-eval-jobs stdout */
+	bool eval_cache_hit = false, eval_ok = false;
 	int ret = 0;
 
 	ret = _nix_init(&nix_ctx);
@@ -111,11 +313,37 @@ static int evanix(char *expr)
 	if (ret < 0)
 		goto out_free;
 
-	ret = jobs_init(&jobs_stream, expr);
-	if (ret < 0)
-		goto out_free;
+	if (evanix_opts.check_cache_status &&
+	    evanix_opts.cache_backend == store_closure_read) {
+		ret = store_init(nix_ctx);
+		if (ret < 0)
+			goto out_free;
+	}
+
+	if (evanix_opts.eval_cache) {
+		ret = eval_cache_open(expr, evanix_opts.eval_cache_invalidate,
+				      &eval_cache_hit);
+		if (ret < 0)
+			goto out_free;
 
-	ret = queue_thread_new(&queue_thread, jobs_stream);
+		if (evanix_opts.solver_report)
+			printf("🗃️ eval cache %s, %s\n",
+			       eval_cache_hit ? "hit" : "miss",
+			       eval_cache_path());
+	}
+
+	if (eval_cache_hit) {
+		ret = eval_mux_file_init(&eval_mux, eval_cache_path());
+		if (ret < 0)
+			goto out_free;
+	} else if (evanix_opts.evaluator == EVALUATOR_NIX_EVAL_JOBS) {
+		ret = eval_mux_init(&eval_mux, expr, evanix_opts.eval_shards,
+				    evanix_opts.eval_shards_filled);
+		if (ret < 0)
+			goto out_free;
+	}
+
+	ret = queue_thread_new(&queue_thread, eval_mux);
 	if (ret < 0)
 		goto out_free;
 
@@ -123,6 +351,12 @@ static int evanix(char *expr)
 	if (ret < 0)
 		goto out_free;
 
+	if (eval_mux == NULL) {
+		ret = evanix_eval_nix(expr, queue_thread, build_thread);
+		eval_ok = ret == 0;
+		goto out_free;
+	}
+
 	ret = pthread_create(&queue_thread->tid, NULL, queue_thread_entry,
 			     queue_thread);
 	if (ret != 0) {
@@ -152,6 +386,8 @@ static int evanix(char *expr)
 		print_err("%s", strerror(ret));
 		goto out_free;
 	}
+	/* the queue thread is done with it either way */
+	eval_ok = eval_mux_wait(eval_mux) == 0;
 
 	ret = pthread_join(build_thread->tid, NULL);
 	if (ret != 0) {
@@ -160,10 +396,26 @@ static int evanix(char *expr)
 	}
 
 out_free:
+	if (queue_thread != NULL && evanix_opts.solver_report &&
+	    evanix_opts.check_cache_status) {
+		printf("🔎 cache status checks: %zu, saved: %zu\n",
+		       queue_thread->queue->memo.checks,
+		       queue_thread->queue->memo.saved);
+	}
+	if (queue_thread != NULL && evanix_opts.solver_report &&
+	    evanix_opts.max_time)
+		evanix_budget_report(queue_thread->queue);
+	if (evanix_opts.solver_report)
+		evanix_memory_report();
+	if (evanix_opts.eval_cache)
+		eval_cache_close(eval_ok);
+	store_free();
 	nix_c_context_free(nix_ctx);
-	fclose(jobs_stream);
+	eval_mux_free(eval_mux);
 	queue_thread_free(queue_thread);
 	free(build_thread);
+	/* the threads are gone, and whatever jobs they left behind with them */
+	jobs_release();
 
 	return ret;
 }
@@ -175,11 +427,7 @@ static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 	extern char *optarg;
 	int longindex, c;
 
-	const char *query = "SELECT statistics.mean_duration "
-			    "FROM statistics "
-			    "WHERE statistics.pname = ? "
-			    "LIMIT 1 ";
-
+	char *statistics_path = NULL;
 	int ret = 0;
 
 	static struct option longopts[] = {
@@ -192,15 +440,27 @@ static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 		{"solver-report", no_argument, NULL, 'r'},
 		{"max-time", required_argument, NULL, 't'},
 		{"statistics", required_argument, NULL, 'a'},
+		{"model", required_argument, NULL, 'M'},
+		{"record", no_argument, NULL, 'R'},
+		{"full-closure", no_argument, NULL, 'F'},
+		{"cost-quantile", required_argument, NULL, 'q'},
 		{"pipelined", required_argument, NULL, 'p'},
 		{"max-builds", required_argument, NULL, 'm'},
 		{"close-unused-fd", required_argument, NULL, 'c'},
 		{"check-cache-status", required_argument, NULL, 'l'},
+		{"ingest-threads", required_argument, NULL, 'i'},
+		{"eval-shard", required_argument, NULL, 'S'},
+		{"evaluator", required_argument, NULL, 'E'},
+		{"cache-backend", required_argument, NULL, 'B'},
+		{"cache-check-jobs", required_argument, NULL, 'j'},
+		{"eval-cache", required_argument, NULL, 'C'},
+		{"eval-cache-invalidate", no_argument, NULL, 'X'},
 		{NULL, 0, NULL, 0},
 	};
 
-	while ((c = getopt_long(argc, argv, "hfds:r::m:p:c:l:k:a:t:", longopts,
-				&longindex)) != -1) {
+	while ((c = getopt_long(argc, argv,
+				"hfds:r::m:p:c:l:k:a:M:RFq:t:i:S:E:B:j:C:X",
+				longopts, &longindex)) != -1) {
 		switch (c) {
 		case 'h':
 			printf("%s", usage);
@@ -228,7 +488,7 @@ static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 			opts->solver_report = true;
 			break;
 		case 'a':
-			if (opts->statistics.db) {
+			if (statistics_path) {
 				fprintf(stderr,
 					"option -%c can't be redefined "
 					"Try 'evanix --help' for more "
@@ -238,25 +498,45 @@ static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 				goto out_free_evanix;
 			}
 
-			ret = sqlite3_open_v2(optarg, &opts->statistics.db,
-					      SQLITE_OPEN_READONLY |
-						      SQLITE_OPEN_FULLMUTEX,
-					      NULL);
-			if (ret != SQLITE_OK) {
-				print_err("Can't open database: %s",
-					  sqlite3_errmsg(opts->statistics.db));
-				ret = -EPERM;
+			/* opened once --record is known */
+			statistics_path = optarg;
+			break;
+		case 'R':
+			opts->record_statistics = true;
+			break;
+		case 'F':
+			opts->full_closure = true;
+			break;
+		case 'q':
+			ret = statistics_quantile_parse(optarg);
+			if (ret < 0) {
+				fprintf(stderr,
+					"option -%c requires mean, p50, p90 or "
+					"p99\n"
+					"Try 'evanix --help' for more "
+					"information.\n",
+					c);
 				goto out_free_evanix;
 			}
-			ret = sqlite3_prepare_v2(opts->statistics.db, query, -1,
-						 &opts->statistics.statement,
-						 NULL);
-			if (ret != SQLITE_OK) {
-				print_err("%s", "Failed to prepare sql");
-				ret = -EPERM;
+
+			opts->cost_quantile = ret;
+			ret = 0;
+			break;
+		case 'M':
+			if (opts->model) {
+				fprintf(stderr,
+					"option -%c can't be redefined "
+					"Try 'evanix --help' for more "
+					"information.\n",
+					c);
+				ret = -EINVAL;
 				goto out_free_evanix;
 			}
 
+			ret = model_read(&opts->model, optarg);
+			if (ret < 0)
+				goto out_free_evanix;
+
 			break;
 		case 'k':
 			if (!strcmp(optarg, "conformity")) {
@@ -306,6 +586,91 @@ static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 
 			opts->max_time = ret;
 			break;
+		case 'i':
+			ret = atoi(optarg);
+			if (ret <= 0) {
+				fprintf(stderr,
+					"option -%c requires a natural number "
+					"argument\n"
+					"Try 'evanix --help' for more "
+					"information.\n",
+					c);
+				ret = -EINVAL;
+				goto out_free_evanix;
+			}
+
+			opts->ingest_threads = ret;
+			break;
+		case 'j':
+			ret = atoi(optarg);
+			if (ret <= 0) {
+				fprintf(stderr,
+					"option -%c requires a natural number "
+					"argument\n"
+					"Try 'evanix --help' for more "
+					"information.\n",
+					c);
+				ret = -EINVAL;
+				goto out_free_evanix;
+			}
+
+			opts->cache_check_jobs = ret;
+			break;
+		case 'S':
+			ret = opts_eval_shard_insert(opts, optarg);
+			if (ret < 0)
+				goto out_free_evanix;
+
+			break;
+		case 'E':
+			if (!strcmp(optarg, "nix-eval-jobs")) {
+				opts->evaluator = EVALUATOR_NIX_EVAL_JOBS;
+			} else if (!strcmp(optarg, "libexpr")) {
+				opts->evaluator = EVALUATOR_LIBEXPR;
+			} else {
+				fprintf(stderr,
+					"option -%c has an invalid evaluator "
+					"argument\n"
+					"Try 'evanix --help' for more "
+					"information.\n",
+					c);
+				ret = -EINVAL;
+				goto out_free_evanix;
+			}
+			break;
+		case 'B':
+			if (!strcmp(optarg, "nix-build")) {
+				opts->cache_backend = job_read_cache;
+			} else if (!strcmp(optarg, "libstore")) {
+				opts->cache_backend = store_closure_read;
+			} else {
+				fprintf(stderr,
+					"option -%c has an invalid cache "
+					"backend argument\n"
+					"Try 'evanix --help' for more "
+					"information.\n",
+					c);
+				ret = -EINVAL;
+				goto out_free_evanix;
+			}
+			break;
+		case 'C':
+			ret = atob(optarg);
+			if (ret < 0) {
+				fprintf(stderr,
+					"option -%c requires a bool argument\n"
+					"Try 'evanix --help' for more "
+					"information.\n",
+					c);
+				ret = -EINVAL;
+				goto out_free_evanix;
+			}
+
+			opts->eval_cache = ret;
+			break;
+		case 'X':
+			opts->eval_cache_invalidate = true;
+			break;
 		case 'p':
 			ret = atob(optarg);
 			if (ret < 0) {
@@ -367,12 +732,43 @@ static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 				"Try 'evanix --help' for more information.\n");
 		ret = -EINVAL;
 		goto out_free_evanix;
-	} else if (opts->max_time && !opts->statistics.db) {
+	} else if (opts->eval_shards_filled && !opts->isflake) {
+		fprintf(stderr, "evanix: option --eval-shard implies --flake\n"
+				"Try 'evanix --help' for more information.\n");
+		ret = -EINVAL;
+		goto out_free_evanix;
+	} else if (opts->eval_shards_filled &&
+		   opts->evaluator == EVALUATOR_LIBEXPR) {
+		fprintf(stderr, "evanix: option --eval-shard implies "
+				"--evaluator=nix-eval-jobs\n"
+				"Try 'evanix --help' for more information.\n");
+		ret = -EINVAL;
+		goto out_free_evanix;
+	} else if (opts->eval_cache_invalidate && !opts->eval_cache) {
+		fprintf(stderr, "evanix: option --eval-cache-invalidate "
+				"implies --eval-cache\n"
+				"Try 'evanix --help' for more information.\n");
+		ret = -EINVAL;
+		goto out_free_evanix;
+	} else if (opts->max_time && !statistics_path && !opts->model) {
 		fprintf(stderr,
-			"evanix: option --max-time implies --statistics\n"
+			"evanix: option --max-time implies --statistics or "
+			"--model\n"
 			"Try 'evanix --help' for more information.\n");
 		ret = -EINVAL;
 		goto out_free_evanix;
+	} else if (opts->record_statistics && !statistics_path) {
+		fprintf(stderr, "evanix: option --record implies --statistics\n"
+				"Try 'evanix --help' for more information.\n");
+		ret = -EINVAL;
+		goto out_free_evanix;
+	}
+
+	if (statistics_path) {
+		ret = statistics_open(&opts->statistics, statistics_path,
+				      opts->record_statistics);
+		if (ret < 0)
+			goto out_free_evanix;
 	}
 
 	if (opts->solver == solver_highs &&
@@ -380,6 +776,13 @@ static int opts_read(struct evanix_opts_t *opts, char **expr, int argc,
 		opts->ispipelined = false;
 	}
 
+	/* the costs are only looked up under a time budget */
+	if (opts->max_time && statistics_isopen(&opts->statistics)) {
+		ret = statistics_load(&opts->statistics, STATISTICS_LOAD_MAX);
+		if (ret < 0)
+			goto out_free_evanix;
+	}
+
 out_free_evanix:
 	if (ret < 0)
 		evanix_free(opts);
@@ -391,26 +794,12 @@ out_free_evanix:
 
 static int evanix_free(struct evanix_opts_t *opts)
 {
-	int ret;
-
 	free(opts->system);
+	free(opts->eval_shards);
+	model_free(opts->model);
+	opts->model = NULL;
 
-	if (opts->statistics.statement) {
-		sqlite3_finalize(opts->statistics.statement);
-		opts->statistics.statement = NULL;
-	}
-	if (opts->statistics.db) {
-		ret = sqlite3_close(opts->statistics.db);
-		if (ret != SQLITE_OK) {
-			print_err("Can't open database: %s",
-				  sqlite3_errmsg(opts->statistics.db));
-			return -EPERM;
-		}
-
-		opts->statistics.db = NULL;
-	}
-
-	return 0;
+	return statistics_close(&opts->statistics);
 }
 
 int main(int argc, char *argv[])
@@ -418,6 +807,14 @@ int main(int argc, char *argv[])
 	char *expr;
 	int ret;
 
+	if (argc > 1 && !strcmp(argv[1], "train")) {
+		ret = train_main(argc - 1, argv + 1);
+		exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	} else if (argc > 1 && !strcmp(argv[1], "stats")) {
+		ret = statistics_index_main(argc - 1, argv + 1);
+		exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
 	ret = opts_read(&evanix_opts, &expr, argc, argv);
 	if (ret < 0)
 		exit(EXIT_FAILURE);
@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache_check.h"
+#include "ingest.h"
+#include "jobs.h"
+#include "util.h"
+
+#define INGEST_BATCH_LINES 256
+/* batches per worker, one being parsed and one being filled by the reader */
+#define INGEST_BATCHES_PER_THREAD 2
+
+struct ingest_batch {
+	size_t seq;
+
+	/* getline(3) buffers, reused every time the batch is refilled */
+	size_t lines_filled;
+	char *lines[INGEST_BATCH_LINES];
+	size_t line_sizes[INGEST_BATCH_LINES];
+	const char *attr_prefixes[INGEST_BATCH_LINES];
+
+	size_t jobs_filled;
+	struct job *jobs[INGEST_BATCH_LINES];
+
+	struct ingest_batch *next;
+};
+
+struct ingest {
+	struct cache_check *cc;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* filled by the reader, waiting for a worker, in seq order */
+	struct ingest_batch *pending_head, *pending_tail;
+	/* merged, waiting to be refilled by the reader */
+	struct ingest_batch *free;
+
+	/* seq of the batch whose turn it is to be merged */
+	size_t seq_merge;
+	bool eof;
+	int ret;
+};
+
+static int ingest_batch_parse(struct ingest_batch *batch);
+static void *ingest_worker_entry(void *ingest);
+static void ingest_read(struct ingest *ingest, struct eval_mux *mux);
+
+static int ingest_batch_parse(struct ingest_batch *batch)
+{
+	struct job *job;
+	int ret;
+
+	batch->jobs_filled = 0;
+	for (size_t i = 0; i < batch->lines_filled; i++) {
+		ret = job_parse(batch->lines[i], batch->attr_prefixes[i], &job);
+		if (ret < 0)
+			return ret;
+		else if (ret == JOB_READ_SUCCESS)
+			batch->jobs[batch->jobs_filled++] = job;
+	}
+
+	return 0;
+}
+
+static void *ingest_worker_entry(void *ingest)
+{
+	struct ingest *in = ingest;
+	struct ingest_batch *batch;
+	int ret, merge_ret;
+
+	while (true) {
+		pthread_mutex_lock(&in->mutex);
+		while (in->pending_head == NULL && !in->eof)
+			pthread_cond_wait(&in->cond, &in->mutex);
+
+		batch = in->pending_head;
+		if (batch == NULL) {
+			pthread_mutex_unlock(&in->mutex);
+			break;
+		}
+		in->pending_head = batch->next;
+		if (in->pending_head == NULL)
+			in->pending_tail = NULL;
+		pthread_mutex_unlock(&in->mutex);
+
+		ret = ingest_batch_parse(batch);
+
+		/* merge in read order, so the DAG and the order of requested
+		 * jobs come out the same as with a single thread */
+		pthread_mutex_lock(&in->mutex);
+		while (batch->seq != in->seq_merge)
+			pthread_cond_wait(&in->cond, &in->mutex);
+		pthread_mutex_unlock(&in->mutex);
+
+		merge_ret = 0;
+		for (size_t i = 0; i < batch->jobs_filled; i++) {
+			if (merge_ret < 0)
+				job_free(batch->jobs[i]);
+			else
+				merge_ret = cache_check_submit(in->cc,
+							       batch->jobs[i]);
+		}
+
+		pthread_mutex_lock(&in->mutex);
+		if (in->ret == 0)
+			in->ret = (ret < 0) ? ret : merge_ret;
+		in->seq_merge++;
+		batch->next = in->free;
+		in->free = batch;
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->mutex);
+	}
+
+	return NULL;
+}
+
+static void ingest_read(struct ingest *ingest, struct eval_mux *mux)
+{
+	struct ingest_batch *batch;
+	bool eof = false;
+	size_t i;
+	int ret;
+
+	for (size_t seq = 0; !eof; seq++) {
+		pthread_mutex_lock(&ingest->mutex);
+		while (ingest->free == NULL)
+			pthread_cond_wait(&ingest->cond, &ingest->mutex);
+		batch = ingest->free;
+		ingest->free = batch->next;
+		ret = ingest->ret;
+		pthread_mutex_unlock(&ingest->mutex);
+		if (ret < 0)
+			break;
+
+		for (batch->lines_filled = 0;
+		     batch->lines_filled < INGEST_BATCH_LINES;
+		     batch->lines_filled++) {
+			i = batch->lines_filled;
+			if (eval_mux_getline(mux, &batch->lines[i],
+					     &batch->line_sizes[i],
+					     &batch->attr_prefixes[i]) < 0) {
+				eof = true;
+				break;
+			}
+		}
+
+		batch->seq = seq;
+		batch->next = NULL;
+
+		pthread_mutex_lock(&ingest->mutex);
+		if (batch->lines_filled == 0) {
+			batch->next = ingest->free;
+			ingest->free = batch;
+		} else if (ingest->pending_tail == NULL) {
+			ingest->pending_head = batch;
+			ingest->pending_tail = batch;
+		} else {
+			ingest->pending_tail->next = batch;
+			ingest->pending_tail = batch;
+		}
+		pthread_cond_broadcast(&ingest->cond);
+		pthread_mutex_unlock(&ingest->mutex);
+	}
+
+	pthread_mutex_lock(&ingest->mutex);
+	ingest->eof = true;
+	pthread_cond_broadcast(&ingest->cond);
+	pthread_mutex_unlock(&ingest->mutex);
+}
+
+int ingest_run(struct cache_check *cc, struct eval_mux *mux,
+	       uint32_t nthreads)
+{
+	struct ingest_batch *batches;
+	struct ingest ingest;
+	pthread_t *workers;
+	size_t nbatches;
+	uint32_t nworkers;
+	int ret = 0;
+
+	nbatches = (size_t)nthreads * INGEST_BATCHES_PER_THREAD;
+	batches = calloc(nbatches, sizeof(*batches));
+	if (batches == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	workers = malloc(nthreads * sizeof(*workers));
+	if (workers == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free_batches;
+	}
+
+	ingest.cc = cc;
+	ingest.pending_head = NULL;
+	ingest.pending_tail = NULL;
+	ingest.free = NULL;
+	ingest.seq_merge = 0;
+	ingest.eof = false;
+	ingest.ret = 0;
+	for (size_t i = 0; i < nbatches; i++) {
+		batches[i].next = ingest.free;
+		ingest.free = &batches[i];
+	}
+	pthread_mutex_init(&ingest.mutex, NULL);
+	pthread_cond_init(&ingest.cond, NULL);
+
+	for (nworkers = 0; nworkers < nthreads; nworkers++) {
+		ret = pthread_create(&workers[nworkers], NULL,
+				     ingest_worker_entry, &ingest);
+		if (ret != 0) {
+			print_err("%s", strerror(ret));
+			ret = -ret;
+			break;
+		}
+
+		pthread_setname_np(workers[nworkers], "evanix_ingest");
+	}
+
+	if (nworkers == nthreads) {
+		ingest_read(&ingest, mux);
+	} else {
+		pthread_mutex_lock(&ingest.mutex);
+		ingest.eof = true;
+		pthread_cond_broadcast(&ingest.cond);
+		pthread_mutex_unlock(&ingest.mutex);
+	}
+
+	for (uint32_t i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	if (ret == 0)
+		ret = ingest.ret;
+
+	pthread_cond_destroy(&ingest.cond);
+	pthread_mutex_destroy(&ingest.mutex);
+	free(workers);
+out_free_batches:
+	for (size_t i = 0; i < nbatches; i++) {
+		for (size_t j = 0; j < INGEST_BATCH_LINES; j++)
+			free(batches[i].lines[j]);
+	}
+	free(batches);
+
+	return ret;
+}
@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "util.h"
+
+#define INTERN_SLOTS_MIN 1024
+
+static int intern_grow(struct intern_stripe *stripe);
+
+/* stripe->mutex must be held */
+static int intern_grow(struct intern_stripe *stripe)
+{
+	struct intern_slot *slots;
+	size_t newsize, mask, j;
+
+	newsize = stripe->slots_size == 0 ? INTERN_SLOTS_MIN
+					   : stripe->slots_size * 2;
+	slots = calloc(newsize, sizeof(*slots));
+	if (slots == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	mask = newsize - 1;
+	for (size_t i = 0; i < stripe->slots_size; i++) {
+		if (stripe->slots[i].s == NULL)
+			continue;
+
+		for (j = stripe->slots[i].hash & mask; slots[j].s != NULL;
+		     j = (j + 1) & mask)
+			;
+		slots[j] = stripe->slots[i];
+	}
+
+	free(stripe->slots);
+	stripe->slots = slots;
+	stripe->slots_size = newsize;
+
+	return 0;
+}
+
+const char *intern(struct intern *in, const char *s)
+{
+	struct intern_stripe *stripe;
+	const char *ret = NULL;
+	uint64_t hash;
+	size_t len, mask, i;
+	char *copy;
+
+	len = strlen(s);
+	hash = fnv1a_64(FNV1A_64_INIT, s, len);
+	/* the low bits pick the slot, the high ones the stripe */
+	stripe = &in->stripes[(hash >> 56) % INTERN_STRIPES];
+
+	pthread_mutex_lock(&stripe->mutex);
+	stripe->lookups++;
+
+	/* keeps it at most 3/4 full */
+	if (4 * (stripe->slots_filled + 1) > 3 * stripe->slots_size) {
+		if (intern_grow(stripe) < 0)
+			goto out_unlock;
+	}
+
+	mask = stripe->slots_size - 1;
+	for (i = hash & mask; stripe->slots[i].s != NULL; i = (i + 1) & mask) {
+		if (stripe->slots[i].hash == hash &&
+		    !strcmp(stripe->slots[i].s, s)) {
+			stripe->hits++;
+			ret = stripe->slots[i].s;
+			goto out_unlock;
+		}
+	}
+
+	copy = arena_alloc(&in->strings, len + 1);
+	if (copy == NULL)
+		goto out_unlock;
+	memcpy(copy, s, len + 1);
+
+	stripe->slots[i].hash = hash;
+	stripe->slots[i].s = copy;
+	stripe->slots_filled++;
+	ret = copy;
+
+out_unlock:
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return ret;
+}
+
+void intern_release(struct intern *in)
+{
+	struct intern_stripe *stripe;
+
+	for (size_t i = 0; i < INTERN_STRIPES; i++) {
+		stripe = &in->stripes[i];
+
+		pthread_mutex_lock(&stripe->mutex);
+		free(stripe->slots);
+		stripe->slots = NULL;
+		stripe->slots_size = 0;
+		stripe->slots_filled = 0;
+		pthread_mutex_unlock(&stripe->mutex);
+	}
+
+	arena_release(&in->strings);
+}
+
+void intern_stats(struct intern *in, struct intern_stats *stats)
+{
+	struct intern_stripe *stripe;
+	struct arena_stats as;
+
+	memset(stats, 0, sizeof(*stats));
+	for (size_t i = 0; i < INTERN_STRIPES; i++) {
+		stripe = &in->stripes[i];
+
+		pthread_mutex_lock(&stripe->mutex);
+		stats->strings += stripe->slots_filled;
+		stats->lookups += stripe->lookups;
+		stats->hits += stripe->hits;
+		pthread_mutex_unlock(&stripe->mutex);
+	}
+
+	arena_stats(&in->strings, &as);
+	stats->bytes = as.bytes;
+}
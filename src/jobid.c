@@ -7,19 +7,23 @@
 #include "jobs.h"
 #include "util.h"
 
-static int dag_id_assign(struct job *j, struct jobid *jobid);
-
-static int dag_id_assign(struct job *j, struct jobid *jobid)
+/* a job along with how many of its deps dag_id_assign() went through */
+struct dag_frame {
+	struct job *job;
+	size_t dep;
+};
+
+static int dag_id_insert(struct job *j, struct jobid *jobid);
+static int dag_frame_push(struct dag_frame **stack, size_t *size,
+			  size_t *filled, struct job *job);
+static int dag_id_assign(struct job *j, struct jobid *jobid,
+			 struct dag_frame **stack, size_t *stack_size);
+
+static int dag_id_insert(struct job *j, struct jobid *jobid)
 {
 	size_t newsize;
 	void *ret;
 
-	if (j->id >= 0)
-		return 0;
-
-	for (size_t i = 0; i < j->deps_filled; i++)
-		dag_id_assign(j->deps[i], jobid);
-
 	if (jobid->filled < jobid->size) {
 		j->id = jobid->filled++;
 		jobid->jobs[j->id] = j;
@@ -41,6 +45,61 @@ static int dag_id_assign(struct job *j, struct jobid *jobid)
 	return 0;
 }
 
+static int dag_frame_push(struct dag_frame **stack, size_t *size,
+			  size_t *filled, struct job *job)
+{
+	size_t newsize;
+	void *ret;
+
+	if (*filled == *size) {
+		newsize = *size == 0 ? 64 : *size * 2;
+		ret = realloc(*stack, newsize * sizeof(**stack));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		*stack = ret;
+		*size = newsize;
+	}
+
+	(*stack)[*filled].job = job;
+	(*stack)[*filled].dep = 0;
+	(*filled)++;
+	return 0;
+}
+
+/* numbers the deps of j before j itself, depth first, stack is kept across
+ * calls */
+static int dag_id_assign(struct job *j, struct jobid *jobid,
+			 struct dag_frame **stack, size_t *stack_size)
+{
+	size_t stack_filled = 0;
+	struct dag_frame *f;
+	struct job *dep;
+	int ret;
+
+	if (j->id >= 0)
+		return 0;
+
+	ret = dag_frame_push(stack, stack_size, &stack_filled, j);
+	while (ret >= 0 && stack_filled > 0) {
+		f = &(*stack)[stack_filled - 1];
+		if (f->dep == f->job->deps_filled) {
+			ret = dag_id_insert(f->job, jobid);
+			stack_filled--;
+			continue;
+		}
+
+		dep = f->job->deps[f->dep++];
+		if (dep->id >= 0)
+			continue;
+		ret = dag_frame_push(stack, stack_size, &stack_filled, dep);
+	}
+
+	return ret;
+}
+
 void jobid_free(struct jobid *jid)
 {
 	if (jid == NULL)
@@ -52,6 +111,8 @@ void jobid_free(struct jobid *jid)
 
 int jobid_init(struct job_clist *q, struct jobid **jobid)
 {
+	struct dag_frame *stack = NULL;
+	size_t stack_size = 0;
 	struct jobid *jid;
 	struct job *j;
 	int ret = 0;
@@ -66,12 +127,13 @@ int jobid_init(struct job_clist *q, struct jobid **jobid)
 	jid->filled = 0;
 
 	CIRCLEQ_FOREACH (j, q, clist) {
-		ret = dag_id_assign(j, jid);
+		ret = dag_id_assign(j, jid, &stack, &stack_size);
 		if (ret < 0)
 			goto out_free_jid;
 	}
 
 out_free_jid:
+	free(stack);
 	if (ret < 0) {
 		free(jid->jobs);
 		free(jid);
@@ -1,18 +1,27 @@
 #include <errno.h>
-#include <regex.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <cjson/cJSON.h>
-#include <sqlite3.h>
-
+#include "arena.h"
+#include "drv.h"
+#include "eval_cache.h"
+#include "eval_json.h"
 #include "evanix.h"
+#include "intern.h"
 #include "jobs.h"
+#include "jobtab.h"
+#include "model.h"
+#include "statistics.h"
 #include "util.h"
 
 #define NIX_STORE_PATH "/nix/store/"
+/* deps, parents and outputs arrays of up to 1 << (JOB_EDGES_CLASSES - 1)
+ * pointers, a job with more than that many fails with -E2BIG */
+#define JOB_EDGES_CLASSES 24
+#define JOB_EDGES_ARENA(k) [k] = ARENA_INIT(sizeof(void *) << (k))
 
 #ifndef NIX_EVAL_JOBS_PATH
 #warning "NIX_EVAL_JOBS_PATH not defined, evanix will rely on PATH instead"
@@ -22,91 +31,102 @@
 #define STR(x)	#x
 #pragma message "NIX_EVAL_JOBS_PATH=" XSTR(NIX_EVAL_JOBS_PATH)
 
+/* a graph is built once per run and torn down at the end of it, along with
+ * every path in it */
+static struct arena job_arena = ARENA_INIT(sizeof(struct job));
+static struct arena output_arena = ARENA_INIT(sizeof(struct output));
+static struct intern job_paths = INTERN_INIT;
+/* the edge arrays by size, a power of 2 of pointers each */
+static struct arena job_edges[JOB_EDGES_CLASSES] = {
+	JOB_EDGES_ARENA(0),  JOB_EDGES_ARENA(1),  JOB_EDGES_ARENA(2),
+	JOB_EDGES_ARENA(3),  JOB_EDGES_ARENA(4),  JOB_EDGES_ARENA(5),
+	JOB_EDGES_ARENA(6),  JOB_EDGES_ARENA(7),  JOB_EDGES_ARENA(8),
+	JOB_EDGES_ARENA(9),  JOB_EDGES_ARENA(10), JOB_EDGES_ARENA(11),
+	JOB_EDGES_ARENA(12), JOB_EDGES_ARENA(13), JOB_EDGES_ARENA(14),
+	JOB_EDGES_ARENA(15), JOB_EDGES_ARENA(16), JOB_EDGES_ARENA(17),
+	JOB_EDGES_ARENA(18), JOB_EDGES_ARENA(19), JOB_EDGES_ARENA(20),
+	JOB_EDGES_ARENA(21), JOB_EDGES_ARENA(22), JOB_EDGES_ARENA(23),
+};
+/* name and nix_attr_name, unique to a job but not given back before the
+ * end of the run either */
+static struct arena job_names = ARENA_INIT(0);
+
 static void output_free(struct output *output);
-static int job_new(struct job **j, char *name, char *drv_path, char *attr,
-		   struct job *parent);
-static int job_output_insert(struct job *j, char *name, char *store_path);
-static int job_read_inputdrvs(struct job *job, cJSON *input_drvs);
-static int job_read_outputs(struct job *job, cJSON *outputs);
-static int job_deps_list_insert(struct job *job, struct job *dep);
+static void *job_edges_grow(void *list, size_t size);
+static void job_edges_free(void *list, size_t size);
+static char *job_strdup(const char *s);
+static int job_read_inputdrvs(struct job *job, char *input_drvs);
+static int job_read_outputs(struct job *job, char *outputs);
 static int job_output_list_insert(struct job *job, struct output *output);
-static char *drv_path_to_pname(char *drv_path);
-static int drv_to_pname(char *drv_path, char **pname);
+static char *drv_path_to_pname(const char *drv_path);
+static char *drv_path_pname(const char *drv_path);
+static const char *job_pname(struct job *job);
+static int job_pname_set(struct job *job, struct drv *drv);
+static int job_closure_apply(struct job *job, struct cache_status *root,
+			     struct cache_memo *memo);
+static void job_cost_recursive_adjust(struct job *job, struct job *dep,
+				      int sign);
+static int job_cost_estimate(struct job *job);
+static int job_list_push(struct job ***list, size_t *size, size_t *filled,
+			 struct job *job);
+static bool job_isdrv(struct job *job);
+static bool job_isknown(struct job *job, struct jobtab *known,
+			pthread_mutex_t *mutex);
+static int job_ptr_cmp(const void *a, const void *b);
+static void job_edges_keep(struct job *job, uint32_t mark, bool isinside);
+static void job_closure_unlink_list(struct job *closure, uint32_t mark);
 
 static void output_free(struct output *output)
 {
-	if (output == NULL)
-		return;
-
-	free(output->name);
-	free(output->store_path);
-
-	free(output);
+	arena_free(&output_arena, output);
 }
 
-static int drv_to_pname(char *drv_path, char **pname)
+/* list of size pointers moved into one of twice the size, returns NULL and
+ * sets errno on failure, list is left be then */
+static void *job_edges_grow(void *list, size_t size)
 {
-	regmatch_t pmatch[2];
-	FILE *drv_file;
-	size_t drv_len;
-	regex_t regex;
-	char *ret_pname;
-	int ret;
-
-	char *drv_string = NULL;
-	char *pattern = "\\(\"pname\",\"([^\"]*)";
+	size_t newsize;
+	void *newlist;
+	int k;
 
-	drv_file = fopen(drv_path, "r");
-	if (drv_file == NULL) {
+	newsize = size == 0 ? 1 : size * 2;
+	k = __builtin_ctzl(newsize);
+	if (k >= JOB_EDGES_CLASSES) {
+		errno = E2BIG;
 		print_err("%s", strerror(errno));
-		return -errno;
+		return NULL;
 	}
 
-	ret = getline(&drv_string, &drv_len, drv_file);
-	if (ret < 0) {
-		print_err("%s", strerror(errno));
-		ret = -errno;
-		goto out_close_drv_file;
-	}
+	newlist = arena_alloc(&job_edges[k], 0);
+	if (newlist == NULL)
+		return NULL;
+	if (size > 0)
+		memcpy(newlist, list, size * sizeof(void *));
+	job_edges_free(list, size);
 
-	ret = regcomp(&regex, pattern, REG_EXTENDED);
-	if (ret != 0) {
-		print_err("%s", "Failed to compile regex");
-		ret = -EPERM;
-		goto out_close_drv_file;
-	}
+	return newlist;
+}
 
-	ret = regexec(&regex, drv_string, 2, pmatch, 0);
-	if (ret != 0) {
-		print_err("%s", "Failed to exec regex");
-		ret = -EPERM;
-		goto out_free_regex;
-	} else if (pmatch[1].rm_so == -1) {
-		print_err("%s", "Failed to match subexpression");
-		ret = -EPERM;
-		goto out_free_regex;
-	}
+static void job_edges_free(void *list, size_t size)
+{
+	if (size > 0)
+		arena_free(&job_edges[__builtin_ctzl(size)], list);
+}
 
-	ret_pname = strndup(drv_string + pmatch[1].rm_so,
-			    pmatch[1].rm_eo - pmatch[1].rm_so);
-	if (ret_pname == NULL) {
-		print_err("%s", strerror(errno));
-		ret = -errno;
-		goto out_free_regex;
-	}
-	*pname = ret_pname;
+/* returns NULL and sets errno on failure */
+static char *job_strdup(const char *s)
+{
+	size_t len = strlen(s);
+	char *dup;
 
-out_free_regex:
-	regfree(&regex);
-out_close_drv_file:
-	if (fclose(drv_file) != 0)
-		print_err("%s", strerror(errno));
-	free(drv_string);
+	dup = arena_alloc(&job_names, len + 1);
+	if (dup != NULL)
+		memcpy(dup, s, len + 1);
 
-	return ret;
+	return dup;
 }
 
-static char *drv_path_to_pname(char *drv_path)
+static char *drv_path_to_pname(const char *drv_path)
 {
 	char *pname, *p;
 
@@ -136,6 +156,57 @@ static char *drv_path_to_pname(char *drv_path)
 	return pname;
 }
 
+/* the pname in the env of the drv, like the statistics and the model have
+ * it, or one made up from drv_path if the env has none */
+static char *drv_path_pname(const char *drv_path)
+{
+	char *pname;
+
+	if (drv_pname(drv_path, &pname) == 0)
+		return pname;
+
+	return drv_path_to_pname(drv_path);
+}
+
+/* job->pname, reading the .drv only if it wasn't when job was parsed */
+static const char *job_pname(struct job *job)
+{
+	char *pname;
+
+	if (job->pname != NULL)
+		return job->pname;
+
+	pname = drv_path_pname(job->drv_path);
+	if (pname == NULL)
+		return NULL;
+	job->pname = intern(&job_paths, pname);
+	free(pname);
+
+	return job->pname;
+}
+
+/* takes the pname of job from drv, its .drv already read */
+static int job_pname_set(struct job *job, struct drv *drv)
+{
+	char *pname;
+	int ret;
+
+	if (drv->pname.s == NULL) {
+		pname = drv_path_to_pname(job->drv_path);
+		if (pname == NULL)
+			return 0;
+	} else {
+		ret = drv_span_dup(&drv->pname, &pname);
+		if (ret < 0)
+			return ret;
+	}
+
+	job->pname = intern(&job_paths, pname);
+	free(pname);
+
+	return job->pname == NULL ? -errno : 0;
+}
+
 static int job_output_list_insert(struct job *job, struct output *output)
 {
 	size_t newsize;
@@ -146,12 +217,10 @@ static int job_output_list_insert(struct job *job, struct output *output)
 		return 0;
 	}
 
-	newsize = job->outputs_size == 0 ? 1 : job->outputs_size * 2;
-	ret = realloc(job->outputs, newsize * sizeof(*job->outputs));
-	if (ret == NULL) {
-		print_err("%s", strerror(errno));
+	ret = job_edges_grow(job->outputs, job->outputs_size);
+	if (ret == NULL)
 		return -errno;
-	}
+	newsize = job->outputs_size == 0 ? 1 : job->outputs_size * 2;
 
 	job->outputs = ret;
 	job->outputs_size = newsize;
@@ -160,6 +229,20 @@ static int job_output_list_insert(struct job *job, struct output *output)
 	return 0;
 }
 
+/* adds (sign 1) or takes away (sign -1) what dep contributes to the cached
+ * cost_recursive of job, dropping the cache if that isn't known */
+static void job_cost_recursive_adjust(struct job *job, struct job *dep,
+				      int sign)
+{
+	if (job->cost_recursive == JOB_COST_UNSET || dep->insubstituters)
+		return;
+
+	if (dep->cost == JOB_COST_UNSET)
+		job->cost_recursive = JOB_COST_UNSET;
+	else
+		job->cost_recursive += sign * dep->cost;
+}
+
 void job_deps_list_rm(struct job *job, struct job *dep)
 {
 	for (size_t i = 0; i < job->deps_filled; i++) {
@@ -168,30 +251,43 @@ void job_deps_list_rm(struct job *job, struct job *dep)
 
 		job->deps[i] = job->deps[job->deps_filled - 1];
 		job->deps_filled -= 1;
+		job_cost_recursive_adjust(job, dep, -1);
+		return;
+	}
+}
+
+void job_parents_list_rm(struct job *job, struct job *parent)
+{
+	for (size_t i = 0; i < job->parents_filled; i++) {
+		if (job->parents[i] != parent)
+			continue;
+
+		job->parents[i] = job->parents[job->parents_filled - 1];
+		job->parents_filled -= 1;
 		return;
 	}
 }
 
-static int job_deps_list_insert(struct job *job, struct job *dep)
+int job_deps_list_insert(struct job *job, struct job *dep)
 {
 	size_t newsize;
 	void *ret;
 
 	if (job->deps_filled < job->deps_size) {
 		job->deps[job->deps_filled++] = dep;
+		job_cost_recursive_adjust(job, dep, 1);
 		return 0;
 	}
 
-	newsize = job->deps_size == 0 ? 1 : job->deps_size * 2;
-	ret = realloc(job->deps, newsize * sizeof(*job->deps));
-	if (ret == NULL) {
-		print_err("%s", strerror(errno));
+	ret = job_edges_grow(job->deps, job->deps_size);
+	if (ret == NULL)
 		return -errno;
-	}
+	newsize = job->deps_size == 0 ? 1 : job->deps_size * 2;
 
 	job->deps = ret;
 	job->deps_size = newsize;
 	job->deps[job->deps_filled++] = dep;
+	job_cost_recursive_adjust(job, dep, 1);
 
 	return 0;
 }
@@ -206,12 +302,10 @@ int job_parents_list_insert(struct job *job, struct job *parent)
 		return 0;
 	}
 
-	newsize = job->parents_size == 0 ? 1 : job->parents_size * 2;
-	ret = realloc(job->parents, newsize * sizeof(*job->parents));
-	if (ret == NULL) {
-		print_err("%s", strerror(errno));
+	ret = job_edges_grow(job->parents, job->parents_size);
+	if (ret == NULL)
 		return -errno;
-	}
+	newsize = job->parents_size == 0 ? 1 : job->parents_size * 2;
 
 	job->parents = ret;
 	job->parents_size = newsize;
@@ -220,52 +314,125 @@ int job_parents_list_insert(struct job *job, struct job *parent)
 	return 0;
 }
 
+/* predicts the cost of job from the pnames of its input drvs */
+static int job_cost_estimate(struct job *job)
+{
+	char *cursor, *drv_path, *outputs, *pname;
+	double prediction;
+	struct drv drv;
+	void *newpnames;
+
+	size_t pnames_size = 0, pnames_filled = 0;
+	char **pnames = NULL;
+	int ret;
+
+	ret = drv_read(job->drv_path, &drv);
+	if (ret < 0)
+		return ret;
+
+	cursor = drv.input_drvs;
+	while ((ret = drv_input_drv_next(&cursor, &drv_path, &outputs)) > 0) {
+		pname = drv_path_pname(drv_path);
+		if (pname == NULL)
+			continue;
+
+		if (pnames_filled == pnames_size) {
+			pnames_size = pnames_size == 0 ? 8 : pnames_size * 2;
+			newpnames = realloc(pnames,
+					    pnames_size * sizeof(*pnames));
+			if (newpnames == NULL) {
+				print_err("%s", strerror(errno));
+				ret = -errno;
+				free(pname);
+				goto out_free_pnames;
+			}
+			pnames = newpnames;
+		}
+		pnames[pnames_filled++] = pname;
+	}
+	if (ret < 0)
+		goto out_free_pnames;
+
+	/* trained on the durations of statistics, not of this host */
+	prediction = model_predict(evanix_opts.model, pnames, pnames_filled) *
+		     statistics_calibration_factor(&evanix_opts.statistics);
+	if (prediction < 0)
+		ret = 0;
+	else if (prediction >= INT_MAX)
+		ret = INT_MAX;
+	else
+		ret = prediction + 0.5;
+	job->cost_estimated = true;
+
+out_free_pnames:
+	for (size_t i = 0; i < pnames_filled; i++)
+		free(pnames[i]);
+	free(pnames);
+	drv_free(&drv);
+
+	return ret;
+}
+
 int job_cost(struct job *job)
 {
+	struct statistics_entry entry;
+	const char *pname;
 	int ret;
-	char *pname;
 
 	if (job->insubstituters)
 		return 0;
 
-	if (!evanix_opts.max_time)
-		return 1;
+	if (job->cost != JOB_COST_UNSET)
+		return job->cost;
+
+	if (!evanix_opts.max_time) {
+		job->cost = 1;
+		return job->cost;
+	}
 
-	pname = drv_path_to_pname(job->drv_path);
+	pname = job_pname(job);
 	if (pname == NULL) {
 		print_err("Unable to obtain pname from drv_path: %s",
 			  job->drv_path);
 		return -EINVAL;
 	}
 
-	ret = sqlite3_reset(evanix_opts.statistics.statement);
-	if (ret != SQLITE_OK) {
-		print_err("%s", "Failed to reset sql statement");
-		ret = -EPERM;
-		goto out_free_pname;
-	}
-	ret = sqlite3_bind_text(evanix_opts.statistics.statement, 1, pname, -1,
-				NULL);
-	if (ret != SQLITE_OK) {
-		print_err("%s", "Failed to bind sql");
-		ret = -EPERM;
-		goto out_free_pname;
+	if (statistics_isopen(&evanix_opts.statistics))
+		ret = statistics_lookup(&evanix_opts.statistics, pname, &entry);
+	else
+		ret = -ENOENT;
+
+	if (ret == 0) {
+		statistics_calibrate(&evanix_opts.statistics, &entry);
+		job->cost_mean = entry.costs[STATISTICS_MEAN];
+		job->cost_variance = entry.variance;
+		ret = entry.costs[evanix_opts.cost_quantile];
 	}
 
-	ret = sqlite3_step(evanix_opts.statistics.statement);
-	if (ret == SQLITE_DONE) {
+	if (ret == -ENOENT && evanix_opts.model != NULL)
+		ret = job_cost_estimate(job);
+	else if (ret == -ENOENT)
 		print_err("Failed to acquire statistics for %s", pname);
-		ret = -ENOENT;
-		goto out_free_pname;
-	} else if (ret != SQLITE_ROW) {
-		print_err("%s", "Failed to step sql");
-		ret = -EPERM;
-		goto out_free_pname;
-	}
 
-	ret = sqlite3_column_int(evanix_opts.statistics.statement, 0);
+	if (ret >= 0)
+		job->cost = ret;
+
+	return ret;
+}
 
-out_free_pname:
+int job_cost_record(const char *drv_path, double duration, bool isalone)
+{
+	char *pname;
+	int ret;
+
+	pname = drv_path_pname(drv_path);
+	if (pname == NULL) {
+		print_err("Unable to obtain pname from drv_path: %s", drv_path);
+		return -EINVAL;
+	}
+
+	ret = statistics_record(&evanix_opts.statistics, pname, duration,
+				isalone);
 	free(pname);
 
 	return ret;
@@ -275,6 +442,9 @@ int job_cost_recursive(struct job *job)
 {
 	int ret, builds;
 
+	if (job->cost_recursive != JOB_COST_UNSET)
+		return job->cost_recursive;
+
 	ret = job_cost(job);
 	if (ret < 0)
 		return ret;
@@ -291,76 +461,85 @@ int job_cost_recursive(struct job *job)
 		builds += ret;
 	}
 
+	job->cost_recursive = builds;
 	return builds;
 }
 
-static int job_output_insert(struct job *j, char *name, char *store_path)
+void job_insubstituters_set(struct job *job, bool insubstituters)
+{
+	if (job->insubstituters == insubstituters)
+		return;
+
+	/* job counts towards its own cost_recursive as much as its parents' */
+	job_cost_recursive_adjust(job, job, -1);
+	for (size_t i = 0; i < job->parents_filled; i++)
+		job_cost_recursive_adjust(job->parents[i], job, -1);
+
+	job->insubstituters = insubstituters;
+
+	job_cost_recursive_adjust(job, job, 1);
+	for (size_t i = 0; i < job->parents_filled; i++)
+		job_cost_recursive_adjust(job->parents[i], job, 1);
+}
+
+int job_output_insert(struct job *j, const char *name,
+		      const char *store_path)
 {
 	struct output *o;
 	int ret = 0;
 
-	o = malloc(sizeof(*o));
-	if (o == NULL) {
-		print_err("%s", strerror(errno));
+	o = arena_alloc(&output_arena, sizeof(*o));
+	if (o == NULL)
 		return -errno;
-	}
 
-	o->name = strdup(name);
+	o->name = intern(&job_paths, name);
 	if (o->name == NULL) {
-		print_err("%s", strerror(errno));
 		ret = -errno;
 		goto out_free_o;
 	}
 	if (store_path != NULL) {
-		o->store_path = strdup(store_path);
+		o->store_path = intern(&job_paths, store_path);
 		if (o->store_path == NULL) {
-			print_err("%s", strerror(errno));
 			ret = -errno;
-			goto out_free_name;
+			goto out_free_o;
 		}
 	} else {
 		o->store_path = NULL;
 	}
 
 	ret = job_output_list_insert(j, o);
-	if (ret < 0)
-		goto out_free_store_path;
 
-out_free_store_path:
-	if (ret < 0)
-		free(o->store_path);
-out_free_name:
-	if (ret < 0)
-		free(o->name);
 out_free_o:
 	if (ret < 0)
-		free(o);
+		output_free(o);
 
-	return 0;
+	return ret;
 }
 
-static int job_read_inputdrvs(struct job *job, cJSON *input_drvs)
+static int job_read_inputdrvs(struct job *job, char *input_drvs)
 {
-	cJSON *output;
+	char *drv_path, *outputs, *output;
 
 	struct job *dep_job = NULL;
 	int ret = 0;
 
-	for (cJSON *array = input_drvs; array != NULL; array = array->next) {
-		ret = job_new(&dep_job, NULL, array->string, NULL, job);
+	while ((ret = eval_json_input_drv_next(&input_drvs, &drv_path,
+					       &outputs)) > 0) {
+		ret = job_new(&dep_job, NULL, drv_path, NULL, job);
 		if (ret < 0)
-			goto out_free_dep_job;
+			return ret;
 
-		cJSON_ArrayForEach (output, array) {
-			ret = job_output_insert(dep_job, output->valuestring,
-						NULL);
+		while ((ret = eval_json_string_next(&outputs, &output)) > 0) {
+			ret = job_output_insert(dep_job, output, NULL);
 			if (ret < 0)
-				job_free(dep_job);
+				goto out_free_dep_job;
 		}
+		if (ret < 0)
+			goto out_free_dep_job;
 
 		ret = job_deps_list_insert(job, dep_job);
 		if (ret < 0)
-			job_free(dep_job);
+			goto out_free_dep_job;
 
 		dep_job = NULL;
 	}
@@ -372,57 +551,182 @@ out_free_dep_job:
 	return ret;
 }
 
-static int job_read_outputs(struct job *job, cJSON *outputs)
+static int job_read_outputs(struct job *job, char *outputs)
 {
+	char *name, *store_path;
 	int ret;
 
-	for (cJSON *i = outputs; i != NULL; i = i->next) {
-		ret = job_output_insert(job, i->string, i->valuestring);
+	while ((ret = eval_json_output_next(&outputs, &name, &store_path)) >
+	       0) {
+		ret = job_output_insert(job, name, store_path);
 		if (ret < 0)
 			return ret;
 	}
 
+	return ret;
+}
+
+int cache_memo_get(struct cache_memo *memo, const char *path,
+		   cache_status_t status, struct cache_status **cs)
+{
+	struct cache_status *c;
+
+	HASH_FIND_STR(memo->htab, path, c);
+	if (c != NULL) {
+		/* the latest word on it wins */
+		c->status = status;
+		*cs = c;
+		return 0;
+	}
+
+	c = malloc(sizeof(*c));
+	if (c == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	c->path = strdup(path);
+	if (c->path == NULL) {
+		print_err("%s", strerror(errno));
+		free(c);
+		return -errno;
+	}
+	c->status = status;
+	c->iscomplete = false;
+	c->closure_size = 0;
+	c->closure_filled = 0;
+	c->closure = NULL;
+
+	HASH_ADD_KEYPTR(hh, memo->htab, c->path, strlen(c->path), c);
+	*cs = c;
 	return 0;
 }
 
-/* for nix-eval-jobs output only, for dag use the htab instead */
-struct job *job_search(struct job *job, const char *drv)
+int cache_status_closure_insert(struct cache_status *cs,
+				struct cache_status *dep)
 {
-	if (!strcmp(drv, job->drv_path))
-		return job;
+	size_t newsize;
+	void *ret;
 
-	for (size_t i = 0; i < job->deps_filled; i++) {
-		if (!strcmp(drv, job->deps[i]->drv_path))
-			return job->deps[i];
+	if (cs->closure_filled == cs->closure_size) {
+		newsize = cs->closure_size == 0 ? 4 : cs->closure_size * 2;
+		ret = realloc(cs->closure, newsize * sizeof(*cs->closure));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		cs->closure = ret;
+		cs->closure_size = newsize;
+	}
+
+	cs->closure[cs->closure_filled++] = dep;
+	return 0;
+}
+
+/* Applies what a nix-build --dry-run on job listed, deps listed nowhere are
+ * valid locally and get dropped. If memo is not NULL it's told about them,
+ * memo->mutex must be held either way. */
+static int job_closure_apply(struct job *job, struct cache_status *root,
+			     struct cache_memo *memo)
+{
+	struct cache_status *cs;
+	struct job *j;
+
+	struct job *dep_job = NULL;
+	struct jobtab tab;
+	const char *path;
+	int ret;
+
+	if (root->closure_filled == 0)
+		return JOB_READ_CACHED;
+
+	jobtab_init(&tab);
+	/* the listing runs to the whole closure with --full-closure, so it's
+	 * matched against job and its deps by hash, not one by one */
+	ret = jobtab_insert(&tab, job);
+	for (size_t i = 0; ret >= 0 && i < job->deps_filled; i++) {
+		ret = jobtab_insert(&tab, job->deps[i]);
+		if (ret == -EEXIST)
+			ret = 0;
+	}
+	if (ret < 0)
+		goto out_free_tab;
+
+	for (size_t i = 0; i < root->closure_filled; i++) {
+		path = root->closure[i]->path;
+		j = jobtab_find(&tab, path, jobtab_hash(path));
+		if (j == NULL) {
+			ret = job_new(&dep_job, NULL, path, NULL, job);
+			if (ret < 0)
+				goto out_free_tab;
+
+			ret = job_deps_list_insert(job, dep_job);
+			if (ret >= 0)
+				ret = jobtab_insert(&tab, dep_job);
+			if (ret < 0) {
+				job_free(dep_job);
+				goto out_free_tab;
+			}
+
+			j = dep_job;
+		}
+
+		job_insubstituters_set(j, root->closure[i]->status ==
+					       CACHE_STATUS_SUBSTITUTABLE);
+		j->stale = false;
 	}
+	jobtab_free(&tab);
+
+	/* remove stale deps */
+	for (size_t i = 0; i < job->deps_filled;) {
+		if (!job->deps[i]->stale) {
+			i++;
+			continue;
+		}
 
-	return NULL;
+		/* only a build needs its inputs, a fetch says nothing */
+		if (memo != NULL && !job->stale) {
+			ret = cache_memo_get(memo, job->deps[i]->drv_path,
+					     CACHE_STATUS_LOCAL, &cs);
+			if (ret < 0)
+				return ret;
+		}
+		job_free(job->deps[i]);
+	}
+
+	return JOB_READ_SUCCESS;
+
+out_free_tab:
+	jobtab_free(&tab);
+
+	return ret;
 }
 
-static int job_read_cache(struct job *job)
+int job_read_cache(struct job *job, struct cache_memo *memo,
+		   struct cache_status *root)
 {
 	size_t argindex, n;
 	FILE *nix_build_stream;
 	char *args[4], *trimmed;
-	int ret, nlines;
-	struct job *j;
+	struct cache_status *cs;
+	int ret = 0;
 
 	char *line = NULL;
 	argindex = 0;
 	args[argindex++] = "nix-build";
 	args[argindex++] = "--dry-run";
-	args[argindex++] = job->drv_path;
+	args[argindex++] = (char *)job->drv_path;
 	args[argindex++] = NULL;
-	struct job *dep_job = NULL;
 
 	ret = vpopen(&nix_build_stream, "nix-build", args, VPOPEN_STDERR);
 	if (ret < 0)
 		return ret;
+	ret = 0;
 
 	errno = 0;
-	nlines = 0;
 	for (bool in_fetched_block = false;
-	     getline(&line, &n, nix_build_stream) >= 0; nlines++) {
+	     getline(&line, &n, nix_build_stream) >= 0;) {
 		trimmed = trim(line);
 
 		if (strstr(line, "will be built")) {
@@ -432,147 +736,421 @@ static int job_read_cache(struct job *job)
 			continue;
 		} else if (strncmp(trimmed, NIX_STORE_PATH,
 				   sizeof(NIX_STORE_PATH) - 1)) {
-			/* TODO: use libstore instead
-			 * */
 			continue;
 		}
 
-		j = job_search(job, trimmed);
-		if (j == NULL) {
-			ret = job_new(&dep_job, NULL, trimmed, NULL, job);
-			if (ret < 0)
-				goto out_free_line;
-
-			ret = job_deps_list_insert(job, dep_job);
-			if (ret < 0)
-				goto out_free_line;
-
-			j = dep_job;
-		}
-
-		if (in_fetched_block)
-			j->insubstituters = true;
-		else
-			j->insubstituters = false;
+		pthread_mutex_lock(&memo->mutex);
+		ret = cache_memo_get(memo, trimmed,
+				     in_fetched_block
+					     ? CACHE_STATUS_SUBSTITUTABLE
+					     : CACHE_STATUS_BUILD,
+				     &cs);
+		pthread_mutex_unlock(&memo->mutex);
+		if (ret < 0)
+			goto out_free_line;
 
-		j->stale = false;
+		ret = cache_status_closure_insert(root, cs);
+		if (ret < 0)
+			goto out_free_line;
 	}
 	if (errno != 0) {
 		print_err("%s", strerror(errno));
 		ret = -errno;
-		goto out_free_line;
-	} else if (errno == 0 && nlines == 0) {
-		ret = JOB_READ_CACHED;
-		goto out_free_line;
-	}
-
-	/* remove stale deps */
-	for (size_t i = 0; i < job->deps_filled;) {
-		if (job->deps[i]->stale)
-			job_free(job->deps[i]);
-		else
-			i++;
 	}
 
-	ret = JOB_READ_SUCCESS;
-
 out_free_line:
 	free(line);
 	fclose(nix_build_stream);
+
+	return ret;
+}
+
+int job_cache_check(struct job *job, struct cache_memo *memo)
+{
+	struct cache_status *cs;
+	int ret;
+
+	/* collects the listing until it can be handed to the memo */
+	struct cache_status root = {
+		.closure_size = 0,
+		.closure_filled = 0,
+		.closure = NULL,
+	};
+
+	if (!evanix_opts.check_cache_status)
+		return JOB_READ_SUCCESS;
+
+	pthread_mutex_lock(&memo->mutex);
+	HASH_FIND_STR(memo->htab, job->drv_path, cs);
+	if (cs != NULL &&
+	    (cs->iscomplete || cs->status == CACHE_STATUS_LOCAL)) {
+		memo->saved++;
+		ret = job_closure_apply(job, cs, NULL);
+		pthread_mutex_unlock(&memo->mutex);
+		return ret;
+	}
+	pthread_mutex_unlock(&memo->mutex);
+
+	ret = evanix_opts.cache_backend(job, memo, &root);
+	if (ret < 0)
+		goto out_free_closure;
+
+	pthread_mutex_lock(&memo->mutex);
+	memo->checks++;
+	ret = cache_memo_get(memo, job->drv_path,
+			     root.closure_filled ? CACHE_STATUS_BUILD
+						 : CACHE_STATUS_LOCAL,
+			     &cs);
+	if (ret == 0 && !cs->iscomplete) {
+		cs->iscomplete = true;
+		cs->closure = root.closure;
+		cs->closure_size = root.closure_size;
+		cs->closure_filled = root.closure_filled;
+		root.closure = NULL;
+	}
+	if (ret == 0)
+		ret = job_closure_apply(job, cs, memo);
+	pthread_mutex_unlock(&memo->mutex);
+
+out_free_closure:
+	free(root.closure);
+
+	return ret;
+}
+
+void cache_memo_init(struct cache_memo *memo)
+{
+	pthread_mutex_init(&memo->mutex, NULL);
+	memo->htab = NULL;
+	memo->checks = 0;
+	memo->saved = 0;
+}
+
+void cache_memo_free(struct cache_memo *memo)
+{
+	struct cache_status *cs, *tmp;
+
+	HASH_ITER (hh, memo->htab, cs, tmp) {
+		HASH_DEL(memo->htab, cs);
+		free(cs->path);
+		free(cs->closure);
+		free(cs);
+	}
+	pthread_mutex_destroy(&memo->mutex);
+}
+
+int job_read_drv(struct job *job)
+{
+	char *cursor, *drv_path, *outputs, *output;
+	struct drv drv;
+
+	struct job *dep_job = NULL;
+	int ret = 0;
+
+	ret = drv_read(job->drv_path, &drv);
+	if (ret < 0)
+		return ret;
+
+	ret = job_pname_set(job, &drv);
+	if (ret < 0)
+		goto out_free_drv;
+
+	cursor = drv.input_drvs;
+	while ((ret = drv_input_drv_next(&cursor, &drv_path, &outputs)) > 0) {
+		ret = job_new(&dep_job, NULL, drv_path, NULL, job);
+		if (ret < 0)
+			goto out_free_drv;
+
+		while ((ret = drv_string_next(&outputs, &output)) > 0) {
+			ret = job_output_insert(dep_job, output, NULL);
+			if (ret < 0)
+				goto out_free_dep_job;
+		}
+		if (ret < 0)
+			goto out_free_dep_job;
+
+		ret = job_deps_list_insert(job, dep_job);
+		if (ret < 0)
+			goto out_free_dep_job;
+
+		dep_job = NULL;
+	}
+
+out_free_dep_job:
 	if (ret < 0)
 		job_free(dep_job);
+out_free_drv:
+	drv_free(&drv);
 
 	return ret;
 }
 
-int job_read(FILE *stream, struct job **job)
+static int job_list_push(struct job ***list, size_t *size, size_t *filled,
+			 struct job *job)
 {
-	cJSON *temp;
+	size_t newsize;
+	void *ret;
 
-	char *drv_path = NULL;
+	if (*filled == *size) {
+		newsize = *size == 0 ? 64 : *size * 2;
+		ret = realloc(*list, newsize * sizeof(**list));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		*list = ret;
+		*size = newsize;
+	}
+
+	(*list)[(*filled)++] = job;
+	return 0;
+}
+
+/* substitutes nix-build --dry-run lists by their output paths */
+static bool job_isdrv(struct job *job)
+{
+	size_t len = strlen(job->drv_path);
+
+	return len > 4 && !strcmp(job->drv_path + len - 4, ".drv");
+}
+
+/* known is NULL when there's nothing to look up */
+static bool job_isknown(struct job *job, struct jobtab *known,
+			pthread_mutex_t *mutex)
+{
+	bool isknown;
+
+	if (known == NULL)
+		return false;
+
+	pthread_mutex_lock(mutex);
+	isknown = jobtab_find(known, job->drv_path, job->drv_hash) != NULL;
+	pthread_mutex_unlock(mutex);
+
+	return isknown;
+}
+
+static int job_ptr_cmp(const void *a, const void *b)
+{
+	const struct job *ja = *(struct job *const *)a;
+	const struct job *jb = *(struct job *const *)b;
+
+	return (ja > jb) - (ja < jb);
+}
+
+int job_read_closure(struct job *job, bool islisted, struct jobtab *known,
+		     pthread_mutex_t *mutex)
+{
+	char *cursor, *drv_path, *outputs, *output;
+	struct job *j, *dep, **found;
+	struct drv drv;
+
+	size_t stack_size = 0, stack_filled = 0;
+	size_t inputs_size = 0, inputs_filled = 0;
+	struct job **stack = NULL, **inputs = NULL;
+	struct jobtab htab;
+	int ret = 0;
+
+	jobtab_init(&htab);
+	for (size_t i = 0; i < job->deps_filled; i++) {
+		ret = jobtab_insert(&htab, job->deps[i]);
+		if (ret < 0)
+			goto out_free;
+		ret = job_list_push(&stack, &stack_size, &stack_filled,
+				    job->deps[i]);
+		if (ret < 0)
+			goto out_free;
+	}
+	/* only to tell its own inputDrvs from the rest of the listing */
+	if (islisted) {
+		ret = job_list_push(&stack, &stack_size, &stack_filled, job);
+		if (ret < 0)
+			goto out_free;
+	}
+
+	while (stack_filled > 0) {
+		j = stack[--stack_filled];
+		if (j->insubstituters || !job_isdrv(j))
+			continue;
+		/* stays a leaf, the merge swaps it for the one known has */
+		if (j != job && job_isknown(j, known, mutex))
+			continue;
+
+		ret = drv_read(j->drv_path, &drv);
+		if (ret < 0)
+			goto out_free;
+
+		ret = j->pname == NULL ? job_pname_set(j, &drv) : 0;
+		if (ret < 0) {
+			drv_free(&drv);
+			goto out_free;
+		}
+
+		cursor = drv.input_drvs;
+		while ((ret = drv_input_drv_next(&cursor, &drv_path,
+						 &outputs)) > 0) {
+			dep = jobtab_find(&htab, drv_path,
+					  jobtab_hash(drv_path));
+			if (dep == NULL && islisted) {
+				/* valid or substitutable */
+				continue;
+			} else if (j == job) {
+				ret = job_list_push(&inputs, &inputs_size,
+						    &inputs_filled, dep);
+				if (ret < 0)
+					break;
+				continue;
+			} else if (dep != NULL) {
+				ret = job_deps_list_insert(j, dep);
+				if (ret < 0)
+					break;
+				ret = job_parents_list_insert(dep, j);
+				if (ret < 0)
+					break;
+				continue;
+			}
+
+			ret = job_new(&dep, NULL, drv_path, NULL, j);
+			if (ret < 0)
+				break;
+			while ((ret = drv_string_next(&outputs, &output)) > 0) {
+				ret = job_output_insert(dep, output, NULL);
+				if (ret < 0)
+					break;
+			}
+			if (ret >= 0)
+				ret = job_deps_list_insert(j, dep);
+			if (ret < 0) {
+				job_free(dep);
+				break;
+			}
+
+			ret = jobtab_insert(&htab, dep);
+			if (ret < 0)
+				break;
+			ret = job_list_push(&stack, &stack_size, &stack_filled,
+					    dep);
+			if (ret < 0)
+				break;
+		}
+		drv_free(&drv);
+		if (ret < 0)
+			goto out_free;
+	}
+
+	if (!islisted)
+		goto out_free;
+
+	/* the listing hangs everything off job, it keeps the edges to its
+	 * inputDrvs and to what no other drv of the closure needs */
+	qsort(inputs, inputs_filled, sizeof(*inputs), job_ptr_cmp);
+	for (size_t i = 0; i < job->deps_filled;) {
+		dep = job->deps[i];
+		found = inputs_filled == 0
+				? NULL
+				: bsearch(&dep, inputs, inputs_filled,
+					  sizeof(*inputs), job_ptr_cmp);
+		if (dep->parents_filled > 1 && found == NULL) {
+			job_parents_list_rm(dep, job);
+			/* moves the last dep into i */
+			job_deps_list_rm(job, dep);
+			continue;
+		}
+
+		i++;
+	}
+
+out_free:
+	jobtab_free(&htab);
+	free(stack);
+	free(inputs);
+
+	return ret;
+}
+
+int job_parse(char *line, const char *attr_prefix, struct job **job)
+{
+	struct eval_json ej;
+
+	char *prefixed_attr = NULL;
 	struct job *j = NULL;
-	cJSON *root = NULL;
 	char *attr = NULL;
-	char *name = NULL;
 	int ret = 0;
 
-	ret = json_streaming_read(stream, &root);
-	if (ret < 0 || ret == -EOF)
-		return JOB_READ_EOF;
+	ret = eval_json_parse(line, &ej);
+	if (ret < 0) {
+		ret = JOB_READ_JSON_INVAL;
+		goto out_free;
+	}
 
-	temp = cJSON_GetObjectItemCaseSensitive(root, "error");
-	if (cJSON_IsString(temp)) {
+	if (ej.error != NULL) {
+		eval_cache_error_write(ej.error);
 		if (evanix_opts.close_unused_fd)
-			puts(temp->valuestring);
+			puts(ej.error);
 		ret = JOB_READ_EVAL_ERR;
 		goto out_free;
 	}
 
-	temp = cJSON_GetObjectItemCaseSensitive(root, "system");
-	if (!cJSON_IsString(temp)) {
+	if (ej.system == NULL) {
 		ret = JOB_READ_JSON_INVAL;
 		goto out_free;
 	}
-	if (strcmp(evanix_opts.system, temp->valuestring)) {
+	if (strcmp(evanix_opts.system, ej.system)) {
 		ret = JOB_READ_SYS_MISMATCH;
 		goto out_free;
 	}
 
-	temp = cJSON_GetObjectItemCaseSensitive(root, "name");
-	if (!cJSON_IsString(temp)) {
-		ret = JOB_READ_JSON_INVAL;
-		goto out_free;
-	}
-	name = temp->valuestring;
-
-	temp = cJSON_GetObjectItemCaseSensitive(root, "attr");
-	if (!cJSON_IsString(temp)) {
+	if (ej.name == NULL || ej.attr == NULL || ej.drv_path == NULL ||
+	    ej.input_drvs == NULL || ej.outputs == NULL) {
 		ret = JOB_READ_JSON_INVAL;
 		goto out_free;
 	}
-	if (temp->valuestring[0] != '\0')
-		attr = temp->valuestring;
+	if (attr_prefix != NULL) {
+		if (ej.attr[0] == '\0')
+			ret = asprintf(&prefixed_attr, "%s", attr_prefix);
+		else
+			ret = asprintf(&prefixed_attr, "%s.%s", attr_prefix,
+				       ej.attr);
+		if (ret < 0) {
+			print_err("%s", "Failed to allocate attr");
+			ret = -ENOMEM;
+			goto out_free;
+		}
 
-	temp = cJSON_GetObjectItemCaseSensitive(root, "drvPath");
-	if (!cJSON_IsString(temp)) {
-		free(name);
-		ret = JOB_READ_JSON_INVAL;
-		goto out_free;
+		attr = prefixed_attr;
+	} else if (ej.attr[0] != '\0') {
+		attr = ej.attr;
 	}
-	drv_path = temp->valuestring;
 
-	ret = job_new(&j, name, drv_path, attr, NULL);
+	ret = job_new(&j, ej.name, ej.drv_path, attr, NULL);
 	if (ret < 0)
 		goto out_free;
 
-	temp = cJSON_GetObjectItemCaseSensitive(root, "inputDrvs");
-	if (!cJSON_IsObject(temp)) {
+	/* -EINVAL is the JSON, anything else like -ENOMEM is passed on */
+	ret = job_read_inputdrvs(j, ej.input_drvs);
+	if (ret == -EINVAL) {
 		ret = JOB_READ_JSON_INVAL;
 		goto out_free;
-	}
-	ret = job_read_inputdrvs(j, temp->child);
-	if (ret < 0)
+	} else if (ret < 0) {
 		goto out_free;
+	}
 
-	temp = cJSON_GetObjectItemCaseSensitive(root, "outputs");
-	if (!cJSON_IsObject(temp)) {
+	ret = job_read_outputs(j, ej.outputs);
+	if (ret == -EINVAL) {
 		ret = JOB_READ_JSON_INVAL;
 		goto out_free;
-	}
-	ret = job_read_outputs(j, temp->child);
-	if (ret < 0)
+	} else if (ret < 0) {
 		goto out_free;
-
-	if (evanix_opts.check_cache_status) {
-		ret = job_read_cache(j);
-		if (ret < 0)
-			goto out_free;
-	} else {
-		ret = JOB_READ_SUCCESS;
 	}
 
+	/* the cache check is left to the caller, what's cached now might
+	 * not be next time */
+	eval_cache_job_write(j);
+	ret = JOB_READ_SUCCESS;
+
 out_free:
-	cJSON_Delete(root);
+	free(prefixed_attr);
 	if (ret != JOB_READ_SUCCESS)
 		job_free(j);
 	else
@@ -583,44 +1161,175 @@ out_free:
 	return ret;
 }
 
-void job_free(struct job *job)
+int job_read(FILE *stream, char **line, size_t *line_size, struct job **job)
 {
-	if (job == NULL)
+	errno = 0;
+	if (getline(line, line_size, stream) < 0) {
+		if (errno != 0)
+			print_err("%s", strerror(errno));
+
+		return JOB_READ_EOF;
+	}
+
+	return job_parse(*line, NULL, job);
+}
+
+uint32_t job_mark_next(void)
+{
+	static uint32_t mark_last = 0;
+	uint32_t mark;
+
+	/* jobs start out with 0 */
+	do {
+		mark = __atomic_add_fetch(&mark_last, 4, __ATOMIC_RELAXED);
+	} while (mark == 0);
+
+	return mark;
+}
+
+/* keeps the edges of job to jobs stamped with mark, or to the others if not
+ * isinside, in the order they were in */
+static void job_edges_keep(struct job *job, uint32_t mark, bool isinside)
+{
+	size_t k = 0;
+
+	for (size_t i = 0; i < job->deps_filled; i++) {
+		if ((job->deps[i]->mark == mark) != isinside) {
+			job_cost_recursive_adjust(job, job->deps[i], -1);
+			continue;
+		}
+		job->deps[k++] = job->deps[i];
+	}
+	job->deps_filled = k;
+
+	k = 0;
+	for (size_t i = 0; i < job->parents_filled; i++) {
+		if ((job->parents[i]->mark == mark) != isinside)
+			continue;
+		job->parents[k++] = job->parents[i];
+	}
+	job->parents_filled = k;
+}
+
+/* the jobs outside are stamped mark + 2 so each is only gone through once,
+ * and listed through mark_next */
+static void job_closure_unlink_list(struct job *closure, uint32_t mark)
+{
+	struct job *j, *outside = NULL;
+
+	for (j = closure; j != NULL; j = j->mark_next) {
+		for (size_t i = 0; i < j->deps_filled; i++) {
+			if (j->deps[i]->mark == mark ||
+			    j->deps[i]->mark == mark + 2)
+				continue;
+
+			j->deps[i]->mark = mark + 2;
+			j->deps[i]->mark_next = outside;
+			outside = j->deps[i];
+		}
+		for (size_t i = 0; i < j->parents_filled; i++) {
+			if (j->parents[i]->mark == mark ||
+			    j->parents[i]->mark == mark + 2)
+				continue;
+
+			j->parents[i]->mark = mark + 2;
+			j->parents[i]->mark_next = outside;
+			outside = j->parents[i];
+		}
+	}
+
+	for (j = outside; j != NULL; j = j->mark_next)
+		job_edges_keep(j, mark, false);
+	for (j = closure; j != NULL; j = j->mark_next)
+		job_edges_keep(j, mark, true);
+}
+
+void job_closure_unlink(struct job **closure, size_t n, uint32_t mark)
+{
+	if (n == 0)
 		return;
 
-	/* deps_filled will be decremented by recusrive call to job_free()
-	 * itself, see job_deps_list_rm() in the next for loop */
-	while (job->deps_filled)
-		job_free(*job->deps);
-	free(job->deps);
+	for (size_t k = 0; k + 1 < n; k++)
+		closure[k]->mark_next = closure[k + 1];
+	closure[n - 1]->mark_next = NULL;
 
-	for (size_t i = 0; i < job->parents_filled; i++)
-		job_deps_list_rm(job->parents[i], job);
-	free(job->parents);
+	job_closure_unlink_list(closure[0], mark);
+}
 
-	for (size_t i = 0; i < job->outputs_filled; i++)
-		output_free(job->outputs[i]);
-	free(job->outputs);
+/* Frees job along with the deps only it needs, and theirs. A dep goes once
+ * every one of its parents does, the parents are counted in mark_parents
+ * while the dep is stamped mark + 1. The closure is listed through
+ * mark_next, there's nothing to allocate and nothing to fail. */
+void job_free(struct job *job)
+{
+	struct job *j, *dep, *next, *tail;
+	uint32_t mark;
 
-	free(job->drv_path);
-	free(job->name);
-	free(job->nix_attr_name);
-	free(job);
+	if (job == NULL)
+		return;
+
+	mark = job_mark_next();
+	job->mark = mark;
+	job->mark_next = NULL;
+	tail = job;
+	for (j = job; j != NULL; j = j->mark_next) {
+		for (size_t i = 0; i < j->deps_filled; i++) {
+			dep = j->deps[i];
+			if (dep->mark == mark)
+				continue;
+
+			if (dep->mark != mark + 1) {
+				dep->mark = mark + 1;
+				dep->mark_parents = 0;
+			}
+			dep->mark_parents++;
+			if (dep->mark_parents < dep->parents_filled)
+				continue;
+
+			dep->mark = mark;
+			dep->mark_next = NULL;
+			tail->mark_next = dep;
+			tail = dep;
+		}
+	}
+	job_closure_unlink_list(job, mark);
+
+	/* arena_free() takes the first bytes of j for its free list */
+	for (j = job; j != NULL; j = next) {
+		next = j->mark_next;
+
+		job_edges_free(j->deps, j->deps_size);
+		job_edges_free(j->parents, j->parents_size);
+		for (size_t i = 0; i < j->outputs_filled; i++)
+			output_free(j->outputs[i]);
+		job_edges_free(j->outputs, j->outputs_size);
+		arena_free(&job_arena, j);
+	}
 }
 
-static int job_new(struct job **j, char *name, char *drv_path, char *attr,
-		   struct job *parent)
+int job_new(struct job **j, char *name, const char *drv_path, char *attr,
+	    struct job *parent)
 {
 	struct job *job;
 	int ret = 0;
 
-	job = malloc(sizeof(*job));
-	if (job == NULL) {
-		print_err("%s", strerror(errno));
+	job = arena_alloc(&job_arena, sizeof(*job));
+	if (job == NULL)
 		return -errno;
-	}
 	job->requested = false;
+	job->insubstituters = false;
 	job->id = -1;
+	job->cost = JOB_COST_UNSET;
+	job->cost_recursive = JOB_COST_UNSET;
+	job->cost_estimated = false;
+	job->cost_mean = JOB_COST_UNSET;
+	job->cost_variance = 0;
+	job->closure_epoch = 0;
+	job->mark = 0;
+	job->mark_parents = 0;
+	job->mark_next = NULL;
+	job->closure_generation = 0;
+	job->pname = NULL;
 
 	job->outputs_size = 0;
 	job->outputs_filled = 0;
@@ -637,14 +1346,12 @@ static int job_new(struct job **j, char *name, char *drv_path, char *attr,
 	if (evanix_opts.check_cache_status) {
 		job->stale = true;
 	} else {
-		job->insubstituters = false;
 		job->stale = false;
 	}
 
 	if (attr != NULL) {
-		job->nix_attr_name = strdup(attr);
+		job->nix_attr_name = job_strdup(attr);
 		if (job->nix_attr_name == NULL) {
-			print_err("%s", strerror(errno));
 			ret = -errno;
 			goto out_free_job;
 		}
@@ -653,41 +1360,29 @@ static int job_new(struct job **j, char *name, char *drv_path, char *attr,
 	}
 
 	if (name != NULL) {
-		job->name = strdup(name);
+		job->name = job_strdup(name);
 		if (job->name == NULL) {
-			print_err("%s", strerror(errno));
 			ret = -errno;
-			goto out_free_attr;
+			goto out_free_job;
 		}
 	} else {
 		job->name = NULL;
 	}
 
-	job->drv_path = strdup(drv_path);
+	job->drv_path = intern(&job_paths, drv_path);
 	if (job->drv_path == NULL) {
-		print_err("%s", strerror(errno));
 		ret = -errno;
-		goto out_free_name;
+		goto out_free_job;
 	}
+	job->drv_hash = jobtab_hash(job->drv_path);
 
-	if (parent != NULL) {
+	if (parent != NULL)
 		ret = job_parents_list_insert(job, parent);
-		if (ret < 0)
-			goto out_free_drv_path;
-	}
 
-out_free_drv_path:
-	if (ret < 0)
-		free(job->drv_path);
-out_free_name:
-	if (ret < 0)
-		free(job->name);
-out_free_attr:
-	if (ret < 0)
-		free(job->nix_attr_name);
+	/* name and nix_attr_name stay in job_names until jobs_release() */
 out_free_job:
 	if (ret < 0)
-		free(job);
+		arena_free(&job_arena, job);
 	else
 		*j = job;
 
@@ -710,12 +1405,61 @@ int jobs_init(FILE **stream, char *expr)
 	return vpopen(stream, XSTR(NIX_EVAL_JOBS_PATH), args, VPOPEN_STDOUT);
 }
 
-void job_stale_set(struct job *job)
+/* the jobs left to go through are stacked through mark_next */
+size_t job_stale_set(struct job *job)
 {
+	struct job *j, *stack;
+	size_t requested = 0;
+
 	if (job->stale)
-		return;
+		return 0;
 
 	job->stale = true;
-	for (size_t i = 0; i < job->parents_filled; i++)
-		job_stale_set(job->parents[i]);
+	requested += job->requested;
+	job->mark_next = NULL;
+	stack = job;
+	while (stack != NULL) {
+		j = stack;
+		stack = j->mark_next;
+		for (size_t i = 0; i < j->parents_filled; i++) {
+			if (j->parents[i]->stale)
+				continue;
+
+			j->parents[i]->stale = true;
+			requested += j->parents[i]->requested;
+			j->parents[i]->mark_next = stack;
+			stack = j->parents[i];
+		}
+	}
+
+	return requested;
+}
+
+void jobs_memory(struct jobs_memory *m)
+{
+	struct arena_stats edges;
+
+	arena_stats(&job_arena, &m->jobs);
+	arena_stats(&output_arena, &m->outputs);
+	intern_stats(&job_paths, &m->paths);
+	arena_stats(&job_names, &m->names);
+
+	memset(&m->edges, 0, sizeof(m->edges));
+	for (size_t k = 0; k < JOB_EDGES_CLASSES; k++) {
+		arena_stats(&job_edges[k], &edges);
+		m->edges.allocs += edges.allocs;
+		m->edges.reuses += edges.reuses;
+		m->edges.chunks += edges.chunks;
+		m->edges.bytes += edges.bytes;
+	}
+}
+
+void jobs_release(void)
+{
+	arena_release(&job_arena);
+	arena_release(&output_arena);
+	intern_release(&job_paths);
+	for (size_t k = 0; k < JOB_EDGES_CLASSES; k++)
+		arena_release(&job_edges[k]);
+	arena_release(&job_names);
 }
@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobtab.h"
+#include "util.h"
+
+#define JOBTAB_SLOTS_MIN 64
+/* digits of a store path hash, nix's own base32 */
+#define STORE_HASH_LEN 32
+
+static int jobtab_grow(struct jobtab *tab);
+static size_t jobtab_slot(struct jobtab *tab, const char *drv_path,
+			  uint64_t hash);
+
+/* each digit of nix's own base32 plus 1, 0 for anything else */
+static const uint8_t store_hash_digits[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6,
+	['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10, ['a'] = 11, ['b'] = 12,
+	['c'] = 13, ['d'] = 14, ['f'] = 15, ['g'] = 16, ['h'] = 17, ['i'] = 18,
+	['j'] = 19, ['k'] = 20, ['l'] = 21, ['m'] = 22, ['n'] = 23, ['p'] = 24,
+	['q'] = 25, ['r'] = 26, ['s'] = 27, ['v'] = 28, ['w'] = 29, ['x'] = 30,
+	['y'] = 31, ['z'] = 32,
+};
+
+int store_hash_decode(const char *path, uint8_t hash[STORE_HASH_SIZE])
+{
+	unsigned bit, byte, shift;
+	unsigned char c;
+	const char *p;
+	int digit;
+
+	p = strrchr(path, '/');
+	if (p == NULL)
+		return -EINVAL;
+	p++;
+	if (strnlen(p, STORE_HASH_LEN + 1) <= STORE_HASH_LEN ||
+	    p[STORE_HASH_LEN] != '-')
+		return -EINVAL;
+
+	/* the last digit holds the lowest bits, see nix's parseHash32() */
+	memset(hash, 0, STORE_HASH_SIZE);
+	for (unsigned n = 0; n < STORE_HASH_LEN; n++) {
+		c = p[STORE_HASH_LEN - n - 1];
+		digit = store_hash_digits[c] - 1;
+		if (digit < 0)
+			return -EINVAL;
+
+		bit = n * 5;
+		byte = bit / 8;
+		shift = bit % 8;
+		hash[byte] |= digit << shift;
+		if (byte < STORE_HASH_SIZE - 1)
+			hash[byte + 1] |= digit >> (8 - shift);
+	}
+
+	return 0;
+}
+
+/* any 8 bytes of a store path hash are as good as a hash function, anything
+ * else like the paths of the tests falls back to fnv1a_64() */
+uint64_t jobtab_hash(const char *path)
+{
+	uint8_t hash[STORE_HASH_SIZE];
+	uint64_t key;
+
+	if (store_hash_decode(path, hash) < 0)
+		return fnv1a_64(FNV1A_64_INIT, path, strlen(path));
+
+	memcpy(&key, hash, sizeof(key));
+	return key;
+}
+
+static int jobtab_grow(struct jobtab *tab)
+{
+	struct jobtab_slot *slots;
+	size_t newsize, mask, j;
+
+	newsize = tab->slots_size == 0 ? JOBTAB_SLOTS_MIN : tab->slots_size * 2;
+	slots = calloc(newsize, sizeof(*slots));
+	if (slots == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	mask = newsize - 1;
+	for (size_t i = 0; i < tab->slots_size; i++) {
+		if (tab->slots[i].job == NULL)
+			continue;
+
+		for (j = tab->slots[i].hash & mask; slots[j].job != NULL;
+		     j = (j + 1) & mask)
+			;
+		slots[j] = tab->slots[i];
+	}
+
+	free(tab->slots);
+	tab->slots = slots;
+	tab->slots_size = newsize;
+
+	return 0;
+}
+
+/* the slot of drv_path, or the empty one it would go in, tab must have
+ * slots. drv paths are interned, so a job found is mostly the same pointer
+ * and strcmp() is for paths that came from elsewhere. */
+static size_t jobtab_slot(struct jobtab *tab, const char *drv_path,
+			  uint64_t hash)
+{
+	struct jobtab_slot *slot;
+	size_t mask, i;
+
+	mask = tab->slots_size - 1;
+	for (i = hash & mask; tab->slots[i].job != NULL; i = (i + 1) & mask) {
+		slot = &tab->slots[i];
+		if (slot->hash != hash)
+			continue;
+		if (slot->job->drv_path == drv_path ||
+		    !strcmp(slot->job->drv_path, drv_path))
+			break;
+	}
+
+	return i;
+}
+
+void jobtab_init(struct jobtab *tab)
+{
+	tab->slots_size = 0;
+	tab->slots_filled = 0;
+	tab->slots = NULL;
+}
+
+struct job *jobtab_find(struct jobtab *tab, const char *drv_path,
+			uint64_t hash)
+{
+	if (tab->slots_filled == 0)
+		return NULL;
+
+	return tab->slots[jobtab_slot(tab, drv_path, hash)].job;
+}
+
+int jobtab_insert(struct jobtab *tab, struct job *job)
+{
+	size_t i;
+	int ret;
+
+	/* keeps it at most 3/4 full */
+	if (4 * (tab->slots_filled + 1) > 3 * tab->slots_size) {
+		ret = jobtab_grow(tab);
+		if (ret < 0)
+			return ret;
+	}
+
+	i = jobtab_slot(tab, job->drv_path, job->drv_hash);
+	if (tab->slots[i].job != NULL)
+		return -EEXIST;
+	tab->slots[i].hash = job->drv_hash;
+	tab->slots[i].job = job;
+	tab->slots_filled++;
+
+	return 0;
+}
+
+/* shifts back what comes after job in its run instead of leaving a
+ * tombstone, so lookups never probe further than the table is full */
+void jobtab_del(struct jobtab *tab, struct job *job)
+{
+	size_t mask, i, j, home;
+
+	if (tab->slots_filled == 0)
+		return;
+
+	i = jobtab_slot(tab, job->drv_path, job->drv_hash);
+	if (tab->slots[i].job != job)
+		return;
+
+	mask = tab->slots_size - 1;
+	for (j = (i + 1) & mask; tab->slots[j].job != NULL;
+	     j = (j + 1) & mask) {
+		/* stays put if its home slot is after the hole */
+		home = tab->slots[j].hash & mask;
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		tab->slots[i] = tab->slots[j];
+		i = j;
+	}
+	tab->slots[i].job = NULL;
+	tab->slots_filled--;
+}
+
+void jobtab_free(struct jobtab *tab)
+{
+	free(tab->slots);
+	jobtab_init(tab);
+}
@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+#include "util.h"
+
+static int model_line_read(struct model *model, char *line);
+
+int model_coef_insert(struct model *model, const char *pname, double coef)
+{
+	struct model_coef *c;
+
+	HASH_FIND_STR(model->htab, pname, c);
+	if (c != NULL) {
+		c->coef = coef;
+		return 0;
+	}
+
+	c = malloc(sizeof(*c));
+	if (c == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	c->pname = strdup(pname);
+	if (c->pname == NULL) {
+		print_err("%s", strerror(errno));
+		free(c);
+		return -errno;
+	}
+	c->coef = coef;
+
+	HASH_ADD_KEYPTR(hh, model->htab, c->pname, strlen(c->pname), c);
+	return 0;
+}
+
+static int model_line_read(struct model *model, char *line)
+{
+	char *tab, *end;
+	double value;
+
+	line = trim(line);
+	if (*line == '\0')
+		return 0;
+
+	tab = strrchr(line, '\t');
+	if (tab == NULL)
+		return -EINVAL;
+	*tab = '\0';
+
+	errno = 0;
+	value = strtod(tab + 1, &end);
+	if (errno != 0 || end == tab + 1 || *end != '\0')
+		return -EINVAL;
+
+	if (!strcmp(line, "intercept")) {
+		model->intercept = value;
+		return 0;
+	}
+
+	return model_coef_insert(model, line, value);
+}
+
+int model_new(struct model **model)
+{
+	struct model *m;
+
+	m = malloc(sizeof(*m));
+	if (m == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	m->intercept = 0;
+	m->htab = NULL;
+
+	*model = m;
+	return 0;
+}
+
+int model_read(struct model **model, const char *path)
+{
+	FILE *stream;
+
+	struct model *m = NULL;
+	size_t line_size = 0, lineno = 1;
+	char *line = NULL;
+	int ret = 0;
+
+	stream = fopen(path, "r");
+	if (stream == NULL) {
+		print_err("%s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	ret = model_new(&m);
+	if (ret < 0)
+		goto out_close_stream;
+
+	if (getline(&line, &line_size, stream) < 0 ||
+	    strcmp(trim(line), MODEL_MAGIC)) {
+		print_err("%s: not an evanix model", path);
+		ret = -EINVAL;
+		goto out_close_stream;
+	}
+
+	while (getline(&line, &line_size, stream) >= 0) {
+		lineno++;
+		ret = model_line_read(m, line);
+		if (ret == -EINVAL) {
+			print_err("%s:%zu: invalid line", path, lineno);
+			goto out_close_stream;
+		} else if (ret < 0) {
+			goto out_close_stream;
+		}
+	}
+
+out_close_stream:
+	free(line);
+	fclose(stream);
+	if (ret < 0)
+		model_free(m);
+	else
+		*model = m;
+
+	return ret;
+}
+
+int model_write(struct model *model, const char *path)
+{
+	struct model_coef *c, *tmp;
+	FILE *stream;
+
+	stream = fopen(path, "w");
+	if (stream == NULL) {
+		print_err("%s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	/* %.17g so the doubles read back the same */
+	fprintf(stream, "%s\nintercept\t%.17g\n", MODEL_MAGIC,
+		model->intercept);
+	HASH_ITER (hh, model->htab, c, tmp)
+		fprintf(stream, "%s\t%.17g\n", c->pname, c->coef);
+
+	if (fclose(stream) != 0) {
+		print_err("%s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+void model_free(struct model *model)
+{
+	struct model_coef *c, *tmp;
+
+	if (model == NULL)
+		return;
+
+	HASH_ITER (hh, model->htab, c, tmp) {
+		HASH_DEL(model->htab, c);
+		free(c->pname);
+		free(c);
+	}
+	free(model);
+}
+
+double model_predict(struct model *model, char **pnames, size_t n)
+{
+	struct model_coef *c;
+	double prediction;
+	bool isdup;
+
+	prediction = model->intercept;
+	for (size_t i = 0; i < n; i++) {
+		/* inputs are few, a hash set isn't worth it */
+		isdup = false;
+		for (size_t j = 0; j < i && !isdup; j++)
+			isdup = !strcmp(pnames[i], pnames[j]);
+		if (isdup)
+			continue;
+
+		HASH_FIND_STR(model->htab, pnames[i], c);
+		if (c != NULL)
+			prediction += c->coef;
+	}
+
+	return prediction;
+}
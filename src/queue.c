@@ -5,94 +5,175 @@
 #include <string.h>
 #include <sys/queue.h>
 
+#include "cache_check.h"
+#include "closure.h"
 #include "evanix.h"
+#include "ingest.h"
 #include "queue.h"
 #include "solver_conformity.h"
 #include "util.h"
 
 #define MAX_NIX_PKG_COUNT 200000
 
-static int queue_push(struct queue *queue, struct job *job);
-static int queue_dag_isolate(struct job *job, struct job *keep_parent,
-			     struct job_clist *jobs, struct job **htab);
+static void queue_read(struct cache_check *cc, struct eval_mux *mux);
+static int queue_closure_push(struct job ***closure, size_t *size,
+			      size_t *filled, struct job *job);
+static int queue_dag_isolate(struct job *job, struct queue *queue);
+static int queue_htab_job_replace(struct job *job, struct job *jtab);
 
-static int queue_dag_isolate(struct job *job, struct job *keep_parent,
-			     struct job_clist *jobs, struct job **htab)
+static int queue_closure_push(struct job ***closure, size_t *size,
+			      size_t *filled, struct job *job)
 {
-	int ret;
+	size_t newsize;
+	void *ret;
+
+	if (*filled == *size) {
+		newsize = *size == 0 ? 64 : *size * 2;
+		ret = realloc(*closure, newsize * sizeof(**closure));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
 
-	for (size_t i = 0; i < job->deps_filled; i++) {
-		ret = queue_dag_isolate(job->deps[i], job, jobs, htab);
-		if (ret < 0)
-			return ret;
+		*closure = ret;
+		*size = newsize;
 	}
 
-	for (size_t i = 0; i < job->parents_filled; i++) {
-		if (job->parents[i] == keep_parent)
-			continue;
+	(*closure)[(*filled)++] = job;
+	return 0;
+}
 
-		job_deps_list_rm(job->parents[i], job);
-	}
+/* takes job and its closure out of htab and jobs, along with the edges that
+ * tie them to what isn't in it, so they are left to whoever builds job */
+static int queue_dag_isolate(struct job *job, struct queue *queue)
+{
+	struct job *j, *jtab, **closure = NULL;
+	size_t closure_size = 0, closure_filled = 0;
+	uint32_t mark;
+	int ret = 0;
 
-	if (keep_parent != NULL) {
-		job->parents[0] = keep_parent;
-		job->parents_filled = 1;
-	} else {
-		/* it must be tha parent */
-		job->parents_filled = 0;
+	/* out of htab means in the closure, everything else is still in */
+	jobtab_del(&queue->htab, job);
+	ret = queue_closure_push(&closure, &closure_size, &closure_filled, job);
+	for (size_t k = 0; ret >= 0 && k < closure_filled; k++) {
+		j = closure[k];
+		for (size_t i = 0; i < j->deps_filled; i++) {
+			jtab = jobtab_find(&queue->htab, j->deps[i]->drv_path,
+					   j->deps[i]->drv_hash);
+			if (jtab != j->deps[i])
+				continue;
+
+			jobtab_del(&queue->htab, jtab);
+			ret = queue_closure_push(&closure, &closure_size,
+						 &closure_filled, jtab);
+			if (ret < 0)
+				break;
+		}
+	}
+	if (ret < 0)
+		goto out_free_closure;
+
+	mark = job_mark_next();
+	for (size_t k = 0; k < closure_filled; k++) {
+		closure[k]->mark = mark;
+		if (queue->dag != NULL)
+			dag_building_set(queue->dag, closure[k]);
+		if (queue->closure_set != NULL)
+			closure_set_exclude(queue->closure_set, closure[k]);
 	}
+	job_closure_unlink(closure, closure_filled, mark);
 
-	if (job->requested)
-		CIRCLEQ_REMOVE(jobs, job, clist);
+	for (size_t k = 0; k < closure_filled; k++) {
+		if (!closure[k]->requested)
+			continue;
 
-	HASH_DEL(*htab, job);
+		CIRCLEQ_REMOVE(&queue->jobs, closure[k], clist);
+		queue->requested--;
+		if (closure[k]->stale)
+			queue->stale--;
+	}
 
-	return 0;
+out_free_closure:
+	free(closure);
+
+	return ret;
 }
 
-int queue_isempty(struct job_clist *jobs)
+int queue_isempty(struct queue *queue)
 {
-	struct job *j;
+	bool isempty;
 
-	CIRCLEQ_FOREACH (j, jobs, clist) {
-		if (j->stale == false)
-			return false;
-	}
+	pthread_mutex_lock(&queue->mutex);
+	isempty = queue->requested == queue->stale;
+	pthread_mutex_unlock(&queue->mutex);
 
-	return true;
+	return isempty;
 }
 
-void *queue_thread_entry(void *queue_thread)
+void queue_counts(struct queue *queue, struct queue_counts *counts)
 {
-	struct queue_thread *qt = queue_thread;
+	pthread_mutex_lock(&queue->mutex);
+	counts->requested = queue->requested;
+	counts->stale = queue->stale;
+	counts->ready = queue->requested - queue->stale;
+	counts->building = queue->building;
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+static void queue_read(struct cache_check *cc, struct eval_mux *mux)
+{
+	const char *attr_prefix;
 	struct job *job = NULL;
+	size_t line_size = 0;
+	char *line = NULL;
 	int ret = 0;
 
-	while (true) {
-		ret = job_read(qt->stream, &job);
-		if (ret == JOB_READ_EOF) {
-			qt->queue->state = Q_ITS_OVER;
-			sem_post(&qt->queue->sem);
-
-			ret = 0;
-			break;
-		} else if (ret == JOB_READ_EVAL_ERR ||
-			   ret == JOB_READ_JSON_INVAL ||
-			   ret == JOB_READ_SYS_MISMATCH ||
-			   ret == JOB_READ_CACHED) {
+	while (eval_mux_getline(mux, &line, &line_size, &attr_prefix) >= 0) {
+		ret = job_parse(line, attr_prefix, &job);
+		if (ret == JOB_READ_EVAL_ERR || ret == JOB_READ_JSON_INVAL ||
+		    ret == JOB_READ_SYS_MISMATCH) {
 			continue;
-		} else if (ret == JOB_READ_SUCCESS) {
-			queue_push(qt->queue, job);
-		} else {
+		} else if (ret != JOB_READ_SUCCESS) {
 			break;
 		}
+
+		ret = cache_check_submit(cc, job);
+		if (ret < 0)
+			break;
 	}
 
+	free(line);
+}
+
+void *queue_thread_entry(void *queue_thread)
+{
+	struct queue_thread *qt = queue_thread;
+	struct cache_check *cc;
+
+	if (cache_check_new(&cc, qt->queue, evanix_opts.cache_check_jobs) < 0)
+		goto out_done;
+
+	if (evanix_opts.ingest_threads > 1)
+		ingest_run(cc, qt->mux, evanix_opts.ingest_threads);
+	else
+		queue_read(cc, qt->mux);
+
+	cache_check_finish(cc);
+out_done:
+	queue_done(qt->queue);
 	pthread_exit(NULL);
 }
 
+void queue_done(struct queue *queue)
+{
+	queue->state = Q_ITS_OVER;
+	sem_post(&queue->sem);
+}
+
 int queue_pop(struct queue *queue, struct job **job)
 {
+	double mean, variance;
+	struct closure c;
 	int ret;
 	struct job *j;
 
@@ -103,16 +184,30 @@ int queue_pop(struct queue *queue, struct job **job)
 
 	pthread_mutex_lock(&queue->mutex);
 	if (evanix_opts.max_builds || evanix_opts.max_time) {
-		ret = evanix_opts.solver(&j, &queue->jobs, queue->resources);
+		ret = evanix_opts.solver(&j, queue, queue->resources);
 		if (ret < 0)
 			goto out_mutex_unlock;
 		queue->resources -= ret;
 	} else {
 		j = CIRCLEQ_FIRST(&queue->jobs);
 	}
-	ret = queue_dag_isolate(j, NULL, &queue->jobs, &queue->htab);
+
+	/* before isolating, the deps left are what building j takes */
+	if (evanix_opts.max_time) {
+		closure_init(&c);
+		ret = closure_moments(&c, j, &mean, &variance);
+		closure_free(&c);
+		if (ret < 0)
+			goto out_mutex_unlock;
+
+		queue->planned_mean += mean;
+		queue->planned_variance += variance;
+	}
+
+	ret = queue_dag_isolate(j, queue);
 	if (ret < 0)
 		goto out_mutex_unlock;
+	queue->building++;
 
 out_mutex_unlock:
 	pthread_mutex_unlock(&queue->mutex);
@@ -122,108 +217,210 @@ out_mutex_unlock:
 	return ret;
 }
 
-/* this merge functions are closely tied to the output characteristics of
- * nix-eval-jobs, that is
- * - only two level of nodes (root and childrens or dependencies)
- * - only childrens or dependencies have parent node
- * - only root node have dependencies
- */
-int queue_htab_job_merge(struct job **job, struct job **htab)
+int queue_dag(struct queue *queue, struct dag **dag)
 {
 	int ret;
-	struct job *jtab = NULL;
-	struct job *j = *job;
 
-	HASH_FIND_STR(*htab, j->drv_path, jtab);
-	if (jtab == NULL) {
-		HASH_ADD_STR(*htab, drv_path, j);
+	if (queue->dag == NULL) {
+		ret = dag_new(&queue->dag, &queue->jobs);
+		if (ret < 0)
+			return ret;
+	}
 
-		for (size_t i = 0; i < j->deps_filled; i++) {
-			ret = queue_htab_job_merge(&j->deps[i], htab);
-			if (ret < 0)
-				return ret;
-		}
+	*dag = queue->dag;
+	return 0;
+}
 
-		return 0;
+int queue_closure_set(struct queue *queue, struct closure_set **cs)
+{
+	struct dag *dag;
+	int ret;
+
+	if (queue->closure_set == NULL) {
+		ret = queue_dag(queue, &dag);
+		if (ret < 0)
+			return ret;
+
+		ret = closure_set_new(&queue->closure_set, dag);
+		if (ret < 0 && ret != -E2BIG)
+			return ret;
 	}
 
-	/* if it's already inside htab, it's deps should also be in htab, hence
-	 * not merging deps */
+	*cs = queue->closure_set;
+	return 0;
+}
+
+void queue_dag_stale_set(struct queue *queue, uint32_t node)
+{
+	queue->stale += dag_stale_set(queue->dag, node);
+}
+
+void queue_build_done(struct queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	queue->building--;
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/* hands the parents of job over to jtab, its duplicate in htab, then frees
+ * job along with the deps nothing else needs, jtab has them already */
+static int queue_htab_job_replace(struct job *job, struct job *jtab)
+{
+	struct job *parent;
+	int ret;
+
 	if (jtab->name == NULL) {
 		/* steal name from new job struct */
-		jtab->name = j->name;
-		j->name = NULL;
+		jtab->name = job->name;
+		job->name = NULL;
 	}
 
-	/* only recursive calls with childrens or dependencies can enter this
-	 * for a recursive call to happen the parent was just entered into htab
-	 * so,
-	 * - update parent's reference to point to jtab (done by *job = jtab)
-	 * - insert the parent to jtab
-	 */
-	if (j->parents_filled > 0) {
-		ret = job_parents_list_insert(jtab, j->parents[0]);
+	for (size_t i = 0; i < job->parents_filled; i++) {
+		parent = job->parents[i];
+		for (size_t k = 0; k < parent->deps_filled; k++) {
+			if (parent->deps[k] == job)
+				parent->deps[k] = jtab;
+		}
+
+		ret = job_parents_list_insert(jtab, parent);
 		if (ret < 0)
 			return ret;
-		j->parents_filled = 0;
+		/* jtab may not cost what job did */
+		parent->cost_recursive = JOB_COST_UNSET;
 	}
+	job->parents_filled = 0;
 
-	job_free(*job);
-	*job = jtab;
+	job_free(job);
 	return 0;
 }
 
-static int queue_push(struct queue *queue, struct job *job)
+/* Merges the DAG of job into htab, it may be the two levels nix-eval-jobs
+ * hands out or all of the closure, see job_read_closure(). A drv already in
+ * htab takes the place of its duplicate in job's DAG, and as whatever is in
+ * htab has its deps in there too, what is below the duplicate is dropped. */
+int queue_htab_job_merge(struct job **job, struct jobtab *htab)
 {
+	struct job *j, *jtab, **stack = NULL;
+	size_t stack_size = 0, stack_filled = 0;
 	int ret;
 
-	pthread_mutex_lock(&queue->mutex);
-	ret = queue_htab_job_merge(&job, &queue->htab);
-	if (ret < 0) {
-		pthread_mutex_unlock(&queue->mutex);
+	jtab = jobtab_find(htab, (*job)->drv_path, (*job)->drv_hash);
+	if (jtab != NULL) {
+		ret = queue_htab_job_replace(*job, jtab);
+		if (ret < 0)
+			return ret;
+
+		*job = jtab;
+		return 0;
+	}
+
+	ret = jobtab_insert(htab, *job);
+	if (ret < 0)
 		return ret;
+	ret = queue_closure_push(&stack, &stack_size, &stack_filled, *job);
+	while (ret >= 0 && stack_filled > 0) {
+		j = stack[--stack_filled];
+		for (size_t i = 0; i < j->deps_filled; i++) {
+			jtab = jobtab_find(htab, j->deps[i]->drv_path,
+					   j->deps[i]->drv_hash);
+			/* reached through another parent already */
+			if (jtab == j->deps[i])
+				continue;
+
+			if (jtab != NULL) {
+				ret = queue_htab_job_replace(j->deps[i], jtab);
+				if (ret < 0)
+					break;
+				continue;
+			}
+
+			ret = jobtab_insert(htab, j->deps[i]);
+			if (ret < 0)
+				break;
+			ret = queue_closure_push(&stack, &stack_size,
+						 &stack_filled, j->deps[i]);
+			if (ret < 0)
+				break;
+		}
 	}
+	free(stack);
 
-	/* no duplicate entries in queue */
-	if (!job->requested) {
-		job->requested = true;
-		CIRCLEQ_INSERT_TAIL(&queue->jobs, job, clist);
+	return ret;
+}
+
+int queue_push_batch(struct queue *queue, struct job **jobs, size_t n)
+{
+	struct job *j;
+	size_t pushed;
+	int ret = 0;
+
+	pthread_mutex_lock(&queue->mutex);
+	/* merging adds nodes and edges, the DAG has to be frozen again */
+	if (n > 0) {
+		closure_set_free(queue->closure_set);
+		queue->closure_set = NULL;
+		dag_free(queue->dag);
+		queue->dag = NULL;
+	}
+	for (pushed = 0; pushed < n; pushed++) {
+		ret = queue_htab_job_merge(&jobs[pushed], &queue->htab);
+		j = jobs[pushed];
+		/* a job that got into htab is the queue's, half merged or
+		 * not */
+		if (ret < 0 &&
+		    jobtab_find(&queue->htab, j->drv_path, j->drv_hash) != j)
+			break;
+
+		/* no duplicate entries in queue */
+		if (!j->requested) {
+			j->requested = true;
+			CIRCLEQ_INSERT_TAIL(&queue->jobs, j, clist);
+			queue->requested++;
+			/* a dep a solver gave up on already */
+			if (j->stale)
+				queue->stale++;
+		}
+		if (ret < 0) {
+			pushed++;
+			break;
+		}
 	}
 	pthread_mutex_unlock(&queue->mutex);
-	sem_post(&queue->sem);
 
-	return 0;
+	/* what wasn't queued has no other owner */
+	for (size_t i = pushed; i < n; i++)
+		job_free(jobs[i]);
+
+	for (size_t i = 0; i < pushed; i++)
+		sem_post(&queue->sem);
+
+	return ret;
 }
 
 void queue_thread_free(struct queue_thread *queue_thread)
 {
-	struct job *j;
 	int ret;
 
 	if (queue_thread == NULL)
 		return;
 
-	while (!CIRCLEQ_EMPTY(&queue_thread->queue->jobs)) {
-		j = CIRCLEQ_FIRST(&queue_thread->queue->jobs);
-		ret = queue_dag_isolate(j, NULL, &queue_thread->queue->jobs,
-					&queue_thread->queue->htab);
-		if (ret < 0)
-			return;
-		job_free(j);
-	}
-
 	ret = sem_destroy(&queue_thread->queue->sem);
 	if (ret < 0)
 		print_err("%s", strerror(errno));
 	ret = pthread_mutex_destroy(&queue_thread->queue->mutex);
 	if (ret < 0)
 		print_err("%s", strerror(errno));
+	cache_memo_free(&queue_thread->queue->memo);
+	jobtab_free(&queue_thread->queue->htab);
+	closure_set_free(queue_thread->queue->closure_set);
+	dag_free(queue_thread->queue->dag);
 
 	free(queue_thread->queue);
 	free(queue_thread);
 }
 
-int queue_thread_new(struct queue_thread **queue_thread, FILE *stream)
+int queue_thread_new(struct queue_thread **queue_thread,
+		     struct eval_mux *mux)
 {
 	int ret = 0;
 	struct queue_thread *qt = NULL;
@@ -233,7 +430,7 @@ int queue_thread_new(struct queue_thread **queue_thread, FILE *stream)
 		print_err("%s", strerror(errno));
 		return -errno;
 	}
-	qt->stream = stream;
+	qt->mux = mux;
 
 	qt->queue = malloc(sizeof(*qt->queue));
 	if (qt->queue == NULL) {
@@ -249,8 +446,16 @@ int queue_thread_new(struct queue_thread **queue_thread, FILE *stream)
 	else
 		qt->queue->resources = 0;
 
-	qt->queue->htab = NULL;
+	jobtab_init(&qt->queue->htab);
+	qt->queue->requested = 0;
+	qt->queue->stale = 0;
+	qt->queue->building = 0;
+	cache_memo_init(&qt->queue->memo);
 	qt->queue->jobid = NULL;
+	qt->queue->dag = NULL;
+	qt->queue->closure_set = NULL;
+	qt->queue->planned_mean = 0;
+	qt->queue->planned_variance = 0;
 	qt->queue->state = Q_SEM_WAIT;
 	ret = sem_init(&qt->queue->sem, 0, 0);
 	if (ret < 0) {
@@ -1,83 +1,130 @@
 #include <errno.h>
 #include <queue.h>
 
+#include "closure.h"
+#include "dag.h"
 #include "evanix.h"
 #include "jobs.h"
 #include "queue.h"
 #include "solver_conformity.h"
 #include "util.h"
 
-static float conformity(struct job *job);
+static uint32_t conformity_deps_filled(struct dag *dag, uint32_t node);
+static float conformity(struct dag *dag, uint32_t node);
+
+/* the deps of node left in the queue, those of what was popped already are
+ * someone else's */
+static uint32_t conformity_deps_filled(struct dag *dag, uint32_t node)
+{
+	uint32_t deps_filled = 0;
+
+	for (uint32_t i = dag->deps_index[node]; i < dag->deps_index[node + 1];
+	     i++) {
+		if (!(dag->flags[dag->deps[i]] & DAG_BUILDING))
+			deps_filled++;
+	}
+
+	return deps_filled;
+}
 
 /* conformity is a ratio between number of direct feasible derivations sharing
  * dependencies of a derivation and total number of dependencies */
-static float conformity(struct job *job)
+static float conformity(struct dag *dag, uint32_t node)
 {
+	uint32_t dep, deps_filled, parent;
 	float conformity = 0;
 
-	if (job->deps_filled == 0)
+	deps_filled = conformity_deps_filled(dag, node);
+	if (deps_filled == 0)
 		return 0;
 
-	for (size_t i = 0; i < job->deps_filled; i++) {
-		for (size_t j = 0; j < job->deps[i]->parents_filled; j++) {
+	for (uint32_t i = dag->deps_index[node]; i < dag->deps_index[node + 1];
+	     i++) {
+		dep = dag->deps[i];
+		if (dag->flags[dep] & DAG_BUILDING)
+			continue;
+
+		for (uint32_t j = dag->parents_index[dep];
+		     j < dag->parents_index[dep + 1]; j++) {
+			parent = dag->parents[j];
 			/* don't count the job itself */
-			if (job->deps[i]->parents[j] == job)
+			if (parent == node)
 				continue;
 			/* don't count stale parents */
-			if (job->deps[i]->parents[j]->stale)
+			if (dag->flags[parent] & DAG_STALE)
 				continue;
 
 			conformity++;
 		}
 	}
-	conformity /= job->deps_filled;
+	conformity /= deps_filled;
 
 	return conformity;
 }
 
-int solver_conformity(struct job **job, struct job_clist *q, int32_t resources)
+int solver_conformity(struct job **job, struct queue *queue,
+		      int32_t resources)
 {
-	struct job *j;
+	uint32_t node, deps_filled;
+	struct closure_set *cs;
 	float conformity_cur;
+	struct dag *dag;
+	struct job *j;
 	int ret;
 
-	struct job *selected = NULL;
+	uint32_t selected = UINT32_MAX, selected_deps_filled = 0;
 	float conformity_max = -1;
 
-	CIRCLEQ_FOREACH (j, q, clist) {
-		if (j->stale)
+	ret = queue_dag(queue, &dag);
+	if (ret < 0)
+		return ret;
+	ret = queue_closure_set(queue, &cs);
+	if (ret < 0)
+		return ret;
+
+	for (uint32_t i = 0; i < dag->roots_filled; i++) {
+		node = dag->roots[i];
+		if (dag->flags[node] & (DAG_STALE | DAG_BUILDING))
 			continue;
 
-		ret = job_cost_recursive(j);
+		j = dag->jobid->jobs[node];
+		ret = cs ? closure_set_cost_marginal(cs, j)
+			 : dag_closure_cost(dag, node);
 		if (ret < 0)
 			return ret;
 
 		if (ret > resources) {
-			job_stale_set(j);
+			queue_dag_stale_set(queue, node);
 			if (evanix_opts.solver_report) {
-				printf("❌ refusing to build %s, cost: %d\n",
-				       j->drv_path, ret);
+				printf("❌ refusing to build %s, cost: %d%s\n",
+				       j->drv_path, ret,
+				       j->cost_estimated ? " (estimated)" : "");
 			}
 		}
 	}
 
-	CIRCLEQ_FOREACH (j, q, clist) {
-		if (j->stale)
+	for (uint32_t i = 0; i < dag->roots_filled; i++) {
+		node = dag->roots[i];
+		if (dag->flags[node] & (DAG_STALE | DAG_BUILDING))
 			continue;
 
-		conformity_cur = conformity(j);
+		conformity_cur = conformity(dag, node);
+		deps_filled = conformity_deps_filled(dag, node);
 		if (conformity_cur > conformity_max) {
 			conformity_max = conformity_cur;
-			selected = j;
+			selected = node;
+			selected_deps_filled = deps_filled;
 		} else if (conformity_cur == conformity_max &&
-			   selected->deps_filled > j->deps_filled) {
-			selected = j;
+			   selected_deps_filled > deps_filled) {
+			selected = node;
+			selected_deps_filled = deps_filled;
 		}
 	}
 
-	if (selected == NULL)
+	if (selected == UINT32_MAX)
 		return -ESRCH;
 
-	*job = selected;
-	return job_cost_recursive(selected);
+	*job = dag->jobid->jobs[selected];
+	return cs ? closure_set_cost_marginal(cs, *job)
+		  : dag_closure_cost(dag, selected);
 }
@@ -4,18 +4,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "closure.h"
+#include "dag.h"
 #include "evanix.h"
 #include "jobid.h"
 #include "solver_highs.h"
 #include "util.h"
 
-static int solver_highs_unwrapped(double *solution, struct job_clist *q,
-				  int32_t resources, struct jobid *jobid)
+static int solver_highs_unwrapped(double *solution, int32_t resources,
+				  struct dag *dag)
 {
 	HighsInt precedence_index[2];
 	double precedence_value[2];
 	int num_non_zero;
-	struct job *j;
+	uint32_t dep;
 	int ret;
 
 	double *col_profit = NULL;
@@ -28,30 +30,30 @@ static int solver_highs_unwrapped(double *solution, struct job_clist *q,
 	double *constraint_value = NULL;
 
 	/* set objective */
-	col_profit = calloc(jobid->filled, sizeof(*col_profit));
+	col_profit = calloc(dag->nodes, sizeof(*col_profit));
 	if (col_profit == NULL) {
 		print_err("%s", strerror(errno));
 		return -errno;
 	}
-	for (size_t i = 0; i < jobid->filled; i++) {
-		if (jobid->jobs[i]->requested)
+	for (uint32_t i = 0; i < dag->nodes; i++) {
+		if (dag->flags[i] & DAG_REQUESTED)
 			col_profit[i] = 1.0;
 	}
 
-	col_lower = calloc(jobid->filled, sizeof(*col_lower));
+	col_lower = calloc(dag->nodes, sizeof(*col_lower));
 	if (col_lower == NULL) {
 		print_err("%s", strerror(errno));
 		ret = -errno;
 		goto out_free_col_profit;
 	}
 
-	col_upper = malloc(jobid->filled * sizeof(*col_lower));
+	col_upper = malloc(dag->nodes * sizeof(*col_lower));
 	if (col_upper == NULL) {
 		print_err("%s", strerror(errno));
 		ret = -errno;
 		goto out_free_col_profit;
 	}
-	for (size_t i = 0; i < jobid->filled; i++)
+	for (uint32_t i = 0; i < dag->nodes; i++)
 		col_upper[i] = 1.0;
 
 	highs = Highs_create();
@@ -66,7 +68,7 @@ static int solver_highs_unwrapped(double *solution, struct job_clist *q,
 		goto out_free_col_profit;
 	}
 
-	ret = Highs_addCols(highs, jobid->filled, col_profit, col_lower,
+	ret = Highs_addCols(highs, dag->nodes, col_profit, col_lower,
 			    col_upper, 0, NULL, NULL, NULL);
 	if (ret != kHighsStatusOk) {
 		print_err("%s", "highs did not return kHighsStatusOk");
@@ -75,13 +77,13 @@ static int solver_highs_unwrapped(double *solution, struct job_clist *q,
 	}
 
 	/* set resource constraint */
-	constraint_index = malloc(jobid->filled * sizeof(*constraint_index));
+	constraint_index = malloc(dag->nodes * sizeof(*constraint_index));
 	if (constraint_index == NULL) {
 		print_err("%s", strerror(errno));
 		ret = -errno;
 		goto out_free_col_profit;
 	}
-	constraint_value = malloc(jobid->filled * sizeof(*constraint_value));
+	constraint_value = malloc(dag->nodes * sizeof(*constraint_value));
 	if (constraint_value == NULL) {
 		print_err("%s", strerror(errno));
 		ret = -errno;
@@ -89,10 +91,10 @@ static int solver_highs_unwrapped(double *solution, struct job_clist *q,
 	}
 
 	num_non_zero = 0;
-	for (size_t i = 0; i < jobid->filled; i++) {
-		ret = job_cost(jobid->jobs[i]);
+	for (uint32_t i = 0; i < dag->nodes; i++) {
+		ret = dag_cost(dag, i);
 		if (ret < 0)
-			return ret;
+			goto out_free_col_profit;
 		else if (ret == 0)
 			continue;
 
@@ -109,18 +111,21 @@ static int solver_highs_unwrapped(double *solution, struct job_clist *q,
 		goto out_free_col_profit;
 	}
 
-	/* set precedance constraints */
-	CIRCLEQ_FOREACH (j, q, clist) {
-		for (size_t i = 0; i < j->deps_filled; i++) {
+	/* set precedance constraints, on every edge so deps of deps are paid
+	 * for too */
+	for (uint32_t k = 0; k < dag->nodes; k++) {
+		for (uint32_t i = dag->deps_index[k];
+		     i < dag->deps_index[k + 1]; i++) {
+			dep = dag->deps[i];
 			/* follow the CSR matrix structure */
-			if (j->id < j->deps[i]->id) {
-				precedence_index[0] = j->id;
-				precedence_index[1] = j->deps[i]->id;
+			if (k < dep) {
+				precedence_index[0] = k;
+				precedence_index[1] = dep;
 				precedence_value[0] = 1;
 				precedence_value[1] = -1;
 			} else {
-				precedence_index[0] = j->deps[i]->id;
-				precedence_index[1] = j->id;
+				precedence_index[0] = dep;
+				precedence_index[1] = k;
 				precedence_value[0] = -1;
 				precedence_value[1] = 1;
 			}
@@ -138,13 +143,13 @@ static int solver_highs_unwrapped(double *solution, struct job_clist *q,
 		goto out_free_col_profit;
 	}
 
-	integrality = malloc(jobid->filled * sizeof(*integrality));
+	integrality = malloc(dag->nodes * sizeof(*integrality));
 	if (integrality == NULL) {
 		print_err("%s", strerror(errno));
 		ret = -errno;
 		goto out_free_col_profit;
 	}
-	for (size_t i = 0; i < jobid->filled; i++)
+	for (uint32_t i = 0; i < dag->nodes; i++)
 		integrality[i] = 1;
 	ret = Highs_changeColsIntegralityByMask(highs, integrality,
 						integrality);
@@ -179,69 +184,115 @@ out_free_col_profit:
 	return ret;
 }
 
+/* A refused job is charged only what the selected ones don't build anyway,
+ * through the bitsets of queue_closure_set() unless they would take too much
+ * memory. The solution is selected into those, it's what gets built. */
+static int solver_highs_report(struct queue *queue)
+{
+	struct closure_set *cs;
+	struct closure c;
+	struct job *j;
+	int ret;
+
+	ret = queue_closure_set(queue, &cs);
+	if (ret < 0)
+		return ret;
+
+	closure_init(&c);
+	CIRCLEQ_FOREACH (j, &queue->jobs, clist) {
+		if (j->stale)
+			continue;
+
+		ret = cs ? closure_set_select(cs, j) : closure_select(&c, j);
+		if (ret < 0)
+			goto out_free_closure;
+	}
+
+	CIRCLEQ_FOREACH (j, &queue->jobs, clist) {
+		if (!j->stale)
+			continue;
+
+		ret = cs ? closure_set_cost_marginal(cs, j)
+			 : closure_cost_marginal(&c, j);
+		if (ret < 0)
+			goto out_free_closure;
+
+		printf("❌ refusing to build %s, cost: %d%s\n", j->drv_path,
+		       ret, j->cost_estimated ? " (estimated)" : "");
+	}
+	printf("📦 selected cost: %d\n",
+	       cs ? cs->selected_cost : c.selected_cost);
+
+out_free_closure:
+	closure_free(&c);
+
+	return ret < 0 ? ret : 0;
+}
+
 static int job_get(struct job **job, struct job_clist *q)
 {
+	struct closure c;
 	struct job *j;
+	int ret;
 
 	CIRCLEQ_FOREACH (j, q, clist) {
 		if (j->stale)
 			continue;
 
+		closure_init(&c);
+		ret = closure_cost(&c, j);
+		closure_free(&c);
+
 		*job = j;
-		return job_cost_recursive(j);
+		return ret;
 	}
 
 	print_err("%s", "empty queue");
 	return -ESRCH;
 }
 
-int solver_highs(struct job **job, struct job_clist *q, int32_t resources)
+int solver_highs(struct job **job, struct queue *queue, int32_t resources)
 {
 	static bool solved = false;
-	struct jobid *jobid = NULL;
 	double *solution = NULL;
-	struct job *j;
+	struct dag *dag;
 	int ret = 0;
 
 	if (solved)
-		goto out_free_jobid;
+		goto out_free_solution;
 
-	ret = jobid_init(q, &jobid);
+	ret = queue_dag(queue, &dag);
 	if (ret < 0)
 		return ret;
 
-	solution = malloc(jobid->filled * sizeof(*solution));
+	solution = malloc(dag->nodes * sizeof(*solution));
 	if (solution == NULL) {
 		print_err("%s", strerror(errno));
 		ret = -errno;
-		goto out_free_jobid;
+		goto out_free_solution;
 	}
 
-	ret = solver_highs_unwrapped(solution, q, resources, jobid);
+	ret = solver_highs_unwrapped(solution, resources, dag);
 	if (ret < 0)
-		goto out_free_jobid;
+		goto out_free_solution;
 
-	for (size_t i = 0; i < jobid->filled; i++) {
+	for (uint32_t i = 0; i < dag->nodes; i++) {
 		if (solution[i] == 0.0)
-			job_stale_set(jobid->jobs[i]);
+			queue_dag_stale_set(queue, i);
 	}
 
 	if (evanix_opts.solver_report) {
-		CIRCLEQ_FOREACH (j, q, clist) {
-			if (j->stale) {
-				printf("❌ refusing to build %s, cost: %d\n",
-				       j->drv_path, job_cost_recursive(j));
-			}
-		}
+		ret = solver_highs_report(queue);
+		if (ret < 0)
+			goto out_free_solution;
 	}
 
 	solved = true;
-out_free_jobid:
-	jobid_free(jobid);
+out_free_solution:
 	free(solution);
 
 	if (ret < 0)
 		return ret;
 	else
-		return job_get(job, q);
+		return job_get(job, &queue->jobs);
 }
@@ -1,31 +1,47 @@
 #include <errno.h>
 #include <queue.h>
 
+#include "closure.h"
+#include "dag.h"
 #include "evanix.h"
 #include "jobs.h"
 #include "solver_sjf.h"
 
-int solver_sjf(struct job **job, struct job_clist *q, int32_t resources)
+int solver_sjf(struct job **job, struct queue *queue, int32_t resources)
 {
+	struct closure_set *cs;
+	struct dag *dag;
+	uint32_t node;
 	struct job *j;
-	int cost_cur;
+	int cost_cur, ret;
 
 	struct job *selected = NULL;
 	int cost_min = -1;
 
-	CIRCLEQ_FOREACH (j, q, clist) {
-		if (j->stale)
+	ret = queue_dag(queue, &dag);
+	if (ret < 0)
+		return ret;
+	ret = queue_closure_set(queue, &cs);
+	if (ret < 0)
+		return ret;
+
+	for (uint32_t i = 0; i < dag->roots_filled; i++) {
+		node = dag->roots[i];
+		if (dag->flags[node] & (DAG_STALE | DAG_BUILDING))
 			continue;
+		j = dag->jobid->jobs[node];
 
-		cost_cur = job_cost_recursive(j);
+		cost_cur = cs ? closure_set_cost_marginal(cs, j)
+			      : dag_closure_cost(dag, node);
 		if (cost_cur < 0)
 			return cost_cur;
 
 		if (cost_cur > resources) {
-			job_stale_set(j);
+			queue_dag_stale_set(queue, node);
 			if (evanix_opts.solver_report) {
-				printf("❌ refusing to build %s, cost: %d\n",
-				       j->drv_path, cost_cur);
+				printf("❌ refusing to build %s, cost: %d%s\n",
+				       j->drv_path, cost_cur,
+				       j->cost_estimated ? " (estimated)" : "");
 			}
 		}
 
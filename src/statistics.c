@@ -0,0 +1,1017 @@
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evanix.h"
+#include "statistics.h"
+#include "statistics_index.h"
+#include "util.h"
+
+/* standard normal quantiles, for statistics that only have a variance */
+static const double statistics_z[STATISTICS_QUANTILES] = {
+	[STATISTICS_MEAN] = 0,
+	[STATISTICS_P50] = 0,
+	[STATISTICS_P90] = 1.2815515655446004,
+	[STATISTICS_P99] = 2.3263478740408408,
+};
+
+static const char *const statistics_quantile_names[STATISTICS_QUANTILES] = {
+	[STATISTICS_MEAN] = "mean",
+	[STATISTICS_P50] = "p50",
+	[STATISTICS_P90] = "p90",
+	[STATISTICS_P99] = "p99",
+};
+
+static int32_t statistics_seconds(double seconds);
+static void statistics_entry_read(sqlite3_stmt *statement, int column,
+				  struct statistics_entry *entry);
+static int statistics_table_exists(struct statistics *stats,
+				   const char *table, bool *exists);
+static int statistics_host(char *host, size_t size);
+static int statistics_local_version(struct statistics *stats);
+static int statistics_local_migrate(struct statistics *stats);
+static int statistics_local_open(struct statistics *stats, bool writable);
+static int statistics_calibration_open(struct statistics *stats,
+				       bool writable);
+static int statistics_calibration_fold(struct statistics *stats,
+				       const char *pname, double duration);
+static int statistics_view_create(struct statistics *stats);
+static int statistics_rows(struct statistics *stats, size_t *rows);
+static int statistics_name_insert(struct statistics *stats, const char *pname,
+				  size_t len, uint32_t *offset);
+static struct statistics_slot *statistics_slot_find(struct statistics *stats,
+						    const char *pname,
+						    uint64_t hash);
+static int statistics_table_insert(struct statistics *stats,
+				   const char *pname,
+				   const struct statistics_entry *entry);
+static void statistics_table_free(struct statistics *stats);
+static int statistics_table_read(struct statistics *stats, const char *query,
+				 size_t nslots);
+static int statistics_query(struct statistics *stats, const char *pname,
+			    struct statistics_entry *entry);
+
+static int32_t statistics_seconds(double seconds)
+{
+	if (!(seconds > 0))
+		return 0;
+	if (seconds >= INT32_MAX)
+		return INT32_MAX;
+
+	return seconds + 0.5;
+}
+
+/* reads mean, p50, p90, p99, variance and local_rank from column on, the
+ * quantiles that are NULL are taken from a normal distribution */
+static void statistics_entry_read(sqlite3_stmt *statement, int column,
+				  struct statistics_entry *entry)
+{
+	double mean, variance = 0;
+	int rank;
+
+	mean = sqlite3_column_double(statement, column);
+	if (sqlite3_column_type(statement, column + STATISTICS_QUANTILES) !=
+	    SQLITE_NULL)
+		variance = sqlite3_column_double(statement,
+						 column + STATISTICS_QUANTILES);
+	if (!(variance > 0))
+		variance = 0;
+
+	entry->variance = variance;
+	rank = sqlite3_column_int(statement, column + STATISTICS_QUANTILES + 1);
+	entry->islocal = rank == 0;
+	entry->costs[STATISTICS_MEAN] = statistics_seconds(mean);
+	for (int q = STATISTICS_P50; q < STATISTICS_QUANTILES; q++) {
+		if (sqlite3_column_type(statement, column + q) == SQLITE_NULL)
+			entry->costs[q] = statistics_seconds(
+				mean + statistics_z[q] * sqrt(variance));
+		else
+			entry->costs[q] = statistics_seconds(
+				sqlite3_column_double(statement, column + q));
+	}
+}
+
+int statistics_quantile_parse(const char *name)
+{
+	for (int q = 0; q < STATISTICS_QUANTILES; q++) {
+		if (!strcmp(name, statistics_quantile_names[q]))
+			return q;
+	}
+
+	return -EINVAL;
+}
+
+const char *statistics_quantile_name(statistics_quantile_t quantile)
+{
+	return statistics_quantile_names[quantile];
+}
+
+static int statistics_table_exists(struct statistics *stats,
+				   const char *table, bool *exists)
+{
+	const char *query = "SELECT 1 FROM sqlite_master "
+			    "WHERE type = 'table' AND name = ?";
+	sqlite3_stmt *statement;
+	int ret;
+
+	ret = sqlite3_prepare_v2(stats->db, query, -1, &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+	ret = sqlite3_bind_text(statement, 1, table, -1, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to bind sql");
+		ret = -EPERM;
+		goto out_finalize;
+	}
+
+	ret = sqlite3_step(statement);
+	if (ret == SQLITE_ROW || ret == SQLITE_DONE) {
+		*exists = ret == SQLITE_ROW;
+		ret = 0;
+	} else {
+		print_err("%s", "Failed to step sql");
+		ret = -EPERM;
+	}
+
+out_finalize:
+	sqlite3_finalize(statement);
+
+	return ret;
+}
+
+static int statistics_host(char *host, size_t size)
+{
+	if (gethostname(host, size) < 0) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	host[size - 1] = '\0';
+
+	return 0;
+}
+
+static int statistics_local_version(struct statistics *stats)
+{
+	sqlite3_stmt *statement;
+	int ret;
+
+	ret = sqlite3_prepare_v2(stats->db, "PRAGMA user_version", -1,
+				 &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+
+	ret = sqlite3_step(statement);
+	if (ret == SQLITE_ROW) {
+		stats->local_version = sqlite3_column_int(statement, 0);
+		ret = 0;
+	} else {
+		print_err("%s", "Failed to step sql");
+		ret = -EPERM;
+	}
+	sqlite3_finalize(statement);
+
+	return ret;
+}
+
+/* brings a local_statistics of an older evanix up to date, the variance of
+ * what was recorded before starts out at 0. mean_cpu goes, it only ever had
+ * the CPU time of the nix-build client, not of the builders nix-daemon
+ * runs. */
+static int statistics_local_migrate(struct statistics *stats)
+{
+	static const char *const migrations[STATISTICS_LOCAL_VERSION] = {
+		"ALTER TABLE local_statistics "
+		"ADD COLUMN variance_duration REAL NOT NULL DEFAULT 0",
+		"ALTER TABLE local_statistics DROP COLUMN mean_cpu",
+	};
+	char version[64];
+	int ret;
+
+	if (stats->local_version >= STATISTICS_LOCAL_VERSION)
+		return 0;
+
+	ret = sqlite3_exec(stats->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("Failed to migrate local_statistics: %s",
+			  sqlite3_errmsg(stats->db));
+		return -EPERM;
+	}
+
+	for (int i = stats->local_version; i < STATISTICS_LOCAL_VERSION; i++) {
+		ret = sqlite3_exec(stats->db, migrations[i], NULL, NULL, NULL);
+		if (ret != SQLITE_OK)
+			goto out_rollback;
+	}
+
+	snprintf(version, sizeof(version), "PRAGMA user_version = %d",
+		 STATISTICS_LOCAL_VERSION);
+	ret = sqlite3_exec(stats->db, version, NULL, NULL, NULL);
+	if (ret != SQLITE_OK)
+		goto out_rollback;
+
+	ret = sqlite3_exec(stats->db, "COMMIT", NULL, NULL, NULL);
+	if (ret != SQLITE_OK)
+		goto out_rollback;
+
+	stats->local_version = STATISTICS_LOCAL_VERSION;
+	return 0;
+
+out_rollback:
+	print_err("Failed to migrate local_statistics: %s",
+		  sqlite3_errmsg(stats->db));
+	sqlite3_exec(stats->db, "ROLLBACK", NULL, NULL, NULL);
+	return -EPERM;
+}
+
+static int statistics_local_open(struct statistics *stats, bool writable)
+{
+	/* as of version 0, statistics_local_migrate() takes it from there */
+	const char *create = "CREATE TABLE local_statistics ("
+			     "pname TEXT PRIMARY KEY, "
+			     "mean_duration REAL NOT NULL, "
+			     "mean_cpu REAL NOT NULL, "
+			     "samples INTEGER NOT NULL)";
+	/* the plain mean and variance while there are few samples, after
+	 * that the mean moves STATISTICS_EWMA_ALPHA of the way to each new
+	 * sample, and the variance follows along */
+	const char *record =
+		"INSERT INTO local_statistics "
+		"(pname, mean_duration, variance_duration, samples) "
+		"VALUES (?1, ?2, 0, 1) "
+		"ON CONFLICT (pname) DO UPDATE SET "
+		"mean_duration = mean_duration + MAX(1.0 / (samples + 1), ?3) "
+		"* (excluded.mean_duration - mean_duration), "
+		"variance_duration = (1 - MAX(1.0 / (samples + 1), ?3)) "
+		"* (variance_duration + MAX(1.0 / (samples + 1), ?3) "
+		"* (excluded.mean_duration - mean_duration) "
+		"* (excluded.mean_duration - mean_duration)), "
+		"samples = samples + 1";
+	bool exists;
+	int ret;
+
+	ret = statistics_table_exists(stats, "local_statistics", &exists);
+	if (ret < 0)
+		return ret;
+	ret = statistics_local_version(stats);
+	if (ret < 0)
+		return ret;
+
+	if (writable && !exists) {
+		ret = sqlite3_exec(stats->db, create, NULL, NULL, NULL);
+		if (ret != SQLITE_OK) {
+			print_err("Failed to create local_statistics: %s",
+				  sqlite3_errmsg(stats->db));
+			return -EPERM;
+		}
+		stats->local_version = 0;
+	}
+
+	if (writable) {
+		ret = statistics_local_migrate(stats);
+		if (ret < 0)
+			return ret;
+
+		ret = sqlite3_prepare_v2(stats->db, record, -1, &stats->record,
+					 NULL);
+		if (ret != SQLITE_OK) {
+			print_err("%s", "Failed to prepare sql");
+			return -EPERM;
+		}
+
+		stats->islocal = true;
+		return 0;
+	}
+
+	stats->islocal = exists;
+	return 0;
+}
+
+static int statistics_calibration_open(struct statistics *stats,
+				       bool writable)
+{
+	const char *create = "CREATE TABLE IF NOT EXISTS local_calibration ("
+			     "host TEXT PRIMARY KEY, "
+			     "sum_xx REAL NOT NULL, "
+			     "sum_xy REAL NOT NULL, "
+			     "sum_yy REAL NOT NULL, "
+			     "samples INTEGER NOT NULL)";
+	/* x is the mean of statistics, y the duration of our build */
+	const char *calibrate =
+		"INSERT INTO local_calibration "
+		"(host, sum_xx, sum_xy, sum_yy, samples) "
+		"VALUES (?1, ?2 * ?2, ?2 * ?3, ?3 * ?3, 1) "
+		"ON CONFLICT (host) DO UPDATE SET "
+		"sum_xx = sum_xx + excluded.sum_xx, "
+		"sum_xy = sum_xy + excluded.sum_xy, "
+		"sum_yy = sum_yy + excluded.sum_yy, "
+		"samples = samples + 1";
+	const char *remote = "SELECT mean_duration FROM statistics "
+			     "WHERE pname = ? LIMIT 1";
+	const char *query = "SELECT sum_xx, sum_xy, sum_yy, samples "
+			    "FROM local_calibration WHERE host = ?";
+	double sum_xx, sum_xy, sum_yy, rss;
+	struct statistics_calibration *c = &stats->calibration;
+	sqlite3_stmt *statement;
+	char host[256];
+	bool exists;
+	int ret;
+
+	c->factor = 1;
+	c->error = 0;
+	c->samples = 0;
+
+	if (writable) {
+		ret = sqlite3_exec(stats->db, create, NULL, NULL, NULL);
+		if (ret != SQLITE_OK) {
+			print_err("Failed to create local_calibration: %s",
+				  sqlite3_errmsg(stats->db));
+			return -EPERM;
+		}
+
+		ret = sqlite3_prepare_v2(stats->db, calibrate, -1,
+					 &stats->calibrate, NULL);
+		if (ret != SQLITE_OK) {
+			print_err("%s", "Failed to prepare sql");
+			return -EPERM;
+		}
+		ret = sqlite3_prepare_v2(stats->db, remote, -1, &stats->remote,
+					 NULL);
+		if (ret != SQLITE_OK) {
+			print_err("%s", "Failed to prepare sql");
+			return -EPERM;
+		}
+	} else {
+		ret = statistics_table_exists(stats, "local_calibration",
+					      &exists);
+		if (ret < 0 || !exists)
+			return ret;
+	}
+
+	ret = statistics_host(host, sizeof(host));
+	if (ret < 0)
+		return ret;
+
+	ret = sqlite3_prepare_v2(stats->db, query, -1, &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+	ret = sqlite3_bind_text(statement, 1, host, -1, SQLITE_TRANSIENT);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to bind sql");
+		ret = -EPERM;
+		goto out_finalize;
+	}
+
+	ret = sqlite3_step(statement);
+	if (ret == SQLITE_DONE) {
+		ret = 0;
+		goto out_finalize;
+	} else if (ret != SQLITE_ROW) {
+		print_err("%s", "Failed to step sql");
+		ret = -EPERM;
+		goto out_finalize;
+	}
+	ret = 0;
+
+	sum_xx = sqlite3_column_double(statement, 0);
+	sum_xy = sqlite3_column_double(statement, 1);
+	sum_yy = sqlite3_column_double(statement, 2);
+	c->samples = sqlite3_column_int64(statement, 3);
+	if (!(sum_xx > 0))
+		goto out_finalize;
+
+	c->factor = sum_xy / sum_xx;
+	if (c->samples > 1) {
+		rss = sum_yy - c->factor * sum_xy;
+		if (!(rss > 0))
+			rss = 0;
+		c->error = sqrt(rss / (c->samples - 1) / sum_xx);
+	}
+
+out_finalize:
+	sqlite3_finalize(statement);
+
+	return ret;
+}
+
+/* evanix_statistics has the rows of local_statistics, then those of
+ * statistics, with NULL for the columns statistics doesn't have */
+static int statistics_view_create(struct statistics *stats)
+{
+	bool has[STATISTICS_QUANTILES + 1] = {false};
+	const char *column, *names[STATISTICS_QUANTILES + 1];
+	sqlite3_stmt *statement;
+	char view[1024], local[256];
+	int ret;
+
+	static const char *const columns[STATISTICS_QUANTILES + 1] = {
+		"mean_duration",
+		"p50_duration",
+		"p90_duration",
+		"p99_duration",
+		"variance_duration",
+	};
+
+	ret = sqlite3_prepare_v2(stats->db, "PRAGMA table_info(statistics)",
+				 -1, &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+	while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
+		column = (const char *)sqlite3_column_text(statement, 1);
+		for (int i = 0; column != NULL && i <= STATISTICS_QUANTILES;
+		     i++) {
+			if (!strcmp(column, columns[i]))
+				has[i] = true;
+		}
+	}
+	sqlite3_finalize(statement);
+	if (ret != SQLITE_DONE) {
+		print_err("%s", "Failed to step sql");
+		return -EPERM;
+	}
+
+	stats->quantiles = 1 << STATISTICS_MEAN;
+	for (int i = 0; i <= STATISTICS_QUANTILES; i++) {
+		names[i] = has[i] ? columns[i] : "NULL";
+		/* a variance gives all of them */
+		if (i < STATISTICS_QUANTILES &&
+		    (has[i] || has[STATISTICS_QUANTILES]))
+			stats->quantiles |= 1 << i;
+	}
+
+	local[0] = '\0';
+	if (stats->islocal) {
+		/* opened read-only, it may not be migrated yet */
+		snprintf(local, sizeof(local),
+			 "SELECT pname, mean_duration, NULL AS p50_duration, "
+			 "NULL AS p90_duration, NULL AS p99_duration, "
+			 "%s AS variance_duration, 0 AS local_rank "
+			 "FROM local_statistics UNION ALL ",
+			 stats->local_version >= 1 ? "variance_duration"
+						   : "NULL");
+	}
+
+	ret = snprintf(view, sizeof(view),
+		       "CREATE TEMP VIEW evanix_statistics AS "
+		       "%s"
+		       "SELECT pname, mean_duration, %s AS p50_duration, "
+		       "%s AS p90_duration, %s AS p99_duration, "
+		       "%s AS variance_duration, 1 AS local_rank "
+		       "FROM statistics",
+		       local, names[STATISTICS_P50], names[STATISTICS_P90],
+		       names[STATISTICS_P99], names[STATISTICS_QUANTILES]);
+	if (ret < 0 || (size_t)ret >= sizeof(view))
+		return -ENAMETOOLONG;
+
+	ret = sqlite3_exec(stats->db, view, NULL, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("Failed to create view: %s",
+			  sqlite3_errmsg(stats->db));
+		return -EPERM;
+	}
+
+	return 0;
+}
+
+int statistics_open(struct statistics *stats, const char *path,
+		    bool writable)
+{
+	/* our own builds know our hardware better */
+	const char *query = "SELECT pname, mean_duration, p50_duration, "
+			    "p90_duration, p99_duration, variance_duration, "
+			    "local_rank "
+			    "FROM evanix_statistics "
+			    "WHERE pname = ? "
+			    "ORDER BY local_rank "
+			    "LIMIT 1";
+	bool isindex;
+	int ret;
+
+	ret = statistics_index_detect(path, &isindex);
+	if (ret < 0)
+		return ret;
+	if (isindex && writable) {
+		print_err("%s: can't record into a compiled index", path);
+		return -EINVAL;
+	} else if (isindex) {
+		ret = statistics_index_open(&stats->index, path);
+		if (ret < 0)
+			return ret;
+
+		stats->quantiles = stats->index->header->quantiles;
+		stats->calibration.factor =
+			stats->index->header->calibration_factor;
+		stats->calibration.error =
+			stats->index->header->calibration_error;
+		stats->calibration.samples =
+			stats->index->header->calibration_samples;
+		goto out_quantile_check;
+	}
+
+	ret = sqlite3_open_v2(path, &stats->db,
+			      (writable ? SQLITE_OPEN_READWRITE
+					: SQLITE_OPEN_READONLY) |
+				      SQLITE_OPEN_FULLMUTEX,
+			      NULL);
+	if (ret != SQLITE_OK) {
+		print_err("Can't open database: %s", sqlite3_errmsg(stats->db));
+		return -EPERM;
+	}
+
+	ret = statistics_local_open(stats, writable);
+	if (ret < 0)
+		return ret;
+
+	ret = statistics_calibration_open(stats, writable);
+	if (ret < 0)
+		return ret;
+
+	ret = statistics_view_create(stats);
+	if (ret < 0)
+		return ret;
+
+	ret = sqlite3_prepare_v2(stats->db, query, -1, &stats->statement,
+				 NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+
+out_quantile_check:
+	if (!(stats->quantiles & (1 << evanix_opts.cost_quantile))) {
+		print_err("%s: statistics has neither %s_duration nor "
+			  "variance_duration",
+			  path,
+			  statistics_quantile_name(evanix_opts.cost_quantile));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int statistics_rows(struct statistics *stats, size_t *rows)
+{
+	sqlite3_stmt *statement;
+	int ret;
+
+	ret = sqlite3_prepare_v2(stats->db,
+				 "SELECT COUNT(*) FROM evanix_statistics", -1,
+				 &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+
+	ret = sqlite3_step(statement);
+	if (ret != SQLITE_ROW) {
+		print_err("%s", "Failed to step sql");
+		ret = -EPERM;
+		goto out_finalize;
+	}
+
+	*rows = sqlite3_column_int64(statement, 0);
+	ret = 0;
+
+out_finalize:
+	sqlite3_finalize(statement);
+
+	return ret;
+}
+
+static int statistics_name_insert(struct statistics *stats, const char *pname,
+				  size_t len, uint32_t *offset)
+{
+	size_t newsize;
+	void *ret;
+
+	if (stats->names_filled + len + 1 >= STATISTICS_SLOT_EMPTY)
+		return -EOVERFLOW;
+
+	if (stats->names_filled + len + 1 > stats->names_size) {
+		newsize = stats->names_size == 0 ? 4096 : stats->names_size;
+		while (newsize < stats->names_filled + len + 1)
+			newsize *= 2;
+
+		ret = realloc(stats->names, newsize);
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		stats->names = ret;
+		stats->names_size = newsize;
+	}
+
+	*offset = stats->names_filled;
+	memcpy(stats->names + stats->names_filled, pname, len + 1);
+	stats->names_filled += len + 1;
+
+	return 0;
+}
+
+/* the slot holding pname, or the empty one it would go in */
+static struct statistics_slot *statistics_slot_find(struct statistics *stats,
+						    const char *pname,
+						    uint64_t hash)
+{
+	struct statistics_slot *slot;
+	size_t i = hash & stats->slots_mask;
+
+	while (true) {
+		slot = &stats->slots[i];
+		if (slot->pname == STATISTICS_SLOT_EMPTY)
+			return slot;
+		if (slot->hash == hash &&
+		    !strcmp(stats->names + slot->pname, pname))
+			return slot;
+
+		i = (i + 1) & stats->slots_mask;
+	}
+}
+
+static int statistics_table_insert(struct statistics *stats,
+				   const char *pname,
+				   const struct statistics_entry *entry)
+{
+	struct statistics_slot *slot;
+	uint64_t hash;
+	size_t len;
+	int ret;
+
+	len = strlen(pname);
+	hash = fnv1a_64(FNV1A_64_INIT, pname, len);
+
+	/* like the LIMIT 1 of statement, the first row wins */
+	slot = statistics_slot_find(stats, pname, hash);
+	if (slot->pname != STATISTICS_SLOT_EMPTY)
+		return 0;
+
+	ret = statistics_name_insert(stats, pname, len, &slot->pname);
+	if (ret < 0)
+		return ret;
+
+	slot->hash = hash;
+	slot->entry = *entry;
+	stats->slots_filled++;
+
+	return 0;
+}
+
+static void statistics_table_free(struct statistics *stats)
+{
+	free(stats->slots);
+	free(stats->names);
+	stats->slots = NULL;
+	stats->slots_mask = 0;
+	stats->slots_filled = 0;
+	stats->names = NULL;
+	stats->names_size = 0;
+	stats->names_filled = 0;
+}
+
+static int statistics_table_read(struct statistics *stats, const char *query,
+				 size_t nslots)
+{
+	struct statistics_entry entry;
+	sqlite3_stmt *statement;
+	const char *pname;
+	int ret;
+
+	ret = sqlite3_prepare_v2(stats->db, query, -1, &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+
+	while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
+		pname = (const char *)sqlite3_column_text(statement, 0);
+		if (pname == NULL)
+			continue;
+
+		/* the table may have grown since it was counted */
+		if (stats->slots_filled * 2 >= nslots) {
+			ret = -EOVERFLOW;
+			break;
+		}
+
+		statistics_entry_read(statement, 1, &entry);
+		ret = statistics_table_insert(stats, pname, &entry);
+		if (ret < 0)
+			break;
+	}
+	sqlite3_finalize(statement);
+
+	if (ret == SQLITE_DONE)
+		return 0;
+	if (ret > 0) {
+		print_err("%s", "Failed to step sql");
+		return -EPERM;
+	}
+
+	return ret;
+}
+
+int statistics_load(struct statistics *stats, size_t max)
+{
+	size_t rows, nslots;
+	double start;
+	int ret;
+
+	/* already as loaded as it gets */
+	if (stats->index != NULL)
+		return 0;
+
+	start = monotonic_now();
+
+	ret = statistics_rows(stats, &rows);
+	if (ret < 0)
+		return ret;
+
+	if (rows > max)
+		goto out_fallback;
+
+	/* keep the load factor at or below a half */
+	for (nslots = 16; nslots < rows * 2; nslots *= 2)
+		;
+	stats->slots = malloc(nslots * sizeof(*stats->slots));
+	if (stats->slots == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	for (size_t i = 0; i < nslots; i++)
+		stats->slots[i].pname = STATISTICS_SLOT_EMPTY;
+	stats->slots_mask = nslots - 1;
+	stats->slots_filled = 0;
+
+	/* local rows go first, so they win */
+	for (int rank = 0; rank <= 1 && ret == 0; rank++) {
+		ret = statistics_table_read(
+			stats,
+			rank == 0 ? "SELECT pname, mean_duration, "
+				    "p50_duration, p90_duration, "
+				    "p99_duration, variance_duration, "
+				    "local_rank "
+				    "FROM evanix_statistics "
+				    "WHERE local_rank = 0"
+				  : "SELECT pname, mean_duration, "
+				    "p50_duration, p90_duration, "
+				    "p99_duration, variance_duration, "
+				    "local_rank "
+				    "FROM evanix_statistics "
+				    "WHERE local_rank = 1",
+			nslots);
+	}
+
+	if (ret == -EOVERFLOW) {
+		statistics_table_free(stats);
+		goto out_fallback;
+	} else if (ret < 0) {
+		goto out_free_table;
+	}
+
+	if (evanix_opts.solver_report) {
+		printf("📊 statistics: %zu pnames loaded in %.3fs\n",
+		       stats->slots_filled, monotonic_now() - start);
+	}
+
+out_free_table:
+	if (ret < 0)
+		statistics_table_free(stats);
+
+	return ret;
+
+out_fallback:
+	if (evanix_opts.solver_report) {
+		printf("📊 statistics: over %zu pnames, querying the database "
+		       "instead\n",
+		       max);
+	}
+
+	return 0;
+}
+
+static int statistics_query(struct statistics *stats, const char *pname,
+			    struct statistics_entry *entry)
+{
+	int ret;
+
+	ret = sqlite3_reset(stats->statement);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to reset sql statement");
+		return -EPERM;
+	}
+	ret = sqlite3_bind_text(stats->statement, 1, pname, -1, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to bind sql");
+		return -EPERM;
+	}
+
+	ret = sqlite3_step(stats->statement);
+	if (ret == SQLITE_DONE) {
+		return -ENOENT;
+	} else if (ret != SQLITE_ROW) {
+		print_err("%s", "Failed to step sql");
+		return -EPERM;
+	}
+
+	statistics_entry_read(stats->statement, 1, entry);
+	return 0;
+}
+
+int statistics_lookup(struct statistics *stats, const char *pname,
+		      struct statistics_entry *entry)
+{
+	struct statistics_slot *slot;
+
+	if (stats->index != NULL)
+		return statistics_index_lookup(stats->index, pname, entry);
+	if (stats->slots == NULL)
+		return statistics_query(stats, pname, entry);
+
+	slot = statistics_slot_find(stats, pname,
+				    fnv1a_64(FNV1A_64_INIT, pname,
+					     strlen(pname)));
+	if (slot->pname == STATISTICS_SLOT_EMPTY)
+		return -ENOENT;
+
+	*entry = slot->entry;
+	return 0;
+}
+
+int statistics_cost(struct statistics *stats, const char *pname)
+{
+	struct statistics_entry entry;
+	int ret;
+
+	ret = statistics_lookup(stats, pname, &entry);
+	if (ret < 0)
+		return ret;
+
+	return entry.costs[evanix_opts.cost_quantile];
+}
+
+bool statistics_isopen(struct statistics *stats)
+{
+	return stats->db != NULL || stats->index != NULL;
+}
+
+int statistics_record(struct statistics *stats, const char *pname,
+		      double duration, bool isalone)
+{
+	int ret;
+
+	if (stats->record == NULL)
+		return -EBADF;
+
+	ret = sqlite3_reset(stats->record);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to reset sql statement");
+		return -EPERM;
+	}
+
+	if (sqlite3_bind_text(stats->record, 1, pname, -1, NULL) != SQLITE_OK ||
+	    sqlite3_bind_double(stats->record, 2, duration) != SQLITE_OK ||
+	    sqlite3_bind_double(stats->record, 3, STATISTICS_EWMA_ALPHA) !=
+		    SQLITE_OK) {
+		print_err("%s", "Failed to bind sql");
+		return -EPERM;
+	}
+
+	ret = sqlite3_step(stats->record);
+	if (ret != SQLITE_DONE) {
+		print_err("Failed to record %s: %s", pname,
+			  sqlite3_errmsg(stats->db));
+		return -EPERM;
+	}
+
+	if (!isalone)
+		return 0;
+	return statistics_calibration_fold(stats, pname, duration);
+}
+
+static int statistics_calibration_fold(struct statistics *stats,
+				       const char *pname, double duration)
+{
+	char host[256];
+	double mean;
+	int ret;
+
+	ret = sqlite3_reset(stats->remote);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to reset sql statement");
+		return -EPERM;
+	}
+	ret = sqlite3_bind_text(stats->remote, 1, pname, -1, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to bind sql");
+		return -EPERM;
+	}
+
+	ret = sqlite3_step(stats->remote);
+	if (ret == SQLITE_DONE) {
+		/* nothing to compare against */
+		return 0;
+	} else if (ret != SQLITE_ROW) {
+		print_err("%s", "Failed to step sql");
+		return -EPERM;
+	}
+	mean = sqlite3_column_double(stats->remote, 0);
+	if (!(mean > 0))
+		return 0;
+
+	ret = statistics_host(host, sizeof(host));
+	if (ret < 0)
+		return ret;
+
+	ret = sqlite3_reset(stats->calibrate);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to reset sql statement");
+		return -EPERM;
+	}
+	if (sqlite3_bind_text(stats->calibrate, 1, host, -1,
+			      SQLITE_TRANSIENT) != SQLITE_OK ||
+	    sqlite3_bind_double(stats->calibrate, 2, mean) != SQLITE_OK ||
+	    sqlite3_bind_double(stats->calibrate, 3, duration) != SQLITE_OK) {
+		print_err("%s", "Failed to bind sql");
+		return -EPERM;
+	}
+
+	ret = sqlite3_step(stats->calibrate);
+	if (ret != SQLITE_DONE) {
+		print_err("Failed to calibrate with %s: %s", pname,
+			  sqlite3_errmsg(stats->db));
+		return -EPERM;
+	}
+
+	return 0;
+}
+
+double statistics_calibration_factor(const struct statistics *stats)
+{
+	if (stats->calibration.samples < STATISTICS_CALIBRATION_MIN ||
+	    !(stats->calibration.factor > 0))
+		return 1;
+
+	return stats->calibration.factor;
+}
+
+void statistics_calibrate(const struct statistics *stats,
+			  struct statistics_entry *entry)
+{
+	double factor;
+
+	if (entry->islocal)
+		return;
+
+	factor = statistics_calibration_factor(stats);
+	for (int q = 0; q < STATISTICS_QUANTILES; q++)
+		entry->costs[q] = statistics_seconds(entry->costs[q] * factor);
+	entry->variance *= factor * factor;
+}
+
+int statistics_close(struct statistics *stats)
+{
+	int ret;
+
+	statistics_table_free(stats);
+	statistics_index_close(stats->index);
+	stats->index = NULL;
+
+	if (stats->statement) {
+		sqlite3_finalize(stats->statement);
+		stats->statement = NULL;
+	}
+	if (stats->record) {
+		sqlite3_finalize(stats->record);
+		stats->record = NULL;
+	}
+	if (stats->remote) {
+		sqlite3_finalize(stats->remote);
+		stats->remote = NULL;
+	}
+	if (stats->calibrate) {
+		sqlite3_finalize(stats->calibrate);
+		stats->calibrate = NULL;
+	}
+	if (stats->db) {
+		ret = sqlite3_close(stats->db);
+		if (ret != SQLITE_OK) {
+			print_err("Can't open database: %s",
+				  sqlite3_errmsg(stats->db));
+			return -EPERM;
+		}
+
+		stats->db = NULL;
+	}
+
+	return 0;
+}
@@ -0,0 +1,511 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "statistics.h"
+#include "statistics_index.h"
+#include "util.h"
+
+/* average keys per bucket, more makes a smaller file and a slower compile */
+#define STATISTICS_INDEX_BUCKET_KEYS 4
+/* seeds to try before giving up on a perfect hash */
+#define STATISTICS_INDEX_SEEDS 16
+
+static const char usage[] =
+	"Usage: evanix stats compile [options]\n"
+	"\n"
+	"  -h, --help                         Show help message and quit.\n"
+	"  -d, --db                   <path>  Statistics database to "
+	"compile.\n"
+	"  -o, --output               <path>  Where to write the index, "
+	"for\n"
+	"                                     --statistics to read.\n"
+	"\n";
+
+static uint64_t statistics_index_mix(uint64_t x);
+static uint32_t statistics_index_bucket(uint64_t hash, uint64_t seed,
+					uint32_t nbuckets);
+static uint32_t statistics_index_slot(uint64_t hash, uint64_t seed,
+				      uint32_t displacement, uint32_t nrecords);
+static size_t statistics_index_records_offset(uint32_t nbuckets);
+static int statistics_index_place(struct statistics_slot **keys, uint32_t n,
+				  uint64_t seed, uint32_t nbuckets,
+				  uint32_t *displacements, uint32_t *placed);
+static int statistics_index_write(FILE *stream, struct statistics *stats,
+				  struct statistics_slot **keys,
+				  struct statistics_index_header *header,
+				  uint32_t *displacements, uint32_t *placed);
+
+/* splitmix64 finalizer, fnv1a_64() alone doesn't spread the low bits */
+static uint64_t statistics_index_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return x;
+}
+
+static uint32_t statistics_index_bucket(uint64_t hash, uint64_t seed,
+					uint32_t nbuckets)
+{
+	return statistics_index_mix(hash ^ seed) % nbuckets;
+}
+
+static uint32_t statistics_index_slot(uint64_t hash, uint64_t seed,
+				      uint32_t displacement, uint32_t nrecords)
+{
+	uint64_t salt = (displacement + 1ULL) * 0x9e3779b97f4a7c15ULL;
+
+	return statistics_index_mix(hash ^ seed ^ salt) % nrecords;
+}
+
+/* the displacements are padded, so the records are 8 byte aligned */
+static size_t statistics_index_records_offset(uint32_t nbuckets)
+{
+	size_t offset;
+
+	offset = sizeof(struct statistics_index_header) +
+		 (size_t)nbuckets * sizeof(uint32_t);
+	return (offset + 7) & ~(size_t)7;
+}
+
+/* hash and displace: the fullest buckets go first, each trying
+ * displacements until its keys all land in free records. placed gets the
+ * record of every key, -EAGAIN asks for another seed. */
+static int statistics_index_place(struct statistics_slot **keys, uint32_t n,
+				  uint64_t seed, uint32_t nbuckets,
+				  uint32_t *displacements, uint32_t *placed)
+{
+	uint32_t *bucket_of, *sizes, *starts, *members, *order;
+	uint32_t b, max_size = 0, filled = 0, tries;
+	uint32_t d, k, i;
+	bool *taken;
+	int ret = 0;
+
+	bucket_of = malloc(n * sizeof(*bucket_of));
+	members = malloc(n * sizeof(*members));
+	sizes = calloc(nbuckets, sizeof(*sizes));
+	starts = calloc(nbuckets + 1, sizeof(*starts));
+	order = malloc(nbuckets * sizeof(*order));
+	taken = calloc(n, sizeof(*taken));
+	if (bucket_of == NULL || members == NULL || sizes == NULL ||
+	    starts == NULL || order == NULL || taken == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free;
+	}
+
+	for (i = 0; i < n; i++) {
+		bucket_of[i] = statistics_index_bucket(keys[i]->hash, seed,
+						       nbuckets);
+		sizes[bucket_of[i]]++;
+	}
+	for (b = 0; b < nbuckets; b++) {
+		starts[b + 1] = starts[b] + sizes[b];
+		if (sizes[b] > max_size)
+			max_size = sizes[b];
+	}
+	for (i = 0; i < n; i++)
+		members[starts[bucket_of[i]]++] = i;
+	for (b = 0; b < nbuckets; b++)
+		starts[b] -= sizes[b];
+
+	/* by size, largest first, the loop is short as buckets are small */
+	for (uint32_t size = max_size; size > 0; size--) {
+		for (b = 0; b < nbuckets; b++) {
+			if (sizes[b] == size)
+				order[filled++] = b;
+		}
+	}
+
+	/* the last keys in go looking for one of few free records */
+	tries = n < (UINT32_MAX - 1024) / 64 ? n * 64 + 1024 : UINT32_MAX;
+	for (b = 0; b < nbuckets; b++)
+		displacements[b] = 0;
+	for (uint32_t o = 0; o < filled; o++) {
+		b = order[o];
+		for (d = 0; d < tries; d++) {
+			for (k = 0; k < sizes[b]; k++) {
+				i = members[starts[b] + k];
+				placed[i] = statistics_index_slot(
+					keys[i]->hash, seed, d, n);
+				if (taken[placed[i]])
+					break;
+				taken[placed[i]] = true;
+			}
+			if (k == sizes[b])
+				break;
+
+			/* give back what this displacement took */
+			while (k-- > 0)
+				taken[placed[members[starts[b] + k]]] = false;
+		}
+		if (d == tries) {
+			ret = -EAGAIN;
+			goto out_free;
+		}
+
+		displacements[b] = d;
+	}
+
+out_free:
+	free(bucket_of);
+	free(members);
+	free(sizes);
+	free(starts);
+	free(order);
+	free(taken);
+
+	return ret;
+}
+
+static int statistics_index_write(FILE *stream, struct statistics *stats,
+				  struct statistics_slot **keys,
+				  struct statistics_index_header *header,
+				  uint32_t *displacements, uint32_t *placed)
+{
+	struct statistics_index_record *records;
+	static const char padding[8] = {0};
+	size_t offset;
+	int ret = 0;
+
+	records = calloc(header->nrecords, sizeof(*records));
+	if (header->nrecords > 0 && records == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+	for (uint32_t i = 0; i < header->nrecords; i++) {
+		records[placed[i]].hash = keys[i]->hash;
+		records[placed[i]].pname = keys[i]->pname;
+		records[placed[i]].pname_len =
+			strlen(stats->names + keys[i]->pname);
+		records[placed[i]].entry = keys[i]->entry;
+	}
+
+	offset = sizeof(*header) + header->nbuckets * sizeof(*displacements);
+	if (fwrite(header, sizeof(*header), 1, stream) != 1 ||
+	    fwrite(displacements, sizeof(*displacements), header->nbuckets,
+		   stream) != header->nbuckets ||
+	    fwrite(padding, 1,
+		   statistics_index_records_offset(header->nbuckets) - offset,
+		   stream) !=
+		    statistics_index_records_offset(header->nbuckets) -
+			    offset ||
+	    fwrite(records, sizeof(*records), header->nrecords, stream) !=
+		    header->nrecords ||
+	    fwrite(stats->names, 1, header->names_size, stream) !=
+		    header->names_size) {
+		print_err("%s", strerror(errno));
+		ret = -EIO;
+	}
+
+	free(records);
+	return ret;
+}
+
+int statistics_index_compile(struct statistics *stats, const char *path)
+{
+	struct statistics_index_header header = {
+		.byte_order = STATISTICS_INDEX_BYTE_ORDER,
+	};
+	struct statistics_slot **keys = NULL;
+	uint32_t *displacements = NULL, *placed = NULL;
+	char *tmp_path = NULL;
+	FILE *stream = NULL;
+	uint32_t n = 0;
+	int fd, ret;
+
+	if (stats->slots == NULL) {
+		print_err("%s", "No statistics loaded to compile");
+		return -EINVAL;
+	}
+	if (stats->slots_filled >= UINT32_MAX)
+		return -EOVERFLOW;
+
+	memcpy(header.magic, STATISTICS_INDEX_MAGIC, sizeof(header.magic));
+	header.nrecords = stats->slots_filled;
+	header.quantiles = stats->quantiles;
+	header.calibration_factor = stats->calibration.factor;
+	header.calibration_error = stats->calibration.error;
+	header.calibration_samples = stats->calibration.samples;
+	header.nbuckets = header.nrecords / STATISTICS_INDEX_BUCKET_KEYS + 1;
+	header.names_size = stats->names_filled;
+
+	keys = malloc(header.nrecords * sizeof(*keys));
+	placed = malloc(header.nrecords * sizeof(*placed));
+	displacements = malloc(header.nbuckets * sizeof(*displacements));
+	if ((header.nrecords > 0 && (keys == NULL || placed == NULL)) ||
+	    displacements == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free;
+	}
+	for (size_t i = 0; i <= stats->slots_mask; i++) {
+		if (stats->slots[i].pname != STATISTICS_SLOT_EMPTY)
+			keys[n++] = &stats->slots[i];
+	}
+
+	ret = n == 0 ? 0 : -EAGAIN;
+	for (uint64_t seed = 0; seed < STATISTICS_INDEX_SEEDS && ret == -EAGAIN;
+	     seed++) {
+		header.seed = statistics_index_mix(seed + 1);
+		ret = statistics_index_place(keys, n, header.seed,
+					     header.nbuckets, displacements,
+					     placed);
+	}
+	if (ret == -EAGAIN)
+		print_err("%s", "Failed to find a perfect hash");
+	if (ret < 0)
+		goto out_free;
+
+	/* readers with the old file mapped keep it, new ones get this one */
+	ret = asprintf(&tmp_path, "%s.XXXXXX", path);
+	if (ret < 0) {
+		print_err("%s", "Failed to allocate index path");
+		tmp_path = NULL;
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		print_err("%s: %s", tmp_path, strerror(errno));
+		ret = -errno;
+		goto out_free;
+	}
+	fchmod(fd, 0644);
+
+	stream = fdopen(fd, "w");
+	if (stream == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		close(fd);
+		goto out_unlink;
+	}
+
+	ret = statistics_index_write(stream, stats, keys, &header,
+				     displacements, placed);
+	if (fclose(stream) != 0 && ret == 0) {
+		print_err("%s: %s", tmp_path, strerror(errno));
+		ret = -EIO;
+	}
+	if (ret == 0 && rename(tmp_path, path) < 0) {
+		print_err("%s: %s", path, strerror(errno));
+		ret = -errno;
+	}
+
+out_unlink:
+	if (ret < 0)
+		unlink(tmp_path);
+out_free:
+	free(tmp_path);
+	free(keys);
+	free(placed);
+	free(displacements);
+
+	return ret;
+}
+
+int statistics_index_detect(const char *path, bool *isindex)
+{
+	char magic[sizeof(STATISTICS_INDEX_MAGIC) - 1];
+	FILE *stream;
+
+	stream = fopen(path, "r");
+	if (stream == NULL) {
+		print_err("%s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	*isindex = fread(magic, sizeof(magic), 1, stream) == 1 &&
+		   !memcmp(magic, STATISTICS_INDEX_MAGIC, sizeof(magic));
+	fclose(stream);
+
+	return 0;
+}
+
+int statistics_index_open(struct statistics_index **index, const char *path)
+{
+	const struct statistics_index_header *header;
+	struct statistics_index *idx;
+	uint64_t records_offset, names_offset;
+	struct stat st;
+	void *base;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		print_err("%s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		print_err("%s: %s", path, strerror(errno));
+		ret = -errno;
+		goto out_close_fd;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		ret = -EINVAL;
+		goto out_close_fd;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		print_err("%s: %s", path, strerror(errno));
+		ret = -errno;
+		goto out_close_fd;
+	}
+
+	header = base;
+	records_offset = statistics_index_records_offset(header->nbuckets);
+	names_offset = records_offset + (uint64_t)header->nrecords *
+						sizeof(*idx->records);
+	if (memcmp(header->magic, STATISTICS_INDEX_MAGIC,
+		   sizeof(header->magic)) ||
+	    header->byte_order != STATISTICS_INDEX_BYTE_ORDER ||
+	    header->nbuckets == 0 ||
+	    names_offset + header->names_size != (uint64_t)st.st_size) {
+		print_err("%s: not an evanix statistics index of this machine",
+			  path);
+		munmap(base, st.st_size);
+		ret = -EINVAL;
+		goto out_close_fd;
+	}
+
+	idx = malloc(sizeof(*idx));
+	if (idx == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		munmap(base, st.st_size);
+		goto out_close_fd;
+	}
+	idx->base = base;
+	idx->size = st.st_size;
+	idx->header = header;
+	idx->displacements = (const uint32_t *)(header + 1);
+	idx->records = (const struct statistics_index_record
+				*)((const char *)base + records_offset);
+	idx->names = (const char *)base + names_offset;
+	*index = idx;
+	ret = 0;
+
+out_close_fd:
+	close(fd);
+	return ret;
+}
+
+int statistics_index_lookup(const struct statistics_index *idx,
+			    const char *pname, struct statistics_entry *entry)
+{
+	const struct statistics_index_record *record;
+	uint32_t bucket;
+	uint64_t hash;
+	size_t len;
+
+	if (idx->header->nrecords == 0)
+		return -ENOENT;
+
+	len = strlen(pname);
+	hash = fnv1a_64(FNV1A_64_INIT, pname, len);
+	bucket = statistics_index_bucket(hash, idx->header->seed,
+					 idx->header->nbuckets);
+	record = &idx->records[statistics_index_slot(
+		hash, idx->header->seed, idx->displacements[bucket],
+		idx->header->nrecords)];
+
+	/* a perfect hash maps pnames it doesn't know anywhere */
+	if (record->hash != hash || record->pname_len != len ||
+	    (uint64_t)record->pname + len >= idx->header->names_size ||
+	    memcmp(idx->names + record->pname, pname, len))
+		return -ENOENT;
+
+	*entry = record->entry;
+	return 0;
+}
+
+void statistics_index_close(struct statistics_index *idx)
+{
+	if (idx == NULL)
+		return;
+
+	munmap(idx->base, idx->size);
+	free(idx);
+}
+
+int statistics_index_main(int argc, char *argv[])
+{
+	struct statistics stats = {0};
+	char *db = NULL, *output = NULL;
+	int longindex, c, ret;
+	double start;
+
+	static struct option longopts[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"db", required_argument, NULL, 'd'},
+		{"output", required_argument, NULL, 'o'},
+		{NULL, 0, NULL, 0},
+	};
+
+	if (argc < 2 || strcmp(argv[1], "compile")) {
+		fprintf(stderr, "%s", usage);
+		return -EINVAL;
+	}
+	argc--;
+	argv++;
+
+	while ((c = getopt_long(argc, argv, "hd:o:", longopts,
+				&longindex)) != -1) {
+		switch (c) {
+		case 'h':
+			printf("%s", usage);
+			return 0;
+		case 'd':
+			db = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			fprintf(stderr, "Try 'evanix stats compile --help' for "
+					"more information.\n");
+			return -EINVAL;
+		}
+	}
+	if (db == NULL || output == NULL) {
+		fprintf(stderr, "evanix stats compile requires --db and "
+				"--output\n"
+				"Try 'evanix stats compile --help' for more "
+				"information.\n");
+		return -EINVAL;
+	}
+
+	start = monotonic_now();
+	ret = statistics_open(&stats, db, false);
+	if (ret < 0)
+		goto out_close;
+
+	ret = statistics_load(&stats, SIZE_MAX);
+	if (ret < 0)
+		goto out_close;
+
+	ret = statistics_index_compile(&stats, output);
+	if (ret < 0)
+		goto out_close;
+
+	printf("🗂️ stats: %zu pnames compiled in %.3fs\n", stats.slots_filled,
+	       monotonic_now() - start);
+
+out_close:
+	statistics_close(&stats);
+	return ret;
+}
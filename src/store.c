@@ -0,0 +1,464 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nix/nix_api_store.h>
+#include <nix/nix_api_util.h>
+#include <uthash.h>
+
+#include "drv.h"
+#include "jobs.h"
+#include "nix.h"
+#include "store.h"
+#include "util.h"
+
+struct store_seen {
+	char *path;
+	UT_hash_handle hh;
+};
+
+/* state of a single store_closure_read() */
+struct store_walk {
+	nix_c_context *ctx;
+	struct cache_memo *memo;
+	struct cache_status *root;
+	/* drv and output paths already visited */
+	struct store_seen *seen;
+};
+
+/* a drv whose input drvs store_walk_drv() is walking */
+struct store_walk_frame {
+	struct drv drv;
+	/* into drv.input_drvs */
+	char *cursor;
+};
+
+static struct {
+	Store *local;
+	size_t substituters_size, substituters_filled;
+	Store **substituters;
+} store = {
+	.local = NULL,
+	.substituters_size = 0,
+	.substituters_filled = 0,
+	.substituters = NULL,
+};
+
+static int store_substituter_insert(Store *substituter);
+static int store_seen_insert(struct store_walk *w, const char *path);
+static void store_seen_free(struct store_walk *w);
+static int store_path_status(struct store_walk *w, const char *path,
+			     cache_status_t *status);
+static int store_closure_insert(struct store_walk *w, const char *path,
+				cache_status_t status);
+static int store_visit_drv(struct store_walk *w, const char *drv_path,
+			   char **wanted, size_t wanted_filled,
+			   struct drv *drv);
+static int store_walk_frame_push(struct store_walk_frame **frames,
+				 size_t *size, size_t *filled,
+				 struct drv *drv);
+static int store_walk_drv(struct store_walk *w, const char *drv_path);
+static int strv_insert(char ***strv, size_t *size, size_t *filled, char *s);
+
+static int strv_insert(char ***strv, size_t *size, size_t *filled, char *s)
+{
+	size_t newsize;
+	void *ret;
+
+	if (*filled == *size) {
+		newsize = *size == 0 ? 4 : *size * 2;
+		ret = realloc(*strv, newsize * sizeof(**strv));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		*strv = ret;
+		*size = newsize;
+	}
+
+	(*strv)[(*filled)++] = s;
+	return 0;
+}
+
+static int store_substituter_insert(Store *substituter)
+{
+	size_t newsize;
+	void *ret;
+
+	if (store.substituters_filled == store.substituters_size) {
+		newsize = store.substituters_size == 0
+				  ? 1
+				  : store.substituters_size * 2;
+		ret = realloc(store.substituters,
+			      newsize * sizeof(*store.substituters));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		store.substituters = ret;
+		store.substituters_size = newsize;
+	}
+
+	store.substituters[store.substituters_filled++] = substituter;
+	return 0;
+}
+
+int store_init(nix_c_context *nix_ctx)
+{
+	char *substituters = NULL;
+	char *uri, *saveptr;
+	Store *substituter;
+	nix_err nix_ret;
+	int ret = 0;
+
+	store.local = nix_store_open(nix_ctx, NULL, NULL);
+	if (store.local == NULL) {
+		print_err("%s", nix_err_msg(NULL, nix_ctx, NULL));
+		return -EPERM;
+	}
+
+	nix_ret = nix_setting_get(nix_ctx, "substituters",
+				  _nix_get_string_strdup, &substituters);
+	if (nix_ret != NIX_OK) {
+		print_err("%s", nix_err_msg(NULL, nix_ctx, NULL));
+		ret = -EPERM;
+		goto out_free;
+	} else if (substituters == NULL) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for (uri = strtok_r(substituters, " \t\n", &saveptr); uri != NULL;
+	     uri = strtok_r(NULL, " \t\n", &saveptr)) {
+		substituter = nix_store_open(nix_ctx, uri, NULL);
+		if (substituter == NULL) {
+			/* nix-build would carry on without it too */
+			print_err("%s: %s", uri,
+				  nix_err_msg(NULL, nix_ctx, NULL));
+			nix_clear_err(nix_ctx);
+			continue;
+		}
+
+		ret = store_substituter_insert(substituter);
+		if (ret < 0) {
+			nix_store_free(substituter);
+			goto out_free;
+		}
+	}
+
+out_free:
+	free(substituters);
+	if (ret < 0)
+		store_free();
+
+	return ret;
+}
+
+void store_free(void)
+{
+	for (size_t i = 0; i < store.substituters_filled; i++)
+		nix_store_free(store.substituters[i]);
+	free(store.substituters);
+	store.substituters = NULL;
+	store.substituters_size = 0;
+	store.substituters_filled = 0;
+
+	if (store.local != NULL)
+		nix_store_free(store.local);
+	store.local = NULL;
+}
+
+/* returns 1 if path was seen before */
+static int store_seen_insert(struct store_walk *w, const char *path)
+{
+	struct store_seen *seen;
+
+	HASH_FIND_STR(w->seen, path, seen);
+	if (seen != NULL)
+		return 1;
+
+	seen = malloc(sizeof(*seen));
+	if (seen == NULL) {
+		print_err("%s", strerror(errno));
+		return -errno;
+	}
+
+	seen->path = strdup(path);
+	if (seen->path == NULL) {
+		print_err("%s", strerror(errno));
+		free(seen);
+		return -errno;
+	}
+
+	HASH_ADD_KEYPTR(hh, w->seen, seen->path, strlen(seen->path), seen);
+	return 0;
+}
+
+static void store_seen_free(struct store_walk *w)
+{
+	struct store_seen *seen, *tmp;
+
+	HASH_ITER (hh, w->seen, seen, tmp) {
+		HASH_DEL(w->seen, seen);
+		free(seen->path);
+		free(seen);
+	}
+}
+
+static int store_path_status(struct store_walk *w, const char *path,
+			     cache_status_t *status)
+{
+	StorePath *store_path;
+
+	/* floating content addressed outputs aren't known before the build */
+	if (path[0] == '\0') {
+		*status = CACHE_STATUS_BUILD;
+		return 0;
+	}
+
+	store_path = nix_store_parse_path(w->ctx, store.local, path);
+	if (store_path == NULL) {
+		print_err("%s: %s", path, nix_err_msg(NULL, w->ctx, NULL));
+		nix_clear_err(w->ctx);
+		return -EINVAL;
+	}
+
+	*status = CACHE_STATUS_BUILD;
+	if (nix_store_is_valid_path(w->ctx, store.local, store_path)) {
+		*status = CACHE_STATUS_LOCAL;
+	} else {
+		for (size_t i = 0; i < store.substituters_filled; i++) {
+			if (nix_store_is_valid_path(w->ctx,
+						    store.substituters[i],
+						    store_path)) {
+				*status = CACHE_STATUS_SUBSTITUTABLE;
+				break;
+			}
+		}
+	}
+	/* an unreachable substituter is as good as a missing path */
+	nix_clear_err(w->ctx);
+
+	nix_store_path_free(store_path);
+	return 0;
+}
+
+static int store_closure_insert(struct store_walk *w, const char *path,
+				cache_status_t status)
+{
+	struct cache_status *cs;
+	int ret;
+
+	pthread_mutex_lock(&w->memo->mutex);
+	ret = cache_memo_get(w->memo, path, status, &cs);
+	pthread_mutex_unlock(&w->memo->mutex);
+	if (ret < 0)
+		return ret;
+
+	if (status == CACHE_STATUS_LOCAL)
+		return 0;
+
+	return cache_status_closure_insert(w->root, cs);
+}
+
+/* wanted are the output names needed, all of them if wanted is NULL.
+ * Returns 1 if drv_path has to be built, its input drvs are to be walked
+ * next and *drv is left for the caller to free. */
+static int store_visit_drv(struct store_walk *w, const char *drv_path,
+			   char **wanted, size_t wanted_filled,
+			   struct drv *drv)
+{
+	char *cursor, *name, *store_path;
+	cache_status_t status, drv_status;
+	struct cache_status *cs, *c;
+	bool iswanted;
+
+	size_t paths_size = 0, paths_filled = 0;
+	char **paths = NULL;
+	int ret;
+
+	ret = store_seen_insert(w, drv_path);
+	if (ret != 0)
+		return ret < 0 ? ret : 0;
+
+	/* answered by an earlier check */
+	pthread_mutex_lock(&w->memo->mutex);
+	HASH_FIND_STR(w->memo->htab, drv_path, cs);
+	if (cs != NULL && cs->status == CACHE_STATUS_LOCAL) {
+		pthread_mutex_unlock(&w->memo->mutex);
+		return 0;
+	} else if (cs != NULL && cs->iscomplete) {
+		for (size_t i = 0; i < cs->closure_filled && ret >= 0; i++) {
+			/* drv_path itself is part of it, and already seen */
+			c = cs->closure[i];
+			ret = strcmp(c->path, drv_path)
+				      ? store_seen_insert(w, c->path)
+				      : 0;
+			if (ret == 0)
+				ret = cache_status_closure_insert(w->root, c);
+		}
+		pthread_mutex_unlock(&w->memo->mutex);
+		return ret < 0 ? ret : 0;
+	}
+	pthread_mutex_unlock(&w->memo->mutex);
+
+	ret = drv_read(drv_path, drv);
+	if (ret < 0)
+		return ret;
+
+	cursor = drv->outputs;
+	while ((ret = drv_output_next(&cursor, &name, &store_path)) > 0) {
+		iswanted = wanted == NULL;
+		for (size_t i = 0; i < wanted_filled && !iswanted; i++)
+			iswanted = !strcmp(wanted[i], name);
+		if (!iswanted)
+			continue;
+
+		ret = strv_insert(&paths, &paths_size, &paths_filled,
+				  store_path);
+		if (ret < 0)
+			goto out_free;
+	}
+	if (ret < 0)
+		goto out_free;
+
+	drv_status = CACHE_STATUS_LOCAL;
+	for (size_t i = 0; i < paths_filled; i++) {
+		ret = store_path_status(w, paths[i], &status);
+		if (ret < 0)
+			goto out_free;
+
+		if (status == CACHE_STATUS_SUBSTITUTABLE &&
+		    store_seen_insert(w, paths[i]) == 0) {
+			ret = store_closure_insert(w, paths[i], status);
+			if (ret < 0)
+				goto out_free;
+		}
+		if (status > drv_status)
+			drv_status = status;
+	}
+
+	/* like nix-build --dry-run, a substituted drv is its outputs */
+	if (drv_status == CACHE_STATUS_SUBSTITUTABLE)
+		goto out_free;
+
+	ret = store_closure_insert(w, drv_path, drv_status);
+	if (ret < 0 || drv_status == CACHE_STATUS_LOCAL)
+		goto out_free;
+
+	free(paths);
+	return 1;
+
+out_free:
+	free(paths);
+	drv_free(drv);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* frees drv on failure */
+static int store_walk_frame_push(struct store_walk_frame **frames,
+				 size_t *size, size_t *filled,
+				 struct drv *drv)
+{
+	struct store_walk_frame *tmp;
+	size_t newsize;
+
+	if (*filled == *size) {
+		newsize = *size == 0 ? 64 : *size * 2;
+		tmp = realloc(*frames, newsize * sizeof(**frames));
+		if (tmp == NULL) {
+			print_err("%s", strerror(errno));
+			drv_free(drv);
+			return -errno;
+		}
+		*frames = tmp;
+		*size = newsize;
+	}
+
+	(*frames)[*filled].drv = *drv;
+	(*frames)[*filled].cursor = drv->input_drvs;
+	(*filled)++;
+
+	return 0;
+}
+
+/* depth first like nix-build --dry-run, with a stack of its own instead of
+ * recursing, a closure can be as deep as it is large */
+static int store_walk_drv(struct store_walk *w, const char *drv_path)
+{
+	char *dep_drv_path, *dep_outputs, *output;
+	struct store_walk_frame *frame;
+	struct drv drv;
+
+	size_t frames_size = 0, frames_filled = 0;
+	size_t names_size = 0, names_filled = 0;
+	struct store_walk_frame *frames = NULL;
+	char **names = NULL;
+	int ret;
+
+	ret = store_visit_drv(w, drv_path, NULL, 0, &drv);
+	if (ret > 0)
+		ret = store_walk_frame_push(&frames, &frames_size,
+					    &frames_filled, &drv);
+
+	while (ret >= 0 && frames_filled > 0) {
+		frame = &frames[frames_filled - 1];
+		ret = drv_input_drv_next(&frame->cursor, &dep_drv_path,
+					 &dep_outputs);
+		if (ret <= 0) {
+			drv_free(&frame->drv);
+			frames_filled--;
+			continue;
+		}
+
+		names_filled = 0;
+		while ((ret = drv_string_next(&dep_outputs, &output)) > 0) {
+			ret = strv_insert(&names, &names_size, &names_filled,
+					  output);
+			if (ret < 0)
+				break;
+		}
+		if (ret < 0)
+			break;
+
+		/* names point into frame->drv, which stays until it's popped */
+		ret = store_visit_drv(w, dep_drv_path, names, names_filled,
+				      &drv);
+		if (ret > 0)
+			ret = store_walk_frame_push(&frames, &frames_size,
+						    &frames_filled, &drv);
+	}
+
+	while (frames_filled > 0)
+		drv_free(&frames[--frames_filled].drv);
+	free(frames);
+	free(names);
+
+	return ret < 0 ? ret : 0;
+}
+
+int store_closure_read(struct job *job, struct cache_memo *memo,
+		       struct cache_status *root)
+{
+	struct store_walk w;
+	int ret;
+
+	w.ctx = nix_c_context_create();
+	if (w.ctx == NULL) {
+		print_err("%s", "Failed to create nix context");
+		return -EPERM;
+	}
+	w.memo = memo;
+	w.root = root;
+	w.seen = NULL;
+
+	ret = store_walk_drv(&w, job->drv_path);
+
+	store_seen_free(&w);
+	nix_c_context_free(w.ctx);
+
+	return ret;
+}
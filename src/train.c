@@ -0,0 +1,542 @@
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "model.h"
+#include "train.h"
+#include "util.h"
+
+#define TRAIN_CG_TOLERANCE 1e-8
+
+static const char usage[] =
+	"Usage: evanix train [options]\n"
+	"\n"
+	"  -h, --help                         Show help message and quit.\n"
+	"  -d, --db                   <path>  Database with builds_cleaned,\n"
+	"                                     input_pnames and pnames.\n"
+	"  -o, --output               <path>  Where to write the model.\n"
+	"  -l, --lambda               <x>     Ridge penalty, defaults to 1.\n"
+	"  -H, --holdout              <n>     Percent of the builds to "
+	"measure\n"
+	"                                     the error on, defaults to 10.\n"
+	"  -n, --iterations           <n>     Max solver iterations, "
+	"defaults\n"
+	"                                     to 1000.\n"
+	"\n";
+
+struct train_opts {
+	char *db;
+	char *output;
+	double lambda;
+	int holdout;
+	int iterations;
+};
+
+/* design matrix in CSR, a row per build and a column per input pname id,
+ * every entry is 1 so only the column indices are kept */
+struct train_csr {
+	size_t rows_size, rows_filled;
+	size_t *row_ptr;
+	double *y;
+	bool *isholdout;
+
+	size_t cols_size, cols_filled;
+	uint32_t *cols;
+
+	/* one past the largest pname id */
+	size_t ncols;
+};
+
+static int train_opts_read(struct train_opts *opts, int argc, char *argv[]);
+static int train_csr_row_insert(struct train_csr *m, double y, bool isholdout);
+static int train_csr_col_insert(struct train_csr *m, uint32_t col);
+static int train_csr_read(struct train_csr *m, sqlite3 *db, int holdout);
+static void train_csr_free(struct train_csr *m);
+static double train_row_dot(struct train_csr *m, size_t row, const double *v);
+static void train_normal_apply(struct train_csr *m, double lambda,
+			       const double *v, double *out);
+static double train_dot(const double *a, const double *b, size_t n);
+static int train_solve(struct train_csr *m, double lambda, int iterations,
+		       double *theta, int *iterated);
+static int train_model_write(sqlite3 *db, const double *theta, size_t ncols,
+			     const char *path);
+
+static int train_opts_read(struct train_opts *opts, int argc, char *argv[])
+{
+	int longindex, c;
+	char *end;
+
+	static struct option longopts[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"db", required_argument, NULL, 'd'},
+		{"output", required_argument, NULL, 'o'},
+		{"lambda", required_argument, NULL, 'l'},
+		{"holdout", required_argument, NULL, 'H'},
+		{"iterations", required_argument, NULL, 'n'},
+		{NULL, 0, NULL, 0},
+	};
+
+	while ((c = getopt_long(argc, argv, "hd:o:l:H:n:", longopts,
+				&longindex)) != -1) {
+		switch (c) {
+		case 'h':
+			printf("%s", usage);
+			return 1;
+		case 'd':
+			opts->db = optarg;
+			break;
+		case 'o':
+			opts->output = optarg;
+			break;
+		case 'l':
+			errno = 0;
+			opts->lambda = strtod(optarg, &end);
+			if (errno != 0 || *end != '\0' || end == optarg ||
+			    !(opts->lambda >= 0)) {
+				fprintf(stderr,
+					"option -%c requires a non-negative "
+					"number argument\n"
+					"Try 'evanix train --help' for more "
+					"information.\n",
+					c);
+				return -EINVAL;
+			}
+			break;
+		case 'H':
+			opts->holdout = atoi(optarg);
+			if (opts->holdout < 0 || opts->holdout >= 100) {
+				fprintf(stderr,
+					"option -%c requires a percentage "
+					"below 100\n"
+					"Try 'evanix train --help' for more "
+					"information.\n",
+					c);
+				return -EINVAL;
+			}
+			break;
+		case 'n':
+			opts->iterations = atoi(optarg);
+			if (opts->iterations <= 0) {
+				fprintf(stderr,
+					"option -%c requires a natural number "
+					"argument\n"
+					"Try 'evanix train --help' for more "
+					"information.\n",
+					c);
+				return -EINVAL;
+			}
+			break;
+		default:
+			fprintf(stderr, "Try 'evanix train --help' for more "
+					"information.\n");
+			return -EINVAL;
+		}
+	}
+
+	if (opts->db == NULL || opts->output == NULL) {
+		fprintf(stderr, "evanix train requires --db and --output\n"
+				"Try 'evanix train --help' for more "
+				"information.\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int train_csr_row_insert(struct train_csr *m, double y, bool isholdout)
+{
+	size_t newsize;
+	void *ret;
+
+	if (m->rows_filled == m->rows_size) {
+		newsize = m->rows_size == 0 ? 1024 : m->rows_size * 2;
+
+		/* row_ptr has one more, where the last row ends */
+		ret = realloc(m->row_ptr, (newsize + 1) * sizeof(*m->row_ptr));
+		if (ret == NULL)
+			goto out_err;
+		m->row_ptr = ret;
+
+		ret = realloc(m->y, newsize * sizeof(*m->y));
+		if (ret == NULL)
+			goto out_err;
+		m->y = ret;
+
+		ret = realloc(m->isholdout, newsize * sizeof(*m->isholdout));
+		if (ret == NULL)
+			goto out_err;
+		m->isholdout = ret;
+
+		m->rows_size = newsize;
+	}
+
+	m->row_ptr[m->rows_filled] = m->cols_filled;
+	m->y[m->rows_filled] = y;
+	m->isholdout[m->rows_filled] = isholdout;
+	m->rows_filled++;
+	m->row_ptr[m->rows_filled] = m->cols_filled;
+
+	return 0;
+
+out_err:
+	print_err("%s", strerror(errno));
+	return -errno;
+}
+
+static int train_csr_col_insert(struct train_csr *m, uint32_t col)
+{
+	size_t newsize;
+	void *ret;
+
+	if (m->cols_filled == m->cols_size) {
+		newsize = m->cols_size == 0 ? 4096 : m->cols_size * 2;
+		ret = realloc(m->cols, newsize * sizeof(*m->cols));
+		if (ret == NULL) {
+			print_err("%s", strerror(errno));
+			return -errno;
+		}
+
+		m->cols = ret;
+		m->cols_size = newsize;
+	}
+
+	m->cols[m->cols_filled++] = col;
+	m->row_ptr[m->rows_filled] = m->cols_filled;
+	if (col >= m->ncols)
+		m->ncols = (size_t)col + 1;
+
+	return 0;
+}
+
+/* one pass over a join sorted by build, instead of a query per build */
+static int train_csr_read(struct train_csr *m, sqlite3 *db, int holdout)
+{
+	const char *query = "SELECT builds_cleaned.ROWID, "
+			    "builds_cleaned.duration, input_pnames.pname_id "
+			    "FROM builds_cleaned "
+			    "LEFT JOIN input_pnames "
+			    "ON input_pnames.drv_id = builds_cleaned.drv_id "
+			    "ORDER BY builds_cleaned.ROWID";
+	sqlite3_stmt *statement;
+	int64_t rowid, rowid_last = 0, pname_id;
+	bool isholdout;
+	uint64_t hash;
+	int ret;
+
+	ret = sqlite3_prepare_v2(db, query, -1, &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		return -EPERM;
+	}
+
+	while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
+		rowid = sqlite3_column_int64(statement, 0);
+		if (m->rows_filled == 0 || rowid != rowid_last) {
+			/* the same builds are held out on every run */
+			hash = fnv1a_64(FNV1A_64_INIT, &rowid, sizeof(rowid));
+			isholdout = (int)(hash % 100) < holdout;
+
+			ret = train_csr_row_insert(
+				m, sqlite3_column_double(statement, 1),
+				isholdout);
+			if (ret < 0)
+				goto out_finalize;
+			rowid_last = rowid;
+		}
+
+		if (sqlite3_column_type(statement, 2) == SQLITE_NULL)
+			continue;
+
+		pname_id = sqlite3_column_int64(statement, 2);
+		if (pname_id < 0 || pname_id >= UINT32_MAX) {
+			print_err("pname id %" PRId64 " is out of range",
+				  pname_id);
+			ret = -ERANGE;
+			goto out_finalize;
+		}
+
+		ret = train_csr_col_insert(m, pname_id);
+		if (ret < 0)
+			goto out_finalize;
+	}
+
+	if (ret != SQLITE_DONE) {
+		print_err("%s", "Failed to step sql");
+		ret = -EPERM;
+	} else {
+		ret = 0;
+	}
+
+out_finalize:
+	sqlite3_finalize(statement);
+	return ret;
+}
+
+static void train_csr_free(struct train_csr *m)
+{
+	free(m->row_ptr);
+	free(m->y);
+	free(m->isholdout);
+	free(m->cols);
+}
+
+/* theta[0] is the intercept and theta[1 + pname id] its coefficient */
+static double train_row_dot(struct train_csr *m, size_t row, const double *v)
+{
+	double sum = v[0];
+
+	for (size_t k = m->row_ptr[row]; k < m->row_ptr[row + 1]; k++)
+		sum += v[1 + m->cols[k]];
+
+	return sum;
+}
+
+/* out = (AᵀA + λI)v over the training rows, without forming AᵀA. The
+ * intercept isn't penalized. */
+static void train_normal_apply(struct train_csr *m, double lambda,
+			       const double *v, double *out)
+{
+	size_t n = m->ncols + 1;
+	double sum;
+
+	memset(out, 0, n * sizeof(*out));
+	for (size_t row = 0; row < m->rows_filled; row++) {
+		if (m->isholdout[row])
+			continue;
+
+		sum = train_row_dot(m, row, v);
+		out[0] += sum;
+		for (size_t k = m->row_ptr[row]; k < m->row_ptr[row + 1]; k++)
+			out[1 + m->cols[k]] += sum;
+	}
+
+	for (size_t i = 1; i < n; i++)
+		out[i] += lambda * v[i];
+}
+
+static double train_dot(const double *a, const double *b, size_t n)
+{
+	double sum = 0;
+
+	for (size_t i = 0; i < n; i++)
+		sum += a[i] * b[i];
+
+	return sum;
+}
+
+/* conjugate gradient on the normal equations, with a Jacobi preconditioner
+ * since the intercept column is much denser than the rest */
+static int train_solve(struct train_csr *m, double lambda, int iterations,
+		       double *theta, int *iterated)
+{
+	double *r, *z, *p, *ap, *diag;
+	double rz, rz_next, alpha, b_norm;
+	size_t n = m->ncols + 1;
+	int i, ret = 0;
+
+	r = calloc(n, sizeof(*r));
+	z = calloc(n, sizeof(*z));
+	p = calloc(n, sizeof(*p));
+	ap = calloc(n, sizeof(*ap));
+	diag = calloc(n, sizeof(*diag));
+	if (r == NULL || z == NULL || p == NULL || ap == NULL ||
+	    diag == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free;
+	}
+
+	/* theta starts at 0, so the residual starts at Aᵀy */
+	for (size_t row = 0; row < m->rows_filled; row++) {
+		if (m->isholdout[row])
+			continue;
+
+		r[0] += m->y[row];
+		diag[0]++;
+		for (size_t k = m->row_ptr[row]; k < m->row_ptr[row + 1];
+		     k++) {
+			r[1 + m->cols[k]] += m->y[row];
+			diag[1 + m->cols[k]]++;
+		}
+	}
+	for (size_t j = 0; j < n; j++) {
+		theta[j] = 0;
+		if (j > 0)
+			diag[j] += lambda;
+		/* pnames only the held out builds have */
+		if (diag[j] == 0)
+			diag[j] = 1;
+
+		z[j] = r[j] / diag[j];
+		p[j] = z[j];
+	}
+
+	b_norm = sqrt(train_dot(r, r, n));
+	rz = train_dot(r, z, n);
+	for (i = 0; i < iterations && b_norm > 0; i++) {
+		train_normal_apply(m, lambda, p, ap);
+		alpha = train_dot(p, ap, n);
+		/* singular without a penalty, theta is as good as it gets */
+		if (alpha <= 0)
+			break;
+		alpha = rz / alpha;
+
+		for (size_t j = 0; j < n; j++) {
+			theta[j] += alpha * p[j];
+			r[j] -= alpha * ap[j];
+		}
+		if (sqrt(train_dot(r, r, n)) <= TRAIN_CG_TOLERANCE * b_norm) {
+			i++;
+			break;
+		}
+
+		for (size_t j = 0; j < n; j++)
+			z[j] = r[j] / diag[j];
+		rz_next = train_dot(r, z, n);
+		for (size_t j = 0; j < n; j++)
+			p[j] = z[j] + rz_next / rz * p[j];
+		rz = rz_next;
+	}
+	*iterated = i;
+
+out_free:
+	free(r);
+	free(z);
+	free(p);
+	free(ap);
+	free(diag);
+
+	return ret;
+}
+
+static int train_model_write(sqlite3 *db, const double *theta, size_t ncols,
+			     const char *path)
+{
+	const char *query = "SELECT ROWID, pname FROM pnames";
+	sqlite3_stmt *statement;
+	struct model *model;
+	const char *pname;
+	int64_t pname_id;
+	int ret;
+
+	ret = model_new(&model);
+	if (ret < 0)
+		return ret;
+	model->intercept = theta[0];
+
+	ret = sqlite3_prepare_v2(db, query, -1, &statement, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("%s", "Failed to prepare sql");
+		ret = -EPERM;
+		goto out_free_model;
+	}
+
+	while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
+		pname_id = sqlite3_column_int64(statement, 0);
+		pname = (const char *)sqlite3_column_text(statement, 1);
+		/* a zero coefficient predicts the same as no coefficient */
+		if (pname == NULL || pname_id < 0 ||
+		    (size_t)pname_id >= ncols || theta[1 + pname_id] == 0)
+			continue;
+
+		ret = model_coef_insert(model, pname, theta[1 + pname_id]);
+		if (ret < 0)
+			goto out_finalize;
+	}
+
+	if (ret != SQLITE_DONE) {
+		print_err("%s", "Failed to step sql");
+		ret = -EPERM;
+		goto out_finalize;
+	}
+
+	ret = model_write(model, path);
+
+out_finalize:
+	sqlite3_finalize(statement);
+out_free_model:
+	model_free(model);
+
+	return ret;
+}
+
+int train_main(int argc, char *argv[])
+{
+	struct train_opts opts = {
+		.db = NULL,
+		.output = NULL,
+		.lambda = 1,
+		.holdout = 10,
+		.iterations = 1000,
+	};
+	struct train_csr m = {0};
+	double start, loaded, trained, error, abs_sum = 0, sq_sum = 0;
+	size_t holdout_rows = 0;
+	double *theta = NULL;
+	int iterated, ret;
+	sqlite3 *db;
+
+	ret = train_opts_read(&opts, argc, argv);
+	if (ret != 0)
+		return ret < 0 ? ret : 0;
+
+	ret = sqlite3_open_v2(opts.db, &db, SQLITE_OPEN_READONLY, NULL);
+	if (ret != SQLITE_OK) {
+		print_err("Can't open database: %s", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return -EPERM;
+	}
+
+	start = monotonic_now();
+	ret = train_csr_read(&m, db, opts.holdout);
+	if (ret < 0)
+		goto out_free;
+	loaded = monotonic_now();
+	printf("📚 train: %zu builds, %zu inputs, %zu pnames loaded in "
+	       "%.3fs\n",
+	       m.rows_filled, m.cols_filled, m.ncols, loaded - start);
+
+	theta = malloc((m.ncols + 1) * sizeof(*theta));
+	if (theta == NULL) {
+		print_err("%s", strerror(errno));
+		ret = -errno;
+		goto out_free;
+	}
+
+	ret = train_solve(&m, opts.lambda, opts.iterations, theta, &iterated);
+	if (ret < 0)
+		goto out_free;
+	trained = monotonic_now();
+	printf("🧮 train: fitted in %d iterations, %.3fs\n", iterated,
+	       trained - loaded);
+
+	for (size_t row = 0; row < m.rows_filled; row++) {
+		if (!m.isholdout[row])
+			continue;
+
+		error = train_row_dot(&m, row, theta) - m.y[row];
+		abs_sum += fabs(error);
+		sq_sum += error * error;
+		holdout_rows++;
+	}
+	if (holdout_rows > 0)
+		printf("🎯 train: %zu held out builds, MAE %.3fs, RMSE %.3fs\n",
+		       holdout_rows, abs_sum / holdout_rows,
+		       sqrt(sq_sum / holdout_rows));
+
+	ret = train_model_write(db, theta, m.ncols, opts.output);
+
+out_free:
+	free(theta);
+	train_csr_free(&m);
+	sqlite3_close(db);
+
+	return ret;
+}
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cjson/cJSON.h>
@@ -155,3 +156,23 @@ char *trim(char *s)
 
 	return s;
 }
+
+uint64_t fnv1a_64(uint64_t hash, const void *buf, size_t len)
+{
+	const unsigned char *c = buf;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= c[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+double monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -1,9 +1,16 @@
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "closure.h"
+#include "dag.h"
 #include "evanix.h"
+#include "jobid.h"
 #include "jobs.h"
+#include "jobtab.h"
 #include "queue.h"
 #include "test.h"
 #include "util.h"
@@ -14,6 +21,10 @@
  *   B     B    B           B
  */
 
+/* MAX_NIX_PKG_COUNT of src/queue.c */
+#define TEST_DEEP_JOBS 200000
+#define TEST_JOBTAB_JOBS 1000
+
 struct evanix_opts_t evanix_opts = {
 	.close_unused_fd = false,
 	.isflake = false,
@@ -29,49 +40,554 @@ struct evanix_opts_t evanix_opts = {
 
 static void test_merge()
 {
-	struct job *job, *a, *b, *c, *tmp;
+	struct job *job, *a, *b, *c;
+	struct jobtab htab;
 	FILE *stream;
 	int ret;
-	struct job *htab = NULL;
+	size_t line_size = 0;
+	char *line = NULL;
 
+	jobtab_init(&htab);
 	stream = fopen("../tests/dag_merge.json", "r");
 	test_assert(stream != NULL);
 
 	/* A */
-	ret = job_read(stream, &job);
+	ret = job_read(stream, &line, &line_size, &job);
 	test_assert(ret == JOB_READ_SUCCESS);
 	ret = queue_htab_job_merge(&job, &htab);
 	test_assert(ret >= 0);
 	a = job;
 
 	/* B */
-	ret = job_read(stream, &job);
+	ret = job_read(stream, &line, &line_size, &job);
 	test_assert(ret == JOB_READ_SUCCESS);
 	ret = queue_htab_job_merge(&job, &htab);
 	test_assert(ret >= 0);
 	b = job;
 
 	/* C */
-	ret = job_read(stream, &job);
+	ret = job_read(stream, &line, &line_size, &job);
 	test_assert(ret == JOB_READ_SUCCESS);
 	ret = queue_htab_job_merge(&job, &htab);
 	test_assert(ret >= 0);
 	c = job;
 
-	ret = job_read(stream, &job);
+	ret = job_read(stream, &line, &line_size, &job);
 	test_assert(ret == JOB_READ_EOF);
 
 	test_assert(a->deps[0] == b);
 	test_assert(a->deps[0] == c->deps[0]);
 
 	fclose(stream);
-	HASH_ITER (hh, htab, job, tmp)
-		HASH_DEL(htab, job);
+	free(line);
+	jobtab_free(&htab);
 	job_free(a);
 	job_free(c);
 }
 
+/* the cached cost_recursive must match what a recount would give */
+static void test_cost()
+{
+	struct job *a, *b, *c, *d;
+	int ret;
+
+	ret = job_new(&a, "a", "/nix/store/a.drv", NULL, NULL);
+	test_assert(ret >= 0);
+	ret = job_new(&b, "b", "/nix/store/b.drv", NULL, a);
+	test_assert(ret >= 0);
+	ret = job_new(&c, "c", "/nix/store/c.drv", NULL, a);
+	test_assert(ret >= 0);
+	ret = job_deps_list_insert(a, b);
+	test_assert(ret >= 0);
+	ret = job_deps_list_insert(a, c);
+	test_assert(ret >= 0);
+
+	test_assert(job_cost_recursive(a) == 3);
+	test_assert(a->cost_recursive == 3);
+
+	job_insubstituters_set(b, true);
+	test_assert(a->cost_recursive == 2);
+	job_insubstituters_set(a, true);
+	test_assert(a->cost_recursive == 1);
+	job_insubstituters_set(a, false);
+	job_insubstituters_set(b, false);
+	test_assert(a->cost_recursive == 3);
+
+	/* d's cost isn't known yet, so it can't be added in */
+	ret = job_new(&d, "d", "/nix/store/d.drv", NULL, a);
+	test_assert(ret >= 0);
+	ret = job_deps_list_insert(a, d);
+	test_assert(ret >= 0);
+	test_assert(a->cost_recursive == JOB_COST_UNSET);
+	test_assert(job_cost_recursive(a) == 4);
+
+	job_free(c);
+	test_assert(a->cost_recursive == 3);
+	job_free(a);
+}
+
+static struct job *test_job_new(char *drv_path, struct job *parent)
+{
+	struct job *job;
+	int ret;
+
+	ret = job_new(&job, NULL, drv_path, NULL, parent);
+	test_assert(ret >= 0);
+	if (parent != NULL) {
+		ret = job_deps_list_insert(parent, job);
+		test_assert(ret >= 0);
+	}
+
+	return job;
+}
+
+/* the bitsets have to agree with the walk, d excluded leaves e with e and
+ * f and a with all but d */
+static void test_closure_set(struct job *a, struct job *e)
+{
+	struct closure_set *cs;
+	struct job_clist q;
+	struct dag *dag;
+	int ret;
+
+	CIRCLEQ_INIT(&q);
+	CIRCLEQ_INSERT_TAIL(&q, a, clist);
+	CIRCLEQ_INSERT_TAIL(&q, e, clist);
+	ret = dag_new(&dag, &q);
+	test_assert(ret >= 0);
+	ret = closure_set_new(&cs, dag);
+	test_assert(ret >= 0);
+
+	test_assert(closure_set_cost(cs, a) == 5);
+	test_assert(closure_set_cost(cs, e) == 3);
+	test_assert(closure_set_overlap(cs, a, e) == 2);
+	test_assert(closure_set_select(cs, a) == 5);
+	test_assert(closure_set_cost_marginal(cs, e) == 1);
+	test_assert(cs->selected_cost == 5);
+	/* only requested jobs have a bitset */
+	test_assert(closure_set_cost(cs, a->deps[0]) == -EINVAL);
+	closure_set_free(cs);
+
+	ret = closure_set_new(&cs, dag);
+	test_assert(ret >= 0);
+	closure_set_exclude(cs, e->deps[0]);
+	test_assert(closure_set_cost_marginal(cs, e) == 2);
+	test_assert(closure_set_cost_marginal(cs, a) == 4);
+	test_assert(closure_set_cost(cs, a) == 5);
+	closure_set_free(cs);
+	dag_free(dag);
+}
+
+/* the frozen DAG has to agree with the walk too, d stale takes everything
+ * above it along, and d being built leaves a and e with only what's above */
+static void test_dag(struct job *a, struct job *e, int cost_a, int cost_e)
+{
+	struct job_clist q;
+	struct dag *dag;
+	struct job *j;
+	uint32_t d;
+	int ret;
+
+	CIRCLEQ_INIT(&q);
+	CIRCLEQ_INSERT_TAIL(&q, a, clist);
+	CIRCLEQ_INSERT_TAIL(&q, e, clist);
+	ret = dag_new(&dag, &q);
+	test_assert(ret >= 0);
+
+	test_assert(dag->nodes == 6);
+	test_assert(dag->roots_filled == 2);
+	test_assert(dag->jobid->jobs[dag->roots[0]] == a);
+	test_assert(dag->jobid->jobs[dag->roots[1]] == e);
+	test_assert(dag->deps_index[dag->nodes] == 6);
+	test_assert(dag->parents_index[dag->nodes] == 6);
+	for (uint32_t n = 0; n < dag->nodes; n++) {
+		for (uint32_t i = dag->deps_index[n];
+		     i < dag->deps_index[n + 1]; i++)
+			test_assert(dag->deps[i] < n);
+	}
+
+	test_assert(dag_closure_cost(dag, dag->roots[0]) == cost_a);
+	test_assert(dag_closure_cost(dag, dag->roots[1]) == cost_e);
+
+	d = e->deps[0]->id;
+	dag_stale_set(dag, d);
+	for (uint32_t n = 0; n < dag->nodes; n++) {
+		j = dag->jobid->jobs[n];
+		test_assert(j->stale == (j->deps_filled > 0));
+		test_assert(!!(dag->flags[n] & DAG_STALE) == j->stale);
+		j->stale = false;
+	}
+
+	dag_building_set(dag, e->deps[0]);
+	dag_building_set(dag, e->deps[0]->deps[0]);
+	test_assert(dag_closure_cost(dag, dag->roots[0]) == 3);
+	test_assert(dag_closure_cost(dag, dag->roots[1]) == 1);
+	dag_free(dag);
+}
+
+/*
+ *     A     E
+ *    / \   /
+ *   B   C /
+ *    \ / /
+ *     D
+ *     |
+ *     F
+ */
+static void test_closure()
+{
+	struct job *a, *b, *c, *d, *e, *f;
+	struct closure cl;
+	int ret;
+
+	a = test_job_new("/nix/store/a.drv", NULL);
+	b = test_job_new("/nix/store/b.drv", a);
+	c = test_job_new("/nix/store/c.drv", a);
+	d = test_job_new("/nix/store/d.drv", b);
+	ret = job_deps_list_insert(c, d);
+	test_assert(ret >= 0);
+	ret = job_parents_list_insert(d, c);
+	test_assert(ret >= 0);
+	f = test_job_new("/nix/store/f.drv", d);
+	e = test_job_new("/nix/store/e.drv", NULL);
+	ret = job_deps_list_insert(e, d);
+	test_assert(ret >= 0);
+	ret = job_parents_list_insert(d, e);
+	test_assert(ret >= 0);
+
+	closure_init(&cl);
+	test_assert(closure_cost(&cl, a) == 5);
+	test_assert(closure_cost(&cl, e) == 3);
+	test_assert(closure_cost(&cl, d) == 2);
+
+	test_assert(closure_select(&cl, a) == 5);
+	test_assert(closure_cost_marginal(&cl, e) == 1);
+	test_assert(closure_cost(&cl, e) == 3);
+	test_assert(cl.selected_cost == 5);
+
+	test_closure_set(a, e);
+	test_dag(a, e, 5, 3);
+
+	/* nothing below a substitute has to be built */
+	job_insubstituters_set(d, true);
+	test_assert(closure_cost(&cl, e) == 1);
+	test_assert(closure_cost(&cl, a) == 3);
+	closure_free(&cl);
+	test_dag(a, e, 3, 1);
+
+	job_free(e);
+	job_free(a);
+	(void)f;
+}
+
+static void test_drv_write(const char *dir, const char *name,
+			   const char *inputs)
+{
+	char path[PATH_MAX];
+	FILE *stream;
+
+	snprintf(path, sizeof(path), "%s/%s.drv", dir, name);
+	stream = fopen(path, "w");
+	test_assert(stream != NULL);
+	fprintf(stream,
+		"Derive([(\"out\",\"/nix/store/%s\",\"\",\"\")],[%s],[],"
+		"\"x86_64-linux\",\"/bin/sh\",[],[(\"pname\",\"%s\")])",
+		name, inputs, name);
+	fclose(stream);
+}
+
+static struct job *test_job_find(struct job *job, const char *dir,
+				 const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s.drv", dir, name);
+	for (size_t i = 0; i < job->deps_filled; i++) {
+		if (!strcmp(job->deps[i]->drv_path, path))
+			return job->deps[i];
+	}
+
+	return NULL;
+}
+
+/*
+ *     A     E
+ *    / \   /
+ *   B   C /
+ *    \ / /
+ *     D
+ *     |
+ *     F
+ *
+ * read from .drv files, merged and then isolated again
+ */
+static void test_full_closure()
+{
+	char dir[] = "/tmp/evanix-dag-XXXXXX", path[PATH_MAX];
+	char inputs[4 * PATH_MAX];
+	struct job *a, *b, *c, *d, *e, *jobs[2];
+	struct closure_set *cs;
+	struct queue queue;
+	struct closure cl;
+	struct dag *dag;
+	int ret;
+
+	test_assert(mkdtemp(dir) != NULL);
+	test_drv_write(dir, "f", "");
+	snprintf(inputs, sizeof(inputs), "(\"%s/f.drv\",[\"out\"])", dir);
+	test_drv_write(dir, "d", inputs);
+	snprintf(inputs, sizeof(inputs), "(\"%s/d.drv\",[\"out\"])", dir);
+	test_drv_write(dir, "b", inputs);
+	test_drv_write(dir, "c", inputs);
+	test_drv_write(dir, "e", inputs);
+	snprintf(inputs, sizeof(inputs),
+		 "(\"%s/b.drv\",[\"out\"]),(\"%s/c.drv\",[\"out\"])", dir,
+		 dir);
+	test_drv_write(dir, "a", inputs);
+
+	snprintf(path, sizeof(path), "%s/a.drv", dir);
+	ret = job_new(&a, "a", path, NULL, NULL);
+	test_assert(ret >= 0);
+	ret = job_read_drv(a);
+	test_assert(ret >= 0);
+	ret = job_read_closure(a, false, NULL, NULL);
+	test_assert(ret >= 0);
+
+	test_assert(a->deps_filled == 2);
+	b = test_job_find(a, dir, "b");
+	c = test_job_find(a, dir, "c");
+	test_assert(b != NULL && c != NULL);
+	d = test_job_find(b, dir, "d");
+	test_assert(d != NULL && d == test_job_find(c, dir, "d"));
+	test_assert(d->parents_filled == 2);
+	test_assert(test_job_find(d, dir, "f") != NULL);
+	/* taken while the .drv was read, not read again for job_cost() */
+	test_assert(a->pname != NULL && !strcmp(a->pname, "a"));
+	test_assert(d->pname != NULL && !strcmp(d->pname, "d"));
+
+	jobtab_init(&queue.htab);
+	queue.requested = 0;
+	queue.stale = 0;
+	queue.building = 0;
+	queue.dag = NULL;
+	queue.closure_set = NULL;
+	queue.state = Q_SEM_WAIT;
+	CIRCLEQ_INIT(&queue.jobs);
+	pthread_mutex_init(&queue.mutex, NULL);
+	test_assert(sem_init(&queue.sem, 0, 0) == 0);
+
+	jobs[0] = a;
+	ret = queue_push_batch(&queue, &jobs[0], 1);
+	test_assert(ret >= 0);
+
+	/* d is in the queue already, so its .drv isn't read again */
+	snprintf(path, sizeof(path), "%s/e.drv", dir);
+	ret = job_new(&e, "e", path, NULL, NULL);
+	test_assert(ret >= 0);
+	ret = job_read_drv(e);
+	test_assert(ret >= 0);
+	ret = job_read_closure(e, false, &queue.htab, &queue.mutex);
+	test_assert(ret >= 0);
+	test_assert(e->deps_filled == 1 && e->deps[0] != d);
+	test_assert(e->deps[0]->deps_filled == 0);
+	test_assert(e->deps[0]->pname == NULL);
+
+	/* and e's d is dropped for that of a */
+	jobs[1] = e;
+	ret = queue_push_batch(&queue, &jobs[1], 1);
+	test_assert(ret >= 0);
+	test_assert(queue.htab.slots_filled == 6);
+	test_assert(queue.requested == 2 && !queue_isempty(&queue));
+	test_assert(e->deps[0] == d);
+	test_assert(d->parents_filled == 3);
+	closure_init(&cl);
+	test_assert(closure_cost(&cl, e) == 3);
+	closure_free(&cl);
+	ret = queue_dag(&queue, &dag);
+	test_assert(ret >= 0);
+	test_assert(dag_closure_cost(dag, e->id) == 3);
+	ret = queue_closure_set(&queue, &cs);
+	test_assert(ret >= 0 && cs != NULL);
+	test_assert(closure_set_cost_marginal(cs, e) == 3);
+
+	/* building a takes d from under e, in the frozen DAG as well */
+	ret = queue_pop(&queue, &jobs[0]);
+	test_assert(ret >= 0 && jobs[0] == a);
+	test_assert(queue.htab.slots_filled == 1);
+	test_assert(e->deps_filled == 0);
+	test_assert(d->parents_filled == 2);
+	test_assert(queue.requested == 1 && queue.building == 1);
+	test_assert(queue.dag == dag);
+	test_assert(dag_closure_cost(dag, e->id) == 1);
+	test_assert(closure_set_cost_marginal(cs, e) == 1);
+	job_free(a);
+	queue_build_done(&queue);
+
+	/* e is all that's left, and it won't be built */
+	queue_dag_stale_set(&queue, e->id);
+	test_assert(queue.stale == 1 && queue_isempty(&queue));
+
+	ret = queue_pop(&queue, &jobs[1]);
+	test_assert(ret >= 0 && jobs[1] == e);
+	test_assert(queue.htab.slots_filled == 0);
+	test_assert(queue.requested == 0 && queue.stale == 0);
+	job_free(e);
+	queue_build_done(&queue);
+	test_assert(queue.building == 0);
+	closure_set_free(queue.closure_set);
+	dag_free(queue.dag);
+	jobtab_free(&queue.htab);
+
+	sem_destroy(&queue.sem);
+	pthread_mutex_destroy(&queue.mutex);
+	for (const char *name = "abcdef"; *name; name++) {
+		snprintf(path, sizeof(path), "%s/%c.drv", dir, *name);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+/* what nix-build --dry-run lists all hangs off a, only its inputs stay */
+static void test_full_closure_listed()
+{
+	char dir[] = "/tmp/evanix-dag-XXXXXX", path[PATH_MAX];
+	char inputs[4 * PATH_MAX];
+	struct job *a, *b, *c, *d;
+	int ret;
+
+	test_assert(mkdtemp(dir) != NULL);
+	test_drv_write(dir, "d", "");
+	snprintf(inputs, sizeof(inputs), "(\"%s/d.drv\",[\"out\"])", dir);
+	test_drv_write(dir, "b", inputs);
+	test_drv_write(dir, "c", inputs);
+	snprintf(inputs, sizeof(inputs),
+		 "(\"%s/b.drv\",[\"out\"]),(\"%s/c.drv\",[\"out\"])", dir,
+		 dir);
+	test_drv_write(dir, "a", inputs);
+
+	snprintf(path, sizeof(path), "%s/a.drv", dir);
+	a = test_job_new(path, NULL);
+	snprintf(path, sizeof(path), "%s/b.drv", dir);
+	b = test_job_new(path, a);
+	/* c is valid, so it isn't listed */
+	snprintf(path, sizeof(path), "%s/d.drv", dir);
+	d = test_job_new(path, a);
+
+	ret = job_read_closure(a, true, NULL, NULL);
+	test_assert(ret >= 0);
+	test_assert(a->deps_filled == 1 && a->deps[0] == b);
+	test_assert(b->deps_filled == 1 && b->deps[0] == d);
+	test_assert(d->parents_filled == 1 && d->parents[0] == b);
+	(void)c;
+
+	job_free(a);
+	for (const char *name = "abcd"; *name; name++) {
+		snprintf(path, sizeof(path), "%s/%c.drv", dir, *name);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+/* A chain as long as the most jobs evanix takes, each link also needing a
+ * shared dep, like stdenv. Recursing down it would run out of stack, and
+ * taking the links out of the shared dep one at a time would take forever. */
+static void test_deep()
+{
+	struct job **jobs, *shared;
+	char drv_path[64];
+	struct jobid *jobid;
+	struct job_clist q;
+	int ret;
+
+	jobs = calloc(TEST_DEEP_JOBS, sizeof(*jobs));
+	test_assert(jobs != NULL);
+	shared = test_job_new("/nix/store/shared.drv", NULL);
+	for (size_t i = 0; i < TEST_DEEP_JOBS; i++) {
+		snprintf(drv_path, sizeof(drv_path), "/nix/store/%zu.drv", i);
+		jobs[i] = test_job_new(drv_path, i ? jobs[i - 1] : NULL);
+		ret = job_deps_list_insert(jobs[i], shared);
+		test_assert(ret >= 0);
+		ret = job_parents_list_insert(shared, jobs[i]);
+		test_assert(ret >= 0);
+	}
+
+	CIRCLEQ_INIT(&q);
+	CIRCLEQ_INSERT_TAIL(&q, jobs[0], clist);
+	ret = jobid_init(&q, &jobid);
+	test_assert(ret >= 0);
+	test_assert(jobid->filled == TEST_DEEP_JOBS + 1);
+	test_assert(shared->id == 0);
+	test_assert(jobs[0]->id == TEST_DEEP_JOBS);
+	test_assert(jobs[TEST_DEEP_JOBS - 1]->id == 1);
+	jobid_free(jobid);
+
+	job_stale_set(shared);
+	for (size_t i = 0; i < TEST_DEEP_JOBS; i++)
+		test_assert(jobs[i]->stale);
+
+	/* the tail on its own first, shared stays with the rest */
+	job_free(jobs[TEST_DEEP_JOBS / 2]);
+	test_assert(jobs[TEST_DEEP_JOBS / 2 - 1]->deps_filled == 1);
+	test_assert(shared->parents_filled == TEST_DEEP_JOBS / 2);
+	job_free(jobs[0]);
+	free(jobs);
+}
+
+/* nix's own sha1 of "abc", and lookups across what deletes shifted back */
+static void test_jobtab()
+{
+	struct job *jobs[TEST_JOBTAB_JOBS];
+	uint8_t hash[STORE_HASH_SIZE];
+	char drv_path[64];
+	struct jobtab tab;
+	int ret;
+
+	const uint8_t abc[STORE_HASH_SIZE] = {
+		0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+		0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d,
+	};
+
+	ret = store_hash_decode(
+		"/nix/store/kpcd173cq987hw957sx6m0868wv3x6d9-abc.drv", hash);
+	test_assert(ret == 0 && !memcmp(hash, abc, sizeof(abc)));
+	ret = store_hash_decode("/nix/store/kpcd173cq987hw957sx6m0868wv3x6d9",
+				hash);
+	test_assert(ret == -EINVAL);
+	ret = store_hash_decode(
+		"/nix/store/kpcd173cq987hw957sx6m0868wv3x6de-abc.drv", hash);
+	test_assert(ret == -EINVAL);
+
+	jobtab_init(&tab);
+	for (size_t i = 0; i < TEST_JOBTAB_JOBS; i++) {
+		snprintf(drv_path, sizeof(drv_path), "/nix/store/%zu.drv", i);
+		jobs[i] = test_job_new(drv_path, NULL);
+		ret = jobtab_insert(&tab, jobs[i]);
+		test_assert(ret >= 0);
+	}
+	ret = jobtab_insert(&tab, jobs[0]);
+	test_assert(ret == -EEXIST);
+
+	for (size_t i = 0; i < TEST_JOBTAB_JOBS; i += 2)
+		jobtab_del(&tab, jobs[i]);
+	test_assert(tab.slots_filled == TEST_JOBTAB_JOBS / 2);
+	for (size_t i = 0; i < TEST_JOBTAB_JOBS; i++) {
+		/* not the interned pointer, so strcmp() has to say */
+		snprintf(drv_path, sizeof(drv_path), "/nix/store/%zu.drv", i);
+		test_assert(jobtab_find(&tab, drv_path,
+					jobtab_hash(drv_path)) ==
+			    (i % 2 ? jobs[i] : NULL));
+		job_free(jobs[i]);
+	}
+	jobtab_free(&tab);
+}
+
 int main(void)
 {
 	test_run(test_merge);
+	test_run(test_cost);
+	test_run(test_closure);
+	test_run(test_full_closure);
+	test_run(test_full_closure_listed);
+	test_run(test_deep);
+	test_run(test_jobtab);
 }
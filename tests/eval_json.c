@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eval_json.h"
+#include "test.h"
+
+static void test_parse()
+{
+	char *input_drvs, *outputs, *drv_path, *name, *store_path, *s;
+	struct eval_json ej;
+	int ret;
+
+	char line[] =
+		"{\"attr\":\"a\\\"b\",\"attrPath\":[\"a\",{\"x\":[1,\"]\"]}],"
+		"\"drvPath\":\"/nix/store/a.drv\",\"name\":\"a\\u00e9\\n\","
+		"\"meta\":{\"broken\":false,\"weight\":-1.5e3},"
+		"\"inputDrvs\":{\"/nix/store/b.drv\":[\"out\",\"dev\"],"
+		"\"/nix/store/c.drv\":[]},"
+		"\"outputs\":{\"out\":\"/nix/store/a\",\"dev\":null},"
+		"\"system\":\"x86_64-linux\"}\n";
+
+	ret = eval_json_parse(line, &ej);
+	test_assert(ret == 0);
+	test_assert(ej.error == NULL);
+	test_assert(!strcmp(ej.attr, "a\"b"));
+	test_assert(!strcmp(ej.name, "a\xc3\xa9\n"));
+	test_assert(!strcmp(ej.drv_path, "/nix/store/a.drv"));
+	test_assert(!strcmp(ej.system, "x86_64-linux"));
+
+	input_drvs = ej.input_drvs;
+	ret = eval_json_input_drv_next(&input_drvs, &drv_path, &outputs);
+	test_assert(ret == 1);
+	test_assert(!strcmp(drv_path, "/nix/store/b.drv"));
+	test_assert(eval_json_string_next(&outputs, &s) == 1);
+	test_assert(!strcmp(s, "out"));
+	test_assert(eval_json_string_next(&outputs, &s) == 1);
+	test_assert(!strcmp(s, "dev"));
+	test_assert(eval_json_string_next(&outputs, &s) == 0);
+
+	ret = eval_json_input_drv_next(&input_drvs, &drv_path, &outputs);
+	test_assert(ret == 1);
+	test_assert(!strcmp(drv_path, "/nix/store/c.drv"));
+	test_assert(eval_json_string_next(&outputs, &s) == 0);
+	test_assert(eval_json_input_drv_next(&input_drvs, &drv_path,
+					     &outputs) == 0);
+
+	outputs = ej.outputs;
+	test_assert(eval_json_output_next(&outputs, &name, &store_path) == 1);
+	test_assert(!strcmp(name, "out"));
+	test_assert(!strcmp(store_path, "/nix/store/a"));
+	test_assert(eval_json_output_next(&outputs, &name, &store_path) == 1);
+	test_assert(!strcmp(name, "dev"));
+	test_assert(store_path == NULL);
+	test_assert(eval_json_output_next(&outputs, &name, &store_path) == 0);
+}
+
+static void test_error()
+{
+	struct eval_json ej;
+
+	char line[] = "{\"attr\":\"broken\",\"error\":\"assertion failed\"}";
+
+	test_assert(eval_json_parse(line, &ej) == 0);
+	test_assert(!strcmp(ej.error, "assertion failed"));
+	test_assert(ej.drv_path == NULL);
+}
+
+static void test_invalid()
+{
+	struct eval_json ej;
+
+	char truncated[] = "{\"attr\":\"a\",\"inputDrvs\":{\"/nix/store/b";
+	char trailing[] = "{\"attr\":\"a\"} {";
+	char escape[] = "{\"attr\":\"\\x\"}";
+	char surrogate[] = "{\"attr\":\"\\udc00\"}";
+
+	test_assert(eval_json_parse(truncated, &ej) < 0);
+	test_assert(eval_json_parse(trailing, &ej) < 0);
+	test_assert(eval_json_parse(escape, &ej) < 0);
+	test_assert(eval_json_parse(surrogate, &ej) < 0);
+}
+
+int main(void)
+{
+	test_run(test_parse);
+	test_run(test_error);
+	test_run(test_invalid);
+}
@@ -0,0 +1,119 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eval_mux.h"
+#include "evanix.h"
+#include "test.h"
+
+/* long enough for nix-eval-jobs to fill the pipe, short enough to give up on
+ * a hung eval_mux_wait() */
+#define TEST_TIMEOUT 30
+
+struct evanix_opts_t evanix_opts = {
+	.close_unused_fd = false,
+	.isflake = false,
+	.ispipelined = true,
+	.isdryrun = true,
+	.max_builds = 0,
+	.system = "0xDEADBEEF",
+	.solver_report = false,
+	.check_cache_status = false,
+	.solver = NULL,
+	.break_evanix = false,
+};
+
+/* a nix-eval-jobs on PATH that never stops writing for the "endless" expr,
+ * and writes two lines for anything else */
+static void fake_nix_eval_jobs(char *dir)
+{
+	char path[PATH_MAX], *env;
+	FILE *stream;
+	int ret;
+
+	test_assert(mkdtemp(dir) != NULL);
+	snprintf(path, sizeof(path), "%s/nix-eval-jobs", dir);
+	stream = fopen(path, "w");
+	test_assert(stream != NULL);
+	fputs("#!/bin/sh\n"
+	      "case \"$*\" in\n"
+	      "*endless*) exec yes '{}' ;;\n"
+	      "*) printf '{}\\n{}\\n' ;;\n"
+	      "esac\n",
+	      stream);
+	test_assert(fclose(stream) == 0);
+	test_assert(chmod(path, 0755) == 0);
+
+	ret = asprintf(&env, "%s:%s", dir, getenv("PATH"));
+	test_assert(ret >= 0);
+	test_assert(setenv("PATH", env, 1) == 0);
+	free(env);
+}
+
+static void fake_nix_eval_jobs_free(char *dir)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/nix-eval-jobs", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+static void test_wait()
+{
+	const char *attr_prefix;
+	size_t line_size = 0;
+	struct eval_mux *mux;
+	char *line = NULL;
+	ssize_t nread;
+	int ret, n;
+
+	ret = eval_mux_init(&mux, "default.nix", NULL, 0);
+	test_assert(ret >= 0);
+	for (n = 0; (nread = eval_mux_getline(mux, &line, &line_size,
+					      &attr_prefix)) >= 0;
+	     n++)
+		test_assert(!strcmp(line, "{}\n"));
+	test_assert(n == 2);
+	test_assert(eval_mux_wait(mux) == 0);
+	eval_mux_free(mux);
+	free(line);
+}
+
+/* the queue thread gives up on a job_parse() error, nix-eval-jobs is left
+ * writing to a pipe no one reads */
+static void test_wait_early_exit()
+{
+	const char *attr_prefix;
+	size_t line_size = 0;
+	struct eval_mux *mux;
+	char *line = NULL;
+	ssize_t nread;
+	int ret;
+
+	ret = eval_mux_init(&mux, "endless", NULL, 0);
+	test_assert(ret >= 0);
+	nread = eval_mux_getline(mux, &line, &line_size, &attr_prefix);
+	test_assert(nread > 0);
+	/* let it fill the pipe */
+	sleep(1);
+
+	alarm(TEST_TIMEOUT);
+	test_assert(eval_mux_wait(mux) < 0);
+	alarm(0);
+	eval_mux_free(mux);
+	free(line);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/evanix-eval-mux-XXXXXX";
+
+	fake_nix_eval_jobs(dir);
+	test_run(test_wait);
+	test_run(test_wait_early_exit);
+	fake_nix_eval_jobs_free(dir);
+}
@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evanix.h"
+#include "model.h"
+#include "test.h"
+
+struct evanix_opts_t evanix_opts = {
+	.solver_report = false,
+};
+
+static void test_model_write(char *path, const char *content)
+{
+	FILE *stream;
+	int fd;
+
+	fd = mkstemp(path);
+	test_assert(fd >= 0);
+	stream = fdopen(fd, "w");
+	test_assert(stream != NULL);
+	fputs(content, stream);
+	fclose(stream);
+}
+
+static void test_predict()
+{
+	char path[] = "/tmp/evanix-model-XXXXXX";
+	struct model *model;
+	int ret;
+
+	char *pnames[] = {"gcc", "zlib", "gcc", "unknown"};
+
+	test_model_write(path, "evanix-model 1\n"
+			       "intercept\t30\n"
+			       "gcc\t100.5\n"
+			       "zlib\t-4.5\n"
+			       "\n"
+			       "python3 minimal\t7\n");
+
+	ret = model_read(&model, path);
+	test_assert(ret == 0);
+	test_assert(model_predict(model, NULL, 0) == 30);
+	/* the second gcc isn't counted, unknown has no say */
+	test_assert(model_predict(model, pnames, 4) == 126);
+	test_assert(model_predict(model, (char *[]){"python3 minimal"}, 1) ==
+		    37);
+
+	model_free(model);
+	unlink(path);
+}
+
+static void test_invalid()
+{
+	char path[] = "/tmp/evanix-model-XXXXXX";
+	struct model *model;
+	int ret;
+
+	test_model_write(path, "evanix-model 1\ngcc\tmany\n");
+	ret = model_read(&model, path);
+	test_assert(ret == -EINVAL);
+	unlink(path);
+
+	strcpy(path, "/tmp/evanix-model-XXXXXX");
+	test_model_write(path, "intercept\t30\n");
+	ret = model_read(&model, path);
+	test_assert(ret == -EINVAL);
+	unlink(path);
+}
+
+int main(void)
+{
+	test_run(test_predict);
+	test_run(test_invalid);
+}
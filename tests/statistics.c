@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "evanix.h"
+#include "statistics.h"
+#include "statistics_index.h"
+#include "test.h"
+
+struct evanix_opts_t evanix_opts = {
+	.solver_report = false,
+};
+
+static void test_db_create(char *path)
+{
+	sqlite3 *db;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	test_assert(fd >= 0);
+	close(fd);
+
+	ret = sqlite3_open(path, &db);
+	test_assert(ret == SQLITE_OK);
+	ret = sqlite3_exec(db,
+			   "CREATE TABLE statistics (pname TEXT, "
+			   "mean_duration INTEGER);"
+			   "INSERT INTO statistics VALUES ('hello', 42);"
+			   "INSERT INTO statistics VALUES ('gcc', 3600);"
+			   "INSERT INTO statistics VALUES ('gcc', 1);"
+			   "INSERT INTO statistics VALUES (NULL, 7);"
+			   "INSERT INTO statistics VALUES ('', 3);",
+			   NULL, NULL, NULL);
+	test_assert(ret == SQLITE_OK);
+	sqlite3_close(db);
+}
+
+static void test_lookup(struct statistics *stats)
+{
+	test_assert(statistics_cost(stats, "hello") == 42);
+	test_assert(statistics_cost(stats, "gcc") == 3600);
+	test_assert(statistics_cost(stats, "") == 3);
+	test_assert(statistics_cost(stats, "hell") == -ENOENT);
+	test_assert(statistics_cost(stats, "hello2") == -ENOENT);
+}
+
+static void test_table()
+{
+	struct statistics stats = {0};
+	char path[] = "/tmp/evanix-statistics-XXXXXX";
+	int ret;
+
+	test_db_create(path);
+
+	ret = statistics_open(&stats, path, false);
+	test_assert(ret == 0);
+
+	/* before loading, the prepared statement answers */
+	test_assert(stats.slots == NULL);
+	test_lookup(&stats);
+
+	ret = statistics_load(&stats, STATISTICS_LOAD_MAX);
+	test_assert(ret == 0);
+	test_assert(stats.slots != NULL);
+	test_assert(stats.slots_filled == 3);
+	test_lookup(&stats);
+
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+	unlink(path);
+}
+
+static void test_record()
+{
+	struct statistics stats = {0};
+	char path[] = "/tmp/evanix-statistics-XXXXXX";
+	int ret;
+
+	test_db_create(path);
+
+	ret = statistics_open(&stats, path, true);
+	test_assert(ret == 0);
+	test_assert(stats.islocal);
+
+	/* the plain mean of the first samples */
+	test_assert(statistics_record(&stats, "gcc", 10, true) == 0);
+	test_assert(statistics_record(&stats, "gcc", 20, true) == 0);
+	test_assert(statistics_record(&stats, "gcc", 30, true) == 0);
+	test_assert(statistics_record(&stats, "new", 5, true) == 0);
+
+	/* local means win over those of statistics */
+	test_assert(statistics_cost(&stats, "gcc") == 20);
+	test_assert(statistics_cost(&stats, "new") == 5);
+	test_assert(statistics_cost(&stats, "hello") == 42);
+	test_assert(statistics_cost(&stats, "hell") == -ENOENT);
+
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+
+	/* and persist, for the next run to load */
+	ret = statistics_open(&stats, path, false);
+	test_assert(ret == 0);
+	test_assert(stats.islocal);
+	test_assert(stats.record == NULL);
+	ret = statistics_load(&stats, STATISTICS_LOAD_MAX);
+	test_assert(ret == 0);
+	test_assert(stats.slots_filled == 4);
+	test_assert(statistics_cost(&stats, "gcc") == 20);
+	test_assert(statistics_cost(&stats, "new") == 5);
+	test_assert(statistics_cost(&stats, "hello") == 42);
+
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+	unlink(path);
+}
+
+/* a local_statistics recorded before variance_duration was added and
+ * mean_cpu dropped */
+static void test_migrate()
+{
+	struct statistics stats = {0};
+	struct statistics_entry entry;
+	char path[] = "/tmp/evanix-statistics-XXXXXX";
+	sqlite3 *db;
+	int ret;
+
+	test_db_create(path);
+	ret = sqlite3_open(path, &db);
+	test_assert(ret == SQLITE_OK);
+	ret = sqlite3_exec(db,
+			   "CREATE TABLE local_statistics ("
+			   "pname TEXT PRIMARY KEY, "
+			   "mean_duration REAL NOT NULL, "
+			   "mean_cpu REAL NOT NULL, "
+			   "samples INTEGER NOT NULL);"
+			   "INSERT INTO local_statistics "
+			   "VALUES ('gcc', 20, 1, 4);",
+			   NULL, NULL, NULL);
+	test_assert(ret == SQLITE_OK);
+	sqlite3_close(db);
+
+	/* read-only leaves it be */
+	ret = statistics_open(&stats, path, false);
+	test_assert(ret == 0);
+	test_assert(stats.islocal && stats.local_version == 0);
+	test_assert(statistics_cost(&stats, "gcc") == 20);
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+
+	ret = statistics_open(&stats, path, true);
+	test_assert(ret == 0);
+	test_assert(stats.local_version == STATISTICS_LOCAL_VERSION);
+	ret = sqlite3_exec(stats.db, "SELECT mean_cpu FROM local_statistics",
+			   NULL, NULL, NULL);
+	test_assert(ret != SQLITE_OK);
+	test_assert(statistics_record(&stats, "gcc", 30, true) == 0);
+	ret = statistics_lookup(&stats, "gcc", &entry);
+	test_assert(ret == 0);
+	test_assert(entry.costs[STATISTICS_MEAN] == 22);
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+
+	/* once is enough */
+	ret = statistics_open(&stats, path, true);
+	test_assert(ret == 0);
+	test_assert(statistics_cost(&stats, "gcc") == 22);
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+	unlink(path);
+}
+
+static void test_index()
+{
+	struct statistics stats = {0};
+	char path[] = "/tmp/evanix-statistics-XXXXXX";
+	char index_path[] = "/tmp/evanix-statistics-index-XXXXXX";
+	int fd, ret;
+
+	test_db_create(path);
+	fd = mkstemp(index_path);
+	test_assert(fd >= 0);
+	close(fd);
+
+	ret = statistics_open(&stats, path, false);
+	test_assert(ret == 0);
+	ret = statistics_load(&stats, SIZE_MAX);
+	test_assert(ret == 0);
+	ret = statistics_index_compile(&stats, index_path);
+	test_assert(ret == 0);
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+
+	/* told apart from a database by its magic */
+	ret = statistics_open(&stats, index_path, false);
+	test_assert(ret == 0);
+	test_assert(stats.db == NULL && stats.index != NULL);
+	test_assert(statistics_isopen(&stats));
+	ret = statistics_load(&stats, STATISTICS_LOAD_MAX);
+	test_assert(ret == 0);
+	test_lookup(&stats);
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+
+	test_assert(statistics_open(&stats, index_path, true) == -EINVAL);
+
+	unlink(index_path);
+	unlink(path);
+}
+
+static void test_quantile()
+{
+	struct statistics stats = {0};
+	struct statistics_entry entry;
+	char path[] = "/tmp/evanix-statistics-XXXXXX";
+	sqlite3 *db;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	test_assert(fd >= 0);
+	close(fd);
+	ret = sqlite3_open(path, &db);
+	test_assert(ret == SQLITE_OK);
+	ret = sqlite3_exec(db,
+			   "CREATE TABLE statistics (pname TEXT, "
+			   "mean_duration INTEGER, p90_duration INTEGER, "
+			   "variance_duration REAL);"
+			   "INSERT INTO statistics VALUES ('gcc', 100, 250, 0);"
+			   "INSERT INTO statistics VALUES "
+			   "('hello', 100, NULL, 400);",
+			   NULL, NULL, NULL);
+	test_assert(ret == SQLITE_OK);
+	sqlite3_close(db);
+
+	evanix_opts.cost_quantile = STATISTICS_P90;
+	ret = statistics_open(&stats, path, false);
+	test_assert(ret == 0);
+	test_assert(stats.quantiles & (1 << STATISTICS_P99));
+
+	ret = statistics_lookup(&stats, "gcc", &entry);
+	test_assert(ret == 0);
+	test_assert(entry.costs[STATISTICS_MEAN] == 100);
+	test_assert(entry.costs[STATISTICS_P90] == 250);
+	test_assert(statistics_cost(&stats, "gcc") == 250);
+	/* 100 + 1.2816 * 20 */
+	test_assert(statistics_cost(&stats, "hello") == 126);
+
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+	evanix_opts.cost_quantile = STATISTICS_MEAN;
+	unlink(path);
+}
+
+static void test_calibration()
+{
+	struct statistics stats = {0};
+	struct statistics_entry entry;
+	char path[] = "/tmp/evanix-statistics-XXXXXX";
+	sqlite3 *db;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	test_assert(fd >= 0);
+	close(fd);
+	ret = sqlite3_open(path, &db);
+	test_assert(ret == SQLITE_OK);
+	ret = sqlite3_exec(db,
+			   "CREATE TABLE statistics (pname TEXT, "
+			   "mean_duration INTEGER);"
+			   "INSERT INTO statistics VALUES ('a', 100);"
+			   "INSERT INTO statistics VALUES ('b', 200);"
+			   "INSERT INTO statistics VALUES ('c', 50);"
+			   "INSERT INTO statistics VALUES ('d', 10);",
+			   NULL, NULL, NULL);
+	test_assert(ret == SQLITE_OK);
+	sqlite3_close(db);
+
+	ret = statistics_open(&stats, path, true);
+	test_assert(ret == 0);
+	test_assert(statistics_calibration_factor(&stats) == 1);
+	/* this host takes twice as long */
+	test_assert(statistics_record(&stats, "a", 200, true) == 0);
+	test_assert(statistics_record(&stats, "b", 400, true) == 0);
+	test_assert(statistics_record(&stats, "c", 100, true) == 0);
+	test_assert(statistics_record(&stats, "e", 100, true) == 0);
+	/* alongside other builds, it says nothing of the host */
+	test_assert(statistics_record(&stats, "b", 4000, false) == 0);
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+
+	ret = statistics_open(&stats, path, false);
+	test_assert(ret == 0);
+	test_assert(stats.calibration.samples == 3);
+	test_assert(stats.calibration.factor > 1.999 &&
+		    stats.calibration.factor < 2.001);
+	test_assert(stats.calibration.error < 0.001);
+
+	ret = statistics_lookup(&stats, "d", &entry);
+	test_assert(ret == 0 && !entry.islocal);
+	statistics_calibrate(&stats, &entry);
+	test_assert(entry.costs[STATISTICS_MEAN] == 20);
+
+	ret = statistics_lookup(&stats, "a", &entry);
+	test_assert(ret == 0 && entry.islocal);
+	statistics_calibrate(&stats, &entry);
+	test_assert(entry.costs[STATISTICS_MEAN] == 200);
+
+	ret = statistics_close(&stats);
+	test_assert(ret == 0);
+	unlink(path);
+}
+
+int main(void)
+{
+	test_run(test_table);
+	test_run(test_record);
+	test_run(test_migrate);
+	test_run(test_index);
+	test_run(test_quantile);
+	test_run(test_calibration);
+}
@@ -0,0 +1,86 @@
+#include <math.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "evanix.h"
+#include "model.h"
+#include "test.h"
+#include "train.h"
+
+struct evanix_opts_t evanix_opts = {
+	.solver_report = false,
+};
+
+/* duration = 10 + 100 gcc + 20 zlib + 5 perl, exactly */
+static void test_db_create(char *path)
+{
+	sqlite3 *db;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	test_assert(fd >= 0);
+	close(fd);
+
+	ret = sqlite3_open(path, &db);
+	test_assert(ret == SQLITE_OK);
+	ret = sqlite3_exec(
+		db,
+		"CREATE TABLE pnames (pname TEXT);"
+		"CREATE TABLE input_pnames (drv_id INTEGER, pname_id INTEGER);"
+		"CREATE TABLE builds_cleaned (drv_id INTEGER, duration REAL);"
+		"INSERT INTO pnames (ROWID, pname) VALUES "
+		"(1, 'gcc'), (2, 'zlib'), (3, 'perl'), (4, 'unused');"
+		"INSERT INTO input_pnames VALUES "
+		"(1, 1), (2, 2), (3, 1), (3, 2), (5, 3), (6, 1), (6, 3);"
+		"INSERT INTO builds_cleaned VALUES "
+		"(1, 110), (2, 30), (3, 130), (4, 10), (5, 15), (6, 115), "
+		"(3, 130), (4, 10);",
+		NULL, NULL, NULL);
+	test_assert(ret == SQLITE_OK);
+	sqlite3_close(db);
+}
+
+static bool test_close(double a, double b)
+{
+	return fabs(a - b) < 1e-6;
+}
+
+static void test_fit()
+{
+	char db_path[] = "/tmp/evanix-train-db-XXXXXX";
+	char model_path[] = "/tmp/evanix-train-model-XXXXXX";
+	struct model *model;
+	int fd, ret;
+
+	char *argv[] = {
+		"train", "--db", db_path,	"--output", model_path,
+		"-l",	 "0",	 "--holdout", "0",	    NULL,
+	};
+
+	test_db_create(db_path);
+	fd = mkstemp(model_path);
+	test_assert(fd >= 0);
+	close(fd);
+
+	ret = train_main(sizeof(argv) / sizeof(*argv) - 1, argv);
+	test_assert(ret == 0);
+
+	ret = model_read(&model, model_path);
+	test_assert(ret == 0);
+	test_assert(test_close(model->intercept, 10));
+	test_assert(
+		test_close(model_predict(model, (char *[]){"gcc"}, 1), 110));
+	test_assert(test_close(
+		model_predict(model, (char *[]){"zlib", "perl"}, 2), 35));
+
+	model_free(model);
+	unlink(model_path);
+	unlink(db_path);
+}
+
+int main(void)
+{
+	test_run(test_fit);
+}